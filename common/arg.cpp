@@ -988,6 +988,10 @@ static bool common_params_parse_ex(int argc, char ** argv, common_params_context
         params.tensor_buft_overrides.push_back({nullptr, nullptr});
     }
 
+    if (!params.kv_type_overrides.empty()) {
+        params.kv_type_overrides.push_back({0, 0, GGML_TYPE_COUNT, GGML_TYPE_COUNT});
+    }
+
     if (!params.chat_template.empty() && !common_chat_verify_template(params.chat_template, params.use_jinja)) {
         throw std::runtime_error(string_format(
             "error: the supplied chat template is not supported: %s%s\n",
@@ -1409,7 +1413,7 @@ common_params_context common_params_parser_init(common_params & params, llama_ex
         [](common_params & params, const std::string & value) {
             params.lookup_cache_static = value;
         }
-    ).set_examples({LLAMA_EXAMPLE_LOOKUP}));
+    ).set_examples({LLAMA_EXAMPLE_LOOKUP, LLAMA_EXAMPLE_SERVER}));
     add_opt(common_arg(
         {"-lcd", "--lookup-cache-dynamic"}, "FNAME",
         "path to dynamic lookup cache to use for lookup decoding (updated by generation)",
@@ -1472,6 +1476,29 @@ common_params_context common_params_parser_init(common_params & params, llama_ex
             params.kv_unified = true;
         }
     ).set_env("LLAMA_ARG_KV_SPLIT"));
+    add_opt(common_arg(
+        {"--kv-block-size"}, "N",
+        string_format("number of cells per block of a paged KV cache, the sequences that share a prefix share its blocks\n"
+            "implies --kv-unified, 0 = disabled (default: %d)", params.kv_block_size),
+        [](common_params & params, int value) {
+            params.kv_block_size = value;
+        }
+    ).set_env("LLAMA_ARG_KV_BLOCK_SIZE"));
+    add_opt(common_arg(
+        {"--kv-budget"}, "N",
+        string_format("max number of KV cells per sequence, beyond it the cells that received the least attention are evicted\n"
+            "(heavy hitters + recent window, the attention is not tracked with flash attention), 0 = unlimited (default: %d)", params.kv_budget),
+        [](common_params & params, int value) {
+            params.kv_budget = value;
+        }
+    ).set_env("LLAMA_ARG_KV_BUDGET"));
+    add_opt(common_arg(
+        {"--kv-recent"}, "N",
+        string_format("number of most recent positions of a sequence that are never evicted by --kv-budget, 0 = half of the budget (default: %d)", params.kv_recent),
+        [](common_params & params, int value) {
+            params.kv_recent = value;
+        }
+    ).set_env("LLAMA_ARG_KV_RECENT"));
     add_opt(common_arg(
         {"--no-context-shift"},
         string_format("disables context shift on infinite text generation (default: %s)", params.ctx_shift ? "disabled" : "enabled"),
@@ -1479,6 +1506,17 @@ common_params_context common_params_parser_init(common_params & params, llama_ex
             params.ctx_shift = false;
         }
     ).set_examples({LLAMA_EXAMPLE_MAIN, LLAMA_EXAMPLE_SERVER, LLAMA_EXAMPLE_IMATRIX, LLAMA_EXAMPLE_PERPLEXITY}).set_env("LLAMA_ARG_NO_CONTEXT_SHIFT"));
+    add_opt(common_arg(
+        {"--ctx-sink"}, "N",
+        string_format(
+            "on context shift, keep the first N tokens as attention sinks plus a rolling window of the most recent tokens (StreamingLLM)\n"
+            "the window is a ring of KV cells and keeps its positions, it is only re-rotated when they reach the training context (default: %d, 0 = disabled)\n"
+            "the n_keep of a request selects how many of the N sinks are kept", params.n_sink
+        ),
+        [](common_params & params, int value) {
+            params.n_sink = value;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_CTX_SINK"));
     add_opt(common_arg(
         {"--chunks"}, "N",
         string_format("max number of chunks to process (default: %d, -1 = all)", params.n_chunks),
@@ -2117,6 +2155,40 @@ common_params_context common_params_parser_init(common_params & params, llama_ex
             params.cache_type_v = kv_cache_type_from_str(value);
         }
     ).set_env("LLAMA_ARG_CACHE_TYPE_V"));
+    add_opt(common_arg(
+        {"-ctl", "--cache-type-layers"}, "<layers>=<type_k>[:<type_v>],...",
+        "KV cache data types of some layers, overriding -ctk and -ctv\n"
+        "layers are a layer index or a range first..last, negative indices count from the last layer\n"
+        "a single type applies to both K and V, e.g. 0..1=f16,-1=f16 or 2..-3=q8_0:q4_0",
+        [](common_params & params, const std::string & value) {
+            for (const auto & override : string_split<std::string>(value, ',')) {
+                const auto pos = override.find('=');
+                if (pos == std::string::npos) {
+                    throw std::invalid_argument("invalid value");
+                }
+
+                const std::string layers = override.substr(0, pos);
+                const std::string types  = override.substr(pos + 1);
+
+                llama_kv_type_override kv_override;
+
+                const auto pos_range = layers.find("..");
+                if (pos_range == std::string::npos) {
+                    kv_override.il_first = std::stoi(layers);
+                    kv_override.il_last  = kv_override.il_first;
+                } else {
+                    kv_override.il_first = std::stoi(layers.substr(0, pos_range));
+                    kv_override.il_last  = std::stoi(layers.substr(pos_range + 2));
+                }
+
+                const auto pos_v = types.find(':');
+                kv_override.type_k = kv_cache_type_from_str(types.substr(0, pos_v));
+                kv_override.type_v = pos_v == std::string::npos ? kv_override.type_k : kv_cache_type_from_str(types.substr(pos_v + 1));
+
+                params.kv_type_overrides.push_back(kv_override);
+            }
+        }
+    ).set_env("LLAMA_ARG_CACHE_TYPE_LAYERS"));
     add_opt(common_arg(
         {"--hellaswag"},
         "compute HellaSwag score over random tasks from datafile supplied with -f",
@@ -2166,6 +2238,14 @@ common_params_context common_params_parser_init(common_params & params, llama_ex
             params.kl_divergence = true;
         }
     ).set_examples({LLAMA_EXAMPLE_PERPLEXITY}));
+    add_opt(common_arg(
+        {"--kv-calibrate"}, "N",
+        "with --kl-divergence, measure the KL-divergence of quantizing the KV cache of each layer alone to -ctk and -ctv,\n"
+        "then print the -ctl value that keeps the N most sensitive layers in F16",
+        [](common_params & params, int value) {
+            params.kv_calibrate = value;
+        }
+    ).set_examples({LLAMA_EXAMPLE_PERPLEXITY}));
     add_opt(common_arg(
         {"--save-all-logits", "--kl-divergence-base"}, "FNAME",
         "set logits file",
@@ -2841,6 +2921,20 @@ common_params_context common_params_parser_init(common_params & params, llama_ex
             params.n_threads_http = value;
         }
     ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_THREADS_HTTP"));
+    add_opt(common_arg(
+        {"--threads-preprocess"}, "N",
+        string_format("number of threads used to parse and tokenize requests, 0 = on the HTTP thread (default: %d, -1 = auto)", params.n_threads_preprocess),
+        [](common_params & params, int value) {
+            params.n_threads_preprocess = value;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_THREADS_PREPROCESS"));
+    add_opt(common_arg(
+        {"--preprocess-queue"}, "N",
+        string_format("max. number of requests waiting for a preprocessing thread, excess requests get 429 (default: %d)", params.preprocess_queue_max),
+        [](common_params & params, int value) {
+            params.preprocess_queue_max = value;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_PREPROCESS_QUEUE"));
     add_opt(common_arg(
         {"--cache-reuse"}, "N",
         string_format(
@@ -2890,6 +2984,28 @@ common_params_context common_params_parser_init(common_params & params, llama_ex
             }
         }
     ).set_examples({LLAMA_EXAMPLE_SERVER}));
+    add_opt(common_arg(
+        {"--models-dir"}, "PATH",
+        "directory of additional GGUF models that can be selected with the \"model\" field of the requests (file name without extension), loaded on first use (default: disabled)",
+        [](common_params & params, const std::string & value) {
+            params.models_dir = value;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_MODELS_DIR"));
+    add_opt(common_arg(
+        {"--models-max-mem"}, "N",
+        string_format("memory budget in MiB of the models loaded from --models-dir, the least recently used idle models are unloaded when it is exceeded (default: %d, 0 = unlimited)", params.models_max_mem),
+        [](common_params & params, int value) {
+            params.models_max_mem = value;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_MODELS_MAX_MEM"));
+    add_opt(common_arg(
+        {"--kv-queue-max"}, "N",
+        string_format("admission control: max KV demand in tokens (prompt + n_predict) of the queued requests beyond the free KV cells, "
+                      "new requests above the limit are rejected with 429 and a Retry-After header (default: %d, -1 = unlimited)", params.kv_queue_max),
+        [](common_params & params, int value) {
+            params.kv_queue_max = value;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_KV_QUEUE_MAX"));
     add_opt(common_arg(
         {"--jinja"},
         "use jinja template for chat (default: disabled)",
@@ -2959,6 +3075,51 @@ common_params_context common_params_parser_init(common_params & params, llama_ex
             params.slot_prompt_similarity = std::stof(value);
         }
     ).set_examples({LLAMA_EXAMPLE_SERVER}));
+    add_opt(common_arg(
+        {"--response-cache-size"}, "N",
+        string_format("size in MiB of the cache of deterministic (greedy or fixed seed) completion results (default: %d, 0 = disabled)", params.response_cache_size),
+        [](common_params & params, int value) {
+            params.response_cache_size = value;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_RESPONSE_CACHE_SIZE"));
+    add_opt(common_arg(
+        {"--response-cache-ttl"}, "N",
+        string_format("time-to-live in seconds of the response cache entries (default: %d, 0 = no expiry)", params.response_cache_ttl),
+        [](common_params & params, int value) {
+            params.response_cache_ttl = value;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_RESPONSE_CACHE_TTL"));
+    add_opt(common_arg(
+        {"--kv-store"}, "PATH",
+        "directory of the persistent store of the KV data of the prompt prefixes, kept across restarts in one file per model and cache type (default: disabled)",
+        [](common_params & params, const std::string & value) {
+            params.kv_store_path = value;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_KV_STORE"));
+    add_opt(common_arg(
+        {"--kv-store-block"}, "N",
+        string_format("number of tokens per block of the KV store, only the full blocks of a prompt are stored (default: %d)", params.kv_store_block),
+        [](common_params & params, int value) {
+            if (value <= 0) {
+                throw std::invalid_argument("invalid value");
+            }
+            params.kv_store_block = value;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_KV_STORE_BLOCK"));
+    add_opt(common_arg(
+        {"--kv-store-size"}, "N",
+        string_format("max size in MiB of the KV store file, no more blocks are added once it is reached (default: %d)", params.kv_store_size),
+        [](common_params & params, int value) {
+            params.kv_store_size = value;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_KV_STORE_SIZE"));
+    add_opt(common_arg(
+        {"--mmproj-cache-size"}, "N",
+        string_format("size in MiB of the cache of the image/audio embeddings computed by the multimodal projector, shared by all requests (default: %d, 0 = disabled)", params.mmproj_cache_size),
+        [](common_params & params, int value) {
+            params.mmproj_cache_size = value;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_MMPROJ_CACHE_SIZE"));
     add_opt(common_arg(
         {"--lora-init-without-apply"},
         string_format("load LoRA adapters without applying them (apply later via POST /lora-adapters) (default: %s)", params.lora_init_without_apply ? "enabled" : "disabled"),
@@ -3215,6 +3376,13 @@ common_params_context common_params_parser_init(common_params & params, llama_ex
             params.speculative.p_min = std::stof(value);
         }
     ).set_examples({LLAMA_EXAMPLE_SPECULATIVE, LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_DRAFT_P_MIN"));
+    add_opt(common_arg(
+        {"--draft-ngram"},
+        string_format("draft tokens from the n-grams of the prompt and the generated text instead of using a draft model (default: %s)", params.speculative.ngram ? "enabled" : "disabled"),
+        [](common_params & params) {
+            params.speculative.ngram = true;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_DRAFT_NGRAM"));
     add_opt(common_arg(
         {"-cd", "--ctx-size-draft"}, "N",
         string_format("size of the prompt context for the draft model (default: %d, 0 = loaded from model)", params.speculative.n_ctx),
@@ -929,6 +929,26 @@ struct common_init_result common_init_from_params(common_params & params) {
         return iparams;
     }
 
+    // without a memory module, the sequences of an embedding context only live within a ubatch, so allow as many of
+    // them as there can be tokens in a ubatch instead of limiting them to the number of parallel sequences
+    if (params.embedding && llama_get_memory(lctx) == nullptr && llama_pooling_type(lctx) != LLAMA_POOLING_TYPE_NONE) {
+        const uint32_t n_seq_max = std::min<uint32_t>(llama_n_ubatch(lctx), llama_max_parallel_sequences());
+        if (n_seq_max > cparams.n_seq_max) {
+            LOG_INF("%s: memory-less embedding context, increasing n_seq_max from %u to %u\n", __func__, cparams.n_seq_max, n_seq_max);
+
+            llama_free(lctx);
+
+            cparams.n_seq_max = n_seq_max;
+
+            lctx = llama_init_from_model(model, cparams);
+            if (lctx == NULL) {
+                LOG_ERR("%s: failed to create context with model '%s'\n", __func__, params.model.path.c_str());
+                llama_model_free(model);
+                return iparams;
+            }
+        }
+    }
+
     if (params.ctx_shift && !llama_memory_can_shift(llama_get_memory(lctx))) {
         LOG_WRN("%s: KV cache shifting is not supported for this context, disabling KV cache shifting\n", __func__);
         params.ctx_shift = false;
@@ -1165,6 +1185,10 @@ struct llama_context_params common_context_params_to_llama(const common_params &
     cparams.pooling_type      = params.pooling_type;
     cparams.attention_type    = params.attention_type;
     cparams.defrag_thold      = params.defrag_thold;
+    cparams.n_kv_block        = params.kv_block_size;
+    cparams.n_kv_budget       = params.kv_budget;
+    cparams.n_kv_recent       = params.kv_recent;
+    cparams.n_kv_sink         = params.n_sink;
     cparams.cb_eval           = params.cb_eval;
     cparams.cb_eval_user_data = params.cb_eval_user_data;
     cparams.offload_kqv       = !params.no_kv_offload;
@@ -1177,6 +1201,14 @@ struct llama_context_params common_context_params_to_llama(const common_params &
     cparams.type_k = params.cache_type_k;
     cparams.type_v = params.cache_type_v;
 
+    if (params.kv_type_overrides.empty()) {
+        cparams.kv_type_overrides = NULL;
+    } else {
+        GGML_ASSERT(params.kv_type_overrides.back().type_k == GGML_TYPE_COUNT && params.kv_type_overrides.back().type_v == GGML_TYPE_COUNT &&
+                "KV type overrides not terminated with an empty entry");
+        cparams.kv_type_overrides = params.kv_type_overrides.data();
+    }
+
     return cparams;
 }
 
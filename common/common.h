@@ -202,6 +202,8 @@ struct common_params_speculative {
     float   p_split      =  0.1f; // speculative decoding split probability
     float   p_min        = 0.75f; // minimum speculative decoding probability (greedy)
 
+    bool ngram = false; // draft from the n-grams of the context (prompt lookup) instead of using a draft model
+
     ggml_type cache_type_k = GGML_TYPE_F16; // KV cache data type for the K
     ggml_type cache_type_v = GGML_TYPE_F16; // KV cache data type for the V
 
@@ -239,6 +241,7 @@ struct common_params {
     int32_t n_batch               =  2048; // logical batch size for prompt processing (must be >=32 to use BLAS)
     int32_t n_ubatch              =   512; // physical batch size for prompt processing (must be >=32 to use BLAS)
     int32_t n_keep                =     0; // number of tokens to keep from initial prompt
+    int32_t n_sink                =     0; // number of attention sink tokens kept on context shift, the other cells form a ring (0 = disabled)
     int32_t n_chunks              =    -1; // max number of chunks to process (-1 = unlimited)
     int32_t n_parallel            =     1; // number of parallel sequences to decode
     int32_t n_sequences           =     1; // number of sequences to decode
@@ -253,6 +256,9 @@ struct common_params {
     float   yarn_beta_slow        =  1.0f; // YaRN high correction dim
     int32_t yarn_orig_ctx         =     0; // YaRN original context length
     float   defrag_thold          =  0.1f; // KV cache defragmentation threshold
+    int32_t kv_block_size         =     0; // cells per block of a paged KV cache (0 = disabled)
+    int32_t kv_budget             =     0; // max KV cells per sequence, the least attended cells are evicted (0 = unlimited)
+    int32_t kv_recent             =     0; // number of recent positions of a sequence that are never evicted (0 = kv_budget/2)
 
     // offload params
     std::vector<ggml_backend_dev_t> devices; // devices to use for offloading
@@ -298,6 +304,7 @@ struct common_params {
     std::vector<std::string> antiprompt; // strings upon which more user input is prompted (a.k.a. reverse prompts)
     std::vector<llama_model_kv_override> kv_overrides;
     std::vector<llama_model_tensor_buft_override> tensor_buft_overrides;
+    std::vector<llama_kv_type_override> kv_type_overrides; // per-layer KV cache types
 
     bool lora_init_without_apply = false; // only load lora to memory, but do not apply it to ctx (user can manually apply lora later using llama_adapter_lora_apply)
     std::vector<common_adapter_lora_info> lora_adapters; // lora adapter path with user defined scale
@@ -323,6 +330,7 @@ struct common_params {
     size_t multiple_choice_tasks = 0; // number of tasks to use when computing the TruthfulQA score. If 0, all tasks will be computed
 
     bool   kl_divergence    = false; // compute KL divergence
+    int32_t kv_calibrate    = 0;     // with kl_divergence, number of the most sensitive layers to keep in F16 in the KV cache, 0 = disabled
 
     bool usage             = false; // print usage
     bool completion        = false; // print source-able completion script
@@ -364,6 +372,7 @@ struct common_params {
     struct common_params_model mmproj;
     bool mmproj_use_gpu = true;     // use GPU for multimodal model
     bool no_mmproj = false;         // explicitly disable multimodal model
+    int32_t mmproj_cache_size = 256; // size in MiB of the cache of the multimodal encoder outputs (server), 0 = disabled
     std::vector<std::string> image; // path to image file(s)
 
     // embedding
@@ -378,6 +387,8 @@ struct common_params {
     int32_t timeout_read   = 600;          // http read timeout in seconds
     int32_t timeout_write  = timeout_read; // http write timeout in seconds
     int32_t n_threads_http = -1;           // number of threads to process HTTP requests (TODO: support threadpool)
+    int32_t n_threads_preprocess = -1;     // number of threads to parse and tokenize requests (-1 = auto, 0 = inline)
+    int32_t preprocess_queue_max = 64;     // max. number of requests waiting for a preprocessing thread
     int32_t n_cache_reuse  = 0;            // min chunk size to reuse from the cache via KV shifting
 
     std::string hostname      = "127.0.0.1";
@@ -409,6 +420,18 @@ struct common_params {
 
     float slot_prompt_similarity = 0.5f;
 
+    int32_t response_cache_size = 0;    // size of the response cache in MiB, 0 = disabled
+    int32_t response_cache_ttl  = 3600; // time-to-live of the response cache entries in seconds, 0 = no expiry
+
+    std::string kv_store_path;          // directory of the persistent prefix KV store, empty = disabled
+    int32_t     kv_store_block =  256;  // number of tokens per block of the KV store
+    int32_t     kv_store_size  = 4096;  // max size of the KV store file in MiB
+
+    std::string models_dir;         // directory of the additional models that can be selected by name, loaded on demand
+    int32_t     models_max_mem = 0; // memory budget of the additional models in MiB, 0 = unlimited
+
+    int32_t kv_queue_max = -1; // max KV demand (in tokens) of the queued requests beyond the free KV cells, -1 = unlimited
+
     // batched-bench params
     bool is_pp_shared = false;
 
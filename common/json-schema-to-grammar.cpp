@@ -4,7 +4,9 @@
 #include <nlohmann/json.hpp>
 
 #include <algorithm>
+#include <list>
 #include <map>
+#include <mutex>
 #include <regex>
 #include <sstream>
 #include <string>
@@ -951,7 +953,69 @@ public:
     }
 };
 
-std::string json_schema_to_grammar(const json & schema, bool force_gbnf) {
+// LRU cache of the converted grammars, keyed by the serialized schema
+struct json_schema_grammar_cache {
+    static constexpr size_t N_ENTRIES_MAX = 64;
+    static constexpr size_t N_BYTES_MAX   = 16*1024*1024;
+
+    std::mutex mutex;
+
+    // most recently used entries first
+    std::list<std::pair<std::string, std::string>> entries;
+    std::unordered_map<std::string, std::list<std::pair<std::string, std::string>>::iterator> map;
+
+    size_t n_bytes = 0;
+
+    json_schema_to_grammar_cache_stats stats;
+
+    bool get(const std::string & key, std::string & grammar) {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = map.find(key);
+        if (it == map.end()) {
+            stats.n_misses++;
+            return false;
+        }
+        entries.splice(entries.begin(), entries, it->second);
+        stats.n_hits++;
+        grammar = it->second->second;
+        return true;
+    }
+
+    void put(const std::string & key, const std::string & grammar) {
+        const size_t size = 2*key.size() + grammar.size();
+        if (size > N_BYTES_MAX) {
+            return;
+        }
+        std::lock_guard<std::mutex> lock(mutex);
+        if (map.find(key) != map.end()) {
+            return;
+        }
+        while (!entries.empty() && (entries.size() >= N_ENTRIES_MAX || n_bytes + size > N_BYTES_MAX)) {
+            const auto & last = entries.back();
+            n_bytes -= 2*last.first.size() + last.second.size();
+            map.erase(last.first);
+            entries.pop_back();
+        }
+        entries.emplace_front(key, grammar);
+        map[key] = entries.begin();
+        n_bytes += size;
+    }
+};
+
+static json_schema_grammar_cache & get_grammar_cache() {
+    static json_schema_grammar_cache cache;
+    return cache;
+}
+
+json_schema_to_grammar_cache_stats json_schema_to_grammar_get_cache_stats() {
+    auto & cache = get_grammar_cache();
+    std::lock_guard<std::mutex> lock(cache.mutex);
+    auto stats = cache.stats;
+    stats.n_entries = cache.entries.size();
+    return stats;
+}
+
+static std::string json_schema_to_grammar_impl(const json & schema, bool force_gbnf) {
 #ifdef LLAMA_USE_LLGUIDANCE
     if (!force_gbnf) {
         return "%llguidance {}\nstart: %json " + schema.dump();
@@ -966,6 +1030,23 @@ std::string json_schema_to_grammar(const json & schema, bool force_gbnf) {
     });
 }
 
+std::string json_schema_to_grammar(const json & schema, bool force_gbnf) {
+    auto & cache = get_grammar_cache();
+
+    const std::string key = (force_gbnf ? "1" : "0") + schema.dump();
+
+    std::string grammar;
+    if (cache.get(key, grammar)) {
+        return grammar;
+    }
+
+    // note: errors are not cached, an invalid schema throws every time
+    grammar = json_schema_to_grammar_impl(schema, force_gbnf);
+    cache.put(key, grammar);
+
+    return grammar;
+}
+
 std::string build_grammar(const std::function<void(const common_grammar_builder &)> & cb, const common_grammar_options & options) {
     SchemaConverter converter([&](const std::string &) { return json(); }, options.dotall);
     common_grammar_builder builder {
@@ -2,12 +2,24 @@
 
 #include <nlohmann/json_fwd.hpp>
 
+#include <cstddef>
+#include <cstdint>
 #include <functional>
 #include <string>
 
+// the conversions are memoized in a small process-wide LRU cache keyed by the schema, so that the same
+// schema sent with many requests (e.g. a structured output endpoint) is only converted once
 std::string json_schema_to_grammar(const nlohmann::ordered_json & schema,
                                    bool force_gbnf = false);
 
+struct json_schema_to_grammar_cache_stats {
+    uint64_t n_hits    = 0;
+    uint64_t n_misses  = 0;
+    size_t   n_entries = 0;
+};
+
+json_schema_to_grammar_cache_stats json_schema_to_grammar_get_cache_stats();
+
 struct common_grammar_builder {
     std::function<std::string(const std::string &, const std::string &)> add_rule;
     std::function<std::string(const std::string &, const nlohmann::ordered_json &)> add_schema;
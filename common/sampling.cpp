@@ -4,6 +4,7 @@
 #include "log.h"
 
 #include <cmath>
+#include <cstring>
 #include <unordered_map>
 #include <algorithm>
 
@@ -112,6 +113,9 @@ struct common_sampler {
 
     llama_token_data_array cur_p;
 
+    // the chain is applied directly to the logits (see llama_sampler_chain_apply_logits)
+    bool fused;
+
     void set_logits(struct llama_context * ctx, int idx) {
         const auto * logits = llama_get_logits_ith(ctx, idx);
 
@@ -128,6 +132,26 @@ struct common_sampler {
 
         cur_p = { cur.data(), cur.size(), -1, false };
     }
+
+    // returns false if the chain is not fused, cur_p must then be set with set_logits()
+    bool apply_fused(struct llama_context * ctx, int idx) {
+        if (!fused) {
+            return false;
+        }
+
+        const auto * logits = llama_get_logits_ith(ctx, idx);
+
+        const llama_model * model = llama_get_model(ctx);
+        const llama_vocab * vocab = llama_model_get_vocab(model);
+
+        const int n_vocab = llama_vocab_n_tokens(vocab);
+
+        cur.resize(n_vocab);
+
+        cur_p = { cur.data(), cur.size(), -1, false };
+
+        return llama_sampler_chain_apply_logits(chain, logits, &cur_p);
+    }
 };
 
 std::string common_params_sampling::print() const {
@@ -220,6 +244,7 @@ struct common_sampler * common_sampler_init(const struct llama_model * model, co
         /* .prev   = */ ring_buffer<llama_token>(std::max(32, params.n_prev)),
         /* .cur    = */ {},
         /* .cur_p  = */ {},
+        /* .fused  = */ false,
     };
 
     llama_sampler_chain_add(result->chain,
@@ -284,6 +309,8 @@ struct common_sampler * common_sampler_init(const struct llama_model * model, co
         GGML_ASSERT(false && "unknown mirostat version");
     }
 
+    result->fused = llama_sampler_chain_can_apply_logits(result->chain);
+
     return result;
 }
 
@@ -321,14 +348,18 @@ struct common_sampler * common_sampler_clone(common_sampler * gsmpl) {
         /* .prev   = */ gsmpl->prev,
         /* .cur    = */ gsmpl->cur,
         /* .cur_p  = */ gsmpl->cur_p,
+        /* .fused  = */ gsmpl->fused,
     };
 }
 
 void common_perf_print(const struct llama_context * ctx, const struct common_sampler * gsmpl) {
-    // TODO: measure grammar performance
-
     if (gsmpl) {
         llama_perf_sampler_print(gsmpl->chain);
+
+        // llguidance samplers have no perf data
+        if (strcmp(llama_sampler_name(gsmpl->grmr), "grammar") == 0 && llama_perf_sampler(gsmpl->grmr).n_sample > 0) {
+            llama_perf_sampler_print(gsmpl->grmr);
+        }
     }
     if (ctx) {
         llama_perf_context_print(ctx);
@@ -336,17 +367,19 @@ void common_perf_print(const struct llama_context * ctx, const struct common_sam
 }
 
 llama_token common_sampler_sample(struct common_sampler * gsmpl, struct llama_context * ctx, int idx, bool grammar_first) {
-    gsmpl->set_logits(ctx, idx);
-
     auto & grmr  = gsmpl->grmr;
     auto & chain = gsmpl->chain;
-    auto & cur_p = gsmpl->cur_p; // initialized by set_logits
+    auto & cur_p = gsmpl->cur_p; // initialized by apply_fused or set_logits
 
-    if (grammar_first) {
-        llama_sampler_apply(grmr, &cur_p);
-    }
+    if (grammar_first || !gsmpl->apply_fused(ctx, idx)) {
+        gsmpl->set_logits(ctx, idx);
 
-    llama_sampler_apply(chain, &cur_p);
+        if (grammar_first) {
+            llama_sampler_apply(grmr, &cur_p);
+        }
+
+        llama_sampler_apply(chain, &cur_p);
+    }
 
     GGML_ASSERT(cur_p.selected != -1 && "no selected token during sampling - check your sampling configuration");
 
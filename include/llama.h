@@ -256,6 +256,15 @@ extern "C" {
         ggml_backend_buffer_type_t buft;
     };
 
+    // the types of the K and V cache of the layers [il_first, il_last]
+    // negative layer indices count from the last layer (-1 = last layer)
+    struct llama_kv_type_override {
+        int32_t        il_first;
+        int32_t        il_last;
+        enum ggml_type type_k; // GGML_TYPE_COUNT = type_k of the context
+        enum ggml_type type_v; // GGML_TYPE_COUNT = type_v of the context
+    };
+
     struct llama_model_params {
         // NULL-terminated list of devices to use for offloading (if NULL, all available devices are used)
         ggml_backend_dev_t * devices;
@@ -338,6 +347,16 @@ extern "C" {
         bool kv_unified;  // use a unified buffer across the input sequences when computing the attention
                           // try to disable when n_seq_max > 1 for improved performance when the sequences do not share a large prefix
                           // ref: https://github.com/ggml-org/llama.cpp/pull/14363
+
+        uint32_t n_kv_sink; // the first n_kv_sink positions of a sequence keep their cells and the next ones are placed in a ring of cells, 0 = disabled (default)
+
+        // per-layer data types for the KV cache, the last matching entry wins [EXPERIMENTAL]
+        // the list is terminated by an entry with both type_k and type_v set to GGML_TYPE_COUNT, NULL = no overrides
+        const struct llama_kv_type_override * kv_type_overrides;
+
+        uint32_t n_kv_block;  // cells per block of a paged KV cache, 0 = cells are allocated individually (default)
+        uint32_t n_kv_budget; // max KV cells per sequence, beyond it the cells that received the least attention are evicted, 0 = unlimited (default)
+        uint32_t n_kv_recent; // the last n_kv_recent positions of a sequence are never evicted, 0 = n_kv_budget/2
     };
 
     // model quantization parameters
@@ -537,6 +556,9 @@ extern "C" {
     // Returns true if the model is recurrent (like Mamba, RWKV, etc.)
     LLAMA_API bool llama_model_is_recurrent(const struct llama_model * model);
 
+    // Returns true if the model is hybrid (attention and recurrent layers, like Jamba, Granite 4.0, etc.)
+    LLAMA_API bool llama_model_is_hybrid(const struct llama_model * model);
+
     // Returns 0 on success
     LLAMA_API uint32_t llama_model_quantize(
             const char * fname_inp,
@@ -662,6 +684,28 @@ extern "C" {
     // Check if the memory supports shifting
     LLAMA_API bool llama_memory_can_shift(llama_memory_t mem);
 
+    // Usage and fragmentation of a stream of KV cells
+    // With a non-unified KV cache (kv_unified == false), each sequence has its own stream
+    struct llama_memory_stream_stats {
+        uint32_t n_cells;   // number of cells of the stream
+        uint32_t n_used;    // number of cells in use
+        uint32_t n_kv;      // index of the last cell in use + 1, the attention visits the cells [0, n_kv)
+        uint32_t n_holes;   // number of runs of free cells in [0, n_kv)
+        float    frag;      // fragmentation: 1 - n_used/n_kv, 0 for an empty stream
+        uint32_t n_defrag;  // number of defragmentations of the stream
+        uint64_t n_moved;   // number of cells moved by the defragmentations
+        uint64_t n_evicted; // number of cells evicted to keep the sequences within the KV budget (n_kv_budget)
+        uint64_t n_shift;   // number of K-shifts applied to the cells of the stream (re-rotation of the keys after llama_memory_seq_add/div)
+    };
+
+    // Get the statistics of the streams of KV cells of the memory
+    // Writes at most n_max entries to stats and returns the number of streams (0 if the memory has no KV cells)
+    // For the SWA and the hybrid models, the statistics are the ones of the full attention cache
+    LLAMA_API int32_t llama_memory_get_stream_stats(
+            llama_memory_t mem,
+            struct llama_memory_stream_stats * stats,
+            int32_t n_max);
+
     //
     // KV cache for self-attention (TODO: deprecate in favor of llama_memory)
     //
@@ -850,6 +894,36 @@ extern "C" {
                           size_t   size,
                     llama_seq_id   dest_seq_id);
 
+    // Same as llama_state_seq_get_size and llama_state_seq_get_data, but only for the cells of the sequence
+    // with positions in [p0, p1)
+    // p0 < 0 : [0,  p1)
+    // p1 < 0 : [p0, inf)
+    // note: memory types that cannot be split by position (e.g. recurrent) always copy the whole sequence state
+    LLAMA_API size_t llama_state_seq_get_size_range(
+            struct llama_context * ctx,
+                    llama_seq_id   seq_id,
+                       llama_pos   p0,
+                       llama_pos   p1);
+
+    LLAMA_API size_t llama_state_seq_get_data_range(
+            struct llama_context * ctx,
+                         uint8_t * dst,
+                          size_t   size,
+                    llama_seq_id   seq_id,
+                       llama_pos   p0,
+                       llama_pos   p1);
+
+    // Append the sequence data (copied with `llama_state_seq_get_data_range` or `llama_state_seq_get_data`) to the
+    // specified sequence. The existing cells at the same or later positions are replaced.
+    // Returns:
+    //  - Positive: Ok
+    //  - Zero: Failed to load
+    LLAMA_API size_t llama_state_seq_append_data(
+            struct llama_context * ctx,
+                   const uint8_t * src,
+                          size_t   size,
+                    llama_seq_id   dest_seq_id);
+
     LLAMA_API size_t llama_state_seq_save_file(
             struct llama_context * ctx,
                       const char * filepath,
@@ -1206,6 +1280,17 @@ extern "C" {
     // after removing a sampler, the chain will no longer own it, and it will not be freed when the chain is freed
     LLAMA_API struct llama_sampler * llama_sampler_chain_remove(   struct llama_sampler * chain, int32_t i);
 
+    // apply the chain directly to the logits of the whole vocabulary, without first filling cur_p with all the candidates
+    // the chain must start with samplers that change the logits of a few tokens (logit-bias, penalties) or that are no-ops with
+    // their parameters, followed by a top-k (k > 0) or a min-p (p > 0) sampler. the candidates kept by this sampler are selected
+    // with vectorized passes over the logits and the rest of the chain is applied to them
+    // on input, cur_p->size is the number of logits and cur_p->data must have room for as many candidates
+    // returns false if the chain cannot be applied this way - cur_p must then be filled with the logits and the chain applied to it
+    LLAMA_API bool llama_sampler_chain_apply_logits(struct llama_sampler * chain, const float * logits, llama_token_data_array * cur_p);
+
+    // true if the chain has the form required by llama_sampler_chain_apply_logits
+    LLAMA_API bool llama_sampler_chain_can_apply_logits(const struct llama_sampler * chain);
+
     // available samplers:
 
     LLAMA_API struct llama_sampler * llama_sampler_init_greedy(void);
@@ -1403,13 +1488,14 @@ extern "C" {
         double t_sample_ms;
 
         int32_t n_sample;
+        int32_t n_mask_hit; // grammar samplers: applies masked from the cache of allowed tokens per grammar state
     };
 
     LLAMA_API struct llama_perf_context_data llama_perf_context      (const struct llama_context * ctx);
     LLAMA_API void                           llama_perf_context_print(const struct llama_context * ctx);
     LLAMA_API void                           llama_perf_context_reset(      struct llama_context * ctx);
 
-    // NOTE: the following work only with samplers constructed via llama_sampler_chain_init
+    // NOTE: the following work only with samplers constructed via llama_sampler_chain_init or llama_sampler_init_grammar*
     LLAMA_API struct llama_perf_sampler_data llama_perf_sampler      (const struct llama_sampler * chain);
     LLAMA_API void                           llama_perf_sampler_print(const struct llama_sampler * chain);
     LLAMA_API void                           llama_perf_sampler_reset(      struct llama_sampler * chain);
@@ -15,9 +15,6 @@ llama_batch_allocr::llama_batch_allocr(uint32_t n_pos_per_embd) : n_pos_per_embd
 
     seq_pos.resize(LLAMA_MAX_SEQ);
     seq_cpl.resize(LLAMA_MAX_SEQ);
-    for (auto & cur : seq_cpl) {
-        cur.resize(LLAMA_MAX_SEQ);
-    }
 
     seq_idx.resize(LLAMA_MAX_SEQ, -1);
 }
@@ -90,21 +87,19 @@ bool llama_batch_allocr::init(
     if (!batch.pos) {
         pos.resize(batch.n_tokens);
 
-        // initialize the starting position for each sequence based on the positions in the memory
-        llama_pos p0[LLAMA_MAX_SEQ];
-        for (uint32_t s = 0; s < n_seq_max; ++s) {
-            if (!memory) {
-                // if no memory -> start from 0
-                p0[s] = 0;
-            } else {
-                p0[s] = memory->seq_pos_max(s) + 1;
-            }
-        }
+        // the starting position of each sequence of the batch, based on the positions in the memory
+        std::unordered_map<llama_seq_id, llama_pos> p0;
 
         for (int32_t i = 0; i < batch.n_tokens; i++) {
             const llama_seq_id seq_id = batch.seq_id[i][0];
 
-            pos[i] = p0[seq_id];
+            auto it = p0.find(seq_id);
+            if (it == p0.end()) {
+                // if no memory -> start from 0
+                it = p0.emplace(seq_id, memory ? memory->seq_pos_max(seq_id) + 1 : 0).first;
+            }
+
+            pos[i] = it->second;
 
             // update the starting position for all sequences that are assigned to the this token
             for (int32_t s = 0; s < batch.n_seq_id[i]; ++s) {
@@ -149,8 +144,7 @@ bool llama_batch_allocr::init(
     // compute stats
     //
 
-    this->n_embd    = n_embd;
-    this->n_seq_max = n_seq_max;
+    this->n_embd = n_embd;
 
     // count the outputs in this batch
     for (int32_t i = 0; i < batch.n_tokens; ++i) {
@@ -171,10 +165,10 @@ bool llama_batch_allocr::init(
 
             if (s > 0) {
                 // mark that sequence s1 is coupled to s0
-                seq_cpl[s1][s0] = true;
+                seq_cpl[s1].insert(s0);
 
                 // note: tracking the other way around is not necessary for now
-                //seq_cpl[s0][s1] = true;
+                //seq_cpl[s0].insert(s1);
 
                 has_cpl = true;
             }
@@ -182,27 +176,31 @@ bool llama_batch_allocr::init(
     }
 
     // precompute the sequence sets for each token and determine the unique sequence ids that participate in the batch
+    // only the sequences of the batch are visited, not all the n_seq_max ids
     {
-        seq_set_t seq_set_unq;
+        seq_set.reserve(batch.n_tokens);
 
         for (int32_t i = 0; i < batch.n_tokens; ++i) {
             seq_set_t cur;
             for (int32_t s = 0; s < batch.n_seq_id[i]; ++s) {
                 const llama_seq_id seq_id = batch.seq_id[i][s];
 
-                cur        .set(seq_id);
-                seq_set_unq.set(seq_id);
+                cur.set(seq_id);
+
+                if (seq_idx[seq_id] < 0) {
+                    seq_idx[seq_id] = 0;
+                    seq_id_unq.push_back(seq_id);
+                }
             }
 
-            seq_set.push_back(cur);
             seq_set_map[cur].push_back(i);
+            seq_set.push_back(std::move(cur));
         }
 
-        for (uint32_t s = 0; s < n_seq_max; ++s) {
-            if (seq_set_unq.test(s)) {
-                seq_idx[s] = seq_id_unq.size();
-                seq_id_unq.push_back(s);
-            }
+        std::sort(seq_id_unq.begin(), seq_id_unq.end());
+
+        for (size_t s = 0; s < seq_id_unq.size(); ++s) {
+            seq_idx[seq_id_unq[s]] = s;
         }
     }
 
@@ -229,16 +227,10 @@ bool llama_batch_allocr::init(
         ubatch_print(ubatch, debug);
 
         LLAMA_LOG_DEBUG("%s:   seq       = [\n", __func__);
-        for (int s0 = 0; s0 < (int) seq_pos.size(); ++s0) {
-            if (seq_pos[s0].empty()) {
-                continue;
-            }
-
+        for (const llama_seq_id s0 : seq_id_unq) {
             std::stringstream ss;
-            for (int s1 = 0; s1 < (int) seq_cpl[s0].size(); ++s1) {
-                if (seq_cpl[s0][s1]) {
-                    ss << s1 << " ";
-                }
+            for (const llama_seq_id s1 : seq_cpl[s0]) {
+                ss << s1 << " ";
             }
 
             LLAMA_LOG_DEBUG("%s:  %4d: pos = [%4d, %4d], cpl = %s\n",
@@ -251,11 +243,7 @@ bool llama_batch_allocr::init(
     // consistency checks
     //
 
-    for (uint32_t s = 0; s < n_seq_max; ++s) {
-        if (seq_pos[s].empty()) {
-            continue;
-        }
-
+    for (const llama_seq_id s : seq_id_unq) {
         const llama_pos p0 = memory ? memory->seq_pos_max(s) : -1;
 
         if (p0 >= 0) {
@@ -294,14 +282,12 @@ bool llama_batch_allocr::init(
     }
 
     if (memory) {
-        for (uint32_t s0 = 0; s0 < n_seq_max; ++s0) {
-            for (uint32_t s1 = 0; s1 < n_seq_max; ++s1) {
-                if (seq_cpl[s0][s1]) {
-                    if (memory->seq_pos_min(s0) != memory->seq_pos_min(s1) ||
-                        memory->seq_pos_max(s0) != memory->seq_pos_max(s1)) {
-                        LLAMA_LOG_ERROR("%s: sequence %d is coupled to %d in the input batch, but have divereged\n", __func__, s0, s1);
-                        return false;
-                    }
+        for (const llama_seq_id s0 : seq_id_unq) {
+            for (const llama_seq_id s1 : seq_cpl[s0]) {
+                if (memory->seq_pos_min(s0) != memory->seq_pos_min(s1) ||
+                    memory->seq_pos_max(s0) != memory->seq_pos_max(s1)) {
+                    LLAMA_LOG_ERROR("%s: sequence %d is coupled to %d in the input batch, but have divereged\n", __func__, s0, s1);
+                    return false;
                 }
             }
         }
@@ -325,15 +311,10 @@ bool llama_batch_allocr::init(
     // seq_id[i][0]: 0 0 1 1 0 1 0
     //
     {
-        seq_set_t cur_seq_set[LLAMA_MAX_SEQ];
-        for (uint32_t s = 0; s < n_seq_max; ++s) {
-            cur_seq_set[s].set();
-        }
+        // indexed by seq_idx, an empty set means that the sequence has not been seen yet
+        std::vector<seq_set_t> cur_seq_set(seq_id_unq.size());
 
-        llama_pos cur_seq_pos[LLAMA_MAX_SEQ];
-        for (uint32_t s = 0; s < n_seq_max; ++s) {
-            cur_seq_pos[s] = -1;
-        }
+        std::vector<llama_pos> cur_seq_pos(seq_id_unq.size(), -1);
 
         for (int32_t i = 0; i < batch.n_tokens; ++i) {
             const llama_pos pos = batch.pos[i];
@@ -341,14 +322,20 @@ bool llama_batch_allocr::init(
             for (int32_t s = 0; s < batch.n_seq_id[i]; ++s) {
                 const llama_seq_id seq_id = batch.seq_id[i][s];
 
-                cur_seq_set[seq_id] &= seq_set[i];
+                auto & cur = cur_seq_set[seq_idx[seq_id]];
 
-                if (cur_seq_set[seq_id].none()) {
+                if (cur.none()) {
+                    cur = seq_set[i];
+                } else {
+                    cur &= seq_set[i];
+                }
+
+                if (cur.none()) {
                     LLAMA_LOG_ERROR("%s: sequence %d belongs to incompatible sequence sets (not allowed)\n", __func__, seq_id);
                     return false;
                 }
 
-                if (pos < cur_seq_pos[seq_id]) {
+                if (pos < cur_seq_pos[seq_idx[seq_id]]) {
                     LLAMA_LOG_ERROR("%s: sequence %d positions are decreasing (not allowed)\n", __func__, seq_id);
                     return false;
                 }
@@ -375,7 +362,7 @@ llama_ubatch llama_batch_allocr::ubatch_reserve(uint32_t n_seq_tokens, uint32_t
     udata->n_seq_id  .resize(n_tokens);
     udata->seq_id    .resize(n_tokens);
     udata->seq_id_unq.resize(0);
-    udata->seq_idx   .resize(LLAMA_MAX_SEQ, -1);
+    udata->seq_idx   .resize(n_seqs, -1);
     udata->output    .resize(n_tokens);
 
     for (uint32_t s = 0; s < n_seqs; ++s) {
@@ -484,6 +471,9 @@ llama_ubatch llama_batch_allocr::split_equal(uint32_t n_ubatch, bool sequential)
 
     std::vector<seq_set_t> cur_seq_set;
 
+    // the sequences that belong to one of the sets in cur_seq_set, indexed by seq_idx
+    std::vector<bool> cur_seq_used(seq_id_unq.size(), false);
+
     llama_seq_id last_seq_id = -1;
 
     // determine the non-overlapping sequence sets participating in this ubatch
@@ -494,13 +484,10 @@ llama_ubatch llama_batch_allocr::split_equal(uint32_t n_ubatch, bool sequential)
 
         bool add = true;
 
-        for (uint32_t s = 0; s < cur_seq_set.size(); ++s) {
-            // no overlap with existing sequence sets:
-            if (!(cur_seq_set[s] & seq_set[i]).none()) {
-                add = false;
-                break;
-            }
-        }
+        // no overlap with existing sequence sets:
+        seq_set[i].for_each([&](llama_seq_id s) {
+            add = add && !cur_seq_used[seq_idx[s]];
+        });
 
         // accept only increasing sequence ids
         if (sequential) {
@@ -510,6 +497,10 @@ llama_ubatch llama_batch_allocr::split_equal(uint32_t n_ubatch, bool sequential)
         if (add) {
             cur_seq_set.push_back(seq_set[i]);
 
+            seq_set[i].for_each([&](llama_seq_id s) {
+                cur_seq_used[seq_idx[s]] = true;
+            });
+
             last_seq_id = batch.seq_id[i][0];
 
             if (cur_seq_set.size() > n_ubatch) {
@@ -610,7 +601,7 @@ llama_ubatch llama_batch_allocr::split_seq(uint32_t n_ubatch) {
 
         do {
             ++cur_idx;
-        } while (cur_idx < get_n_tokens() && (used[cur_idx] || ((cur_seq_set & seq_set[cur_idx]) != seq_set[cur_idx])));
+        } while (cur_idx < get_n_tokens() && (used[cur_idx] || !seq_set[cur_idx].is_subset_of(cur_seq_set)));
 
         if (cur_idx == get_n_tokens()) {
             break;
@@ -627,25 +618,22 @@ void llama_batch_allocr::clear() {
 
     batch = {};
 
+    // only the sequences of the previous batch have been set
+    for (const llama_seq_id s : seq_id_unq) {
+        seq_pos[s].clear();
+        seq_cpl[s].clear();
+        seq_idx[s] = -1;
+    }
+
     pos       .clear();
     n_seq_id  .clear();
     seq_id    .clear();
     seq_id_unq.clear();
     output    .clear();
 
-    for (auto & cur : seq_pos) {
-        cur.clear();
-    }
-
-    for (auto & cur : seq_cpl) {
-        std::fill(cur.begin(), cur.end(), false);
-    }
-
     seq_set.clear();
 
     seq_set_map.clear();
-
-    std::fill(seq_idx.begin(), seq_idx.end(), -1);
 }
 
 llama_ubatch llama_batch_allocr::ubatch_add(const std::vector<int32_t> & idxs, uint32_t n_seqs, bool equal_seqs) {
@@ -666,11 +654,8 @@ llama_ubatch llama_batch_allocr::ubatch_add(const std::vector<int32_t> & idxs, u
     udata->n_seq_id  .resize(n_tokens);
     udata->seq_id    .resize(n_tokens);
     udata->seq_id_unq.resize(0);
-    udata->seq_idx   .resize(LLAMA_MAX_SEQ, -1);
     udata->output    .resize(n_tokens);
 
-    seq_set_t seq_set_unq;
-
     for (size_t i = 0; i < idxs.size(); ++i) {
         if (batch.token) {
             udata->token[i] = batch.token[idxs[i]];
@@ -689,7 +674,16 @@ llama_ubatch llama_batch_allocr::ubatch_add(const std::vector<int32_t> & idxs, u
         udata->output[i]   = batch.logits[idxs[i]];
 
         for (int s = 0; s < udata->n_seq_id[i]; ++s) {
-            seq_set_unq.set(udata->seq_id[i][s]);
+            const llama_seq_id seq_id = udata->seq_id[i][s];
+
+            if (udata->seq_idx.size() <= (size_t) seq_id) {
+                udata->seq_idx.resize(seq_id + 1, -1);
+            }
+
+            if (udata->seq_idx[seq_id] < 0) {
+                udata->seq_idx[seq_id] = 0;
+                udata->seq_id_unq.push_back(seq_id);
+            }
         }
 
         if (udata->output[i]) {
@@ -697,11 +691,10 @@ llama_ubatch llama_batch_allocr::ubatch_add(const std::vector<int32_t> & idxs, u
         }
     }
 
-    for (uint32_t s = 0; s < n_seq_max; ++s) {
-        if (seq_set_unq.test(s)) {
-            udata->seq_idx[s] = udata->seq_id_unq.size();
-            udata->seq_id_unq.push_back(s);
-        }
+    std::sort(udata->seq_id_unq.begin(), udata->seq_id_unq.end());
+
+    for (size_t s = 0; s < udata->seq_id_unq.size(); ++s) {
+        udata->seq_idx[udata->seq_id_unq[s]] = s;
     }
 
     llama_ubatch res {
@@ -749,7 +742,10 @@ void llama_batch_allocr::ubatch_print(const llama_ubatch & ubatch, int debug) {
             ss_seq_id_unq << ubatch.seq_id_unq[s] << " ";
         }
 
-        for (uint32_t s = 0; s < LLAMA_MAX_SEQ; ++s) {
+        // seq_idx covers the ids up to the largest one of the ubatch
+        const uint32_t n_seq_idx = ubatch.n_seqs_unq > 0 ? ubatch.seq_id_unq[ubatch.n_seqs_unq - 1] + 1 : 0;
+
+        for (uint32_t s = 0; s < n_seq_idx; ++s) {
             if (ubatch.seq_idx[s] >= 0) {
                 ss_seq_idx << ubatch.seq_idx[s]%10;
             } else {
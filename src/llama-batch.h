@@ -3,11 +3,11 @@
 #include "llama.h"
 
 #include "llama-cparams.h"
+#include "llama-seq-set.h"
 
 #include <array>
 #include <vector>
 #include <set>
-#include <bitset>
 #include <memory>
 #include <unordered_map>
 
@@ -37,7 +37,7 @@ struct llama_ubatch {
     int32_t      *  n_seq_id;   // [n_tokens]         | i   | -
     llama_seq_id ** seq_id;     // [n_tokens]         | s   | s0, s1, seq_id
     llama_seq_id *  seq_id_unq; // [n_seqs_unq]       | s   | seq_id
-    int32_t      *  seq_idx;    // [LLAMA_MAX_SEQ]    | -   | seq_idx
+    int32_t      *  seq_idx;    // [seq_id_max + 1]   | -   | seq_idx
     int8_t       *  output;     // [n_tokens]         | i   | -
 
     struct data_t {
@@ -120,7 +120,6 @@ private:
     const uint32_t n_pos_per_embd;
 
     uint32_t n_embd;
-    uint32_t n_seq_max;
     uint32_t n_outputs;
 
     std::array<llama_seq_id, 1> seq_id_0 = { 0 }; // default sequence id
@@ -133,20 +132,20 @@ private:
     std::vector<int8_t>         output;
 
     using pos_set_t = std::set<llama_pos>;
-    using seq_cpl_t = std::vector<bool>;
+    using seq_cpl_t = std::set<llama_seq_id>;
 
     // helper flag to quickly determine if there are any coupled sequences in the batch
     bool has_cpl = false;
 
     std::vector<pos_set_t> seq_pos; // seq_pos[s]: the set of positions in sequence s
-    std::vector<seq_cpl_t> seq_cpl; // seq_cpl[s0][s1]: if sequence s0 is coupled to sequence s1
+    std::vector<seq_cpl_t> seq_cpl; // seq_cpl[s0]: the sequences s1 to which sequence s0 is coupled
 
     using idx_vec_t = std::vector<int32_t>;
-    using seq_set_t = std::bitset<LLAMA_MAX_SEQ>;
+    using seq_set_t = llama_seq_set;
 
     std::vector<seq_set_t> seq_set; // seq_set[i]: the sequence set of token i
 
-    std::unordered_map<seq_set_t, idx_vec_t> seq_set_map; // the indices at which the sequence set appears
+    std::unordered_map<seq_set_t, idx_vec_t, seq_set_t::hash> seq_set_map; // the indices at which the sequence set appears
 
     // batch indices of the output
     std::vector<int32_t> out_ids;
@@ -10,6 +10,7 @@
 #include <cinttypes>
 #include <cstring>
 #include <limits>
+#include <map>
 #include <stdexcept>
 
 //
@@ -33,6 +34,13 @@ llama_context::llama_context(
         throw std::runtime_error("n_seq_max must be <= " + std::to_string(LLAMA_MAX_SEQ));
     }
 
+    cparams.n_kv_block = params.n_kv_block;
+
+    cparams.n_kv_budget = params.n_kv_budget;
+    cparams.n_kv_recent = params.n_kv_budget > 0 ? std::min(params.n_kv_recent > 0 ? params.n_kv_recent : params.n_kv_budget/2, params.n_kv_budget) : 0;
+
+    cparams.n_kv_sink = params.n_kv_sink;
+
     cparams.n_threads        = params.n_threads;
     cparams.n_threads_batch  = params.n_threads_batch;
     cparams.yarn_ext_factor  = params.yarn_ext_factor;
@@ -113,6 +121,15 @@ llama_context::llama_context(
         }
     }
 
+    if (cparams.n_kv_block > 0 && !cparams.kv_unified) {
+        LLAMA_LOG_WARN("%s: the paged KV cache uses a single stream - forcing unified KV cache\n", __func__);
+        cparams.kv_unified = true;
+    }
+
+    if (cparams.n_kv_budget > 0 && cparams.flash_attn) {
+        LLAMA_LOG_WARN("%s: the attention scores are not available with flash attention - the KV budget evicts the oldest cells\n", __func__);
+    }
+
     const uint32_t n_ctx_per_seq = cparams.n_ctx / cparams.n_seq_max;
 
     LLAMA_LOG_INFO("%s: n_seq_max     = %u\n",   __func__, cparams.n_seq_max);
@@ -123,6 +140,9 @@ llama_context::llama_context(
     LLAMA_LOG_INFO("%s: causal_attn   = %d\n",   __func__, cparams.causal_attn);
     LLAMA_LOG_INFO("%s: flash_attn    = %d\n",   __func__, cparams.flash_attn);
     LLAMA_LOG_INFO("%s: kv_unified    = %s\n",   __func__, cparams.kv_unified ? "true" : "false");
+    LLAMA_LOG_INFO("%s: n_kv_block    = %u\n",   __func__, cparams.n_kv_block);
+    LLAMA_LOG_INFO("%s: n_kv_budget   = %u\n",   __func__, cparams.n_kv_budget);
+    LLAMA_LOG_INFO("%s: n_kv_sink     = %u\n",   __func__, cparams.n_kv_sink);
     LLAMA_LOG_INFO("%s: freq_base     = %.1f\n", __func__, cparams.rope_freq_base);
     LLAMA_LOG_INFO("%s: freq_scale    = %g\n",   __func__, cparams.rope_freq_scale);
 
@@ -200,11 +220,16 @@ llama_context::llama_context(
     // init the memory module
     if (!hparams.vocab_only) {
         llama_memory_params params_mem = {
-            /*.type_k   =*/ params.type_k,
-            /*.type_v   =*/ params.type_v,
-            /*.swa_full =*/ params.swa_full,
+            /*.type_k         =*/ params.type_k,
+            /*.type_v         =*/ params.type_v,
+            /*.type_overrides =*/ {},
+            /*.swa_full       =*/ params.swa_full,
         };
 
+        for (const auto * o = params.kv_type_overrides; o && (o->type_k != GGML_TYPE_COUNT || o->type_v != GGML_TYPE_COUNT); ++o) {
+            params_mem.type_overrides.push_back(*o);
+        }
+
         memory.reset(model.create_memory(params_mem, cparams));
     }
 
@@ -761,6 +786,15 @@ llm_graph_result * llama_context::process_ubatch(const llama_ubatch & ubatch, ll
         return nullptr;
     }
 
+    if (res->get_has_outputs()) {
+        // the attention received by the KV cells is read back by the inputs of the graph, which waits for the graph
+        // computation. this only happens with a KV budget, without flash attention and once a sequence of the ubatch
+        // is close to the budget, see llama_kv_cache_unified::get_needs_score()
+        ggml_backend_sched_synchronize(sched.get());
+
+        res->read_outputs();
+    }
+
     ret = GGML_STATUS_SUCCESS;
 
     return res;
@@ -1062,25 +1096,19 @@ int llama_context::decode(const llama_batch & batch_inp) {
 
         if (!res) {
             // the last ubatch failed or was aborted -> remove all positions of that ubatch from the KV cache
-            llama_pos pos_min[LLAMA_MAX_SEQ];
-            for (int s = 0; s < LLAMA_MAX_SEQ; ++s) {
-                pos_min[s] = std::numeric_limits<llama_pos>::max();
-            }
+            std::map<llama_seq_id, llama_pos> pos_min;
 
             for (uint32_t i = 0; i < ubatch.n_tokens; ++i) {
                 const auto & seq_id = ubatch.seq_id[i][0];
 
-                pos_min[seq_id] = std::min(pos_min[seq_id], ubatch.pos[i]);
+                auto it = pos_min.emplace(seq_id, ubatch.pos[i]).first;
+                it->second = std::min(it->second, ubatch.pos[i]);
             }
 
-            for (int s = 0; s < LLAMA_MAX_SEQ; ++s) {
-                if (pos_min[s] == std::numeric_limits<llama_pos>::max()) {
-                    continue;
-                }
-
-                LLAMA_LOG_WARN("%s: removing KV cache entries for seq_id = %d, pos = [%d, +inf)\n", __func__, s, pos_min[s]);
+            for (const auto & [s, p0] : pos_min) {
+                LLAMA_LOG_WARN("%s: removing KV cache entries for seq_id = %d, pos = [%d, +inf)\n", __func__, s, p0);
 
-                memory->seq_rm(s, pos_min[s], -1);
+                memory->seq_rm(s, p0, -1);
             }
 
             switch (status) {
@@ -1666,6 +1694,36 @@ size_t llama_context::state_seq_set_data(llama_seq_id seq_id, const uint8_t * sr
     }
 }
 
+size_t llama_context::state_seq_get_size_range(llama_seq_id seq_id, llama_pos p0, llama_pos p1) {
+    llama_io_write_dummy io;
+    try {
+        return state_seq_write_data(io, seq_id, p0, p1);
+    } catch (const std::exception & err) {
+        LLAMA_LOG_ERROR("%s: error getting state size: %s\n", __func__, err.what());
+        return 0;
+    }
+}
+
+size_t llama_context::state_seq_get_data_range(llama_seq_id seq_id, llama_pos p0, llama_pos p1, uint8_t * dst, size_t size) {
+    llama_io_write_buffer io(dst, size);
+    try {
+        return state_seq_write_data(io, seq_id, p0, p1);
+    } catch (const std::exception & err) {
+        LLAMA_LOG_ERROR("%s: error saving state: %s\n", __func__, err.what());
+        return 0;
+    }
+}
+
+size_t llama_context::state_seq_append_data(llama_seq_id seq_id, const uint8_t * src, size_t size) {
+    llama_io_read_buffer io(src, size);
+    try {
+        return state_seq_read_data(io, seq_id, true);
+    } catch (const std::exception & err) {
+        LLAMA_LOG_ERROR("%s: error loading state: %s\n", __func__, err.what());
+        return 0;
+    }
+}
+
 bool llama_context::state_load_file(const char * filepath, llama_token * tokens_out, size_t n_token_capacity, size_t * n_token_count_out) {
     llama_file file(filepath, "rb");
 
@@ -1950,21 +2008,25 @@ size_t llama_context::state_read_data(llama_io_read_i & io) {
     return io.n_bytes();
 }
 
-size_t llama_context::state_seq_write_data(llama_io_write_i & io, llama_seq_id seq_id) {
-    GGML_UNUSED(seq_id);
-
+size_t llama_context::state_seq_write_data(llama_io_write_i & io, llama_seq_id seq_id, llama_pos p0, llama_pos p1) {
     if (memory) {
-        memory->state_write(io, seq_id);
+        if (p0 < 0 && p1 < 0) {
+            memory->state_write(io, seq_id);
+        } else {
+            memory->state_write_range(io, seq_id, p0, p1);
+        }
     }
 
     return io.n_bytes();
 }
 
-size_t llama_context::state_seq_read_data(llama_io_read_i & io, llama_seq_id seq_id) {
-    GGML_UNUSED(seq_id);
-
+size_t llama_context::state_seq_read_data(llama_io_read_i & io, llama_seq_id seq_id, bool append) {
     if (memory) {
-        memory->state_read(io, seq_id);
+        if (append) {
+            memory->state_read_append(io, seq_id);
+        } else {
+            memory->state_read(io, seq_id);
+        }
     }
 
     return io.n_bytes();
@@ -2248,6 +2310,11 @@ llama_context_params llama_context_default_params() {
         /*.op_offload                  =*/ true,
         /*.swa_full                    =*/ true,
         /*.kv_unified                  =*/ false,
+        /*.n_kv_sink                   =*/ 0,
+        /*.kv_type_overrides           =*/ nullptr,
+        /*.n_kv_block                  =*/ 0,
+        /*.n_kv_budget                 =*/ 0,
+        /*.n_kv_recent                 =*/ 0,
     };
 
     return result;
@@ -2281,6 +2348,13 @@ llama_context * llama_init_from_model(
         return nullptr;
     }
 
+    for (const auto * o = params.kv_type_overrides; o && (o->type_k != GGML_TYPE_COUNT || o->type_v != GGML_TYPE_COUNT); ++o) {
+        if (o->type_v != GGML_TYPE_COUNT && ggml_is_quantized(o->type_v) && !params.flash_attn) {
+            LLAMA_LOG_ERROR("%s: V cache quantization requires flash_attn (layers %d to %d)\n", __func__, o->il_first, o->il_last);
+            return nullptr;
+        }
+    }
+
     try {
         auto * ctx = new llama_context(*model, params);
         return ctx;
@@ -2549,6 +2623,20 @@ bool llama_memory_can_shift(llama_memory_t mem) {
     return mem->get_can_shift();
 }
 
+int32_t llama_memory_get_stream_stats(llama_memory_t mem, llama_memory_stream_stats * stats, int32_t n_max) {
+    if (!mem) {
+        return 0;
+    }
+
+    const auto res = mem->get_stream_stats();
+
+    for (int32_t i = 0; i < std::min<int32_t>(n_max, res.size()); ++i) {
+        stats[i] = res[i];
+    }
+
+    return res.size();
+}
+
 //
 // kv cache
 //
@@ -2795,6 +2883,22 @@ size_t llama_state_seq_set_data(llama_context * ctx, const uint8_t * src, size_t
     return ctx->state_seq_set_data(seq_id, src, size);
 }
 
+size_t llama_state_seq_get_size_range(llama_context * ctx, llama_seq_id seq_id, llama_pos p0, llama_pos p1) {
+    return ctx->state_seq_get_size_range(seq_id, p0, p1);
+}
+
+size_t llama_state_seq_get_data_range(llama_context * ctx, uint8_t * dst, size_t size, llama_seq_id seq_id, llama_pos p0, llama_pos p1) {
+    ctx->synchronize();
+
+    return ctx->state_seq_get_data_range(seq_id, p0, p1, dst, size);
+}
+
+size_t llama_state_seq_append_data(llama_context * ctx, const uint8_t * src, size_t size, llama_seq_id seq_id) {
+    ctx->synchronize();
+
+    return ctx->state_seq_append_data(seq_id, src, size);
+}
+
 size_t llama_state_seq_save_file(llama_context * ctx, const char * filepath, llama_seq_id seq_id, const llama_token * tokens, size_t n_token_count) {
     ctx->synchronize();
 
@@ -115,6 +115,10 @@ struct llama_context {
     size_t state_seq_get_data(llama_seq_id seq_id,       uint8_t * dst, size_t size);
     size_t state_seq_set_data(llama_seq_id seq_id, const uint8_t * src, size_t size);
 
+    size_t state_seq_get_size_range (llama_seq_id seq_id, llama_pos p0, llama_pos p1);
+    size_t state_seq_get_data_range (llama_seq_id seq_id, llama_pos p0, llama_pos p1,       uint8_t * dst, size_t size);
+    size_t state_seq_append_data    (llama_seq_id seq_id,                               const uint8_t * src, size_t size);
+
     bool state_load_file(
             const char * filepath,
            llama_token * tokens_out,
@@ -212,8 +216,8 @@ private:
     size_t state_write_data(llama_io_write_i & io);
     size_t state_read_data (llama_io_read_i  & io);
 
-    size_t state_seq_write_data(llama_io_write_i & io, llama_seq_id seq_id);
-    size_t state_seq_read_data (llama_io_read_i  & io, llama_seq_id seq_id);
+    size_t state_seq_write_data(llama_io_write_i & io, llama_seq_id seq_id, llama_pos p0 = -1, llama_pos p1 = -1);
+    size_t state_seq_read_data (llama_io_read_i  & io, llama_seq_id seq_id, bool append = false);
 
     //
     // members
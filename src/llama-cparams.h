@@ -4,13 +4,17 @@
 
 #include <cstdint>
 
-#define LLAMA_MAX_SEQ 64
+#define LLAMA_MAX_SEQ 4096
 
 struct llama_cparams {
     uint32_t n_ctx;           // context size used during inference
     uint32_t n_batch;
     uint32_t n_ubatch;
     uint32_t n_seq_max;
+    uint32_t n_kv_block;      // block size of the paged KV cache, 0 = disabled
+    uint32_t n_kv_budget;     // max KV cells per sequence, 0 = unlimited
+    uint32_t n_kv_recent;     // number of recent positions of a sequence that are never evicted
+    uint32_t n_kv_sink;       // number of sink positions of a sequence, the other positions are placed in a ring
     int32_t  n_threads;       // number of threads to use for generation
     int32_t  n_threads_batch; // number of threads to use for batch processing
 
@@ -7,6 +7,7 @@
 #include <cmath>
 #include <algorithm>
 #include <stdexcept>
+#include <unordered_set>
 
 //
 // helpers
@@ -585,8 +586,8 @@ void llama_grammar_parser::print(FILE * file) {
     }
 }
 
-llama_grammar_stack llama_grammar_parser::c_rules() const {
-    llama_grammar_stack ret;
+std::vector<const llama_grammar_element *> llama_grammar_parser::c_rules() const {
+    std::vector<const llama_grammar_element *> ret;
     ret.reserve(rules.size());
     for (const auto & rule : rules) {
         ret.push_back(rule.data());
@@ -594,6 +595,76 @@ llama_grammar_stack llama_grammar_parser::c_rules() const {
     return ret;
 }
 
+//
+// graph-structured stack
+//
+
+const llama_grammar_element * llama_grammar_stack::operator[](size_t i) const {
+    const llama_grammar_stack_node * node = top;
+    for (size_t n = size(); n > i + 1; --n) {
+        node = node->parent;
+    }
+    return node->pos;
+}
+
+llama_grammar_stack llama_grammar_stack::push(const llama_grammar_element * pos) const {
+    return { pool, pool->get(pos, top) };
+}
+
+const llama_grammar_stack_node * llama_grammar_stack_pool::get(
+        const llama_grammar_element    * pos,
+        const llama_grammar_stack_node * parent) {
+    const auto it = index.find({ pos, parent });
+    if (it != index.end()) {
+        return it->second;
+    }
+
+    nodes.push_back({ pos, parent, parent ? parent->size + 1 : 1 });
+    index.emplace(std::make_pair(pos, parent), &nodes.back());
+
+    return &nodes.back();
+}
+
+void llama_grammar_stack_pool::gc(std::vector<llama_grammar_stack> & stacks) {
+    if (nodes.size() <= n_gc) {
+        return;
+    }
+
+    std::deque<llama_grammar_stack_node> nodes_new;
+    decltype(index)                      index_new;
+
+    std::unordered_map<const llama_grammar_stack_node *, const llama_grammar_stack_node *> moved;
+
+    std::vector<const llama_grammar_stack_node *> chain;
+
+    for (auto & stack : stacks) {
+        // the nodes of the stack that have not been moved yet, a node is moved after its parent
+        chain.clear();
+        for (const auto * node = stack.top; node != nullptr && moved.find(node) == moved.end(); node = node->parent) {
+            chain.push_back(node);
+        }
+
+        for (auto it = chain.rbegin(); it != chain.rend(); ++it) {
+            const llama_grammar_stack_node * parent = (*it)->parent ? moved.at((*it)->parent) : nullptr;
+
+            nodes_new.push_back({ (*it)->pos, parent, (*it)->size });
+            index_new.emplace(std::make_pair((*it)->pos, parent), &nodes_new.back());
+
+            moved[*it] = &nodes_new.back();
+        }
+
+        stack.top = stack.top ? moved.at(stack.top) : nullptr;
+    }
+
+    // swapping keeps the addresses of the nodes
+    nodes.swap(nodes_new);
+    index.swap(index_new);
+
+    advanced.clear();
+
+    n_gc = std::max(n_gc_min, 2*nodes.size());
+}
+
 // returns true iff pos points to the end of one of the definitions of a rule
 static bool llama_grammar_is_end_of_sequence(const llama_grammar_element * pos) {
     switch (pos->type) {
@@ -685,13 +756,13 @@ static bool llama_grammar_match_partial_char(
 
 // transforms a grammar pushdown stack into N possible stacks, all ending
 // at a character range (terminal element)
-static void llama_grammar_advance_stack(
-        const llama_grammar_rules  & rules,
-        const llama_grammar_stack  & stack,
-              llama_grammar_stacks & new_stacks) {
+static void llama_grammar_advance_stack_impl(
+        const llama_grammar_rules                     & rules,
+        const llama_grammar_stack                     & stack,
+        std::vector<const llama_grammar_stack_node *> & new_tops) {
     if (stack.empty()) {
-        if (std::find(new_stacks.begin(), new_stacks.end(), stack) == new_stacks.end()) {
-            new_stacks.emplace_back(stack);
+        if (std::find(new_tops.begin(), new_tops.end(), stack.top) == new_tops.end()) {
+            new_tops.push_back(stack.top);
         }
         return;
     }
@@ -704,16 +775,16 @@ static void llama_grammar_advance_stack(
             const llama_grammar_element * subpos  = rules[rule_id].data();
             do {
                 // init new stack without the top (pos)
-                llama_grammar_stack new_stack(stack.begin(), stack.end() - 1);
+                llama_grammar_stack new_stack = stack.pop();
                 if (!llama_grammar_is_end_of_sequence(pos + 1)) {
                     // if this rule ref is followed by another element, add that to stack
-                    new_stack.push_back(pos + 1);
+                    new_stack = new_stack.push(pos + 1);
                 }
                 if (!llama_grammar_is_end_of_sequence(subpos)) {
                     // if alternate is nonempty, add to stack
-                    new_stack.push_back(subpos);
+                    new_stack = new_stack.push(subpos);
                 }
-                llama_grammar_advance_stack(rules, new_stack, new_stacks);
+                llama_grammar_advance_stack_impl(rules, new_stack, new_tops);
                 while (!llama_grammar_is_end_of_sequence(subpos)) {
                     // scan to end of alternate def
                     subpos++;
@@ -730,9 +801,9 @@ static void llama_grammar_advance_stack(
         case LLAMA_GRETYPE_CHAR:
         case LLAMA_GRETYPE_CHAR_NOT:
         case LLAMA_GRETYPE_CHAR_ANY:
-            if (std::find(new_stacks.begin(), new_stacks.end(), stack) == new_stacks.end()) {
+            if (std::find(new_tops.begin(), new_tops.end(), stack.top) == new_tops.end()) {
                 // only add the stack if it's not a duplicate of one we already have
-                new_stacks.emplace_back(stack);
+                new_tops.push_back(stack.top);
             }
             break;
         default:
@@ -743,11 +814,42 @@ static void llama_grammar_advance_stack(
     }
 }
 
+// the tops of the stacks reached from a stack only depend on the stack, so they are computed once per
+// stack node and shared by all the stacks of the grammar that reach this node
+static const std::vector<const llama_grammar_stack_node *> & llama_grammar_advance_tops(
+        const llama_grammar_rules & rules,
+        const llama_grammar_stack & stack) {
+    auto & advanced = stack.pool->advanced;
+
+    auto it = advanced.find(stack.top);
+    if (it == advanced.end()) {
+        std::vector<const llama_grammar_stack_node *> new_tops;
+        llama_grammar_advance_stack_impl(rules, stack, new_tops);
+        it = advanced.emplace(stack.top, std::move(new_tops)).first;
+    }
+
+    return it->second;
+}
+
+static void llama_grammar_advance_stack(
+        const llama_grammar_rules  & rules,
+        const llama_grammar_stack  & stack,
+              llama_grammar_stacks & new_stacks) {
+    for (const auto * top : llama_grammar_advance_tops(rules, stack)) {
+        const llama_grammar_stack new_stack = { stack.pool, top };
+        if (std::find(new_stacks.begin(), new_stacks.end(), new_stack) == new_stacks.end()) {
+            new_stacks.push_back(new_stack);
+        }
+    }
+}
+
 static llama_grammar_candidates llama_grammar_reject_candidates(
         const llama_grammar_rules      & rules,
         const llama_grammar_stacks     & stacks,
         const llama_grammar_candidates & candidates) {
-    GGML_ASSERT(!stacks.empty()); // REVIEW
+    // advancing a stack yields at least one stack (a completed stack advances to itself), and
+    // llama_grammar_accept_impl throws instead of leaving the grammar without stacks
+    GGML_ASSERT(!stacks.empty());
 
     if (candidates.empty()) {
         return {};
@@ -762,6 +864,134 @@ static llama_grammar_candidates llama_grammar_reject_candidates(
     return rejects;
 }
 
+// stacks reached while walking the token trie, interned so that the stacks following the char at
+// the top of a stack are computed once per walk and not once per trie node
+struct llama_grammar_trie_walk {
+    const llama_grammar_rules  & rules;
+    const llama_grammar_tokens & tokens;
+
+    std::vector<uint8_t> & accepted; // [n_tokens]
+
+    std::unordered_map<const llama_grammar_stack_node *, uint32_t> ids;
+
+    std::vector<llama_grammar_stack>         stacks;
+    std::vector<std::vector<uint32_t>>       stacks_next;
+    std::vector<uint8_t>                     stacks_next_done;
+
+    // the stack set at each depth of the walk
+    std::vector<std::vector<uint32_t>> sets;
+
+    uint32_t intern(const llama_grammar_stack & stack) {
+        const auto res = ids.emplace(stack.top, (uint32_t) stacks.size());
+        if (res.second) {
+            stacks.push_back(stack);
+            stacks_next.emplace_back();
+            stacks_next_done.push_back(0);
+        }
+        return res.first->second;
+    }
+
+    const std::vector<uint32_t> & get_next(uint32_t sid) {
+        if (!stacks_next_done[sid]) {
+            const llama_grammar_stack stack = stacks[sid];
+
+            const auto * pos_after = llama_grammar_match_char(stack.back(), 0).second;
+
+            llama_grammar_stack stack_after = stack.pop();
+            if (!llama_grammar_is_end_of_sequence(pos_after)) {
+                stack_after = stack_after.push(pos_after);
+            }
+
+            const auto & tops = llama_grammar_advance_tops(rules, stack_after);
+
+            std::vector<uint32_t> next;
+            next.reserve(tops.size());
+            for (const auto * top : tops) {
+                next.push_back(intern({ stack.pool, top }));
+            }
+            stacks_next[sid]      = std::move(next);
+            stacks_next_done[sid] = 1;
+        }
+        return stacks_next[sid];
+    }
+
+    // the stacks in sets[depth] are those reached after the prefix of the node
+    void walk(uint32_t i_node, size_t depth) {
+        const auto & node = tokens.nodes[i_node];
+
+        for (uint32_t k = node.t0; k < node.t0 + node.n_end; ++k) {
+            const llama_token          id      = tokens.sorted[k];
+            const llama_partial_utf8 & partial = tokens.partial[id];
+
+            // a token ending on complete code points is accepted by any stack, the ones ending on a
+            // partial sequence need a stack where that sequence can continue
+            if (partial.n_remain == 0) {
+                accepted[id] = 1;
+                continue;
+            }
+            for (const uint32_t sid : sets[depth]) {
+                const llama_grammar_stack & stack = stacks[sid];
+                if (!stack.empty() && llama_grammar_match_partial_char(stack.back(), partial)) {
+                    accepted[id] = 1;
+                    break;
+                }
+            }
+        }
+
+        if (sets.size() < depth + 2) {
+            sets.resize(depth + 2);
+        }
+
+        for (uint32_t i_child = i_node + 1; i_child < node.next; i_child = tokens.nodes[i_child].next) {
+            const uint32_t chr = tokens.nodes[i_child].chr;
+
+            auto & set_next = sets[depth + 1];
+            set_next.clear();
+
+            for (const uint32_t sid : sets[depth]) {
+                const llama_grammar_stack & stack = stacks[sid];
+                if (stack.empty() || !llama_grammar_match_char(stack.back(), chr).first) {
+                    continue;
+                }
+                for (const uint32_t sid_next : get_next(sid)) {
+                    set_next.push_back(sid_next);
+                }
+            }
+
+            // no stack accepts the prefix: reject all the tokens below this child
+            if (set_next.empty()) {
+                continue;
+            }
+
+            std::sort(set_next.begin(), set_next.end());
+            set_next.erase(std::unique(set_next.begin(), set_next.end()), set_next.end());
+
+            walk(i_child, depth + 1);
+        }
+    }
+};
+
+// marks the tokens accepted by any of the stacks, matching each prefix shared by several tokens once
+static void llama_grammar_accept_tokens(
+        const llama_grammar_rules  & rules,
+        const llama_grammar_stacks & stacks,
+        const llama_grammar_tokens & tokens,
+              std::vector<uint8_t> & accepted) {
+    // the grammar always has a stack, see llama_grammar_reject_candidates
+    GGML_ASSERT(!stacks.empty());
+
+    llama_grammar_trie_walk walk = { rules, tokens, accepted, {}, {}, {}, {}, {} };
+
+    walk.sets.resize(1);
+    for (const auto & stack : stacks) {
+        walk.sets[0].push_back(walk.intern(stack));
+    }
+    std::sort(walk.sets[0].begin(), walk.sets[0].end());
+    walk.sets[0].erase(std::unique(walk.sets[0].begin(), walk.sets[0].end()), walk.sets[0].end());
+
+    walk.walk(0, 0);
+}
+
 static bool llama_grammar_detect_left_recursion(
         const llama_grammar_rules & rules,
         size_t rule_index,
@@ -827,6 +1057,9 @@ void llama_grammar_accept(struct llama_grammar * grammar, uint32_t chr) {
     llama_grammar_stacks stacks_new;
     stacks_new.reserve(grammar->stacks.size());
 
+    // the stacks are hash-consed, dedup them by node
+    std::unordered_set<const llama_grammar_stack_node *> seen;
+
     for (const auto & stack : grammar->stacks) {
         if (stack.empty()) {
             continue;
@@ -837,11 +1070,15 @@ void llama_grammar_accept(struct llama_grammar * grammar, uint32_t chr) {
             const llama_grammar_element * pos = match.second;
 
             // update top of stack to next element, if any
-            llama_grammar_stack new_stack(stack.begin(), stack.end() - 1);
+            llama_grammar_stack new_stack = stack.pop();
             if (!llama_grammar_is_end_of_sequence(pos)) {
-                new_stack.push_back(pos);
+                new_stack = new_stack.push(pos);
+            }
+            for (const auto * top : llama_grammar_advance_tops(grammar->rules, new_stack)) {
+                if (seen.insert(top).second) {
+                    stacks_new.push_back({ stack.pool, top });
+                }
             }
-            llama_grammar_advance_stack(grammar->rules, new_stack, stacks_new);
         }
     }
 
@@ -888,9 +1125,9 @@ llama_grammar_candidates llama_grammar_reject_candidates_for_stack(
     const auto * stack_pos_after = llama_grammar_match_char(stack_pos, 0).second;
 
     // update top of stack to next element, if any
-    llama_grammar_stack stack_after(stack.begin(), stack.end() - 1);
+    llama_grammar_stack stack_after = stack.pop();
     if (!llama_grammar_is_end_of_sequence(stack_pos_after)) {
-        stack_after.push_back(stack_pos_after);
+        stack_after = stack_after.push(stack_pos_after);
     }
     llama_grammar_stacks next_stacks;
     llama_grammar_advance_stack(rules, stack_after, next_stacks);
@@ -903,6 +1140,95 @@ llama_grammar_candidates llama_grammar_reject_candidates_for_stack(
     return rejects;
 }
 
+// builds the trie nodes of the sorted tokens [t0, t1), which share their first `depth` code points
+static void llama_grammar_tokens_add_node(
+        llama_grammar_tokens & tokens,
+                    uint32_t   chr,
+                      size_t   depth,
+                    uint32_t   t0,
+                    uint32_t   t1) {
+    const auto chr_at = [&](uint32_t t) {
+        return tokens.code_points[tokens.offsets[tokens.sorted[t]] + depth];
+    };
+
+    const size_t i_node = tokens.nodes.size();
+    tokens.nodes.push_back({ chr, t0, 0, 0 });
+
+    // the tokens ending here sort first
+    uint32_t t = t0;
+    while (t < t1 && chr_at(t) == 0) {
+        ++t;
+    }
+    tokens.nodes[i_node].n_end = t - t0;
+
+    while (t < t1) {
+        const uint32_t chr_child = chr_at(t);
+
+        uint32_t t_end = t + 1;
+        while (t_end < t1 && chr_at(t_end) == chr_child) {
+            ++t_end;
+        }
+        llama_grammar_tokens_add_node(tokens, chr_child, depth + 1, t, t_end);
+        t = t_end;
+    }
+
+    tokens.nodes[i_node].next = tokens.nodes.size();
+}
+
+std::unique_ptr<llama_grammar_tokens> llama_grammar_tokens_init(const llama_vocab & vocab) {
+    auto result = std::make_unique<llama_grammar_tokens>();
+
+    const uint32_t n_tokens = vocab.n_tokens();
+
+    result->offsets.resize(n_tokens);
+    result->partial.resize(n_tokens);
+    result->empty  .resize(n_tokens, 0);
+    result->sorted .reserve(n_tokens);
+
+    for (uint32_t id = 0; id < n_tokens; ++id) {
+        const std::string & piece = vocab.token_to_piece(id);
+
+        if (vocab.is_eog(id)) {
+            result->eog.push_back(id);
+        }
+
+        result->offsets[id] = result->code_points.size();
+
+        if (piece.empty() || piece[0] == 0) {
+            result->code_points.push_back(0);
+            result->partial[id] = { 0, 0 };
+            result->empty  [id] = 1;
+            continue;
+        }
+
+        const auto decoded = decode_utf8(piece, { 0, 0 });
+        result->code_points.insert(result->code_points.end(), decoded.first.begin(), decoded.first.end());
+        result->partial[id] = decoded.second;
+        result->sorted.push_back(id);
+    }
+
+    // a 0-terminated prefix sorts before its extensions, so the tokens below a trie node are contiguous
+    const uint32_t * code_points = result->code_points.data();
+    const uint32_t * offsets     = result->offsets.data();
+
+    std::sort(result->sorted.begin(), result->sorted.end(), [&](llama_token a, llama_token b) {
+        const uint32_t * pa = code_points + offsets[a];
+        const uint32_t * pb = code_points + offsets[b];
+        while (*pa != 0 && *pa == *pb) {
+            ++pa;
+            ++pb;
+        }
+        return *pa != *pb ? *pa < *pb : a < b;
+    });
+
+    llama_grammar_tokens_add_node(*result, 0, 0, 0, result->sorted.size());
+
+    LLAMA_LOG_DEBUG("%s: %u tokens, %zu code points, %zu trie nodes\n", __func__,
+            n_tokens, result->code_points.size(), result->nodes.size());
+
+    return result;
+}
+
 ////////////////////
 
 struct llama_grammar * llama_grammar_init_impl(
@@ -935,14 +1261,16 @@ struct llama_grammar * llama_grammar_init_impl(
         }
     }
 
+    auto stack_pool = std::make_unique<llama_grammar_stack_pool>();
+
     // loop over alternates of start rule to build initial stacks
     llama_grammar_stacks stacks;
     pos = vec_rules[start_rule_index].data();
     do {
-        llama_grammar_stack stack;
+        llama_grammar_stack stack = { stack_pool.get(), nullptr };
         if (!llama_grammar_is_end_of_sequence(pos)) {
             // if alternate is nonempty, add to stack
-            stack.push_back(pos);
+            stack = stack.push(pos);
         }
         llama_grammar_advance_stack(vec_rules, stack, stacks);
         while (!llama_grammar_is_end_of_sequence(pos)) {
@@ -970,6 +1298,9 @@ struct llama_grammar * llama_grammar_init_impl(
         /* .trigger_buffer = */   "",
         /* .trigger_tokens   = */ {},
         /* .trigger_patterns    = */ {},
+        /* .element_ids = */      {},
+        /* .mask_cache = */       nullptr,
+        /* .stack_pool = */       std::move(stack_pool),
     };
 }
 
@@ -1027,14 +1358,16 @@ struct llama_grammar * llama_grammar_init_impl(
         }
     }
 
+    auto stack_pool = std::make_unique<llama_grammar_stack_pool>();
+
     // loop over alternates of start rule to build initial stacks
     llama_grammar_stacks stacks;
     pos = vec_rules[start_rule_index].data();
     do {
-        llama_grammar_stack stack;
+        llama_grammar_stack stack = { stack_pool.get(), nullptr };
         if (!llama_grammar_is_end_of_sequence(pos)) {
             // if alternate is nonempty, add to stack
-            stack.push_back(pos);
+            stack = stack.push(pos);
         }
         llama_grammar_advance_stack(vec_rules, stack, stacks);
         while (!llama_grammar_is_end_of_sequence(pos)) {
@@ -1075,6 +1408,9 @@ struct llama_grammar * llama_grammar_init_impl(
         /* .trigger_buffer = */   "",
         std::move(vec_trigger_tokens),
         std::move(vec_trigger_patterns),
+        /* .element_ids = */      {},
+        /* .mask_cache = */       nullptr,
+        /* .stack_pool = */       std::move(stack_pool),
     };
 }
 
@@ -1090,32 +1426,154 @@ struct llama_grammar * llama_grammar_clone_impl(const struct llama_grammar & gra
     auto * result = new llama_grammar {
         grammar.vocab,
         grammar.rules,
-        grammar.stacks,
+        /* .stacks = */           {},
         grammar.partial_utf8,
         grammar.lazy,
         grammar.awaiting_trigger,
         grammar.trigger_buffer,
         grammar.trigger_tokens,
         grammar.trigger_patterns,
+        /* .element_ids = */      {},
+        /* .mask_cache = */       nullptr,
+        /* .stack_pool = */       std::make_unique<llama_grammar_stack_pool>(),
     };
 
-    // redirect elements in stacks to point to new rules
-    for (size_t is = 0; is < result->stacks.size(); is++) {
-        for (size_t ie = 0; ie < result->stacks[is].size(); ie++) {
-            for (size_t ir0 = 0; ir0 < grammar.rules.size(); ir0++) {
-                for (size_t ir1 = 0; ir1 < grammar.rules[ir0].size(); ir1++) {
-                    if (grammar.stacks[is][ie] == &grammar.rules[ir0][ir1]) {
-                        result->stacks[is][ie] =  &result->rules[ir0][ir1];
-                    }
+    // rebuild the stacks on the nodes of the new pool, pointing to the new rules
+    for (const auto & stack : grammar.stacks) {
+        std::vector<const llama_grammar_element *> elements;
+        for (const auto * node = stack.top; node != nullptr; node = node->parent) {
+            elements.push_back(node->pos);
+        }
+
+        llama_grammar_stack stack_new = { result->stack_pool.get(), nullptr };
+        for (auto it = elements.rbegin(); it != elements.rend(); ++it) {
+            for (size_t ir = 0; ir < grammar.rules.size(); ir++) {
+                const auto & rule = grammar.rules[ir];
+                if (*it >= rule.data() && *it < rule.data() + rule.size()) {
+                    stack_new = stack_new.push(&result->rules[ir][*it - rule.data()]);
+                    break;
                 }
             }
         }
+        result->stacks.push_back(stack_new);
     }
 
     return result;
 }
 
-void llama_grammar_apply_impl(const struct llama_grammar & grammar, llama_token_data_array * cur_p) {
+// canonical key of the grammar state: the sorted stacks as element ids, then the partial UTF-8 state
+static std::vector<uint32_t> llama_grammar_mask_key(struct llama_grammar & grammar, uint64_t & hash) {
+    if (grammar.element_ids.empty()) {
+        uint32_t id = 0;
+        for (const auto & rule : grammar.rules) {
+            for (const auto & elem : rule) {
+                grammar.element_ids[&elem] = id++;
+            }
+        }
+    }
+
+    std::vector<std::vector<uint32_t>> stacks;
+    stacks.reserve(grammar.stacks.size());
+    for (const auto & stack : grammar.stacks) {
+        std::vector<uint32_t> ids;
+        ids.reserve(stack.size());
+        for (const auto * node = stack.top; node != nullptr; node = node->parent) {
+            ids.push_back(grammar.element_ids.at(node->pos));
+        }
+        stacks.push_back(std::move(ids));
+    }
+    std::sort(stacks.begin(), stacks.end());
+    stacks.erase(std::unique(stacks.begin(), stacks.end()), stacks.end());
+
+    std::vector<uint32_t> key;
+    for (const auto & stack : stacks) {
+        key.push_back(stack.size());
+        key.insert(key.end(), stack.begin(), stack.end());
+    }
+    key.push_back(grammar.partial_utf8.value);
+    key.push_back((uint32_t) grammar.partial_utf8.n_remain);
+
+    // FNV-1a
+    hash = 0xcbf29ce484222325ULL;
+    for (const uint32_t v : key) {
+        hash = (hash ^ v) * 0x100000001b3ULL;
+    }
+
+    return key;
+}
+
+// bit set of the tokens of the whole vocab allowed by the grammar in its current state
+static std::vector<uint64_t> llama_grammar_mask(
+        const struct llama_grammar & grammar,
+        const llama_grammar_tokens & tokens,
+                              bool   allow_eog) {
+    const size_t n_tokens = tokens.offsets.size();
+
+    std::vector<uint8_t> accepted(n_tokens, 0);
+
+    if (grammar.partial_utf8.n_remain == 0) {
+        llama_grammar_accept_tokens(grammar.rules, grammar.stacks, tokens, accepted);
+    } else {
+        // the precomputed code points start from an empty partial UTF-8 state
+        std::vector<std::pair<std::vector<uint32_t>, llama_partial_utf8>> candidates_decoded;
+        candidates_decoded.reserve(tokens.sorted.size());
+
+        llama_grammar_candidates candidates_grammar;
+        candidates_grammar.reserve(tokens.sorted.size());
+
+        for (const llama_token id : tokens.sorted) {
+            candidates_decoded.push_back(decode_utf8(grammar.vocab->token_to_piece(id), grammar.partial_utf8));
+            candidates_grammar.push_back({ (size_t) id, candidates_decoded.back().first.data(), candidates_decoded.back().second });
+            accepted[id] = 1;
+        }
+
+        const auto rejects = llama_grammar_reject_candidates(grammar.rules, grammar.stacks, candidates_grammar);
+        for (const auto & reject : rejects) {
+            accepted[reject.index] = 0;
+        }
+    }
+
+    for (const llama_token id : tokens.eog) {
+        accepted[id] = allow_eog;
+    }
+
+    std::vector<uint64_t> mask((n_tokens + 63)/64, 0);
+    for (size_t id = 0; id < n_tokens; ++id) {
+        mask[id/64] |= (uint64_t) accepted[id] << (id%64);
+    }
+
+    return mask;
+}
+
+const uint64_t * llama_grammar_mask_cache::find(const std::vector<uint32_t> & key, uint64_t hash) {
+    const auto it = index.find(hash);
+    if (it == index.end() || it->second->key != key) {
+        return nullptr;
+    }
+
+    entries.splice(entries.begin(), entries, it->second);
+
+    return it->second->mask.data();
+}
+
+const uint64_t * llama_grammar_mask_cache::insert(std::vector<uint32_t> key, uint64_t hash, std::vector<uint64_t> mask) {
+    const auto it = index.find(hash);
+    if (it != index.end()) {
+        // hash collision, replace the entry
+        entries.erase(it->second);
+        index.erase(it);
+    } else if (entries.size() >= n_max) {
+        index.erase(entries.back().hash);
+        entries.pop_back();
+    }
+
+    entries.push_front({ hash, std::move(key), std::move(mask) });
+    index[hash] = entries.begin();
+
+    return entries.front().mask.data();
+}
+
+void llama_grammar_apply_impl(struct llama_grammar & grammar, llama_token_data_array * cur_p) {
     GGML_ASSERT(grammar.vocab != nullptr);
 
     if (grammar.awaiting_trigger) {
@@ -1130,24 +1588,62 @@ void llama_grammar_apply_impl(const struct llama_grammar & grammar, llama_token_
         }
     }
 
+    const auto & tokens = grammar.vocab->get_grammar_tokens();
+
+    if (!grammar.mask_cache) {
+        grammar.mask_cache = std::make_unique<llama_grammar_mask_cache>();
+    }
+    auto & cache = *grammar.mask_cache;
+
+    uint64_t hash = 0;
+    auto key = llama_grammar_mask_key(grammar, hash);
+
+    const uint64_t * mask = cache.find(key, hash);
+    if (mask) {
+        cache.n_hit++;
+    } else {
+        cache.n_miss++;
+
+        if (4*cur_p->size >= tokens.offsets.size()) {
+            // a large part of the vocab: mask the whole vocab at once and keep it for this state
+            mask = cache.insert(std::move(key), hash, llama_grammar_mask(grammar, tokens, allow_eog));
+        }
+    }
+
+    if (mask) {
+        for (size_t i = 0; i < cur_p->size; ++i) {
+            const llama_token id = cur_p->data[i].id;
+            const bool allowed   = (mask[id/64] >> (id%64)) & 1;
+
+            cur_p->data[i].logit = allowed ? cur_p->data[i].logit : -INFINITY;
+        }
+        return;
+    }
+
+    // a few candidates in a new state: match them one by one
+    const bool use_tokens = grammar.partial_utf8.n_remain == 0;
+
     std::vector<std::pair<std::vector<uint32_t>, llama_partial_utf8>> candidates_decoded;
-    candidates_decoded.reserve(cur_p->size);
+    if (!use_tokens) {
+        candidates_decoded.reserve(cur_p->size);
+    }
 
     llama_grammar_candidates candidates_grammar;
     candidates_grammar.reserve(cur_p->size);
 
     for (size_t i = 0; i < cur_p->size; ++i) {
-        const llama_token id      = cur_p->data[i].id;
-        const std::string & piece = grammar.vocab->token_to_piece(id);
+        const llama_token id = cur_p->data[i].id;
 
         if (grammar.vocab->is_eog(id)) {
             if (!allow_eog) {
                 cur_p->data[i].logit = -INFINITY;
             }
-        } else if (piece.empty() || piece[0] == 0) {
+        } else if (tokens.empty[id]) {
             cur_p->data[i].logit = -INFINITY;
+        } else if (use_tokens) {
+            candidates_grammar.push_back({ i, tokens.code_points.data() + tokens.offsets[id], tokens.partial[id] });
         } else {
-            candidates_decoded.push_back(decode_utf8(piece, grammar.partial_utf8));
+            candidates_decoded.push_back(decode_utf8(grammar.vocab->token_to_piece(id), grammar.partial_utf8));
             candidates_grammar.push_back({ i, candidates_decoded.back().first.data(), candidates_decoded.back().second });
         }
     }
@@ -1226,4 +1722,7 @@ void llama_grammar_accept_str(struct llama_grammar & grammar, const std::string
     if (grammar.stacks.empty()) {
         throw std::runtime_error("Unexpected empty grammar stack after accepting piece: " + piece);
     }
+
+    // the stacks of the grammar are the only live stacks between two pieces
+    grammar.stack_pool->gc(grammar.stacks);
 }
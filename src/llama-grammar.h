@@ -2,9 +2,13 @@
 
 #include "llama.h"
 
+#include <deque>
+#include <list>
 #include <map>
+#include <memory>
 #include <regex>
 #include <string>
+#include <unordered_map>
 #include <vector>
 
 struct llama_vocab;
@@ -54,8 +58,89 @@ struct llama_grammar_candidate {
     llama_partial_utf8   partial_utf8;
 };
 
+// code points of all vocab tokens, decoded once per vocab from an empty partial UTF-8 state,
+// together with a prefix trie over them, so that the tokens sharing a prefix are matched against
+// the grammar once for the whole prefix
+struct llama_grammar_tokens {
+    struct node {
+        uint32_t chr;   // code point on the edge from the parent
+        uint32_t t0;    // first entry in `sorted` of the tokens ending at this node
+        uint32_t n_end; // number of tokens ending at this node
+        uint32_t next;  // index of the first node after this subtree
+    };
+
+    std::vector<uint32_t>           code_points; // 0-terminated code points of the tokens, back to back
+    std::vector<uint32_t>           offsets;     // [n_tokens] offset of the token in code_points
+    std::vector<llama_partial_utf8> partial;     // [n_tokens] trailing incomplete UTF-8 sequence
+    std::vector<uint8_t>            empty;       // [n_tokens] empty piece or leading 0, never accepted
+    std::vector<llama_token>        eog;         // end-of-generation tokens, accepted iff a stack is empty
+
+    std::vector<llama_token> sorted; // non-empty tokens in lexicographic order of their code points
+    std::vector<node>        nodes;  // the trie in preorder, the children of a node follow it
+};
+
+std::unique_ptr<llama_grammar_tokens> llama_grammar_tokens_init(const llama_vocab & vocab);
+
 using llama_grammar_rule  = std::vector<      llama_grammar_element>;
-using llama_grammar_stack = std::vector<const llama_grammar_element *>;
+
+// a node of the graph-structured stack: the top element of a stack and the node of the stack below it
+struct llama_grammar_stack_node {
+    const llama_grammar_element    * pos;
+    const llama_grammar_stack_node * parent; // nullptr at the bottom of the stack
+    size_t                           size;
+};
+
+struct llama_grammar_stack_pool;
+
+// a grammar pushdown stack, as a handle to the node of its top element
+// the nodes are hash-consed by the pool: stacks with the same bottom part share its nodes, and equal
+// stacks are the same node, so that copying and comparing stacks is O(1)
+struct llama_grammar_stack {
+    llama_grammar_stack_pool       * pool = nullptr;
+    const llama_grammar_stack_node * top  = nullptr; // nullptr for the empty stack
+
+    bool   empty() const { return top == nullptr; }
+    size_t size()  const { return top ? top->size : 0; }
+
+    const llama_grammar_element * back() const { return top->pos; }
+
+    // i-th element from the bottom, walks down the stack
+    const llama_grammar_element * operator[](size_t i) const;
+
+    llama_grammar_stack pop() const { return { pool, top->parent }; }
+    llama_grammar_stack push(const llama_grammar_element * pos) const;
+
+    bool operator==(const llama_grammar_stack & other) const { return top == other.top; }
+    bool operator!=(const llama_grammar_stack & other) const { return top != other.top; }
+};
+
+// owns the stack nodes of a grammar
+// the nodes of the stacks that are not reachable anymore are only dropped by gc(), which rebuilds the pool with the
+// nodes of the live stacks once it holds more than n_gc nodes
+struct llama_grammar_stack_pool {
+    struct key_hash {
+        size_t operator()(const std::pair<const llama_grammar_element *, const llama_grammar_stack_node *> & key) const {
+            return std::hash<const void *>()(key.first) ^ (std::hash<const void *>()(key.second) << 1);
+        }
+    };
+
+    std::deque<llama_grammar_stack_node> nodes;
+
+    std::unordered_map<std::pair<const llama_grammar_element *, const llama_grammar_stack_node *>,
+                       const llama_grammar_stack_node *, key_hash> index;
+
+    // tops of the stacks reached by llama_grammar_advance_stack from a stack, computed once per stack
+    std::unordered_map<const llama_grammar_stack_node *, std::vector<const llama_grammar_stack_node *>> advanced;
+
+    size_t n_gc_min = 1 << 16;
+    size_t n_gc     = n_gc_min; // twice the number of live nodes after a gc, at least n_gc_min
+
+    const llama_grammar_stack_node * get(const llama_grammar_element * pos, const llama_grammar_stack_node * parent);
+
+    // keep only the nodes of the given stacks, which are moved to the new nodes, if the pool holds more than n_gc nodes
+    // the other stacks of the pool and the memo of advanced stacks are invalidated
+    void gc(std::vector<llama_grammar_stack> & stacks);
+};
 
 using llama_grammar_rules      = std::vector<llama_grammar_rule>;
 using llama_grammar_stacks     = std::vector<llama_grammar_stack>;
@@ -81,7 +166,7 @@ struct llama_grammar_parser {
 
     llama_grammar_rules rules;
 
-    llama_grammar_stack c_rules() const;
+    std::vector<const llama_grammar_element *> c_rules() const;
 
     uint32_t get_symbol_id(const char * src, size_t len);
     uint32_t generate_symbol_id(const std::string & base_name);
@@ -106,6 +191,31 @@ struct llama_grammar_parser {
     void print(FILE * file);
 };
 
+// allowed tokens of the grammar states seen so far, so that a state reached again (e.g. inside a JSON
+// string, or expecting a comma or a brace) is masked without matching the vocab against the stacks
+struct llama_grammar_mask_cache {
+    struct entry {
+        uint64_t              hash;
+        std::vector<uint32_t> key;  // canonical stacks and partial UTF-8 state
+        std::vector<uint64_t> mask; // [n_tokens/64] bit set for the allowed tokens
+    };
+
+    static constexpr size_t n_max = 64;
+
+    std::list<entry> entries; // most recently used first
+
+    std::unordered_map<uint64_t, std::list<entry>::iterator> index; // hash of the key -> entry
+
+    int32_t n_hit  = 0;
+    int32_t n_miss = 0;
+
+    // returns nullptr if the key is not cached
+    const uint64_t * find(const std::vector<uint32_t> & key, uint64_t hash);
+
+    // evicts the least recently used entry when full
+    const uint64_t * insert(std::vector<uint32_t> key, uint64_t hash, std::vector<uint64_t> mask);
+};
+
 struct llama_grammar_trigger_pattern {
     std::string pattern;
     std::regex  regex;
@@ -132,6 +242,14 @@ struct llama_grammar {
                              trigger_patterns;         // Regular expressions that trigger a lazy grammar. Must be a full match of the entire generated
                                                        // string, and the grammar will be given the string from the first match group onwards.
 
+    // canonical ids of the rule elements, so that the cached masks do not depend on the addresses of the rules
+    std::unordered_map<const llama_grammar_element *, uint32_t> element_ids;
+
+    // kept by the grammar sampler across resets
+    std::unique_ptr<llama_grammar_mask_cache> mask_cache;
+
+    // nodes of the stacks
+    std::unique_ptr<llama_grammar_stack_pool> stack_pool;
 };
 
 //
@@ -161,7 +279,7 @@ struct llama_grammar * llama_grammar_clone_impl(const struct llama_grammar & gra
 
 // TODO: move the API below as member functions of llama_grammar
 void llama_grammar_apply_impl(
-        const struct llama_grammar & grammar,
+              struct llama_grammar & grammar,
             llama_token_data_array * cur_p);
 
 void llama_grammar_accept_impl(
@@ -309,7 +309,21 @@ void llm_graph_input_attn_kv_unified::set_input(const llama_ubatch * ubatch) {
     mctx->set_input_k_idxs(self_k_idxs, ubatch);
     mctx->set_input_v_idxs(self_v_idxs, ubatch);
 
-    mctx->set_input_kq_mask(self_kq_mask, ubatch, cparams.causal_attn);
+    mctx->set_input_kq_mask(self_kq_mask, ubatch, cparams.causal_attn, ubatch->n_tokens > 1 ? cparams.n_threads_batch : cparams.n_threads);
+}
+
+bool llm_graph_input_attn_kv_unified::set_outputs() {
+    if (self_kq_score) {
+        ggml_set_output(self_kq_score);
+    }
+
+    return self_kq_score != nullptr;
+}
+
+void llm_graph_input_attn_kv_unified::read_outputs() {
+    if (self_kq_score) {
+        mctx->add_kq_score(self_kq_score);
+    }
 }
 
 bool llm_graph_input_attn_kv_unified::can_reuse(const llm_graph_params & params) {
@@ -325,6 +339,8 @@ bool llm_graph_input_attn_kv_unified::can_reuse(const llm_graph_params & params)
     res &= self_kq_mask->ne[0] == mctx->get_n_kv();
     res &= self_kq_mask->ne[1] == GGML_PAD(params.ubatch.n_tokens, GGML_KQ_MASK_PAD);
 
+    res &= needs_score == mctx->get_needs_score();
+
     res &= mctx->get_supports_set_rows(); // TODO: tmp
 
     return res;
@@ -334,12 +350,26 @@ void llm_graph_input_attn_kv_unified_iswa::set_input(const llama_ubatch * ubatch
     mctx->get_base()->set_input_k_idxs(self_k_idxs, ubatch);
     mctx->get_base()->set_input_v_idxs(self_v_idxs, ubatch);
 
-    mctx->get_base()->set_input_kq_mask(self_kq_mask, ubatch, cparams.causal_attn);
+    mctx->get_base()->set_input_kq_mask(self_kq_mask, ubatch, cparams.causal_attn, ubatch->n_tokens > 1 ? cparams.n_threads_batch : cparams.n_threads);
 
     mctx->get_swa()->set_input_k_idxs(self_k_idxs_swa, ubatch);
     mctx->get_swa()->set_input_v_idxs(self_v_idxs_swa, ubatch);
 
-    mctx->get_swa()->set_input_kq_mask(self_kq_mask_swa, ubatch, cparams.causal_attn);
+    mctx->get_swa()->set_input_kq_mask(self_kq_mask_swa, ubatch, cparams.causal_attn, ubatch->n_tokens > 1 ? cparams.n_threads_batch : cparams.n_threads);
+}
+
+bool llm_graph_input_attn_kv_unified_iswa::set_outputs() {
+    if (self_kq_score) {
+        ggml_set_output(self_kq_score);
+    }
+
+    return self_kq_score != nullptr;
+}
+
+void llm_graph_input_attn_kv_unified_iswa::read_outputs() {
+    if (self_kq_score) {
+        mctx->get_base()->add_kq_score(self_kq_score);
+    }
 }
 
 bool llm_graph_input_attn_kv_unified_iswa::can_reuse(const llm_graph_params & params) {
@@ -361,6 +391,8 @@ bool llm_graph_input_attn_kv_unified_iswa::can_reuse(const llm_graph_params & pa
     res &= self_kq_mask_swa->ne[0] == mctx->get_swa()->get_n_kv();
     res &= self_kq_mask_swa->ne[1] == GGML_PAD(params.ubatch.n_tokens, GGML_KQ_MASK_PAD);
 
+    res &= needs_score == mctx->get_base()->get_needs_score();
+
     res &= mctx->get_base()->get_supports_set_rows(); // TODO: tmp
 
     return res;
@@ -428,6 +460,8 @@ void llm_graph_result::reset() {
     t_embd        = nullptr;
     t_embd_pooled = nullptr;
 
+    has_outputs = false;
+
     params = {};
 
     inputs.clear();
@@ -451,6 +485,19 @@ void llm_graph_result::set_inputs(const llama_ubatch * ubatch) {
     }
 }
 
+void llm_graph_result::set_outputs() {
+    has_outputs = false;
+    for (auto & input : inputs) {
+        has_outputs |= input->set_outputs();
+    }
+}
+
+void llm_graph_result::read_outputs() {
+    for (auto & input : inputs) {
+        input->read_outputs();
+    }
+}
+
 bool llm_graph_result::can_reuse(const llm_graph_params & params) {
     if (!this->params.allow_reuse(params)) {
         if (debug > 1) {
@@ -1140,7 +1187,8 @@ ggml_tensor * llm_graph_context::build_attn_mha(
          ggml_tensor * kq_b,
          ggml_tensor * kq_mask,
          ggml_tensor * v_mla,
-             float     kq_scale) const {
+             float     kq_scale,
+         ggml_tensor ** kq_score) const {
     const bool v_trans = v->nb[1] > v->nb[2];
 
     // split the batch into streams if needed
@@ -1225,6 +1273,20 @@ ggml_tensor * llm_graph_context::build_attn_mha(
 
         kq = ggml_soft_max_ext(ctx0, kq, kq_mask, kq_scale, hparams.f_max_alibi_bias);
 
+        if (kq_score) {
+            // sum the attention over the heads and the tokens of each stream:
+            //   [n_kv, n_tokens, n_head, n_stream] -> [n_tokens*n_head, n_kv, n_stream] -> [1, n_kv, n_stream]
+            ggml_tensor * s = ggml_reshape_3d(ctx0, kq, kq->ne[0], kq->ne[1]*kq->ne[2], kq->ne[3]);
+
+            s = ggml_sum_rows(ctx0, ggml_cont(ctx0, ggml_transpose(ctx0, s)));
+            s = ggml_reshape_2d(ctx0, s, s->ne[1], s->ne[2]);
+
+            // only the sum over all the layers is an output, see llm_graph_input_attn_kv_unified::set_outputs()
+            *kq_score = *kq_score ? ggml_add(ctx0, *kq_score, s) : s;
+
+            ggml_build_forward_expand(gf, *kq_score);
+        }
+
         if (!v_trans) {
             // note: avoid this branch
             v = ggml_cont(ctx0, ggml_transpose(ctx0, v));
@@ -1335,6 +1397,8 @@ static std::unique_ptr<llm_graph_input_attn_kv_unified> build_attn_inp_kv_unifie
         ggml_set_input(inp->self_kq_mask);
 
         inp->self_kq_mask_cnv = cparams.flash_attn ? ggml_cast(ctx0, inp->self_kq_mask, GGML_TYPE_F16) : inp->self_kq_mask;
+
+        inp->needs_score = mctx_cur->get_needs_score();
     }
 
     return inp;
@@ -1382,7 +1446,9 @@ ggml_tensor * llm_graph_context::build_attn(
     ggml_tensor * k = mctx_cur->get_k(ctx0, il);
     ggml_tensor * v = mctx_cur->get_v(ctx0, il);
 
-    ggml_tensor * cur = build_attn_mha(q, k, v, kq_b, kq_mask, v_mla, kq_scale);
+    ggml_tensor ** kq_score = inp->needs_score ? &inp->self_kq_score : nullptr;
+
+    ggml_tensor * cur = build_attn_mha(q, k, v, kq_b, kq_mask, v_mla, kq_scale, kq_score);
     cb(cur, "kqv_out", il);
 
     if (wo) {
@@ -1448,7 +1514,9 @@ ggml_tensor * llm_graph_context::build_attn(
     ggml_tensor * k = mctx_cur->get_k(ctx0, il);
     ggml_tensor * v = mctx_cur->get_v(ctx0, il);
 
-    ggml_tensor * cur = build_attn_mha(q, k, v, kq_b, kq_mask, v_mla, kq_scale);
+    ggml_tensor ** kq_score = !is_swa && inp->needs_score ? &inp->self_kq_score : nullptr;
+
+    ggml_tensor * cur = build_attn_mha(q, k, v, kq_b, kq_mask, v_mla, kq_scale, kq_score);
     cb(cur, "kqv_out", il);
 
     if (wo) {
@@ -1540,6 +1608,8 @@ llm_graph_input_attn_kv_unified_iswa * llm_graph_context::build_attn_inp_kv_unif
         ggml_set_input(inp->self_kq_mask);
 
         inp->self_kq_mask_cnv = cparams.flash_attn ? ggml_cast(ctx0, inp->self_kq_mask, GGML_TYPE_F16) : inp->self_kq_mask;
+
+        inp->needs_score = mctx_cur->get_base()->get_needs_score();
     }
 
     {
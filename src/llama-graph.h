@@ -81,6 +81,13 @@ public:
 
     virtual void set_input(const llama_ubatch * ubatch) = 0;
 
+    // called after the graph has been built, for the inputs that read back some results of the graph
+    // returns true if some results have to be read back
+    virtual bool set_outputs() { return false; }
+
+    // called after the graph has been computed, for the inputs that read back some results of the graph
+    virtual void read_outputs() {}
+
     // return true if the resulting input tensors using the provided graph parameters would be
     //   the same as the previous input tensors that we have currently stored in the object
     virtual bool can_reuse(const llm_graph_params & params) {
@@ -264,6 +271,8 @@ public:
     ~llm_graph_input_attn_kv_unified() = default;
 
     void set_input(const llama_ubatch * ubatch) override;
+    bool set_outputs() override;
+    void read_outputs() override;
 
     bool can_reuse(const llm_graph_params & params) override;
 
@@ -278,6 +287,12 @@ public:
     ggml_tensor * self_kq_mask     = nullptr; // F32 [n_kv, n_batch/n_stream, 1, n_stream]
     ggml_tensor * self_kq_mask_cnv = nullptr; //     [n_kv, n_batch/n_stream, 1, n_stream]
 
+    // attention received by the KV cells, used by the KV budget (only without flash attention)
+    // only computed when the memory context needs it for the ubatch, see llama_kv_cache_unified::get_needs_score()
+    ggml_tensor * self_kq_score = nullptr; // F32 [n_kv, n_stream]
+
+    bool needs_score = false;
+
     const llama_hparams & hparams;
     const llama_cparams & cparams;
 
@@ -297,6 +312,8 @@ public:
     ~llm_graph_input_attn_kv_unified_iswa() = default;
 
     void set_input(const llama_ubatch * ubatch) override;
+    bool set_outputs() override;
+    void read_outputs() override;
 
     bool can_reuse(const llm_graph_params & params) override;
 
@@ -318,6 +335,11 @@ public:
     ggml_tensor * self_kq_mask_swa     = nullptr; // F32 [n_kv, n_batch/n_stream, 1, n_stream]
     ggml_tensor * self_kq_mask_swa_cnv = nullptr; //     [n_kv, n_batch/n_stream, 1, n_stream]
 
+    // attention received by the KV cells of the non-SWA layers, used by the KV budget (only without flash attention)
+    ggml_tensor * self_kq_score = nullptr; // F32 [n_kv, n_stream]
+
+    bool needs_score = false;
+
     const llama_hparams & hparams;
     const llama_cparams & cparams;
 
@@ -463,6 +485,15 @@ public:
 
     void set_inputs(const llama_ubatch * ubatch);
 
+    // mark the results of the graph needed by the inputs as outputs, after the graph has been built
+    void set_outputs();
+
+    // true if read_outputs() has something to read, which requires to wait for the computation of the graph
+    bool get_has_outputs() const { return has_outputs; }
+
+    // read back the results of the graph needed by the inputs, after the graph has been computed
+    void read_outputs();
+
     // try to update the existing graph result using the new graph parameters in order to reuse it
     // this can only be done if we determine that the resulting graph using the new graph parameters
     //   would be identical to the existing graph. in that case, we simply have to update the memory
@@ -491,6 +522,8 @@ public:
 
     int64_t max_nodes;
 
+    bool has_outputs = false;
+
 private:
     // keep a copy of the previous graph parameters
     // we will use this to determine whether the graph can be reused by comparing them with the new parameters
@@ -652,7 +685,8 @@ struct llm_graph_context {
              ggml_tensor * kq_b,
              ggml_tensor * kq_mask,
              ggml_tensor * v_mla,   // [n_embd_head_v_mla, n_embd_head_v, n_head_v]
-                   float   kq_scale) const;
+                   float   kq_scale,
+             ggml_tensor ** kq_score = nullptr) const; // if not null, the attention received by the KV cells is added to it [n_kv, n_stream]
 
     llm_graph_input_attn_no_cache * build_attn_inp_no_cache() const;
 
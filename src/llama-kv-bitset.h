@@ -0,0 +1,187 @@
+#pragma once
+
+#include <cassert>
+#include <cstdint>
+#include <vector>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+// a bitset with summary levels, used to index the used and the empty KV cells
+//
+// levels[0] holds one bit per element and levels[k + 1] one bit per word of levels[k], set when the word is not zero.
+// the top level is a single word, so finding the next or the previous set bit visits at most 2 words per level and
+// skips a fully clear range of 64^k elements at once. for a cache of 128k cells, there are 3 levels
+class llama_kv_bitset {
+public:
+    static constexpr uint32_t npos = UINT32_MAX;
+
+    // n elements, all set to value
+    void init(uint32_t n, bool value) {
+        this->n = n;
+
+        n_set = value ? n : 0;
+
+        levels.clear();
+
+        uint32_t n_bits = n;
+        do {
+            const uint32_t n_words = (n_bits + 63)/64;
+
+            std::vector<uint64_t> words(n_words, value ? ~0ULL : 0ULL);
+            if (value && n_bits % 64 != 0) {
+                words.back() = (1ULL << (n_bits % 64)) - 1;
+            }
+
+            levels.push_back(std::move(words));
+
+            n_bits = n_words;
+        } while (n_bits > 1);
+    }
+
+    uint32_t size() const {
+        return n;
+    }
+
+    uint32_t count() const {
+        return n_set;
+    }
+
+    bool test(uint32_t i) const {
+        assert(i < n);
+
+        return (levels[0][i/64] >> (i % 64)) & 1;
+    }
+
+    void set(uint32_t i) {
+        assert(i < n);
+
+        if (test(i)) {
+            return;
+        }
+
+        n_set++;
+
+        // propagate up while the words become non-zero
+        for (auto & words : levels) {
+            const bool was_zero = words[i/64] == 0;
+
+            words[i/64] |= 1ULL << (i % 64);
+
+            if (!was_zero) {
+                break;
+            }
+
+            i /= 64;
+        }
+    }
+
+    void reset(uint32_t i) {
+        assert(i < n);
+
+        if (!test(i)) {
+            return;
+        }
+
+        n_set--;
+
+        // propagate up while the words become zero
+        for (auto & words : levels) {
+            words[i/64] &= ~(1ULL << (i % 64));
+
+            if (words[i/64] != 0) {
+                break;
+            }
+
+            i /= 64;
+        }
+    }
+
+    // the first set element >= i, npos if none
+    uint32_t find_next(uint32_t i) const {
+        return i < n ? find_next(0, i) : npos;
+    }
+
+    // the last set element <= i, npos if none
+    uint32_t find_prev(uint32_t i) const {
+        if (n == 0) {
+            return npos;
+        }
+
+        return find_prev(0, i < n ? i : n - 1);
+    }
+
+private:
+    uint32_t n     = 0;
+    uint32_t n_set = 0;
+
+    std::vector<std::vector<uint64_t>> levels;
+
+    uint32_t find_next(size_t k, uint32_t i) const {
+        const auto & words = levels[k];
+
+        if ((size_t) i/64 >= words.size()) {
+            return npos;
+        }
+
+        const uint64_t w = words[i/64] & (~0ULL << (i % 64));
+        if (w != 0) {
+            return (i/64)*64 + ctz(w);
+        }
+
+        if (k + 1 == levels.size()) {
+            return npos;
+        }
+
+        // the next non-zero word of this level
+        const uint32_t j = find_next(k + 1, i/64 + 1);
+        if (j == npos) {
+            return npos;
+        }
+
+        return j*64 + ctz(words[j]);
+    }
+
+    uint32_t find_prev(size_t k, uint32_t i) const {
+        const auto & words = levels[k];
+
+        const uint64_t w = words[i/64] & (~0ULL >> (63 - i % 64));
+        if (w != 0) {
+            return (i/64)*64 + 63 - clz(w);
+        }
+
+        if (k + 1 == levels.size() || i/64 == 0) {
+            return npos;
+        }
+
+        // the previous non-zero word of this level
+        const uint32_t j = find_prev(k + 1, i/64 - 1);
+        if (j == npos) {
+            return npos;
+        }
+
+        return j*64 + 63 - clz(words[j]);
+    }
+
+    // note: w != 0
+    static uint32_t ctz(uint64_t w) {
+#if defined(_MSC_VER)
+        unsigned long r;
+        _BitScanForward64(&r, w);
+        return r;
+#else
+        return __builtin_ctzll(w);
+#endif
+    }
+
+    static uint32_t clz(uint64_t w) {
+#if defined(_MSC_VER)
+        unsigned long r;
+        _BitScanReverse64(&r, w);
+        return 63 - r;
+#else
+        return __builtin_clzll(w);
+#endif
+    }
+};
@@ -0,0 +1,882 @@
+#pragma once
+
+#include "llama.h"
+#include "llama-batch.h"
+#include "llama-kv-cells.h"
+
+#include <algorithm>
+#include <cassert>
+#include <limits>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// the cells [c0, c1) of block id, as seen by a sequence
+struct llama_kv_block_ref {
+    uint32_t id;
+    uint32_t c0;
+    uint32_t c1;
+};
+
+// block tables of a paged KV cache
+//
+// the cells are grouped in blocks of a fixed size. each sequence has a table of references to ranges of cells within
+// the blocks, in the order of the positions. a block is reference-counted by the table entries that point to it, so the
+// sequences that share a prefix share its blocks and forking a sequence copies its table instead of updating every
+// cell. new tokens are appended only to a block that is not seen by any other sequence: a shared block that is
+// partially filled is sealed and the sequences continue in new blocks, which bounds the waste to less than one block
+// per sequence. shifting the positions of a shared block first moves the cells of the block seen by the sequence to a
+// new block (copy-on-write) - the data of these cells is copied during the next update
+//
+// seq_cp() reserves the free blocks that the copy-on-write of the blocks it shares can need, one per block and per
+// sequence that sees it besides the first one, and the new tokens are not placed in the reserved blocks. when there are
+// not enough free blocks, the cells are copied to new blocks instead, and when even that is not possible the fork is
+// refused. a shift or a division of the positions of shared cells that finds no free block for their copy-on-write is
+// refused too and leaves the sequence unchanged - updating the cells in place would update them for all the sequences
+// that see them
+//
+// the positions and the pending shifts of the cells are stored in a llama_kv_cells_unified, without the sequence ids
+class llama_kv_blocks {
+public:
+    using table_t = std::vector<llama_kv_block_ref>;
+
+    static constexpr uint32_t none = std::numeric_limits<uint32_t>::max();
+
+    // copy the data of the cells [src, src + n) to [dst, dst + n)
+    struct copy_info {
+        uint32_t src;
+        uint32_t dst;
+        uint32_t n;
+    };
+
+    // the part of the state that is modified when placing a ubatch (see save() and restore())
+    struct state_t {
+        std::vector<uint32_t> refs;
+        std::vector<uint32_t> fill;
+
+        uint32_t n_used;
+        uint32_t free_min;
+
+        std::vector<std::pair<llama_seq_id, table_t>> tables;
+    };
+
+    void init(llama_kv_cells_unified * cells, uint32_t block_size) {
+        assert(cells != nullptr);
+        assert(block_size > 0 && block_size <= cells->size());
+
+        this->cells = cells;
+        this->block_size = block_size;
+
+        const uint32_t n_blocks = cells->size()/block_size;
+
+        refs.resize(n_blocks);
+        fill.resize(n_blocks);
+        resv.resize(n_blocks);
+
+        reset();
+    }
+
+    void reset() {
+        std::fill(refs.begin(), refs.end(), 0);
+        std::fill(fill.begin(), fill.end(), 0);
+        std::fill(resv.begin(), resv.end(), 0);
+
+        n_used   = 0;
+        free_min = 0;
+
+        tables.clear();
+        copies.clear();
+
+        cells->reset();
+    }
+
+    uint32_t get_block_size() const {
+        return block_size;
+    }
+
+    uint32_t get_n_blocks() const {
+        return refs.size();
+    }
+
+    // number of blocks referenced by at least one sequence
+    uint32_t get_n_used() const {
+        return n_used;
+    }
+
+    uint32_t get_n_free() const {
+        return get_n_blocks() - n_used;
+    }
+
+    // number of free blocks reserved for the copy-on-write of the shared blocks
+    uint32_t get_n_reserved() const {
+        if (std::all_of(resv.begin(), resv.end(), [](uint32_t r) { return r == 0; })) {
+            return 0;
+        }
+
+        const auto n_seqs = count_seqs();
+
+        uint32_t res = 0;
+
+        for (uint32_t id = 0; id < refs.size(); ++id) {
+            if (resv[id] > 0 && n_seqs[id] > 1) {
+                res += std::min(resv[id], n_seqs[id] - 1);
+            }
+        }
+
+        return res;
+    }
+
+    // number of table entries that reference the block
+    uint32_t get_refs(uint32_t id) const {
+        return refs[id];
+    }
+
+    // number of cells of the block that have been written
+    uint32_t get_fill(uint32_t id) const {
+        return fill[id];
+    }
+
+    const table_t & get_table(llama_seq_id seq_id) const {
+        static const table_t empty;
+
+        return (size_t) seq_id < tables.size() ? tables[seq_id] : empty;
+    }
+
+    // call f(idx) for each cell seen by the sequence, in the order of the positions
+    template <typename F>
+    void seq_for_each_cell(llama_seq_id seq_id, F && f) const {
+        for (const auto & e : get_table(seq_id)) {
+            for (uint32_t c = e.c0; c < e.c1; ++c) {
+                f(e.id*block_size + c);
+            }
+        }
+    }
+
+    //
+    // placement of the ubatches
+    //
+
+    // find the cells for the tokens of the ubatch, without modifying the state
+    // the tokens of a set of sequences go to the tail block of these sequences if they are the only ones to see it,
+    // otherwise to the lowest free block
+    // return false if there are not enough free blocks
+    bool find(const llama_ubatch & ubatch, std::vector<uint32_t> & idxs) const {
+        idxs.resize(ubatch.n_tokens);
+
+        // the blocks and the tails of the sequences that change while placing the ubatch
+        std::unordered_map<uint32_t, std::pair<uint32_t, uint32_t>> blk; // id -> (fill, refs)
+        std::unordered_map<llama_seq_id, std::pair<uint32_t, uint32_t>> tails; // seq_id -> (id, c1)
+
+        auto get_tail = [&](llama_seq_id seq_id) -> std::pair<uint32_t, uint32_t> {
+            const auto it = tails.find(seq_id);
+            if (it != tails.end()) {
+                return it->second;
+            }
+
+            const auto & table = get_table(seq_id);
+            if (table.empty()) {
+                return { none, 0 };
+            }
+
+            return { table.back().id, table.back().c1 };
+        };
+
+        auto get_blk = [&](uint32_t id) -> std::pair<uint32_t, uint32_t> {
+            const auto it = blk.find(id);
+
+            return it != blk.end() ? it->second : std::make_pair(fill[id], refs[id]);
+        };
+
+        uint32_t next = free_min;
+
+        // number of new blocks
+        uint32_t n_new = 0;
+
+        for (uint32_t i = 0; i < ubatch.n_tokens; ++i) {
+            const int32_t        n_seq_id = ubatch.n_seq_id[i];
+            const llama_seq_id * seq_ids  = ubatch.seq_id[i];
+
+            uint32_t id = get_tail(seq_ids[0]).first;
+
+            if (id != none) {
+                const auto [fill_cur, refs_cur] = get_blk(id);
+
+                bool can_append = fill_cur < block_size && refs_cur == (uint32_t) n_seq_id;
+
+                for (int32_t s = 0; s < n_seq_id && can_append; ++s) {
+                    can_append = get_tail(seq_ids[s]) == std::make_pair(id, fill_cur);
+                }
+
+                if (!can_append) {
+                    id = none;
+                }
+            }
+
+            if (id == none) {
+                while (next < refs.size() && refs[next] != 0) {
+                    next++;
+                }
+
+                if (next == refs.size()) {
+                    return false;
+                }
+
+                id = next++;
+
+                n_new++;
+
+                blk[id] = { 0, n_seq_id };
+            }
+
+            auto & cur = blk.emplace(id, get_blk(id)).first->second;
+
+            idxs[i] = id*block_size + cur.first;
+
+            cur.first++;
+
+            for (int32_t s = 0; s < n_seq_id; ++s) {
+                tails[seq_ids[s]] = { id, cur.first };
+            }
+        }
+
+        // the reserved blocks are kept free
+        return n_new == 0 || n_new + get_n_reserved() <= get_n_free();
+    }
+
+    // place the tokens of the ubatch in the cells found by find()
+    void apply(const std::vector<uint32_t> & idxs, const llama_ubatch & ubatch) {
+        assert(idxs.size() == ubatch.n_tokens);
+
+        for (uint32_t i = 0; i < ubatch.n_tokens; ++i) {
+            const uint32_t id = idxs[i] / block_size;
+            const uint32_t c  = idxs[i] % block_size;
+
+            const int32_t        n_seq_id = ubatch.n_seq_id[i];
+            const llama_seq_id * seq_ids  = ubatch.seq_id[i];
+
+            if (refs[id] == 0) {
+                // start a new block
+                assert(c == 0 && fill[id] == 0);
+
+                n_used++;
+
+                // find() takes the lowest free block
+                free_min = std::max(free_min, id + 1);
+
+                refs[id] = n_seq_id;
+
+                for (int32_t s = 0; s < n_seq_id; ++s) {
+                    get_table_mut(seq_ids[s]).push_back({ id, 0, 0 });
+                }
+            }
+
+            assert(fill[id] == c);
+
+            for (int32_t s = 0; s < n_seq_id; ++s) {
+                auto & e = get_table_mut(seq_ids[s]).back();
+
+                assert(e.id == id && e.c1 == c);
+
+                e.c1 = c + 1;
+            }
+
+            fill[id] = c + 1;
+
+            cells->pos_set(idxs[i], ubatch.pos[i]);
+        }
+    }
+
+    // save the state of the blocks and of the tables of the given sequences
+    state_t save(const std::vector<llama_seq_id> & seq_ids) const {
+        state_t res = { refs, fill, n_used, free_min, {} };
+
+        for (const auto seq_id : seq_ids) {
+            res.tables.emplace_back(seq_id, get_table(seq_id));
+        }
+
+        return res;
+    }
+
+    // restore a saved state, the cells idxs placed since the save are cleared
+    void restore(state_t && state, const std::vector<uint32_t> & idxs) {
+        for (const auto idx : idxs) {
+            if (!cells->is_empty(idx)) {
+                cells->rm(idx);
+            }
+        }
+
+        refs     = std::move(state.refs);
+        fill     = std::move(state.fill);
+        n_used   = state.n_used;
+        free_min = state.free_min;
+
+        for (auto & [seq_id, table] : state.tables) {
+            get_table_mut(seq_id) = std::move(table);
+        }
+    }
+
+    //
+    // sequence operations
+    //
+
+    // remove the cells with positions in [p0, p1) from the sequence, -1 for all sequences
+    void seq_rm(llama_seq_id seq_id, llama_pos p0, llama_pos p1) {
+        if (seq_id < 0) {
+            for (llama_seq_id s = 0; s < (llama_seq_id) tables.size(); ++s) {
+                seq_rm(s, p0, p1);
+            }
+            return;
+        }
+
+        if ((size_t) seq_id >= tables.size() || tables[seq_id].empty()) {
+            return;
+        }
+
+        table_t res;
+        res.reserve(tables[seq_id].size());
+
+        for (const auto & e : tables[seq_id]) {
+            split(e, res, [&](llama_pos p) { return p < p0 || p >= p1; });
+
+            release(e.id);
+        }
+
+        tables[seq_id] = std::move(res);
+
+        trim(seq_id);
+    }
+
+    // the destination sees the cells of the source with positions in [p0, p1)
+    // the blocks are shared, so the cost is proportional to the number of blocks of the source
+    // return false, without changing the destination, if there are not enough free blocks to reserve the blocks for the
+    // copy-on-write of the shared blocks or to copy the cells (see the class comment)
+    bool seq_cp(llama_seq_id seq_id_src, llama_seq_id seq_id_dst, llama_pos p0, llama_pos p1) {
+        if (seq_id_src == seq_id_dst || (size_t) seq_id_src >= tables.size()) {
+            return true;
+        }
+
+        table_t add;
+
+        if (p0 <= 0 && p1 == std::numeric_limits<llama_pos>::max()) {
+            add = tables[seq_id_src];
+
+            for (const auto & e : add) {
+                refs[e.id]++;
+            }
+        } else {
+            for (const auto & e : tables[seq_id_src]) {
+                split(e, add, [&](llama_pos p) { return p >= p0 && p < p1; });
+            }
+        }
+
+        // the blocks that the destination starts to share
+        std::vector<uint32_t> ids;
+        {
+            std::vector<bool> seen(refs.size(), false);
+            for (const auto & e : get_table(seq_id_dst)) {
+                seen[e.id] = true;
+            }
+
+            for (const auto & e : add) {
+                if (!seen[e.id]) {
+                    seen[e.id] = true;
+                    ids.push_back(e.id);
+                }
+            }
+        }
+
+        const uint32_t n_reserved = get_n_reserved();
+
+        if (n_reserved + ids.size() <= get_n_free()) {
+            for (const auto id : ids) {
+                resv[id]++;
+            }
+        } else {
+            uint32_t n_cells = 0;
+            for (const auto & e : add) {
+                n_cells += e.c1 - e.c0;
+            }
+
+            if (n_reserved + (n_cells + block_size - 1)/block_size <= get_n_free()) {
+                add = copy_entries(add);
+            } else {
+                for (const auto & e : add) {
+                    release(e.id);
+                }
+
+                return false;
+            }
+        }
+
+        auto & dst = get_table_mut(seq_id_dst);
+
+        if (dst.empty()) {
+            dst = std::move(add);
+            return true;
+        }
+
+        dst.insert(dst.end(), add.begin(), add.end());
+
+        std::stable_sort(dst.begin(), dst.end(), [&](const llama_kv_block_ref & a, const llama_kv_block_ref & b) {
+            return pos_get(a.id, a.c0) < pos_get(b.id, b.c0);
+        });
+
+        return true;
+    }
+
+    // remove all the sequences except seq_id
+    void seq_keep(llama_seq_id seq_id) {
+        for (llama_seq_id s = 0; s < (llama_seq_id) tables.size(); ++s) {
+            if (s == seq_id) {
+                continue;
+            }
+
+            for (const auto & e : tables[s]) {
+                release(e.id);
+            }
+
+            tables[s].clear();
+        }
+
+        if ((size_t) seq_id < tables.size()) {
+            trim(seq_id);
+        }
+    }
+
+    // add shift to the positions in [p0, p1) of the sequence
+    // return false, without changing the sequence, if there are not enough free blocks to copy its shared cells
+    bool seq_add(llama_seq_id seq_id, llama_pos p0, llama_pos p1, llama_pos shift) {
+        if (!can_update(seq_id, p0, p1)) {
+            return false;
+        }
+
+        // the cells that would get a negative position are removed
+        if (shift < 0 && p0 < -shift) {
+            seq_rm(seq_id, p0, std::min(p1, -shift));
+        }
+
+        return seq_update(seq_id, p0, p1, [&](uint32_t idx) {
+            cells->pos_add(idx, shift);
+        });
+    }
+
+    // divide the positions in [p0, p1) of the sequence by d
+    // return false, without changing the sequence, if there are not enough free blocks to copy its shared cells
+    bool seq_div(llama_seq_id seq_id, llama_pos p0, llama_pos p1, int d) {
+        if (!can_update(seq_id, p0, p1)) {
+            return false;
+        }
+
+        return seq_update(seq_id, p0, p1, [&](uint32_t idx) {
+            cells->pos_div(idx, d);
+        });
+    }
+
+    // the minimum position of the sequence, -1 if the sequence is not present
+    llama_pos seq_pos_min(llama_seq_id seq_id) const {
+        const auto & table = get_table(seq_id);
+        if (table.empty()) {
+            return -1;
+        }
+
+        llama_pos res = std::numeric_limits<llama_pos>::max();
+
+        // a shift of a part of the sequence can leave the entries out of order
+        for (const auto & e : table) {
+            for (uint32_t c = e.c0; c < e.c1; ++c) {
+                res = std::min(res, pos_get(e.id, c));
+            }
+        }
+
+        return res;
+    }
+
+    // the maximum position of the sequence, -1 if the sequence is not present
+    llama_pos seq_pos_max(llama_seq_id seq_id) const {
+        const auto & table = get_table(seq_id);
+        if (table.empty()) {
+            return -1;
+        }
+
+        llama_pos res = -1;
+
+        for (const auto & e : table) {
+            for (uint32_t c = e.c0; c < e.c1; ++c) {
+                res = std::max(res, pos_get(e.id, c));
+            }
+        }
+
+        return res;
+    }
+
+    //
+    // copy-on-write
+    //
+
+    // the data copies that must be performed before the next use of the cache, in order
+    const std::vector<copy_info> & get_copies() const {
+        return copies;
+    }
+
+    // call after the data of the pending copies has been copied: releases the source blocks
+    void copies_done() {
+        const auto done = std::move(copies);
+
+        copies.clear();
+
+        for (const auto & cp : done) {
+            release(cp.src / block_size);
+        }
+    }
+
+    // the cell that currently holds the data of cell idx: the source of a pending copy, or idx itself
+    uint32_t data_src(uint32_t idx) const {
+        for (auto it = copies.rbegin(); it != copies.rend(); ++it) {
+            if (idx >= it->dst && idx < it->dst + it->n) {
+                return it->src + (idx - it->dst);
+            }
+        }
+
+        return idx;
+    }
+
+private:
+    llama_kv_cells_unified * cells = nullptr;
+
+    uint32_t block_size = 0;
+
+    // number of table entries that reference each block, 0 for a free block
+    std::vector<uint32_t> refs;
+
+    // number of cells that have been written in each block
+    // the cells [0, fill) of a block in use are not empty, the cells [fill, block_size) are empty
+    std::vector<uint32_t> fill;
+
+    // number of free blocks reserved by seq_cp() for the copy-on-write of each block
+    // only min(resv, number of sequences that see the block - 1) of them are still needed
+    std::vector<uint32_t> resv;
+
+    uint32_t n_used = 0;
+
+    // all blocks before this one are in use
+    uint32_t free_min = 0;
+
+    // the block table of each sequence, grown on demand
+    std::vector<table_t> tables;
+
+    // pending data copies, the source blocks hold an extra reference until copies_done()
+    std::vector<copy_info> copies;
+
+    table_t & get_table_mut(llama_seq_id seq_id) {
+        assert(seq_id >= 0);
+
+        if ((size_t) seq_id >= tables.size()) {
+            tables.resize(seq_id + 1);
+        }
+
+        return tables[seq_id];
+    }
+
+    llama_pos pos_get(uint32_t id, uint32_t c) const {
+        return cells->pos_get(id*block_size + c);
+    }
+
+    uint32_t alloc() {
+        for (uint32_t id = free_min; id < refs.size(); ++id) {
+            if (refs[id] == 0) {
+                free_min = id + 1;
+                n_used++;
+
+                return id;
+            }
+        }
+
+        return none;
+    }
+
+    // drop a reference to a block, the block is freed when it is no longer referenced
+    void release(uint32_t id) {
+        assert(refs[id] > 0);
+
+        if (--refs[id] > 0) {
+            return;
+        }
+
+        for (uint32_t c = 0; c < fill[id]; ++c) {
+            cells->rm(id*block_size + c);
+        }
+
+        fill[id] = 0;
+        resv[id] = 0;
+        n_used--;
+
+        free_min = std::min(free_min, id);
+
+        // the pending copies to a freed block are no longer needed
+        if (!copies.empty()) {
+            std::vector<uint32_t> srcs;
+
+            copies.erase(std::remove_if(copies.begin(), copies.end(), [&](const copy_info & cp) {
+                if (cp.dst / block_size == id) {
+                    srcs.push_back(cp.src / block_size);
+                    return true;
+                }
+                return false;
+            }), copies.end());
+
+            for (const auto src : srcs) {
+                release(src);
+            }
+        }
+    }
+
+    // append to dst the runs of cells of e with positions that satisfy keep(pos), each run takes a reference to the block
+    template <typename F>
+    void split(const llama_kv_block_ref & e, table_t & dst, F && keep) {
+        uint32_t c = e.c0;
+
+        while (c < e.c1) {
+            while (c < e.c1 && !keep(pos_get(e.id, c))) {
+                c++;
+            }
+
+            if (c == e.c1) {
+                break;
+            }
+
+            const uint32_t c0 = c;
+
+            while (c < e.c1 && keep(pos_get(e.id, c))) {
+                c++;
+            }
+
+            dst.push_back({ e.id, c0, c });
+
+            refs[e.id]++;
+        }
+    }
+
+    // the cells at the end of a block that are seen only by the last entry of the sequence can be reused
+    void trim(llama_seq_id seq_id) {
+        for (const auto & e : tables[seq_id]) {
+            if (refs[e.id] != 1 || e.c1 == fill[e.id]) {
+                continue;
+            }
+
+            for (uint32_t c = e.c1; c < fill[e.id]; ++c) {
+                cells->rm(e.id*block_size + c);
+            }
+
+            fill[e.id] = e.c1;
+        }
+    }
+
+    // number of sequences that see each block
+    std::vector<uint32_t> count_seqs() const {
+        std::vector<uint32_t> res(refs.size(), 0);
+
+        // the last sequence counted for each block
+        std::vector<llama_seq_id> last(refs.size(), -1);
+
+        for (llama_seq_id s = 0; s < (llama_seq_id) tables.size(); ++s) {
+            for (const auto & e : tables[s]) {
+                if (last[e.id] != s) {
+                    last[e.id] = s;
+                    res[e.id]++;
+                }
+            }
+        }
+
+        return res;
+    }
+
+    // set the positions of the cells [c_new, c_new + c1 - c0) of block id_new from the cells [c0, c1) of block id and
+    // queue the copy of their data
+    void copy_cells(uint32_t id, uint32_t c0, uint32_t c1, uint32_t id_new, uint32_t c_new) {
+        for (uint32_t c = c0; c < c1; ++c) {
+            const uint32_t isrc = id*block_size + c;
+            const uint32_t idst = id_new*block_size + c_new + (c - c0);
+
+            // keep the pending shift of the source, the copied data is not shifted yet
+            const llama_pos shift = cells->get_shift(isrc);
+
+            cells->pos_set(idst, cells->pos_get(isrc) - shift);
+            if (shift != 0) {
+                cells->pos_add(idst, shift);
+            }
+        }
+
+        // one copy per run of cells that hold their data in consecutive cells of a block
+        // the blocks that hold the data are kept until the data is copied
+        for (uint32_t c = c0; c < c1; ) {
+            const uint32_t isrc = data_src(id*block_size + c);
+
+            uint32_t n = 1;
+            while (c + n < c1 && (isrc + n) % block_size != 0 && data_src(id*block_size + c + n) == isrc + n) {
+                n++;
+            }
+
+            refs[isrc / block_size]++;
+            copies.push_back({ isrc, id_new*block_size + c_new + (c - c0), n });
+
+            c += n;
+        }
+    }
+
+    // copy the cells of the entries to new blocks, the references to the old blocks are dropped
+    table_t copy_entries(const table_t & src) {
+        table_t res;
+
+        uint32_t id_new = none;
+        uint32_t c_new  = block_size;
+
+        for (const auto & e : src) {
+            for (uint32_t c0 = e.c0; c0 < e.c1; ) {
+                if (c_new == block_size) {
+                    id_new = alloc();
+                    c_new  = 0;
+
+                    assert(id_new != none);
+                }
+
+                const uint32_t c1 = std::min(e.c1, c0 + block_size - c_new);
+
+                copy_cells(e.id, c0, c1, id_new, c_new);
+
+                res.push_back({ id_new, c_new, c_new + (c1 - c0) });
+
+                refs[id_new]++;
+                c_new += c1 - c0;
+                fill[id_new] = c_new;
+
+                c0 = c1;
+            }
+
+            release(e.id);
+        }
+
+        return res;
+    }
+
+    // apply f to the cells of the sequence with positions in [p0, p1)
+    // the sequence first moves all its cells of a shared block with cells in the range to a new block, so that the
+    // copy-on-write of a block needs a single new block (see seq_cp() for the reservation of these blocks)
+    // the caller checks with can_update() that the new blocks are available
+    template <typename F>
+    bool seq_update(llama_seq_id seq_id, llama_pos p0, llama_pos p1, F && f) {
+        if ((size_t) seq_id >= tables.size() || tables[seq_id].empty()) {
+            return true;
+        }
+
+        auto in_range = [&](llama_pos p) { return p >= p0 && p < p1; };
+
+        auto & table = tables[seq_id];
+
+        // the shared blocks to move, with the block and the number of cells they are moved to
+        struct move_info {
+            uint32_t id;
+            uint32_t c;
+        };
+
+        std::unordered_map<uint32_t, move_info> moves;
+        for (const auto id : get_shared(seq_id, p0, p1)) {
+            moves[id] = { none, 0 };
+        }
+
+        for (auto & e : table) {
+            const auto it = moves.find(e.id);
+
+            if (it == moves.end()) {
+                // not shared - update in place
+                for (uint32_t c = e.c0; c < e.c1; ++c) {
+                    if (in_range(pos_get(e.id, c))) {
+                        f(e.id*block_size + c);
+                    }
+                }
+
+                continue;
+            }
+
+            if (it->second.id == none || it->second.c + (e.c1 - e.c0) > block_size) {
+                // a block reserved for this one, or a free block that is not reserved for the others
+                if (resv[e.id] > 0 && get_n_free() > 0) {
+                    resv[e.id]--;
+                } else {
+                    assert(get_n_free() > get_n_reserved());
+                }
+
+                it->second = { alloc(), 0 };
+            }
+
+            // copy-on-write: the cells move to the new block
+            auto & mv = it->second;
+
+            const uint32_t n = e.c1 - e.c0;
+
+            copy_cells(e.id, e.c0, e.c1, mv.id, mv.c);
+
+            for (uint32_t c = e.c0; c < e.c1; ++c) {
+                if (in_range(pos_get(e.id, c))) {
+                    f(mv.id*block_size + mv.c + (c - e.c0));
+                }
+            }
+
+            const uint32_t id_old = e.id;
+
+            e = { mv.id, mv.c, mv.c + n };
+
+            refs[mv.id]++;
+            mv.c += n;
+            fill[mv.id] = mv.c;
+
+            release(id_old);
+        }
+
+        return true;
+    }
+
+    // the shared blocks of the sequence with cells in [p0, p1)
+    std::vector<uint32_t> get_shared(llama_seq_id seq_id, llama_pos p0, llama_pos p1) const {
+        std::vector<uint32_t> res;
+
+        const auto n_seqs = count_seqs();
+
+        std::vector<bool> seen(refs.size(), false);
+
+        for (const auto & e : get_table(seq_id)) {
+            if (n_seqs[e.id] < 2 || seen[e.id]) {
+                continue;
+            }
+
+            for (uint32_t c = e.c0; c < e.c1; ++c) {
+                const llama_pos p = pos_get(e.id, c);
+                if (p >= p0 && p < p1) {
+                    seen[e.id] = true;
+                    res.push_back(e.id);
+                    break;
+                }
+            }
+        }
+
+        return res;
+    }
+
+    // true if there are enough free blocks for the copy-on-write of the shared blocks of the sequence with cells in
+    // [p0, p1): the reserved blocks of a block, or free blocks that are not reserved for the others
+    bool can_update(llama_seq_id seq_id, llama_pos p0, llama_pos p1) const {
+        uint32_t n_resv  = 0;
+        uint32_t n_other = 0;
+
+        for (const auto id : get_shared(seq_id, p0, p1)) {
+            if (resv[id] > 0) {
+                n_resv++;
+            } else {
+                n_other++;
+            }
+        }
+
+        const uint32_t n_free = get_n_free();
+
+        return n_resv + n_other <= n_free && get_n_reserved() + n_other <= n_free;
+    }
+};
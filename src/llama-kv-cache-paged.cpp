@@ -0,0 +1,602 @@
+#include "llama-kv-cache-paged.h"
+
+#include "llama-impl.h"
+#include "llama-io.h"
+#include "llama-model.h"
+#include "llama-context.h"
+
+#include <algorithm>
+#include <cassert>
+#include <limits>
+#include <numeric>
+#include <stdexcept>
+
+//
+// llama_kv_cache_paged
+//
+
+llama_kv_cache_paged::llama_kv_cache_paged(
+        const llama_model &  model,
+          layer_filter_cb && filter,
+   const llama_kv_types &    types,
+                     bool    v_trans,
+                     bool    offload,
+                 uint32_t    kv_size,
+                 uint32_t    n_seq_max,
+                 uint32_t    n_pad,
+                 uint32_t    block_size) :
+    llama_kv_cache_unified(model, std::move(filter), types, v_trans, offload, true, kv_size, n_seq_max, n_pad, 0, LLAMA_SWA_TYPE_NONE, 0, 0, 0) {
+
+    if (block_size == 0 || block_size > kv_size) {
+        throw std::runtime_error("KV block size must be in [1, " + std::to_string(kv_size) + "]");
+    }
+
+    blocks.init(&v_cells[0], block_size);
+
+    // the tokens of a ubatch are spread over several blocks
+    supports_set_rows = true;
+
+    LLAMA_LOG_INFO("%s: block size = %u cells, %u blocks, using ggml_set_rows()\n", __func__, block_size, blocks.get_n_blocks());
+}
+
+llama_memory_context_ptr llama_kv_cache_paged::init_update(llama_context * lctx, bool optimize) {
+    GGML_UNUSED(optimize);
+
+    // no defrag: the lowest free block is always used first, so the used cells remain compact
+    // the pending copies of the shared blocks always come with a shift of the copied cells
+    const bool do_shift = get_has_shift() || !blocks.get_copies().empty();
+
+    return std::make_unique<llama_kv_cache_unified_context>(this, lctx, do_shift, defrag_info(), stream_copy_info());
+}
+
+void llama_kv_cache_paged::clear(bool data) {
+    llama_kv_cache_unified::clear(data);
+
+    blocks.reset();
+}
+
+bool llama_kv_cache_paged::seq_rm(llama_seq_id seq_id, llama_pos p0, llama_pos p1) {
+    GGML_ASSERT(seq_id == -1 || (seq_id >= 0 && (size_t) seq_id < seq_to_stream.size()));
+
+    if (p0 < 0) {
+        p0 = 0;
+    }
+
+    if (p1 < 0) {
+        p1 = std::numeric_limits<llama_pos>::max();
+    }
+
+    blocks.seq_rm(seq_id, p0, p1);
+
+    // the block tables can change without changing the cells
+    mask_runs.invalidate(0);
+
+    return true;
+}
+
+void llama_kv_cache_paged::seq_cp(llama_seq_id seq_id_src, llama_seq_id seq_id_dst, llama_pos p0, llama_pos p1) {
+    GGML_ASSERT(seq_id_src >= 0 && (size_t) seq_id_src < seq_to_stream.size());
+    GGML_ASSERT(seq_id_dst >= 0 && (size_t) seq_id_dst < seq_to_stream.size());
+
+    if (p0 < 0) {
+        p0 = 0;
+    }
+
+    if (p1 < 0) {
+        p1 = std::numeric_limits<llama_pos>::max();
+    }
+
+    if (!blocks.seq_cp(seq_id_src, seq_id_dst, p0, p1)) {
+        LLAMA_LOG_ERROR("%s: not enough free blocks to fork sequence %d into sequence %d, the sequence is not copied\n", __func__, seq_id_src, seq_id_dst);
+        return;
+    }
+
+    mask_runs.invalidate(0);
+}
+
+void llama_kv_cache_paged::seq_keep(llama_seq_id seq_id) {
+    GGML_ASSERT(seq_id >= 0 && (size_t) seq_id < seq_to_stream.size());
+
+    blocks.seq_keep(seq_id);
+
+    mask_runs.invalidate(0);
+}
+
+void llama_kv_cache_paged::seq_add(llama_seq_id seq_id, llama_pos p0, llama_pos p1, llama_pos shift) {
+    GGML_ASSERT(seq_id >= 0 && (size_t) seq_id < seq_to_stream.size());
+
+    if (shift == 0) {
+        return;
+    }
+
+    if (p0 < 0) {
+        p0 = 0;
+    }
+
+    if (p1 < 0) {
+        p1 = std::numeric_limits<llama_pos>::max();
+    }
+
+    if (p0 == p1) {
+        return;
+    }
+
+    // the shared cells are first copied, shifting them in place would shift them for the other sequences too
+    if (!blocks.seq_add(seq_id, p0, p1, shift)) {
+        LLAMA_LOG_ERROR("%s: not enough free blocks to copy the shared cells of sequence %d, the positions are not shifted\n", __func__, seq_id);
+    }
+}
+
+void llama_kv_cache_paged::seq_div(llama_seq_id seq_id, llama_pos p0, llama_pos p1, int d) {
+    GGML_ASSERT(seq_id >= 0 && (size_t) seq_id < seq_to_stream.size());
+
+    if (d == 1) {
+        return;
+    }
+
+    if (p0 < 0) {
+        p0 = 0;
+    }
+
+    if (p1 < 0) {
+        p1 = std::numeric_limits<llama_pos>::max();
+    }
+
+    if (p0 == p1) {
+        return;
+    }
+
+    if (!blocks.seq_div(seq_id, p0, p1, d)) {
+        LLAMA_LOG_ERROR("%s: not enough free blocks to copy the shared cells of sequence %d, the positions are not divided\n", __func__, seq_id);
+    }
+}
+
+llama_pos llama_kv_cache_paged::seq_pos_min(llama_seq_id seq_id) const {
+    GGML_ASSERT(seq_id >= 0 && (size_t) seq_id < seq_to_stream.size());
+
+    return blocks.seq_pos_min(seq_id);
+}
+
+llama_pos llama_kv_cache_paged::seq_pos_max(llama_seq_id seq_id) const {
+    GGML_ASSERT(seq_id >= 0 && (size_t) seq_id < seq_to_stream.size());
+
+    return blocks.seq_pos_max(seq_id);
+}
+
+llama_kv_cache_unified::slot_info_vec_t llama_kv_cache_paged::prepare(const std::vector<llama_ubatch> & ubatches) {
+    slot_info_vec_t res;
+
+    // remember the state of the blocks and of the tables of the sequences in the ubatches
+    std::vector<llama_seq_id> seq_ids;
+    for (const auto & ubatch : ubatches) {
+        for (uint32_t i = 0; i < ubatch.n_tokens; ++i) {
+            seq_ids.insert(seq_ids.end(), ubatch.seq_id[i], ubatch.seq_id[i] + ubatch.n_seq_id[i]);
+        }
+    }
+
+    std::sort(seq_ids.begin(), seq_ids.end());
+    seq_ids.erase(std::unique(seq_ids.begin(), seq_ids.end()), seq_ids.end());
+
+    auto state = blocks.save(seq_ids);
+
+    const uint64_t version = v_cells[0].get_version();
+
+    std::vector<uint32_t> idxs;
+
+    bool success = true;
+
+    for (const auto & ubatch : ubatches) {
+        const auto sinfo_new = find_slot(ubatch, false);
+        if (sinfo_new.empty()) {
+            success = false;
+            break;
+        }
+
+        res.push_back(sinfo_new);
+
+        apply_ubatch(sinfo_new, ubatch);
+
+        idxs.insert(idxs.end(), sinfo_new.idxs[0].begin(), sinfo_new.idxs[0].end());
+    }
+
+    blocks.restore(std::move(state), idxs);
+
+    // the tokens are placed only in free cells, so the cells are restored exactly and the runs of the KQ mask remain valid
+    v_cells[0].set_version(version);
+
+    if (!success) {
+        return {};
+    }
+
+    return res;
+}
+
+bool llama_kv_cache_paged::update(llama_context * lctx, bool do_shift, const defrag_info & dinfo, const stream_copy_info & sc_info) {
+    bool updated = false;
+
+    const auto & copies = blocks.get_copies();
+
+    // the copies of the shared blocks go first, the copied cells are then shifted with the others
+    if (!copies.empty() && !layers.empty()) {
+        LLAMA_LOG_DEBUG("%s: copying %zu cell ranges of shared blocks\n", __func__, copies.size());
+
+        auto * sched = lctx->get_sched();
+
+        // each copy uses 6 nodes per layer (see build_graph_copy())
+        const size_t n_max = std::max<size_t>(1, (lctx->graph_max_nodes() - 2*layers.size())/(6*layers.size()));
+
+        for (size_t i0 = 0; i0 < copies.size(); i0 += n_max) {
+            const size_t i1 = std::min(copies.size(), i0 + n_max);
+
+            ggml_backend_sched_reset(sched);
+
+            auto * res = lctx->get_gf_res_reserve();
+
+            res->reset();
+
+            auto * gf = build_graph_copy(res, i0, i1);
+            if (!ggml_backend_sched_alloc_graph(sched, gf)) {
+                LLAMA_LOG_ERROR("%s: failed to allocate compute graph for the block copies\n", __func__);
+                return updated;
+            }
+
+            res->set_inputs(nullptr);
+
+            if (lctx->graph_compute(gf, false) != GGML_STATUS_SUCCESS) {
+                LLAMA_LOG_ERROR("%s: failed to compute the block copies\n", __func__);
+                return updated;
+            }
+        }
+
+        updated = true;
+    }
+
+    blocks.copies_done();
+
+    updated = llama_kv_cache_unified::update(lctx, do_shift, dinfo, sc_info) || updated;
+
+    return updated;
+}
+
+llama_kv_cache_unified::slot_info llama_kv_cache_paged::find_slot(const llama_ubatch & ubatch, bool cont) const {
+    GGML_UNUSED(cont);
+
+    slot_info res = {
+        /*.s0   =*/ 0,
+        /*.s1   =*/ 0,
+        /*.strm =*/ { },
+        /*.idxs =*/ { },
+    };
+
+    res.resize(1);
+    res.strm[0] = 0;
+
+    if (!blocks.find(ubatch, res.idxs[0])) {
+        return { };
+    }
+
+    return res;
+}
+
+void llama_kv_cache_paged::apply_ubatch(const slot_info & sinfo, const llama_ubatch & ubatch) {
+    assert(sinfo.n_stream() == 1);
+
+    blocks.apply(sinfo.idxs[0], ubatch);
+}
+
+const llama_kv_blocks & llama_kv_cache_paged::get_blocks() const {
+    return blocks;
+}
+
+void llama_kv_cache_paged::build_kq_mask_runs(uint32_t strm) const {
+    GGML_ASSERT(strm == 0);
+
+    // the cells of each sequence are found from its block table
+    for (uint32_t s = 0; s < n_seq_max; ++s) {
+        mask_runs.clear(s);
+
+        blocks.seq_for_each_cell(s, [&](uint32_t idx) {
+            mask_runs.add(s, idx, v_cells[0].pos_get(idx));
+        });
+    }
+}
+
+ggml_cgraph * llama_kv_cache_paged::build_graph_copy(llm_graph_result * res, size_t i0, size_t i1) const {
+    auto * ctx = res->get_ctx();
+    auto * gf  = res->get_gf();
+
+    const auto & copies = blocks.get_copies();
+
+    const uint32_t kv_size = get_size();
+
+    for (size_t i = i0; i < i1; ++i) {
+        const auto & cp = copies[i];
+
+        for (const auto & layer : layers) {
+            const uint32_t il = layer.il;
+
+            const int64_t n_embd_k_gqa = hparams.n_embd_k_gqa(il);
+            const int64_t n_embd_v_gqa = hparams.n_embd_v_gqa(il);
+
+            ggml_tensor * view_k_src = ggml_view_2d(ctx, layer.k,
+                    n_embd_k_gqa, cp.n,
+                    layer.k->nb[1],
+                    layer.k->nb[1]*cp.src);
+
+            ggml_tensor * view_k_dst = ggml_view_2d(ctx, layer.k,
+                    n_embd_k_gqa, cp.n,
+                    layer.k->nb[1],
+                    layer.k->nb[1]*cp.dst);
+
+            ggml_tensor * view_v_src;
+            ggml_tensor * view_v_dst;
+
+            if (!v_trans) {
+                view_v_src = ggml_view_2d(ctx, layer.v,
+                        n_embd_v_gqa, cp.n,
+                        layer.v->nb[1],
+                        layer.v->nb[1]*cp.src);
+
+                view_v_dst = ggml_view_2d(ctx, layer.v,
+                        n_embd_v_gqa, cp.n,
+                        layer.v->nb[1],
+                        layer.v->nb[1]*cp.dst);
+            } else {
+                view_v_src = ggml_view_2d(ctx, layer.v,
+                        cp.n, n_embd_v_gqa,
+                        ggml_row_size(layer.v->type, kv_size),
+                        ggml_row_size(layer.v->type, cp.src));
+
+                view_v_dst = ggml_view_2d(ctx, layer.v,
+                        cp.n, n_embd_v_gqa,
+                        ggml_row_size(layer.v->type, kv_size),
+                        ggml_row_size(layer.v->type, cp.dst));
+            }
+
+            ggml_build_forward_expand(gf, ggml_cpy(ctx, view_k_src, view_k_dst));
+            ggml_build_forward_expand(gf, ggml_cpy(ctx, view_v_src, view_v_dst));
+        }
+    }
+
+    return gf;
+}
+
+void llama_kv_cache_paged::state_write_range(llama_io_write_i & io, llama_seq_id seq_id, llama_pos p0, llama_pos p1) const {
+    GGML_ASSERT(seq_id == -1 || (seq_id >= 0 && (size_t) seq_id < seq_to_stream.size()));
+
+    if (p0 < 0) {
+        p0 = 0;
+    }
+
+    if (p1 < 0) {
+        p1 = std::numeric_limits<llama_pos>::max();
+    }
+
+    io.write(&n_stream, sizeof(n_stream));
+
+    const auto & cells = v_cells[0];
+
+    // the cells to write, in the order of the cells for the whole cache and in the order of the positions for a single
+    // sequence. the format is the same as for llama_kv_cache_unified
+    std::vector<uint32_t> idxs;
+    std::vector<std::vector<llama_seq_id>> seq_ids;
+
+    if (seq_id == -1) {
+        std::vector<std::vector<llama_seq_id>> cell_seq_ids(cells.used_max_p1());
+
+        for (llama_seq_id s = 0; s < (llama_seq_id) seq_to_stream.size(); ++s) {
+            blocks.seq_for_each_cell(s, [&](uint32_t i) {
+                auto & cur = cell_seq_ids[i];
+                if (cells.pos_in(i, p0, p1) && (cur.empty() || cur.back() != s)) {
+                    cur.push_back(s);
+                }
+            });
+        }
+
+        for (uint32_t i = 0; i < cell_seq_ids.size(); ++i) {
+            if (!cell_seq_ids[i].empty()) {
+                idxs.push_back(i);
+                seq_ids.push_back(std::move(cell_seq_ids[i]));
+            }
+        }
+    } else {
+        blocks.seq_for_each_cell(seq_id, [&](uint32_t i) {
+            if (cells.pos_in(i, p0, p1)) {
+                idxs.push_back(i);
+            }
+        });
+    }
+
+    const uint32_t cell_count = idxs.size();
+
+    io.write(&cell_count, sizeof(cell_count));
+
+    if (cell_count == 0) {
+        return;
+    }
+
+    for (uint32_t k = 0; k < cell_count; ++k) {
+        const llama_pos pos     = cells.pos_get(idxs[k]);
+        const uint32_t n_seq_id = seq_id == -1 ? seq_ids[k].size() : 1;
+
+        io.write(&pos,      sizeof(pos));
+        io.write(&n_seq_id, sizeof(n_seq_id));
+
+        if (seq_id == -1) {
+            for (const auto & cur : seq_ids[k]) {
+                io.write(&cur, sizeof(cur));
+            }
+        } else {
+            io.write(&seq_id, sizeof(seq_id));
+        }
+    }
+
+    // the data of the cells with a pending copy is still in the source cells
+    cell_ranges_t cr { 0, {} };
+
+    for (const auto i : idxs) {
+        const uint32_t j = blocks.data_src(i);
+
+        if (!cr.data.empty() && cr.data.back().second == j) {
+            cr.data.back().second++;
+        } else {
+            cr.data.emplace_back(j, j + 1);
+        }
+    }
+
+    state_write_data(io, cr);
+}
+
+void llama_kv_cache_paged::state_read(llama_io_read_i & io, llama_seq_id seq_id) {
+    state_read_impl(io, seq_id, false);
+}
+
+void llama_kv_cache_paged::state_read_append(llama_io_read_i & io, llama_seq_id seq_id) {
+    GGML_ASSERT(seq_id >= 0);
+
+    state_read_impl(io, seq_id, true);
+}
+
+void llama_kv_cache_paged::state_read_impl(llama_io_read_i & io, llama_seq_id seq_id, bool append) {
+    GGML_ASSERT(seq_id == -1 || (seq_id >= 0 && (size_t) seq_id < seq_to_stream.size()));
+
+    uint32_t n_stream_cur;
+    io.read_to(&n_stream_cur, sizeof(n_stream_cur));
+    if (n_stream_cur != n_stream) {
+        throw std::runtime_error("n_stream mismatch");
+    }
+
+    uint32_t cell_count;
+    io.read_to(&cell_count, sizeof(cell_count));
+
+    if (cell_count == 0) {
+        return;
+    }
+
+    std::vector<uint32_t> idxs;
+
+    bool res = state_read_meta(io, cell_count, seq_id, append, idxs);
+
+    if (res) {
+        cell_ranges_t cr { 0, {} };
+
+        for (const auto i : idxs) {
+            if (!cr.data.empty() && cr.data.back().second == i) {
+                cr.data.back().second++;
+            } else {
+                cr.data.emplace_back(i, i + 1);
+            }
+        }
+
+        res = state_read_data(io, cr);
+    }
+
+    if (!res) {
+        if (seq_id == -1) {
+            clear(true);
+        } else {
+            seq_rm(seq_id, -1, -1);
+        }
+        throw std::runtime_error("failed to restore kv cache");
+    }
+}
+
+bool llama_kv_cache_paged::state_read_meta(llama_io_read_i & io, uint32_t cell_count, llama_seq_id dest_seq_id, bool append, std::vector<uint32_t> & idxs) {
+    std::vector<llama_pos> pos(cell_count);
+
+    std::vector<std::vector<llama_seq_id>> seq_ids(cell_count);
+
+    for (uint32_t i = 0; i < cell_count; ++i) {
+        uint32_t n_seq_id;
+
+        io.read_to(&pos[i],   sizeof(pos[i]));
+        io.read_to(&n_seq_id, sizeof(n_seq_id));
+
+        if (dest_seq_id != -1) {
+            if (n_seq_id != 1) {
+                LLAMA_LOG_ERROR("%s: invalid seq_id-agnostic kv cell\n", __func__);
+                return false;
+            }
+
+            // read the sequence id, but directly discard it - we will use dest_seq_id instead
+            {
+                llama_seq_id seq_id;
+                io.read_to(&seq_id, sizeof(seq_id));
+            }
+
+            seq_ids[i].push_back(dest_seq_id);
+
+            continue;
+        }
+
+        if (n_seq_id == 0) {
+            LLAMA_LOG_ERROR("%s: kv cell without a sequence\n", __func__);
+            return false;
+        }
+
+        for (uint32_t j = 0; j < n_seq_id; ++j) {
+            llama_seq_id seq_id;
+            io.read_to(&seq_id, sizeof(seq_id));
+
+            if (seq_id < 0 || (uint32_t) seq_id >= n_seq_max) {
+                LLAMA_LOG_ERROR("%s: invalid seq_id, %d is out of range [0, %u)\n", __func__, seq_id, n_seq_max);
+                return false;
+            }
+
+            seq_ids[i].push_back(seq_id);
+        }
+    }
+
+    if (dest_seq_id != -1) {
+        if (append) {
+            // replace the cells at the same or later positions
+            seq_rm(dest_seq_id, *std::min_element(pos.begin(), pos.end()), -1);
+        } else {
+            seq_rm(dest_seq_id, -1, -1);
+        }
+    } else {
+        clear(true);
+    }
+
+    // the cells are appended to the block tables in the order of the positions
+    std::vector<uint32_t> order(cell_count);
+    std::iota(order.begin(), order.end(), 0);
+    std::stable_sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) {
+        return pos[a] < pos[b];
+    });
+
+    std::vector<llama_pos>      ubatch_pos     (cell_count);
+    std::vector<int32_t>        ubatch_n_seq_id(cell_count);
+    std::vector<llama_seq_id *> ubatch_seq_id  (cell_count);
+
+    for (uint32_t k = 0; k < cell_count; ++k) {
+        const uint32_t i = order[k];
+
+        ubatch_pos     [k] = pos[i];
+        ubatch_n_seq_id[k] = seq_ids[i].size();
+        ubatch_seq_id  [k] = seq_ids[i].data();
+    }
+
+    llama_ubatch ubatch = {};
+
+    ubatch.n_tokens = cell_count;
+    ubatch.pos      = ubatch_pos.data();
+    ubatch.n_seq_id = ubatch_n_seq_id.data();
+    ubatch.seq_id   = ubatch_seq_id.data();
+
+    std::vector<uint32_t> idxs_sorted;
+    if (!blocks.find(ubatch, idxs_sorted)) {
+        LLAMA_LOG_ERROR("%s: failed to find available cells in kv cache\n", __func__);
+        return false;
+    }
+
+    blocks.apply(idxs_sorted, ubatch);
+
+    // the data is stored in the order of the cells in the file
+    idxs.resize(cell_count);
+    for (uint32_t k = 0; k < cell_count; ++k) {
+        idxs[order[k]] = idxs_sorted[k];
+    }
+
+    return true;
+}
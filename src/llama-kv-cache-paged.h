@@ -0,0 +1,86 @@
+#pragma once
+
+#include "llama-kv-blocks.h"
+#include "llama-kv-cache-unified.h"
+
+#include <vector>
+
+//
+// llama_kv_cache_paged
+//
+
+// a unified KV cache that allocates the cells in fixed-size blocks, with a block table per sequence (see llama_kv_blocks)
+//   the sequences that share a prefix share its blocks, seq_cp() copies block tables and the shifts of shared blocks
+//   are copy-on-write. the tensors and the graph inputs are the ones of llama_kv_cache_unified, so the models use the
+//   cache without changes. single stream only, the tokens are always placed with ggml_set_rows()
+
+class llama_kv_cache_paged : public llama_kv_cache_unified {
+public:
+    llama_kv_cache_paged(
+            const llama_model &  model,
+              layer_filter_cb && filter,
+       const llama_kv_types &    types,
+                         bool    v_trans,
+                         bool    offload,
+                     uint32_t    kv_size,
+                     uint32_t    n_seq_max,
+                     uint32_t    n_pad,
+                     uint32_t    block_size);
+
+    ~llama_kv_cache_paged() = default;
+
+    //
+    // llama_memory_i
+    //
+
+    llama_memory_context_ptr init_update(llama_context * lctx, bool optimize) override;
+
+    void clear(bool data) override;
+
+    bool seq_rm  (llama_seq_id seq_id,                              llama_pos p0, llama_pos p1) override;
+    void seq_cp  (llama_seq_id seq_id_src, llama_seq_id seq_id_dst, llama_pos p0, llama_pos p1) override;
+    void seq_keep(llama_seq_id seq_id)                                                          override;
+    void seq_add (llama_seq_id seq_id,                              llama_pos p0, llama_pos p1, llama_pos shift) override;
+    void seq_div (llama_seq_id seq_id,                              llama_pos p0, llama_pos p1, int d) override;
+
+    llama_pos seq_pos_min(llama_seq_id seq_id) const override;
+    llama_pos seq_pos_max(llama_seq_id seq_id) const override;
+
+    // state write/load
+
+    void state_read(llama_io_read_i & io, llama_seq_id seq_id = -1) override;
+
+    void state_write_range (llama_io_write_i & io, llama_seq_id seq_id, llama_pos p0, llama_pos p1) const override;
+    void state_read_append(llama_io_read_i  & io, llama_seq_id seq_id)                                   override;
+
+    //
+    // llama_kv_cache_unified
+    //
+
+    slot_info_vec_t prepare(const std::vector<llama_ubatch> & ubatches) override;
+
+    bool update(llama_context * lctx, bool do_shift, const defrag_info & dinfo, const stream_copy_info & sc_info) override;
+
+    slot_info find_slot(const llama_ubatch & ubatch, bool cont) const override;
+
+    void apply_ubatch(const slot_info & sinfo, const llama_ubatch & ubatch) override;
+
+    //
+    // llama_kv_cache_paged specific API
+    //
+
+    const llama_kv_blocks & get_blocks() const;
+
+protected:
+    void build_kq_mask_runs(uint32_t strm) const override;
+
+private:
+    llama_kv_blocks blocks;
+
+    // copy the data of the cells for the pending copies [i0, i1) of the blocks
+    ggml_cgraph * build_graph_copy(llm_graph_result * res, size_t i0, size_t i1) const;
+
+    void state_read_impl(llama_io_read_i & io, llama_seq_id seq_id, bool append);
+
+    bool state_read_meta(llama_io_read_i & io, uint32_t cell_count, llama_seq_id dest_seq_id, bool append, std::vector<uint32_t> & idxs);
+};
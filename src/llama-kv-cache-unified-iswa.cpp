@@ -13,8 +13,7 @@
 
 llama_kv_cache_unified_iswa::llama_kv_cache_unified_iswa(
         const llama_model & model,
-                ggml_type   type_k,
-                ggml_type   type_v,
+   const llama_kv_types &   types,
                      bool   v_trans,
                      bool   offload,
                      bool   swa_full,
@@ -22,12 +21,16 @@ llama_kv_cache_unified_iswa::llama_kv_cache_unified_iswa(
                  uint32_t   kv_size,
                  uint32_t   n_seq_max,
                  uint32_t   n_ubatch,
-                 uint32_t   n_pad) : hparams(model.hparams), unified(unified) {
+                 uint32_t   n_pad,
+                 uint32_t   n_budget,
+                 uint32_t   n_recent) : hparams(model.hparams), unified(unified) {
     llama_kv_cache_unified::layer_filter_cb filter_base = [&](int32_t il) { return !model.hparams.is_swa(il); };
     llama_kv_cache_unified::layer_filter_cb filter_swa  = [&](int32_t il) { return  model.hparams.is_swa(il); };
 
     const uint32_t size_base = kv_size;
 
+    // the window of each sequence and the tokens of a ubatch, which are placed before the window moves
+    // with a single sequence per stream, the cells of a stream are a ring of the positions (see llama_kv_cache_unified::find_slot_ring())
     uint32_t size_swa = std::min(size_base, GGML_PAD(hparams.n_swa*(unified ? n_seq_max : 1) + n_ubatch, n_pad));
 
     // when using full-size SWA cache, we set the SWA cache size to be equal to the base cache size
@@ -41,16 +44,16 @@ llama_kv_cache_unified_iswa::llama_kv_cache_unified_iswa(
     LLAMA_LOG_INFO("%s: creating non-SWA KV cache, size = %u cells\n", __func__, size_base);
 
     kv_base = std::make_unique<llama_kv_cache_unified>(
-            model, std::move(filter_base), type_k, type_v,
+            model, std::move(filter_base), types,
             v_trans, offload, unified, size_base, n_seq_max, n_pad,
-            0, LLAMA_SWA_TYPE_NONE);
+            0, LLAMA_SWA_TYPE_NONE, n_budget, n_recent, 0);
 
     LLAMA_LOG_INFO("%s: creating     SWA KV cache, size = %u cells\n", __func__, size_swa);
 
     kv_swa = std::make_unique<llama_kv_cache_unified>(
-            model, std::move(filter_swa), type_k, type_v,
+            model, std::move(filter_swa), types,
             v_trans, offload, unified, size_swa, n_seq_max, n_pad,
-            hparams.n_swa, hparams.swa_type);
+            hparams.n_swa, hparams.swa_type, 0, 0, 0);
 }
 
 void llama_kv_cache_unified_iswa::clear(bool data) {
@@ -136,6 +139,9 @@ llama_memory_context_ptr llama_kv_cache_unified_iswa::init_batch(llama_batch_all
 
         assert(sinfos_base.size() == sinfos_swa.size());
 
+        // the SWA cache is already bounded by the window, only the cells of the base cache are evicted
+        kv_base->evict(balloc);
+
         return std::make_unique<llama_kv_cache_unified_iswa_context>(
                 this, std::move(sinfos_base), std::move(sinfos_swa), std::move(ubatches));
     } while (false);
@@ -172,6 +178,9 @@ llama_memory_context_ptr llama_kv_cache_unified_iswa::init_batch(llama_batch_all
 
         assert(sinfos_base.size() == sinfos_swa.size());
 
+        // the SWA cache is already bounded by the window, only the cells of the base cache are evicted
+        kv_base->evict(balloc);
+
         return std::make_unique<llama_kv_cache_unified_iswa_context>(
                 this, std::move(sinfos_base), std::move(sinfos_swa), std::move(ubatches));
     } while (false);
@@ -194,6 +203,10 @@ bool llama_kv_cache_unified_iswa::get_can_shift() const {
     return kv_base->get_size() == kv_swa->get_size();
 }
 
+std::vector<llama_memory_stream_stats> llama_kv_cache_unified_iswa::get_stream_stats() const {
+    return kv_base->get_stream_stats();
+}
+
 void llama_kv_cache_unified_iswa::state_write(llama_io_write_i & io, llama_seq_id seq_id) const {
     kv_base->state_write(io, seq_id);
     kv_swa ->state_write(io, seq_id);
@@ -204,6 +217,16 @@ void llama_kv_cache_unified_iswa::state_read(llama_io_read_i & io, llama_seq_id
     kv_swa ->state_read(io, seq_id);
 }
 
+void llama_kv_cache_unified_iswa::state_write_range(llama_io_write_i & io, llama_seq_id seq_id, llama_pos p0, llama_pos p1) const {
+    kv_base->state_write_range(io, seq_id, p0, p1);
+    kv_swa ->state_write_range(io, seq_id, p0, p1);
+}
+
+void llama_kv_cache_unified_iswa::state_read_append(llama_io_read_i & io, llama_seq_id seq_id) {
+    kv_base->state_read_append(io, seq_id);
+    kv_swa ->state_read_append(io, seq_id);
+}
+
 llama_kv_cache_unified * llama_kv_cache_unified_iswa::get_base() const {
     return kv_base.get();
 }
@@ -15,8 +15,7 @@ class llama_kv_cache_unified_iswa : public llama_memory_i {
 public:
     llama_kv_cache_unified_iswa(
             const llama_model & model,
-                    ggml_type   type_k,
-                    ggml_type   type_v,
+       const llama_kv_types &   types,
                          bool   v_trans,
                          bool   offload,
                          bool   swa_full,
@@ -24,7 +23,9 @@ public:
                      uint32_t   kv_size,
                      uint32_t   n_seq_max,
                      uint32_t   n_ubatch,
-                     uint32_t   n_pad);
+                     uint32_t   n_pad,
+                     uint32_t   n_budget,
+                     uint32_t   n_recent);
 
     ~llama_kv_cache_unified_iswa() = default;
 
@@ -43,6 +44,8 @@ public:
 
     bool get_can_shift() const override;
 
+    std::vector<llama_memory_stream_stats> get_stream_stats() const override;
+
     void clear(bool data) override;
 
     bool seq_rm  (llama_seq_id seq_id,                              llama_pos p0, llama_pos p1) override;
@@ -59,6 +62,9 @@ public:
     void state_write(llama_io_write_i & io, llama_seq_id seq_id = -1) const override;
     void state_read (llama_io_read_i  & io, llama_seq_id seq_id = -1)       override;
 
+    void state_write_range (llama_io_write_i & io, llama_seq_id seq_id, llama_pos p0, llama_pos p1) const override;
+    void state_read_append(llama_io_read_i  & io, llama_seq_id seq_id)                                   override;
+
     //
     // llama_kv_cache_unified_iswa specific API
     //
@@ -8,6 +8,7 @@
 #include <algorithm>
 #include <cassert>
 #include <cmath>
+#include <cstring>
 #include <limits>
 #include <map>
 #include <stdexcept>
@@ -19,8 +20,7 @@
 llama_kv_cache_unified::llama_kv_cache_unified(
         const llama_model &  model,
           layer_filter_cb && filter,
-                ggml_type    type_k,
-                ggml_type    type_v,
+   const llama_kv_types &    types,
                      bool    v_trans,
                      bool    offload,
                      bool    unified,
@@ -28,9 +28,12 @@ llama_kv_cache_unified::llama_kv_cache_unified(
                  uint32_t    n_seq_max,
                  uint32_t    n_pad,
                  uint32_t    n_swa,
-           llama_swa_type    swa_type) :
+           llama_swa_type    swa_type,
+                 uint32_t    n_budget,
+                 uint32_t    n_recent,
+                 uint32_t    n_sink) :
     model(model), hparams(model.hparams), v_trans(v_trans),
-    n_seq_max(n_seq_max), n_stream(unified ? 1 : n_seq_max), n_pad(n_pad), n_swa(n_swa), swa_type(swa_type) {
+    n_seq_max(n_seq_max), n_stream(unified ? 1 : n_seq_max), n_pad(n_pad), n_swa(n_swa), n_budget(n_budget), n_recent(n_recent), n_sink(n_sink), swa_type(swa_type) {
 
     GGML_ASSERT(kv_size % n_pad == 0);
 
@@ -87,6 +90,18 @@ llama_kv_cache_unified::llama_kv_cache_unified(
         }
     }
 
+    mask_runs.init(n_seq_max, n_stream);
+
+    v_n_defrag .resize(n_stream, 0);
+    v_n_moved  .resize(n_stream, 0);
+    v_n_evicted.resize(n_stream, 0);
+    v_n_shift  .resize(n_stream, 0);
+    v_ring_off .resize(n_stream, 0);
+
+    if (n_budget > 0) {
+        LLAMA_LOG_INFO("%s: KV budget = %u cells per sequence, %u recent positions are kept\n", __func__, n_budget, n_recent);
+    }
+
     // [TAG_V_CACHE_VARIABLE]
     if (v_trans && hparams.is_n_embd_v_gqa_variable()) {
         LLAMA_LOG_WARN("%s: the V embeddings have different sizes across layers and FA is not enabled - padding V cache to %d\n",
@@ -103,6 +118,9 @@ llama_kv_cache_unified::llama_kv_cache_unified(
         const uint32_t n_embd_k_gqa =            hparams.n_embd_k_gqa(il);
         const uint32_t n_embd_v_gqa = !v_trans ? hparams.n_embd_v_gqa(il) : hparams.n_embd_v_gqa_max();
 
+        const ggml_type type_k = types.get_k(il, hparams.n_layer);
+        const ggml_type type_v = types.get_v(il, hparams.n_layer);
+
         const char * dev_name = "CPU";
 
         ggml_backend_buffer_type_t buft = ggml_backend_cpu_buffer_type();
@@ -114,7 +132,7 @@ llama_kv_cache_unified::llama_kv_cache_unified(
             dev_name = ggml_backend_dev_name(dev);
         }
 
-        LLAMA_LOG_DEBUG("%s: layer %3d: dev = %s\n", __func__, il, dev_name);
+        LLAMA_LOG_DEBUG("%s: layer %3d: dev = %s, K (%s), V (%s)\n", __func__, il, dev_name, ggml_type_name(type_k), ggml_type_name(type_v));
 
         ggml_context * ctx = ctx_for_buft(buft);
         if (!ctx) {
@@ -183,10 +201,23 @@ llama_kv_cache_unified::llama_kv_cache_unified(
         const size_t memory_size_k = size_k_bytes();
         const size_t memory_size_v = size_v_bytes();
 
+        // "mixed" when the layers have different types
+        const char * type_k = layers.empty() ? ggml_type_name(types.type_k) : ggml_type_name(layers[0].k->type);
+        const char * type_v = layers.empty() ? ggml_type_name(types.type_v) : ggml_type_name(layers[0].v->type);
+
+        for (const auto & layer : layers) {
+            if (layer.k->type != layers[0].k->type) {
+                type_k = "mixed";
+            }
+            if (layer.v->type != layers[0].v->type) {
+                type_v = "mixed";
+            }
+        }
+
         LLAMA_LOG_INFO("%s: size = %7.2f MiB (%6u cells, %3d layers, %2u/%2u seqs), K (%s): %7.2f MiB, V (%s): %7.2f MiB\n", __func__,
                 (float)(memory_size_k + memory_size_v) / (1024.0f * 1024.0f), kv_size, (int) layers.size(), n_seq_max, n_stream,
-                ggml_type_name(type_k), (float)memory_size_k / (1024.0f * 1024.0f),
-                ggml_type_name(type_v), (float)memory_size_v / (1024.0f * 1024.0f));
+                type_k, (float)memory_size_k / (1024.0f * 1024.0f),
+                type_v, (float)memory_size_v / (1024.0f * 1024.0f));
     }
 
     const char * LLAMA_KV_CACHE_DEBUG = getenv("LLAMA_KV_CACHE_DEBUG");
@@ -203,12 +234,28 @@ llama_kv_cache_unified::llama_kv_cache_unified(
     if (!supports_set_rows) {
         LLAMA_LOG_WARN("%s: LLAMA_SET_ROWS=0, using old ggml_cpy() method for backwards compatibility\n", __func__);
     }
+
+    GGML_ASSERT(n_sink == 0 || swa_type == LLAMA_SWA_TYPE_NONE);
+
+    // the sequences of a unified stream share its cells, so they cannot be addressed by position
+    const bool use_ring = (n_swa > 0 && swa_type != LLAMA_SWA_TYPE_NONE) || n_sink > 0;
+
+    ring = use_ring && supports_set_rows && (n_stream > 1 || n_seq_max == 1) && n_sink < kv_size;
+
+    if (ring && n_sink > 0) {
+        LLAMA_LOG_INFO("%s: %u attention sink cells and a ring of %u cells per sequence\n", __func__, n_sink, kv_size - n_sink);
+    } else if (ring) {
+        LLAMA_LOG_INFO("%s: SWA cells are placed in a ring of %u cells per sequence\n", __func__, kv_size);
+    } else if (n_sink > 0) {
+        LLAMA_LOG_WARN("%s: the attention sink ring needs ggml_set_rows() and one stream per sequence - the cells are placed individually\n", __func__);
+    }
 }
 
 void llama_kv_cache_unified::clear(bool data) {
     for (uint32_t s = 0; s < n_stream; ++s) {
         v_cells[s].reset();
         v_heads[s] = 0;
+        v_ring_off[s] = 0;
     }
 
     if (data) {
@@ -234,8 +281,9 @@ bool llama_kv_cache_unified::seq_rm(llama_seq_id seq_id, llama_pos p0, llama_pos
         p1 = std::numeric_limits<llama_pos>::max();
     }
 
+    // only the used cells are visited
     if (seq_id >= 0) {
-        for (uint32_t i = 0; i < cells.size(); ++i) {
+        for (uint32_t i = cells.find_used(0); i < cells.size(); i = cells.find_used(i + 1)) {
             if (!cells.pos_in(i, p0, p1)) {
                 continue;
             }
@@ -248,7 +296,7 @@ bool llama_kv_cache_unified::seq_rm(llama_seq_id seq_id, llama_pos p0, llama_pos
         }
     } else {
         // match any sequence
-        for (uint32_t i = 0; i < cells.size(); ++i) {
+        for (uint32_t i = cells.find_used(0); i < cells.size(); i = cells.find_used(i + 1)) {
             if (!cells.pos_in(i, p0, p1)) {
                 continue;
             }
@@ -360,7 +408,7 @@ void llama_kv_cache_unified::seq_keep(llama_seq_id seq_id) {
 
     uint32_t new_head = cells.size();
 
-    for (uint32_t i = 0; i < cells.size(); ++i) {
+    for (uint32_t i = cells.find_used(0); i < cells.size(); i = cells.find_used(i + 1)) {
         if (cells.seq_keep(i, seq_id)) {
             if (new_head == cells.size()) {
                 new_head = i;
@@ -399,7 +447,33 @@ void llama_kv_cache_unified::seq_add(llama_seq_id seq_id, llama_pos p0, llama_po
         return;
     }
 
-    for (uint32_t i = 0; i < cells.size(); ++i) {
+    const uint32_t strm = seq_to_stream[seq_id];
+
+    // when the whole window of the ring is moved and stays out of the sinks, the ring is rotated by the same amount so
+    // that the cells keep matching ring_idx() of their new positions
+    bool rotate = ring;
+
+    for (uint32_t i = cells.find_used(0); i < cells.size() && rotate; i = cells.find_used(i + 1)) {
+        if (!cells.seq_has(i, seq_id)) {
+            continue;
+        }
+
+        const llama_pos p = cells.pos_get(i);
+
+        if (p < (llama_pos) n_sink) {
+            rotate = !cells.pos_in(i, p0, p1);
+        } else {
+            rotate = cells.pos_in(i, p0, p1) && p + shift >= (llama_pos) n_sink;
+        }
+    }
+
+    if (rotate) {
+        const llama_pos n_ring = cells.size() - n_sink;
+
+        v_ring_off[strm] = ((v_ring_off[strm] - shift) % n_ring + n_ring) % n_ring;
+    }
+
+    for (uint32_t i = cells.find_used(0); i < cells.size(); i = cells.find_used(i + 1)) {
         if (!cells.pos_in(i, p0, p1)) {
             continue;
         }
@@ -440,7 +514,7 @@ void llama_kv_cache_unified::seq_div(llama_seq_id seq_id, llama_pos p0, llama_po
         return;
     }
 
-    for (uint32_t i = 0; i < cells.size(); ++i) {
+    for (uint32_t i = cells.find_used(0); i < cells.size(); i = cells.find_used(i + 1)) {
         if (!cells.pos_in(i, p0, p1)) {
             continue;
         }
@@ -497,6 +571,9 @@ llama_memory_context_ptr llama_kv_cache_unified::init_batch(
             break;
         }
 
+        // the batch fits - evict only the cells that are not used by the slots found above
+        evict(balloc);
+
         return std::make_unique<llama_kv_cache_unified_context>(
                 this, std::move(sinfos), std::move(ubatches));
     } while (false);
@@ -514,30 +591,51 @@ llama_memory_context_ptr llama_kv_cache_unified::init_update(llama_context * lct
     defrag_info dinfo;
 
     // see if we need to defrag
-    if (n_stream == 1) {
-        // note : for now do not consider defrag for n_stream > 1
-        const auto & cells = v_cells[seq_to_stream[0]];
+    // with multiple streams, only the most fragmented stream is defragmented by an update, so that the number of moves
+    // per update remains bounded - the other streams are defragmented by the following updates
+    {
+        const auto thold = lctx->get_cparams().defrag_thold;
 
-        bool do_defrag = optimize;
+        int32_t strm      = -1;
+        float   frag_best = 0.0f;
 
-        const auto thold = lctx->get_cparams().defrag_thold;
+        for (uint32_t s = 0; s < n_stream; ++s) {
+            const auto & cells = v_cells[s];
+
+            // the cells of a ring are addressed by position, moving them would only defeat the ring placement
+            if (ring) {
+                continue;
+            }
 
-        if (!do_defrag && thold > 0.0f) {
             const auto n_kv = cells.used_max_p1();
+            if (n_kv == 0) {
+                continue;
+            }
+
+            float fragmentation = 0.0f;
 
-            // - do not defrag small contexts (i.e. < 2048 tokens)
-            // - count the padding towards the number of used tokens
-            const float fragmentation = n_kv >= 2048 ? std::max(0.0f, 1.0f - (float(cells.get_used() + n_pad)/n_kv)) : 0.0f;
+            if (optimize) {
+                fragmentation = 1.0f - float(cells.get_used())/n_kv;
+            } else if (thold > 0.0f) {
+                // - do not defrag small contexts (i.e. < 2048 tokens)
+                // - count the padding towards the number of used tokens
+                fragmentation = n_kv >= 2048 ? std::max(0.0f, 1.0f - (float(cells.get_used() + n_pad)/n_kv)) : 0.0f;
 
-            if (fragmentation > thold) {
-                LLAMA_LOG_DEBUG("%s: fragmentation: %.2f - requesting defrag\n", __func__, fragmentation);
+                if (fragmentation <= thold) {
+                    continue;
+                }
+            }
 
-                do_defrag = true;
+            if (fragmentation > frag_best) {
+                strm      = s;
+                frag_best = fragmentation;
             }
         }
 
-        if (do_defrag) {
-            dinfo = defrag_prepare(lctx->graph_max_nodes());
+        if (strm >= 0) {
+            LLAMA_LOG_DEBUG("%s: stream %d, fragmentation: %.2f - requesting defrag\n", __func__, strm, frag_best);
+
+            dinfo = defrag_prepare(strm, lctx->graph_max_nodes());
         }
     }
 
@@ -558,6 +656,14 @@ llama_kv_cache_unified::slot_info_vec_t llama_kv_cache_unified::prepare(const st
     // remember the old state of the cells so we can restore it in the end
     std::vector<state_t> states;
 
+    // the cells are restored exactly, unless a ubatch overwrites cells (SWA) and purges the older positions
+    std::vector<uint64_t> versions(n_stream);
+    std::vector<uint32_t> n_used  (n_stream);
+    for (uint32_t s = 0; s < n_stream; ++s) {
+        versions[s] = v_cells[s].get_version();
+        n_used  [s] = v_cells[s].get_used();
+    }
+
     bool success = true;
 
     for (const auto & ubatch : ubatches) {
@@ -606,6 +712,18 @@ llama_kv_cache_unified::slot_info_vec_t llama_kv_cache_unified::prepare(const st
         }
     }
 
+    // the runs of the KQ mask remain valid, unless cells outside of the slots have been purged
+    bool purged = false;
+    for (uint32_t s = 0; s < n_stream; ++s) {
+        purged = purged || v_cells[s].get_used() != n_used[s];
+    }
+
+    if (!purged) {
+        for (uint32_t s = 0; s < n_stream; ++s) {
+            v_cells[s].set_version(versions[s]);
+        }
+    }
+
     if (!success) {
         return {};
     }
@@ -679,16 +797,19 @@ bool llama_kv_cache_unified::update(llama_context * lctx, bool do_shift, const d
         for (uint32_t s = 0; s < n_stream; ++s) {
             auto & cells = v_cells[s];
 
+            if (cells.get_has_shift() && hparams.rope_type != LLAMA_ROPE_TYPE_NONE) {
+                v_n_shift[s]++;
+            }
+
             cells.reset_shift();
         }
     }
 
     if (!dinfo.empty()) {
-        LLAMA_LOG_DEBUG("%s: defragmenting KV cache\n", __func__);
+        LLAMA_LOG_DEBUG("%s: defragmenting KV cache, stream %u\n", __func__, dinfo.strm);
 
-        // note: for now do not consider defrag for n_stream > 1
-        auto & cells = v_cells[seq_to_stream[0]];
-        auto & head  = v_heads[seq_to_stream[0]];
+        auto & cells = v_cells[dinfo.strm];
+        auto & head  = v_heads[dinfo.strm];
 
         // apply moves:
         {
@@ -702,8 +823,12 @@ bool llama_kv_cache_unified::update(llama_context * lctx, bool do_shift, const d
                 }
 
                 cells.mv(i, dinfo.ids[i]);
+
+                v_n_moved[dinfo.strm]++;
             }
 
+            v_n_defrag[dinfo.strm]++;
+
             // reset the head so we can find the first free slot during the next ubatch
             head = 0;
         }
@@ -830,6 +955,12 @@ llama_kv_cache_unified::slot_info llama_kv_cache_unified::find_slot(const llama_
         res.strm[s] = seq_to_stream[seq_id];
         res.idxs[s].reserve(n_tokens);
 
+        if (ring && find_slot_ring(ubatch, s*n_tokens, n_tokens, seq_to_stream[seq_id], cont, res.idxs[s])) {
+            continue;
+        }
+
+        res.idxs[s].clear();
+
         const auto & cells = v_cells[seq_to_stream[seq_id]];
 
         uint32_t head_cur = v_heads[seq_to_stream[seq_id]];
@@ -845,6 +976,43 @@ llama_kv_cache_unified::slot_info llama_kv_cache_unified::find_slot(const llama_
             return { };
         }
 
+        // without SWA only the empty cells can be used, they are found with the index of the cells instead of testing
+        // the cells one by one. the cells are the same as with the linear search below
+        if (n_swa == 0) {
+            auto & idxs = res.idxs[s];
+
+            if (cont) {
+                uint32_t i = cells.find_empty_run(head_cur, n_tokens);
+                if (i == cells.size()) {
+                    i = cells.find_empty_run(0, n_tokens);
+                }
+
+                if (i == cells.size()) {
+                    return { };
+                }
+
+                for (uint32_t k = 0; k < n_tokens; ++k) {
+                    idxs.push_back(i + k);
+                }
+            } else {
+                if (cells.size() - cells.get_used() < n_tokens) {
+                    return { };
+                }
+
+                while (idxs.size() < n_tokens) {
+                    head_cur = cells.find_empty(head_cur);
+                    if (head_cur == cells.size()) {
+                        head_cur = 0;
+                        continue;
+                    }
+
+                    idxs.push_back(head_cur++);
+                }
+            }
+
+            continue;
+        }
+
         uint32_t n_tested = 0;
 
         // for continuous slots, we test that all tokens in the ubatch fit, starting from the current head
@@ -928,13 +1096,59 @@ llama_kv_cache_unified::slot_info llama_kv_cache_unified::find_slot(const llama_
     return res;
 }
 
+uint32_t llama_kv_cache_unified::ring_idx(llama_pos p, uint32_t strm) const {
+    if (p < (llama_pos) n_sink) {
+        return p;
+    }
+
+    return n_sink + (p - n_sink + v_ring_off[strm]) % (v_cells[strm].size() - n_sink);
+}
+
+bool llama_kv_cache_unified::find_slot_ring(const llama_ubatch & ubatch, uint32_t i0, uint32_t n_tokens, uint32_t strm, bool cont, slot_info::idx_vec_t & idxs) const {
+    const auto & cells = v_cells[strm];
+
+    const uint32_t size = cells.size();
+
+    const llama_seq_id seq_id = ubatch.seq_id[i0][0];
+    const llama_pos    p0     = ubatch.pos[i0];
+
+    // the cells of a continuous slot cannot wrap around
+    if (p0 < 0 || n_tokens > size - n_sink || (cont && ring_idx(p0 + n_tokens - 1, strm) != ring_idx(p0, strm) + n_tokens - 1)) {
+        return false;
+    }
+
+    for (uint32_t i = 0; i < n_tokens; ++i) {
+        const uint32_t j = i0 + i;
+
+        if (ubatch.n_seq_id[j] != 1 || ubatch.seq_id[j][0] != seq_id || ubatch.pos[j] != p0 + (llama_pos) i) {
+            return false;
+        }
+
+        const uint32_t idx = ring_idx(p0 + i, strm);
+
+        if (cells.is_empty(idx)) {
+            idxs.push_back(idx);
+            continue;
+        }
+
+        // the overwritten cell must not be visible by any token of the ubatch
+        // with attention sinks, the window is rolling: the oldest cell of the ring is dropped to make room for the new token
+        const llama_pos pos = cells.pos_get(idx);
+
+        if (cells.seq_count(idx) != 1 || !cells.seq_has(idx, seq_id) || !(n_sink > 0 ? pos < p0 : is_masked_swa(pos, p0))) {
+            return false;
+        }
+
+        idxs.push_back(idx);
+    }
+
+    return true;
+}
+
 void llama_kv_cache_unified::apply_ubatch(const slot_info & sinfo, const llama_ubatch & ubatch) {
     // keep track of the max sequence position that we would overwrite with this ubatch
     // for non-SWA cache, this would be always empty
-    llama_seq_id seq_pos_max_rm[LLAMA_MAX_SEQ];
-    for (uint32_t s = 0; s < LLAMA_MAX_SEQ; ++s) {
-        seq_pos_max_rm[s] = -1;
-    }
+    std::map<llama_seq_id, llama_pos> seq_pos_max_rm;
 
     assert(ubatch.n_tokens == sinfo.n_stream()*sinfo.size());
 
@@ -952,7 +1166,8 @@ void llama_kv_cache_unified::apply_ubatch(const slot_info & sinfo, const llama_u
                 const llama_seq_id seq_id = cells.seq_get(idx);
                 const llama_pos    pos    = cells.pos_get(idx);
 
-                seq_pos_max_rm[seq_id] = std::max(seq_pos_max_rm[seq_id], pos);
+                auto it = seq_pos_max_rm.emplace(seq_id, pos).first;
+                it->second = std::max(it->second, pos);
 
                 cells.rm(idx);
             }
@@ -968,20 +1183,19 @@ void llama_kv_cache_unified::apply_ubatch(const slot_info & sinfo, const llama_u
     // note: we want to preserve the invariant that all positions between [pos_min, pos_max] for each sequence
     //       will be present in the cache. so we have to purge any position which is less than those we would overwrite
     //       ref: https://github.com/ggml-org/llama.cpp/pull/13746#issuecomment-2916057092
-    for (uint32_t s = 0; s < LLAMA_MAX_SEQ; ++s) {
-        if (seq_pos_max_rm[s] == -1) {
-            continue;
-        }
-
-        GGML_ASSERT(s < seq_to_stream.size());
+    for (const auto & [s, pos_max_rm] : seq_pos_max_rm) {
+        GGML_ASSERT((size_t) s < seq_to_stream.size());
 
         auto & cells = v_cells[seq_to_stream[s]];
 
-        if (cells.seq_pos_min(s) <= seq_pos_max_rm[s]) {
+        // the attention sinks are never purged
+        const llama_pos pos_min = std::max(cells.seq_pos_min(s), (llama_pos) n_sink);
+
+        if (pos_min <= pos_max_rm) {
             LLAMA_LOG_DEBUG("%s: purging positions [%d, %d] of sequence %d from KV cache\n",
-                    __func__, cells.seq_pos_min(s), seq_pos_max_rm[s], s);
+                    __func__, pos_min, pos_max_rm, s);
 
-            seq_rm(s, cells.seq_pos_min(s), seq_pos_max_rm[s] + 1);
+            seq_rm(s, pos_min, pos_max_rm + 1);
         }
     }
 
@@ -993,10 +1207,168 @@ void llama_kv_cache_unified::apply_ubatch(const slot_info & sinfo, const llama_u
     }
 }
 
+void llama_kv_cache_unified::commit_ubatch(const slot_info & sinfo, const llama_ubatch & ubatch) {
+    // the runs can be extended if they are up to date and the ubatch is placed in empty cells
+    // in a ring, the overwritten cells are the oldest ones of the sequence and are removed from the front of its runs
+    std::vector<bool>     extend(sinfo.n_stream());
+    std::vector<uint32_t> n_used(sinfo.n_stream());
+
+    for (uint32_t s = 0; s < sinfo.n_stream(); ++s) {
+        const auto & cells = v_cells[sinfo.strm[s]];
+
+        n_used[s] = cells.get_used();
+
+        bool ok = mask_runs.is_valid(sinfo.strm[s], cells.get_version());
+        for (uint32_t ii = 0; ii < sinfo.size() && ok; ++ii) {
+            const auto idx = sinfo.idxs[s][ii];
+
+            if (cells.is_empty(idx)) {
+                n_used[s]++;
+                continue;
+            }
+
+            ok = ring && cells.seq_count(idx) == 1 && mask_runs.pop_front(cells.seq_get(idx), idx, cells, n_sink);
+        }
+
+        extend[s] = ok;
+    }
+
+    apply_ubatch(sinfo, ubatch);
+
+    for (uint32_t s = 0; s < sinfo.n_stream(); ++s) {
+        // the older positions of the overwritten sequences have been purged from other cells
+        if (!extend[s] || v_cells[sinfo.strm[s]].get_used() != n_used[s]) {
+            continue;
+        }
+
+        for (uint32_t ii = 0; ii < sinfo.size(); ++ii) {
+            const uint32_t i = s*sinfo.size() + ii;
+
+            for (int32_t k = 0; k < ubatch.n_seq_id[i]; ++k) {
+                mask_runs.add(ubatch.seq_id[i][k], sinfo.idxs[s][ii], ubatch.pos[i]);
+            }
+        }
+
+        mask_runs.set_valid(sinfo.strm[s], v_cells[sinfo.strm[s]].get_version());
+    }
+}
+
+void llama_kv_cache_unified::evict(const llama_batch_allocr & balloc) {
+    if (n_budget == 0) {
+        return;
+    }
+
+    std::vector<uint32_t> idxs;
+
+    for (uint32_t s = 0; s < n_seq_max; ++s) {
+        const llama_pos p0 = balloc.seq_pos_min(s);
+        if (p0 < 0) {
+            continue;
+        }
+
+        const llama_pos p1 = balloc.seq_pos_max(s);
+
+        const uint32_t strm = seq_to_stream[s];
+
+        auto & cells = v_cells[strm];
+
+        const uint32_t n_cur = cells.seq_n_cells(s);
+        const uint32_t n_new = p1 - p0 + 1;
+
+        if (n_cur + n_new <= n_budget) {
+            continue;
+        }
+
+        // the positions in [p1 - n_recent + 1, p1] are kept
+        const llama_pos p_recent = p1 - (llama_pos) n_recent + 1;
+
+        idxs.clear();
+
+        for (uint32_t i = 0; i < cells.used_max_p1(); ++i) {
+            if (cells.is_empty(i) || !cells.seq_has(i, s) || cells.pos_get(i) >= p_recent) {
+                continue;
+            }
+
+            idxs.push_back(i);
+        }
+
+        const uint32_t n_evict = std::min<uint32_t>(n_cur + n_new - n_budget, idxs.size());
+        if (n_evict == 0) {
+            continue;
+        }
+
+        // the least attended cells first, the oldest first among the cells with the same score
+        std::nth_element(idxs.begin(), idxs.begin() + n_evict - 1, idxs.end(), [&](uint32_t a, uint32_t b) {
+            const float sa = cells.score_get(a);
+            const float sb = cells.score_get(b);
+
+            return sa < sb || (sa == sb && cells.pos_get(a) < cells.pos_get(b));
+        });
+
+        auto & head = v_heads[strm];
+
+        for (uint32_t k = 0; k < n_evict; ++k) {
+            const uint32_t i = idxs[k];
+
+            cells.seq_rm(i, s);
+
+            head = std::min(head, i);
+        }
+
+        v_n_evicted[strm] += n_evict;
+
+        LLAMA_LOG_DEBUG("%s: seq %d: evicted %u of %u cells to keep %u + %u new tokens within the budget of %u\n",
+                __func__, s, n_evict, n_cur, n_cur - n_evict, n_new, n_budget);
+    }
+}
+
+void llama_kv_cache_unified::add_kq_score(const float * data, uint32_t n_kv, const slot_info & sinfo) {
+    for (uint32_t s = 0; s < sinfo.n_stream(); ++s) {
+        auto & cells = v_cells[sinfo.s0 + s];
+
+        const float * row = data + s*n_kv;
+
+        for (uint32_t i = 0; i < n_kv; ++i) {
+            if (!cells.is_empty(i)) {
+                cells.score_add(i, row[i]);
+            }
+        }
+    }
+}
+
 bool llama_kv_cache_unified::get_can_shift() const {
     return true;
 }
 
+std::vector<llama_memory_stream_stats> llama_kv_cache_unified::get_stream_stats() const {
+    std::vector<llama_memory_stream_stats> res(n_stream);
+
+    for (uint32_t s = 0; s < n_stream; ++s) {
+        const auto & cells = v_cells[s];
+
+        auto & st = res[s];
+
+        st.n_cells = cells.size();
+        st.n_used  = cells.get_used();
+        st.n_kv    = cells.used_max_p1();
+        st.n_holes = 0;
+
+        for (uint32_t i = 0; i < st.n_kv; ++i) {
+            if (cells.is_empty(i) && (i == 0 || !cells.is_empty(i - 1))) {
+                st.n_holes++;
+            }
+        }
+
+        st.frag     = st.n_kv > 0 ? 1.0f - float(st.n_used)/st.n_kv : 0.0f;
+        st.n_defrag  = v_n_defrag[s];
+        st.n_moved   = v_n_moved[s];
+        st.n_evicted = v_n_evicted[s];
+        st.n_shift   = v_n_shift[s];
+    }
+
+    return res;
+}
+
 uint32_t llama_kv_cache_unified::get_size() const {
     const auto & cells = v_cells[seq_to_stream[0]];
 
@@ -1017,6 +1389,22 @@ bool llama_kv_cache_unified::get_has_shift() const {
     return result;
 }
 
+bool llama_kv_cache_unified::get_needs_score(const llama_ubatch * ubatch) const {
+    if (n_budget == 0 || ubatch == nullptr) {
+        return n_budget > 0;
+    }
+
+    for (uint32_t i = 0; i < ubatch->n_seqs_unq; ++i) {
+        const llama_seq_id s = ubatch->seq_id_unq[i];
+
+        if (v_cells[seq_to_stream[s]].seq_n_cells(s) + n_recent > n_budget) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
 uint32_t llama_kv_cache_unified::get_n_kv() const {
     uint32_t result = 0;
 
@@ -1266,7 +1654,7 @@ void llama_kv_cache_unified::set_input_k_shift(ggml_tensor * dst) const {
     }
 }
 
-void llama_kv_cache_unified::set_input_kq_mask(ggml_tensor * dst, const llama_ubatch * ubatch, bool causal_attn) const {
+void llama_kv_cache_unified::set_input_kq_mask(ggml_tensor * dst, const llama_ubatch * ubatch, bool causal_attn, int n_threads) const {
     const uint32_t n_tokens = ubatch->n_tokens;
 
     GGML_ASSERT(ggml_backend_buffer_is_host(dst->buffer));
@@ -1281,7 +1669,16 @@ void llama_kv_cache_unified::set_input_kq_mask(ggml_tensor * dst, const llama_ub
     const int64_t n_tps     = n_tokens/n_stream;
     const int64_t n_tps_pad = GGML_PAD(n_tps, GGML_KQ_MASK_PAD);
 
-    std::fill(data, data + ggml_nelements(dst), -INFINITY);
+    // bring the runs of cells of the streams of the ubatch up to date
+    for (uint32_t k = 0; k < ubatch->n_seqs_unq; ++k) {
+        const uint32_t strm = seq_to_stream[ubatch->seq_id_unq[k]];
+
+        if (!mask_runs.is_valid(strm, v_cells[strm].get_version())) {
+            build_kq_mask_runs(strm);
+
+            mask_runs.set_valid(strm, v_cells[strm].get_version());
+        }
+    }
 
     // Use only the previous KV cells of the correct sequence for each token of the ubatch.
     // It's assumed that if a token in the batch has multiple sequences, they are equivalent.
@@ -1295,46 +1692,61 @@ void llama_kv_cache_unified::set_input_kq_mask(ggml_tensor * dst, const llama_ub
     //      xxxxx-----
     //      xxxxx-----
     // To visualize the mask, see https://github.com/ggml-org/llama.cpp/pull/12615
-    // TODO: optimize this section
-    for (uint32_t h = 0; h < 1; ++h) {
-        for (uint32_t s = 0; s < n_stream; ++s) {
-            for (uint32_t ii = 0; ii < n_tps; ++ii) {
-                const uint32_t i = s*n_tps + ii;
+    //
+    // the visible positions of a token form the interval [swa_pos_min(p1), p1] (or [swa_pos_min(p1), inf) without
+    // causal attention), so each row is filled from the runs of cells of the sequence of the token
+    // the rows only read the cells and the runs, so the rows of a large mask are filled in parallel
+    llama_kv_mask_fill_rows(n_stream*n_tps_pad, n_kv, n_threads, [&](int64_t r) {
+        const int64_t s  = r / n_tps_pad;
+        const int64_t ii = r % n_tps_pad;
+
+        float * row = data + n_kv*r;
+
+        // padding
+        if (ii >= n_tps) {
+            std::fill(row, row + n_kv, -INFINITY);
+            return;
+        }
 
-                const llama_seq_id seq_id = ubatch->seq_id[i][0];
+        const uint32_t i = s*n_tps + ii;
 
-                const auto & cells = v_cells[seq_to_stream[seq_id]];
+        const llama_seq_id seq_id = ubatch->seq_id[i][0];
 
-                const llama_pos p1 = ubatch->pos[i];
+        const llama_pos p1 = ubatch->pos[i];
 
-                const uint64_t idst = n_kv*(h*n_stream*n_tps_pad + s*n_tps_pad + ii);
+        const llama_pos p_min = swa_pos_min(p1);
+        const llama_pos p_max = causal_attn ? p1 : std::numeric_limits<llama_pos>::max();
 
-                for (uint32_t j = 0; j < n_kv; ++j) {
-                    if (cells.is_empty(j)) {
-                        continue;
-                    }
+        mask_runs.fill_row(row, n_kv, seq_id, p_min, p_max, hparams.use_alibi, p1, v_cells[seq_to_stream[seq_id]]);
+    });
+}
 
-                    // mask the token if not the same sequence
-                    if (!cells.seq_has(j, seq_id)) {
-                        continue;
-                    }
+void llama_kv_cache_unified::build_kq_mask_runs(uint32_t strm) const {
+    for (uint32_t s = 0; s < n_seq_max; ++s) {
+        if (seq_to_stream[s] == strm) {
+            mask_runs.clear(s);
+        }
+    }
 
-                    const llama_pos p0 = cells.pos_get(j);
+    const auto & cells = v_cells[strm];
 
-                    // mask future tokens
-                    if (causal_attn && p0 > p1) {
-                        continue;
-                    }
+    // a ring is scanned from its oldest cell, the one after the last placed token, so that the cells overwritten by
+    // the next ubatches are at the front of the runs. the attention sink cells come first, they are never overwritten
+    const uint32_t n_fixed = ring ? n_sink : 0;
+    const uint32_t n_ring  = cells.size() - n_fixed;
 
-                    // apply SWA if any
-                    if (is_masked_swa(p0, p1)) {
-                        continue;
-                    }
+    const uint32_t i0 = ring && v_heads[strm] >= n_fixed ? (v_heads[strm] - n_fixed) % n_ring : 0;
 
-                    data[idst + j] = hparams.use_alibi ? -std::abs(p0 - p1) : 0.0f;
-                }
-            }
+    for (uint32_t k = 0; k < cells.size(); ++k) {
+        const uint32_t i = k < n_fixed ? k : n_fixed + (i0 + k - n_fixed) % n_ring;
+
+        if (cells.is_empty(i)) {
+            continue;
         }
+
+        cells.seq_for_each(i, [&](llama_seq_id seq_id) {
+            mask_runs.add(seq_id, i, cells.pos_get(i));
+        });
     }
 }
 
@@ -1512,9 +1924,7 @@ ggml_cgraph * llama_kv_cache_unified::build_graph_defrag(
     auto * ctx = res->get_ctx();
     auto * gf  = res->get_gf();
 
-    GGML_ASSERT(n_stream == 1 && "n_stream > 1 does not support defrag");
-
-    const auto & cells = v_cells[0];
+    const auto & cells = v_cells[dinfo.strm];
 
     const auto & ids = dinfo.ids;
 
@@ -1610,15 +2020,19 @@ ggml_cgraph * llama_kv_cache_unified::build_graph_defrag(
             const int64_t n_embd_k_gqa = hparams.n_embd_k_gqa(il);
             const int64_t n_embd_v_gqa = hparams.n_embd_v_gqa(il);
 
+            // offsets of the stream
+            const size_t ok = dinfo.strm*layer.k->nb[2];
+            const size_t ov = dinfo.strm*layer.v->nb[2];
+
             ggml_tensor * view_k_src = ggml_view_2d(ctx, layer.k,
                     n_embd_k_gqa, nm,
                     ggml_row_size(layer.k->type, n_embd_k_gqa),
-                    ggml_row_size(layer.k->type, n_embd_k_gqa*i));
+                    ok + ggml_row_size(layer.k->type, n_embd_k_gqa*i));
 
             ggml_tensor * view_k_dst = ggml_view_2d(ctx, layer.k,
                     n_embd_k_gqa, nm,
                     ggml_row_size(layer.k->type, n_embd_k_gqa),
-                    ggml_row_size(layer.k->type, n_embd_k_gqa*id));
+                    ok + ggml_row_size(layer.k->type, n_embd_k_gqa*id));
 
             ggml_tensor * view_v_src;
             ggml_tensor * view_v_dst;
@@ -1628,22 +2042,22 @@ ggml_cgraph * llama_kv_cache_unified::build_graph_defrag(
                 view_v_src = ggml_view_2d(ctx, layer.v,
                         n_embd_v_gqa, nm,
                         ggml_row_size(layer.v->type, n_embd_v_gqa),
-                        ggml_row_size(layer.v->type, n_embd_v_gqa*i));
+                        ov + ggml_row_size(layer.v->type, n_embd_v_gqa*i));
 
                 view_v_dst = ggml_view_2d(ctx, layer.v,
                         n_embd_v_gqa, nm,
                         ggml_row_size(layer.v->type, n_embd_v_gqa),
-                        ggml_row_size(layer.v->type, n_embd_v_gqa*id));
+                        ov + ggml_row_size(layer.v->type, n_embd_v_gqa*id));
             } else {
                 view_v_src = ggml_view_2d(ctx, layer.v,
                         nm, n_embd_v_gqa,
                         ggml_row_size(layer.v->type, cells.size()),
-                        ggml_row_size(layer.v->type, i));
+                        ov + ggml_row_size(layer.v->type, i));
 
                 view_v_dst = ggml_view_2d(ctx, layer.v,
                         nm, n_embd_v_gqa,
                         ggml_row_size(layer.v->type, cells.size()),
-                        ggml_row_size(layer.v->type, id));
+                        ov + ggml_row_size(layer.v->type, id));
             }
 
             ggml_build_forward_expand(gf, ggml_cpy(ctx, view_k_src, view_k_dst));
@@ -1659,10 +2073,8 @@ ggml_cgraph * llama_kv_cache_unified::build_graph_defrag(
     return gf;
 }
 
-llama_kv_cache_unified::defrag_info llama_kv_cache_unified::defrag_prepare(int32_t n_max_nodes) const {
-    GGML_ASSERT(n_stream == 1 && "n_stream > 1 does not support defrag");
-
-    const auto & cells = v_cells[0];
+llama_kv_cache_unified::defrag_info llama_kv_cache_unified::defrag_prepare(uint32_t strm, int32_t n_max_nodes) const {
+    const auto & cells = v_cells[strm];
 
     const uint32_t n_layer = layers.size();
 
@@ -1685,6 +2097,8 @@ llama_kv_cache_unified::defrag_info llama_kv_cache_unified::defrag_prepare(int32
 
     // determine which KV cells to move where
     defrag_info res;
+    res.strm = strm;
+
     auto & ids = res.ids;
 
     ids.resize(n_kv, n_kv);
@@ -1808,7 +2222,37 @@ bool llama_kv_cache_unified::is_masked_swa(llama_pos p0, llama_pos p1) const {
     return false;
 }
 
+llama_pos llama_kv_cache_unified::swa_pos_min(llama_pos p1) const {
+    switch (swa_type) {
+        case LLAMA_SWA_TYPE_NONE:
+            {
+            } break;
+        case LLAMA_SWA_TYPE_STANDARD:
+            {
+                return std::max(0, p1 - (int32_t) n_swa + 1);
+            }
+        case LLAMA_SWA_TYPE_CHUNKED:
+            {
+                return (p1 / n_swa) * n_swa;
+            }
+    }
+
+    return 0;
+}
+
 void llama_kv_cache_unified::state_write(llama_io_write_i & io, llama_seq_id seq_id) const {
+    state_write_range(io, seq_id, -1, -1);
+}
+
+void llama_kv_cache_unified::state_write_range(llama_io_write_i & io, llama_seq_id seq_id, llama_pos p0, llama_pos p1) const {
+    if (p0 < 0) {
+        p0 = 0;
+    }
+
+    if (p1 < 0) {
+        p1 = std::numeric_limits<llama_pos>::max();
+    }
+
     io.write(&n_stream, sizeof(n_stream));
 
     for (uint32_t s = 0; s < n_stream; ++s) {
@@ -1818,12 +2262,12 @@ void llama_kv_cache_unified::state_write(llama_io_write_i & io, llama_seq_id seq
 
         const auto & cells = v_cells[s];
 
-        // Count the number of cells with the specified seq_id
+        // Count the number of cells with the specified seq_id and position range
         // Find all the ranges of cells with this seq id (or all, when -1)
         uint32_t cell_range_begin = cells.size();
 
         for (uint32_t i = 0; i < cells.size(); ++i) {
-            if (!cells.is_empty(i) && (seq_id == -1 || cells.seq_has(i, seq_id))) {
+            if (!cells.is_empty(i) && (seq_id == -1 || cells.seq_has(i, seq_id)) && cells.pos_in(i, p0, p1)) {
                 ++cell_count;
                 if (cell_range_begin == cells.size()) {
                     cell_range_begin = i;
@@ -1860,6 +2304,16 @@ void llama_kv_cache_unified::state_write(llama_io_write_i & io, llama_seq_id seq
 }
 
 void llama_kv_cache_unified::state_read(llama_io_read_i & io, llama_seq_id seq_id) {
+    state_read_impl(io, seq_id, false);
+}
+
+void llama_kv_cache_unified::state_read_append(llama_io_read_i & io, llama_seq_id seq_id) {
+    GGML_ASSERT(seq_id >= 0);
+
+    state_read_impl(io, seq_id, true);
+}
+
+void llama_kv_cache_unified::state_read_impl(llama_io_read_i & io, llama_seq_id seq_id, bool append) {
     GGML_ASSERT(seq_id == -1 || (seq_id >= 0 && (size_t) seq_id < seq_to_stream.size()));
 
     uint32_t n_stream_cur;
@@ -1879,8 +2333,8 @@ void llama_kv_cache_unified::state_read(llama_io_read_i & io, llama_seq_id seq_i
         const uint32_t strm = seq_id == -1 ? s : seq_to_stream[seq_id];
 
         bool res = true;
-        res = res && state_read_meta(io, strm, cell_count, seq_id);
-        res = res && state_read_data(io, strm, cell_count);
+        res = res && state_read_meta(io, strm, cell_count, seq_id, append);
+        res = res && state_read_data(io, { strm, { { v_heads[strm], v_heads[strm] + cell_count } } });
 
         if (!res) {
             if (seq_id == -1) {
@@ -1900,12 +2354,12 @@ void llama_kv_cache_unified::state_write_meta(llama_io_write_i & io, const cell_
         for (uint32_t i = range.first; i < range.second; ++i) {
             std::vector<llama_seq_id> seq_ids;
 
-            for (llama_seq_id cur = 0; cur < (int) n_seq_max; ++cur) {
-                if (cur == seq_id || seq_id == -1) {
-                    if (cells.seq_has(i, cur)) {
-                        seq_ids.push_back(cur);
-                    }
-                }
+            if (seq_id == -1) {
+                cells.seq_for_each(i, [&](llama_seq_id cur) {
+                    seq_ids.push_back(cur);
+                });
+            } else if (cells.seq_has(i, seq_id)) {
+                seq_ids.push_back(seq_id);
             }
 
             const llama_pos pos     = cells.pos_get(i);
@@ -2016,14 +2470,12 @@ void llama_kv_cache_unified::state_write_data(llama_io_write_i & io, const cell_
     }
 }
 
-bool llama_kv_cache_unified::state_read_meta(llama_io_read_i & io, uint32_t strm, uint32_t cell_count, llama_seq_id dest_seq_id) {
+bool llama_kv_cache_unified::state_read_meta(llama_io_read_i & io, uint32_t strm, uint32_t cell_count, llama_seq_id dest_seq_id, bool append) {
     auto & cells = v_cells[strm];
     auto & head  = v_heads[strm];
 
     if (dest_seq_id != -1) {
         // single sequence
-        seq_rm(dest_seq_id, -1, -1);
-
         llama_batch_allocr balloc(hparams.n_pos_per_embd());
 
         llama_ubatch ubatch = balloc.ubatch_reserve(cell_count, 1);
@@ -2053,6 +2505,13 @@ bool llama_kv_cache_unified::state_read_meta(llama_io_read_i & io, uint32_t strm
             ubatch.seq_id[i]   = &dest_seq_id;
         }
 
+        if (append) {
+            // replace the cells at the same or later positions
+            seq_rm(dest_seq_id, *std::min_element(ubatch.pos, ubatch.pos + cell_count), -1);
+        } else {
+            seq_rm(dest_seq_id, -1, -1);
+        }
+
         const auto sinfo = find_slot(ubatch, true);
         if (sinfo.empty()) {
             LLAMA_LOG_ERROR("%s: failed to find available cells in kv cache\n", __func__);
@@ -2113,9 +2572,41 @@ bool llama_kv_cache_unified::state_read_meta(llama_io_read_i & io, uint32_t strm
     return true;
 }
 
-bool llama_kv_cache_unified::state_read_data(llama_io_read_i & io, uint32_t strm, uint32_t cell_count) {
+// convert n_rows rows of n_per_row elements from type_src to type_dst, through F32
+// used to restore a state that was saved with other types of the KV cache
+static bool llama_kv_convert_rows(
+        ggml_type type_src, ggml_type type_dst, const void * src, std::vector<uint8_t> & dst, int64_t n_rows, int64_t n_per_row) {
+    const auto * traits_src = ggml_get_type_traits(type_src);
+
+    if ((type_src != GGML_TYPE_F32 && traits_src->to_float == nullptr) || ggml_quantize_requires_imatrix(type_dst) ||
+        n_per_row % ggml_blck_size(type_src) != 0 || n_per_row % ggml_blck_size(type_dst) != 0) {
+        return false;
+    }
+
+    std::vector<float> tmp(n_rows*n_per_row);
+
+    if (type_src == GGML_TYPE_F32) {
+        memcpy(tmp.data(), src, tmp.size()*sizeof(float));
+    } else {
+        traits_src->to_float(src, tmp.data(), tmp.size());
+    }
+
+    dst.resize(ggml_row_size(type_dst, n_per_row)*n_rows);
+
+    ggml_quantize_chunk(type_dst, tmp.data(), dst.data(), 0, n_rows, n_per_row, nullptr);
+
+    return true;
+}
+
+bool llama_kv_cache_unified::state_read_data(llama_io_read_i & io, const cell_ranges_t & cr) {
+    const uint32_t strm = cr.strm;
+
     auto & cells = v_cells[strm];
-    auto & head  = v_heads[strm];
+
+    uint32_t cell_count = 0;
+    for (const auto & range : cr.data) {
+        cell_count += range.second - range.first;
+    }
 
     uint32_t v_trans;
     uint32_t n_layer;
@@ -2138,6 +2629,9 @@ bool llama_kv_cache_unified::state_read_data(llama_io_read_i & io, uint32_t strm
         return false;
     }
 
+    // the rows that are converted to the types of the layers
+    std::vector<uint8_t> buf_conv;
+
     // For each layer, read the keys for each cell, one row is one cell, read as one contiguous block
     for (const auto & layer : layers) {
         const uint32_t il = layer.il;
@@ -2150,23 +2644,35 @@ bool llama_kv_cache_unified::state_read_data(llama_io_read_i & io, uint32_t strm
         int32_t k_type_i_ref;
         io.read_to(&k_type_i_ref, sizeof(k_type_i_ref));
         const int32_t k_type_i = (int32_t) k->type;
-        if (k_type_i != k_type_i_ref) {
-            LLAMA_LOG_ERROR("%s: mismatched key type (%d != %d, layer %d)\n", __func__, k_type_i, k_type_i_ref, il);
+        if (k_type_i_ref < 0 || k_type_i_ref >= GGML_TYPE_COUNT) {
+            LLAMA_LOG_ERROR("%s: invalid key type (%d, layer %d)\n", __func__, k_type_i_ref, il);
             return false;
         }
 
         // Read row size of key
         uint64_t k_size_row_ref;
         io.read_to(&k_size_row_ref, sizeof(k_size_row_ref));
-        const size_t k_size_row = ggml_row_size(k->type, n_embd_k_gqa);
+        const size_t k_size_row = ggml_row_size((ggml_type) k_type_i_ref, n_embd_k_gqa);
         if (k_size_row != k_size_row_ref) {
             LLAMA_LOG_ERROR("%s: mismatched key row size (%zu != %zu, layer %d)\n", __func__, k_size_row, (size_t) k_size_row_ref, il);
             return false;
         }
 
-        if (cell_count) {
-            // Read and set the keys for the whole cell range
-            ggml_backend_tensor_set(k, io.read(cell_count * k_size_row), head * k_size_row, cell_count * k_size_row);
+        // Read and set the keys for each cell range, the keys saved with another type are converted
+        for (const auto & range : cr.data) {
+            const size_t range_size = range.second - range.first;
+
+            if (k_type_i == k_type_i_ref) {
+                ggml_backend_tensor_set(k, io.read(range_size * k_size_row), range.first * k_size_row, range_size * k_size_row);
+                continue;
+            }
+
+            if (!llama_kv_convert_rows((ggml_type) k_type_i_ref, k->type, io.read(range_size * k_size_row), buf_conv, range_size, n_embd_k_gqa)) {
+                LLAMA_LOG_ERROR("%s: mismatched key type (%d != %d, layer %d)\n", __func__, k_type_i, k_type_i_ref, il);
+                return false;
+            }
+
+            ggml_backend_tensor_set(k, buf_conv.data(), range.first * ggml_row_size(k->type, n_embd_k_gqa), buf_conv.size());
         }
     }
 
@@ -2182,23 +2688,35 @@ bool llama_kv_cache_unified::state_read_data(llama_io_read_i & io, uint32_t strm
             int32_t v_type_i_ref;
             io.read_to(&v_type_i_ref, sizeof(v_type_i_ref));
             const int32_t v_type_i = (int32_t) v->type;
-            if (v_type_i != v_type_i_ref) {
-                LLAMA_LOG_ERROR("%s: mismatched value type (%d != %d, layer %d)\n", __func__, v_type_i, v_type_i_ref, il);
+            if (v_type_i_ref < 0 || v_type_i_ref >= GGML_TYPE_COUNT) {
+                LLAMA_LOG_ERROR("%s: invalid value type (%d, layer %d)\n", __func__, v_type_i_ref, il);
                 return false;
             }
 
             // Read row size of value
             uint64_t v_size_row_ref;
             io.read_to(&v_size_row_ref, sizeof(v_size_row_ref));
-            const size_t v_size_row = ggml_row_size(v->type, n_embd_v_gqa);
+            const size_t v_size_row = ggml_row_size((ggml_type) v_type_i_ref, n_embd_v_gqa);
             if (v_size_row != v_size_row_ref) {
                 LLAMA_LOG_ERROR("%s: mismatched value row size (%zu != %zu, layer %d)\n", __func__, v_size_row, (size_t) v_size_row_ref, il);
                 return false;
             }
 
-            if (cell_count) {
-                // Read and set the values for the whole cell range
-                ggml_backend_tensor_set(v, io.read(cell_count * v_size_row), head * v_size_row, cell_count * v_size_row);
+            // Read and set the values for each cell range, the values saved with another type are converted
+            for (const auto & range : cr.data) {
+                const size_t range_size = range.second - range.first;
+
+                if (v_type_i == v_type_i_ref) {
+                    ggml_backend_tensor_set(v, io.read(range_size * v_size_row), range.first * v_size_row, range_size * v_size_row);
+                    continue;
+                }
+
+                if (!llama_kv_convert_rows((ggml_type) v_type_i_ref, v->type, io.read(range_size * v_size_row), buf_conv, range_size, n_embd_v_gqa)) {
+                    LLAMA_LOG_ERROR("%s: mismatched value type (%d != %d, layer %d)\n", __func__, v_type_i, v_type_i_ref, il);
+                    return false;
+                }
+
+                ggml_backend_tensor_set(v, buf_conv.data(), range.first * ggml_row_size(v->type, n_embd_v_gqa), buf_conv.size());
             }
         }
     } else {
@@ -2214,15 +2732,15 @@ bool llama_kv_cache_unified::state_read_data(llama_io_read_i & io, uint32_t strm
             int32_t v_type_i_ref;
             io.read_to(&v_type_i_ref, sizeof(v_type_i_ref));
             const int32_t v_type_i = (int32_t) v->type;
-            if (v_type_i != v_type_i_ref) {
-                LLAMA_LOG_ERROR("%s: mismatched value type (%d != %d, layer %d)\n", __func__, v_type_i, v_type_i_ref, il);
+            if (v_type_i_ref < 0 || v_type_i_ref >= GGML_TYPE_COUNT) {
+                LLAMA_LOG_ERROR("%s: invalid value type (%d, layer %d)\n", __func__, v_type_i_ref, il);
                 return false;
             }
 
             // Read element size of value
             uint32_t v_size_el_ref;
             io.read_to(&v_size_el_ref, sizeof(v_size_el_ref));
-            const size_t v_size_el = ggml_type_size(v->type);
+            const size_t v_size_el = ggml_type_size((ggml_type) v_type_i_ref);
             if (v_size_el != v_size_el_ref) {
                 LLAMA_LOG_ERROR("%s: mismatched value element size (%zu != %zu, layer %d)\n", __func__, v_size_el, (size_t) v_size_el_ref, il);
                 return false;
@@ -2236,11 +2754,25 @@ bool llama_kv_cache_unified::state_read_data(llama_io_read_i & io, uint32_t strm
                 return false;
             }
 
-            if (cell_count) {
-                // For each row in the transposed matrix, read the values for the whole cell range
-                for (uint32_t j = 0; j < n_embd_v_gqa; ++j) {
-                    const size_t dst_offset = (head + j * cells.size()) * v_size_el;
-                    ggml_backend_tensor_set(v, io.read(cell_count * v_size_el), dst_offset, cell_count * v_size_el);
+            // For each row in the transposed matrix, read the values for each cell range, the values saved with another
+            // type are converted
+            for (uint32_t j = 0; j < n_embd_v_gqa; ++j) {
+                for (const auto & range : cr.data) {
+                    const size_t range_size = range.second - range.first;
+
+                    if (v_type_i == v_type_i_ref) {
+                        const size_t dst_offset = (range.first + j * cells.size()) * v_size_el;
+                        ggml_backend_tensor_set(v, io.read(range_size * v_size_el), dst_offset, range_size * v_size_el);
+                        continue;
+                    }
+
+                    if (!llama_kv_convert_rows((ggml_type) v_type_i_ref, v->type, io.read(range_size * v_size_el), buf_conv, 1, range_size)) {
+                        LLAMA_LOG_ERROR("%s: mismatched value type (%d != %d, layer %d)\n", __func__, v_type_i, v_type_i_ref, il);
+                        return false;
+                    }
+
+                    const size_t dst_offset = (range.first + j * cells.size()) * ggml_type_size(v->type);
+                    ggml_backend_tensor_set(v, buf_conv.data(), dst_offset, buf_conv.size());
                 }
             }
         }
@@ -2311,7 +2843,7 @@ bool llama_kv_cache_unified_context::apply() {
         return true;
     }
 
-    kv->apply_ubatch(sinfos[i_cur], ubatches[i_cur]);
+    kv->commit_ubatch(sinfos[i_cur], ubatches[i_cur]);
 
     n_kv = kv->get_n_kv();
 
@@ -2336,6 +2868,20 @@ bool llama_kv_cache_unified_context::get_supports_set_rows() const {
     return kv->get_supports_set_rows();
 }
 
+bool llama_kv_cache_unified_context::get_needs_score() const {
+    return kv->get_needs_score(ubatches.empty() ? nullptr : &ubatches[i_cur]);
+}
+
+void llama_kv_cache_unified_context::add_kq_score(const ggml_tensor * src) const {
+    GGML_ASSERT(src->type == GGML_TYPE_F32);
+    GGML_ASSERT(src->ne[0] == n_kv);
+
+    std::vector<float> data(ggml_nelements(src));
+    ggml_backend_tensor_get(src, data.data(), 0, ggml_nbytes(src));
+
+    kv->add_kq_score(data.data(), n_kv, sinfos[i_cur]);
+}
+
 ggml_tensor * llama_kv_cache_unified_context::get_k(ggml_context * ctx, int32_t il) const {
     return kv->get_k(ctx, il, n_kv, sinfos[i_cur]);
 }
@@ -2372,8 +2918,8 @@ void llama_kv_cache_unified_context::set_input_v_idxs(ggml_tensor * dst, const l
     kv->set_input_v_idxs(dst, ubatch, sinfos[i_cur]);
 }
 
-void llama_kv_cache_unified_context::set_input_kq_mask(ggml_tensor * dst, const llama_ubatch * ubatch, bool causal_attn) const {
-    kv->set_input_kq_mask(dst, ubatch, causal_attn);
+void llama_kv_cache_unified_context::set_input_kq_mask(ggml_tensor * dst, const llama_ubatch * ubatch, bool causal_attn, int n_threads) const {
+    kv->set_input_kq_mask(dst, ubatch, causal_attn, n_threads);
 }
 
 void llama_kv_cache_unified_context::set_input_pos_bucket(ggml_tensor * dst, const llama_ubatch * ubatch) const {
@@ -3,6 +3,7 @@
 #include "llama-batch.h"
 #include "llama-graph.h"
 #include "llama-kv-cells.h"
+#include "llama-kv-mask.h"
 #include "llama-memory.h"
 
 #include <unordered_map>
@@ -29,6 +30,9 @@ public:
             return ids.empty();
         }
 
+        // the stream that is defragmented
+        uint32_t strm = 0;
+
         // contains information about which cell moves where:
         //  - cell i moves to ids[i]
         //  - if ids[i] == i || ids[i] == ids.size(), then cell i is not moved
@@ -95,8 +99,7 @@ public:
     llama_kv_cache_unified(
             const llama_model &  model,
               layer_filter_cb && filter,
-                    ggml_type    type_k,
-                    ggml_type    type_v,
+       const llama_kv_types &    types,
                          bool    v_trans,
                          bool    offload,
                          bool    unified,
@@ -104,7 +107,10 @@ public:
                      uint32_t    n_seq_max,
                      uint32_t    n_pad,
                      uint32_t    n_swa,
-               llama_swa_type    swa_type);
+               llama_swa_type    swa_type,
+                     uint32_t    n_budget,
+                     uint32_t    n_recent,
+                     uint32_t    n_sink);
 
     ~llama_kv_cache_unified() = default;
 
@@ -123,6 +129,8 @@ public:
 
     bool get_can_shift() const override;
 
+    std::vector<llama_memory_stream_stats> get_stream_stats() const override;
+
     void clear(bool data) override;
 
     bool seq_rm  (llama_seq_id seq_id,                              llama_pos p0, llama_pos p1) override;
@@ -139,6 +147,9 @@ public:
     void state_write(llama_io_write_i & io, llama_seq_id seq_id = -1) const override;
     void state_read (llama_io_read_i  & io, llama_seq_id seq_id = -1)       override;
 
+    void state_write_range (llama_io_write_i & io, llama_seq_id seq_id, llama_pos p0, llama_pos p1) const override;
+    void state_read_append(llama_io_read_i  & io, llama_seq_id seq_id)                                   override;
+
     //
     // llama_kv_cache_unified specific API
     //
@@ -148,6 +159,12 @@ public:
 
     bool get_has_shift() const;
 
+    // true if the attention received by the cells has to be collected while computing the ubatch: one of its
+    // sequences holds more than n_budget - n_recent cells, i.e. it is less than n_recent tokens away from an eviction
+    // the scores are collected over this window only, so that the sequences far below the budget do not pay for it
+    // ubatch is nullptr for the reserved worst-case graph, which includes the computation of the scores
+    bool get_needs_score(const llama_ubatch * ubatch) const;
+
     //
     // graph_build API
     //
@@ -171,17 +188,30 @@ public:
 
     // find places for the provided ubatches in the cache, returns the slot infos
     // return empty vector on failure
-    slot_info_vec_t prepare(const std::vector<llama_ubatch> & ubatches);
+    virtual slot_info_vec_t prepare(const std::vector<llama_ubatch> & ubatches);
 
-    bool update(llama_context * lctx, bool do_shift, const defrag_info & dinfo, const stream_copy_info & sc_info);
+    virtual bool update(llama_context * lctx, bool do_shift, const defrag_info & dinfo, const stream_copy_info & sc_info);
 
     // find a slot of kv cells that can hold the ubatch
     // if cont == true, then the slot must be continuous
     // return empty slot_info on failure
-    slot_info find_slot(const llama_ubatch & ubatch, bool cont) const;
+    virtual slot_info find_slot(const llama_ubatch & ubatch, bool cont) const;
 
     // emplace the ubatch context into slot: [sinfo.idxs[0...ubatch.n_tokens - 1]]
-    void apply_ubatch(const slot_info & sinfo, const llama_ubatch & ubatch);
+    virtual void apply_ubatch(const slot_info & sinfo, const llama_ubatch & ubatch);
+
+    // apply_ubatch() for the ubatch that is about to be processed, the new cells are appended to the runs of the KQ mask
+    void commit_ubatch(const slot_info & sinfo, const llama_ubatch & ubatch);
+
+    // evict the cells of the sequences that would exceed the budget with the tokens of the batch
+    // the cells that received the least attention are evicted first, the cells of the recent positions are kept
+    // the positions of the remaining cells are not changed
+    // called once prepare() has placed the batch, so that a batch that does not fit does not evict anything
+    void evict(const llama_batch_allocr & balloc);
+
+    // accumulate the attention received by the cells [0, n_kv) of the streams of the slot
+    // data is [n_kv, n_stream], summed over the heads, the tokens and the layers of a ubatch
+    void add_kq_score(const float * data, uint32_t n_kv, const slot_info & sinfo);
 
     //
     // input API
@@ -195,10 +225,10 @@ public:
 
     void set_input_k_shift(ggml_tensor * dst) const;
 
-    void set_input_kq_mask   (ggml_tensor * dst, const llama_ubatch * ubatch, bool causal_attn) const;
+    void set_input_kq_mask   (ggml_tensor * dst, const llama_ubatch * ubatch, bool causal_attn, int n_threads = 1) const;
     void set_input_pos_bucket(ggml_tensor * dst, const llama_ubatch * ubatch) const;
 
-private:
+protected:
     const llama_model & model;
     const llama_hparams & hparams;
 
@@ -225,6 +255,13 @@ private:
     // SWA
     const uint32_t n_swa = 0;
 
+    // max number of cells per sequence (0 = unlimited) and number of recent positions that are never evicted
+    const uint32_t n_budget = 0;
+    const uint32_t n_recent = 0;
+
+    // number of attention sink positions of each sequence, kept in the first cells of its ring (see find_slot_ring())
+    const uint32_t n_sink = 0;
+
     // env: LLAMA_KV_CACHE_DEBUG
     int debug = 0;
 
@@ -232,6 +269,12 @@ private:
     // ref: https://github.com/ggml-org/llama.cpp/pull/14285
     bool supports_set_rows = false;
 
+    // the cells of each stream are a ring of the positions of its sequence (SWA or attention sinks, single sequence per stream)
+    // the token at position p is placed in the cell p % size, overwriting the oldest cell of the window (see find_slot_ring())
+    // with attention sinks, the positions [0, n_sink) are placed in the first n_sink cells and the ring is made of the others
+    // a seq_add() of the whole window rotates the ring instead of moving the cells, so its positions can be re-based
+    bool ring = false;
+
     const llama_swa_type swa_type = LLAMA_SWA_TYPE_NONE;
 
     std::vector<ggml_context_ptr>        ctxs;
@@ -249,13 +292,26 @@ private:
     // pending stream copies that will be applied during the next update
     stream_copy_info sc_info;
 
+    // number of defragmentations and of cells moved by them, per stream
+    std::vector<uint32_t> v_n_defrag;
+    std::vector<uint64_t> v_n_moved;
+
+    // number of cells evicted to keep the sequences within the budget, per stream
+    std::vector<uint64_t> v_n_evicted;
+
+    // number of K-shifts applied to the cells, per stream
+    std::vector<uint64_t> v_n_shift;
+
+    // rotation of the ring of each stream: the window is moved by seq_add() without moving its cells (see ring_idx())
+    std::vector<llama_pos> v_ring_off;
+
     std::vector<kv_layer> layers;
 
     // model layer id -> KV cache layer id
     std::unordered_map<int32_t, int32_t> map_layer_ids;
 
-    // return non-empty vector if cells have been moved
-    defrag_info defrag_prepare(int32_t n_max_nodes) const;
+    // return non-empty vector if cells of the stream have been moved
+    defrag_info defrag_prepare(uint32_t strm, int32_t n_max_nodes) const;
 
     size_t total_size() const;
 
@@ -264,6 +320,22 @@ private:
 
     bool is_masked_swa(llama_pos p0, llama_pos p1) const;
 
+    // the smallest position that is not masked by the SWA for a token at position p1
+    llama_pos swa_pos_min(llama_pos p1) const;
+
+    // the runs of cells of each sequence, rebuilt by set_input_kq_mask() when the cells of a stream have changed
+    mutable llama_kv_mask_runs mask_runs;
+
+    // rebuild the runs of the sequences of the stream
+    virtual void build_kq_mask_runs(uint32_t strm) const;
+
+    // the cell of the position p in the ring of the stream strm
+    uint32_t ring_idx(llama_pos p, uint32_t strm) const;
+
+    // place the tokens [i0, i0 + n_tokens) of the ubatch in the ring of the stream, in O(n_tokens)
+    // returns false if the positions are not consecutive or if a cell is still visible, the generic search is used then
+    bool find_slot_ring(const llama_ubatch & ubatch, uint32_t i0, uint32_t n_tokens, uint32_t strm, bool cont, slot_info::idx_vec_t & idxs) const;
+
     ggml_tensor * build_rope_shift(
             const llama_cparams & cparams,
                    ggml_context * ctx,
@@ -291,8 +363,10 @@ private:
     void state_write_meta(llama_io_write_i & io, const cell_ranges_t & cr, llama_seq_id seq_id = -1) const;
     void state_write_data(llama_io_write_i & io, const cell_ranges_t & cr) const;
 
-    bool state_read_meta(llama_io_read_i & io, uint32_t strm, uint32_t cell_count, llama_seq_id dest_seq_id = -1);
-    bool state_read_data(llama_io_read_i & io, uint32_t strm, uint32_t cell_count);
+    void state_read_impl(llama_io_read_i & io, llama_seq_id seq_id, bool append);
+
+    bool state_read_meta(llama_io_read_i & io, uint32_t strm, uint32_t cell_count, llama_seq_id dest_seq_id = -1, bool append = false);
+    bool state_read_data(llama_io_read_i & io, const cell_ranges_t & cr);
 };
 
 class llama_kv_cache_unified_context : public llama_memory_context_i {
@@ -344,6 +418,12 @@ public:
     // TODO: temporary
     bool get_supports_set_rows() const;
 
+    // see llama_kv_cache_unified::get_needs_score()
+    bool get_needs_score() const;
+
+    // add the attention received by the cells during the computation of the current ubatch, F32 [n_kv, n_stream]
+    void add_kq_score(const ggml_tensor * src) const;
+
     // get views of the current state of the cache
     ggml_tensor * get_k(ggml_context * ctx, int32_t il) const;
     ggml_tensor * get_v(ggml_context * ctx, int32_t il) const;
@@ -359,7 +439,7 @@ public:
     void set_input_v_idxs(ggml_tensor * dst, const llama_ubatch * ubatch) const;
 
     void set_input_k_shift   (ggml_tensor * dst) const;
-    void set_input_kq_mask   (ggml_tensor * dst, const llama_ubatch * ubatch, bool causal_attn) const;
+    void set_input_kq_mask   (ggml_tensor * dst, const llama_ubatch * ubatch, bool causal_attn, int n_threads = 1) const;
     void set_input_pos_bucket(ggml_tensor * dst, const llama_ubatch * ubatch) const;
 
 private:
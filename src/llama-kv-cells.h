@@ -2,31 +2,34 @@
 
 #include "llama.h"
 #include "llama-cparams.h"
+#include "llama-kv-bitset.h"
+#include "llama-seq-set.h"
 
-#include <bitset>
 #include <cassert>
 #include <vector>
-#include <set>
 #include <map>
+#include <utility>
 
 // meta information about KV cells that can be part of multiple sequences at the same time
 // TODO: add unit tests
 class llama_kv_cells_unified {
 public:
     void reset() {
+        version++;
+
         for (uint32_t i = 0; i < pos.size(); ++i) {
             pos[i]   = -1;
             shift[i] =  0;
+            score[i] =  0.0f;
             seq[i].reset();
         }
 
         has_shift = false;
 
-        used.clear();
+        used .init(pos.size(), false);
+        empty.init(pos.size(), true);
 
-        for (uint32_t s = 0; s < LLAMA_MAX_SEQ; ++s) {
-            seq_pos[s].clear();
-        }
+        seq_pos.clear();
     }
 
     void reset_shift() {
@@ -44,6 +47,7 @@ public:
     void resize(uint32_t n) {
         pos.resize(n);
         shift.resize(n);
+        score.resize(n);
         seq.resize(n);
 
         reset();
@@ -57,25 +61,74 @@ public:
     }
 
     uint32_t get_used() const {
-        return used.size();
+        return used.count();
     }
 
     // the index of the first cell that is used
     // return 0 if no cells are used
     uint32_t used_min() const {
-        return used.empty() ? 0 : *used.begin();
+        const uint32_t i = used.find_next(0);
+
+        return i == llama_kv_bitset::npos ? 0 : i;
     }
 
     // the index of the last cell that is used + 1
     // return 0 if no cells are used
     uint32_t used_max_p1() const {
-        return used.empty() ? 0 : *used.rbegin() + 1;
+        const uint32_t i = used.find_prev(pos.size() - 1);
+
+        return i == llama_kv_bitset::npos ? 0 : i + 1;
+    }
+
+    // the index of the first empty cell >= i
+    // return size() if there is none
+    uint32_t find_empty(uint32_t i) const {
+        const uint32_t res = empty.find_next(i);
+
+        return res == llama_kv_bitset::npos ? pos.size() : res;
+    }
+
+    // the index of the first used cell >= i
+    // return size() if there is none
+    uint32_t find_used(uint32_t i) const {
+        const uint32_t res = used.find_next(i);
+
+        return res == llama_kv_bitset::npos ? pos.size() : res;
+    }
+
+    // the index of the first cell >= i that starts a run of n empty cells
+    // return size() if there is none
+    uint32_t find_empty_run(uint32_t i, uint32_t n) const {
+        while (true) {
+            i = find_empty(i);
+            if ((uint64_t) i + n > pos.size()) {
+                return pos.size();
+            }
+
+            const uint32_t j = find_used(i);
+            if (j - i >= n) {
+                return i;
+            }
+
+            i = j;
+        }
     }
 
     bool get_has_shift() const {
         return has_shift;
     }
 
+    // incremented by every change of the positions or of the sequences of the cells
+    // can be used to check if the information derived from the cells is still valid
+    uint64_t get_version() const {
+        return version;
+    }
+
+    // restore the version after a change that has been fully reverted (see llama_kv_cache_unified::prepare())
+    void set_version(uint64_t v) {
+        version = v;
+    }
+
     // move cell isrc to idst (used during defrag)
     void mv(uint32_t isrc, uint32_t idst) {
         assert(isrc < pos.size());
@@ -84,16 +137,20 @@ public:
         assert(pos[idst] == -1);
         assert(pos[isrc] != -1);
 
+        version++;
+
         pos  [idst] = pos  [isrc];
         shift[idst] = shift[isrc];
-        seq  [idst] = seq  [isrc];
+        score[idst] = score[isrc];
+        seq  [idst] = std::move(seq[isrc]);
 
         pos  [isrc] = -1;
         shift[isrc] =  0;
+        score[isrc] =  0.0f;
         seq  [isrc].reset();
 
-        used.erase (isrc);
-        used.insert(idst);
+        set_empty(isrc);
+        set_used (idst);
     }
 
     // copy the state of cells [i, i + n) (used for save/restore the state of the cells)
@@ -107,8 +164,9 @@ public:
         for (uint32_t j = 0; j < n; ++j) {
             const auto idx = i + j;
 
-            res.pos[j] = pos[idx];
-            res.seq[j] = seq[idx];
+            res.pos  [j] = pos  [idx];
+            res.score[j] = score[idx];
+            res.seq  [j] = seq  [idx];
 
             assert(shift[idx] == 0);
         }
@@ -125,8 +183,9 @@ public:
         for (uint32_t j = 0; j < idxs.size(); ++j) {
             const auto idx = idxs[j];
 
-            res.pos[j] = pos[idx];
-            res.seq[j] = seq[idx];
+            res.pos  [j] = pos  [idx];
+            res.score[j] = score[idx];
+            res.seq  [j] = seq  [idx];
 
             assert(shift[idx] == 0);
         }
@@ -138,23 +197,26 @@ public:
     void set(uint32_t i, const llama_kv_cells_unified & other) {
         assert(i + other.pos.size() <= pos.size());
 
+        version++;
+
         for (uint32_t j = 0; j < other.pos.size(); ++j) {
             const auto idx = i + j;
 
             if (pos[idx] == -1 && other.pos[j] != -1) {
-                used.insert(i + j);
+                set_used(i + j);
             }
 
             if (pos[idx] != -1 && other.pos[j] == -1) {
-                used.erase(i + j);
+                set_empty(i + j);
             }
 
             if (pos[idx] != -1) {
                 seq_pos_rm(i + j);
             }
 
-            pos[idx] = other.pos[j];
-            seq[idx] = other.seq[j];
+            pos  [idx] = other.pos  [j];
+            score[idx] = other.score[j];
+            seq  [idx] = other.seq  [j];
 
             if (pos[idx] != -1) {
                 seq_pos_add(i + j);
@@ -168,23 +230,26 @@ public:
     void set(const std::vector<uint32_t> & idxs, const llama_kv_cells_unified & other) {
         assert(idxs.size() == other.pos.size());
 
+        version++;
+
         for (uint32_t j = 0; j < other.pos.size(); ++j) {
             const auto idx = idxs[j];
 
             if (pos[idx] == -1 && other.pos[j] != -1) {
-                used.insert(idx);
+                set_used(idx);
             }
 
             if (pos[idx] != -1 && other.pos[j] == -1) {
-                used.erase(idx);
+                set_empty(idx);
             }
 
             if (pos[idx] != -1) {
                 seq_pos_rm(idx);
             }
 
-            pos[idx] = other.pos[j];
-            seq[idx] = other.seq[j];
+            pos  [idx] = other.pos  [j];
+            score[idx] = other.score[j];
+            seq  [idx] = other.seq  [j];
 
             if (pos[idx] != -1) {
                 seq_pos_add(idx);
@@ -199,13 +264,15 @@ public:
         assert(i < pos.size());
         assert(pos[i] != -1);
 
+        version++;
+
         seq_pos_rm(i);
         seq[i].reset();
 
         pos[i] = -1;
         shift[i] = 0;
 
-        used.erase(i);
+        set_empty(i);
     }
 
     // note: call only if the cell has seq_id
@@ -216,6 +283,8 @@ public:
         assert(pos[i] != -1);
         assert(seq_id >= 0);
 
+        version++;
+
         seq[i].reset(seq_id);
         seq_pos_dec(seq_id, pos[i]);
 
@@ -223,7 +292,7 @@ public:
             pos[i] = -1;
             shift[i] = 0;
 
-            used.erase(i);
+            set_empty(i);
 
             return true;
         }
@@ -235,6 +304,8 @@ public:
     bool seq_keep(uint32_t i, llama_seq_id seq_id) {
         assert(i < pos.size());
 
+        version++;
+
         if (seq[i].test(seq_id)) {
             seq_pos_rm(i);
             seq[i].reset();
@@ -252,7 +323,7 @@ public:
             pos[i] = -1;
             shift[i] = 0;
 
-            used.erase(i);
+            set_empty(i);
 
             return true;
         }
@@ -284,6 +355,8 @@ public:
         assert(pos[i] != -1);
         assert(!seq[i].test(seq_id));
 
+        version++;
+
         seq[i].set(seq_id);
         seq_pos_inc(seq_id, pos[i]);
     }
@@ -293,13 +366,15 @@ public:
     llama_seq_id seq_get(uint32_t i) const {
         assert(seq[i].count() == 1);
 
-        for (int s = 0; s < LLAMA_MAX_SEQ; ++s) {
-            if (seq[i].test(s)) {
-                return s;
-            }
-        }
+        return seq[i].first();
+    }
 
-        return -1;
+    // call f(seq_id) for each sequence of the cell, in increasing order
+    template <typename F>
+    void seq_for_each(uint32_t i, F && f) const {
+        assert(i < pos.size());
+
+        seq[i].for_each(std::forward<F>(f));
     }
 
     // the minimum position of sequence seq_id currently present in any of the cells
@@ -308,7 +383,7 @@ public:
         assert(seq_id >= 0);
         assert(seq_id < LLAMA_MAX_SEQ);
 
-        if (seq_pos[seq_id].empty()) {
+        if ((size_t) seq_id >= seq_pos.size() || seq_pos[seq_id].empty()) {
             return -1;
         }
 
@@ -323,7 +398,7 @@ public:
         assert(seq_id >= 0);
         assert(seq_id < LLAMA_MAX_SEQ);
 
-        if (seq_pos[seq_id].empty()) {
+        if ((size_t) seq_id >= seq_pos.size() || seq_pos[seq_id].empty()) {
             return -1;
         }
 
@@ -363,9 +438,46 @@ public:
         assert(pos[i] == -1);
         assert(seq[i].none());
 
-        pos[i] = p;
+        version++;
+
+        pos[i]   = p;
+        score[i] = 0.0f;
 
-        used.insert(i);
+        set_used(i);
+    }
+
+    // the attention received by the cell since it has been set, see llama_kv_cache_unified::add_kq_score()
+    // note: call only if the cell is not empty
+    float score_get(uint32_t i) const {
+        assert(i < pos.size());
+        assert(pos[i] != -1);
+
+        return score[i];
+    }
+
+    // does not modify the version, the score does not affect the mask
+    void score_add(uint32_t i, float s) {
+        assert(i < pos.size());
+        assert(pos[i] != -1);
+
+        score[i] += s;
+    }
+
+    // the number of cells that contain seq_id
+    uint32_t seq_n_cells(llama_seq_id seq_id) const {
+        assert(seq_id >= 0);
+
+        if ((size_t) seq_id >= seq_pos.size()) {
+            return 0;
+        }
+
+        uint32_t res = 0;
+
+        for (const auto & it : seq_pos[seq_id]) {
+            res += it.second;
+        }
+
+        return res;
     }
 
     // pos[i] = pos[i] + d
@@ -375,6 +487,8 @@ public:
         assert(i < pos.size());
         assert(pos[i] != -1);
 
+        version++;
+
         seq_pos_rm(i);
 
         pos[i]   += d;
@@ -387,7 +501,7 @@ public:
             pos[i] = -1;
             shift[i] = 0;
 
-            used.erase(i);
+            set_empty(i);
 
             return true;
         }
@@ -404,6 +518,8 @@ public:
         assert(i < pos.size());
         assert(pos[i] != -1);
 
+        version++;
+
         const llama_pos p_old = pos[i];
 
         seq_pos_rm(i);
@@ -419,8 +535,22 @@ public:
 private:
     bool has_shift = false;
 
-    // set of indices of used cells (i.e. pos[i] != -1, allowed to not have any seq_id)
-    std::set<uint32_t> used;
+    uint64_t version = 0;
+
+    // indices of the used cells (i.e. pos[i] != -1, allowed to not have any seq_id) and of the empty ones
+    // the two indices are kept so that both the next used and the next empty cell are found in sublinear time
+    llama_kv_bitset used;
+    llama_kv_bitset empty;
+
+    void set_used(uint32_t i) {
+        used .set  (i);
+        empty.reset(i);
+    }
+
+    void set_empty(uint32_t i) {
+        used .reset(i);
+        empty.set  (i);
+    }
 
     std::vector<llama_pos> pos;
 
@@ -441,10 +571,11 @@ private:
     //
     std::vector<llama_pos> shift;
 
-    using seq_set_t = std::bitset<LLAMA_MAX_SEQ>;
+    // the accumulated attention received by each cell, used to select the cells to evict (see llama_kv_cache_unified::evict())
+    std::vector<float> score;
 
-    // the bitset seq[i] tells us which sequences are currently occupying the i-th cell
-    std::vector<seq_set_t> seq;
+    // the set seq[i] tells us which sequences are currently occupying the i-th cell
+    std::vector<llama_seq_set> seq;
 
     // the set seq_pos[s][p] tells us how many times the position p is currently present for sequence s
     // if the position p is not present, seq_pos[s][p] is not set
@@ -454,11 +585,15 @@ private:
     //  - during performing a cache reuse via (rm + add)
     //  - some vision models have input embeddings with repeating positions
     //
-    std::map<llama_pos, int> seq_pos[LLAMA_MAX_SEQ];
+    // the array grows on demand up to the largest sequence id used, so its size does not depend on LLAMA_MAX_SEQ
+    //
+    std::vector<std::map<llama_pos, int>> seq_pos;
 
     // helper functions for updating `seq_pos`, once cell at a time:
 
     void seq_pos_dec(llama_seq_id s, llama_pos p) {
+        assert((size_t) s < seq_pos.size());
+
         auto it = seq_pos[s].find(p);
         assert(it != seq_pos[s].end());
 
@@ -468,24 +603,26 @@ private:
     }
 
     void seq_pos_inc(llama_seq_id s, llama_pos p) {
+        assert(s < LLAMA_MAX_SEQ);
+
+        if ((size_t) s >= seq_pos.size()) {
+            seq_pos.resize(s + 1);
+        }
+
         seq_pos[s][p]++;
     }
 
     // remove cell i
     void seq_pos_rm(uint32_t i) {
-        for (int s = 0; s < LLAMA_MAX_SEQ; ++s) {
-            if (seq[i].test(s)) {
-                seq_pos_dec(s, pos[i]);
-            }
-        }
+        seq[i].for_each([&](llama_seq_id s) {
+            seq_pos_dec(s, pos[i]);
+        });
     }
 
     // add cell i
     void seq_pos_add(uint32_t i) {
-        for (int s = 0; s < LLAMA_MAX_SEQ; ++s) {
-            if (seq[i].test(s)) {
-                seq_pos_inc(s, pos[i]);
-            }
-        }
+        seq[i].for_each([&](llama_seq_id s) {
+            seq_pos_inc(s, pos[i]);
+        });
     }
 };
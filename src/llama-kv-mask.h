@@ -0,0 +1,198 @@
+#pragma once
+
+#include "llama.h"
+#include "llama-kv-cells.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstdint>
+#include <thread>
+#include <vector>
+
+// runs of consecutive KV cells seen by each sequence, used to build the KQ mask
+//
+// a run is a range of cells [i0, i1) of one stream with non-decreasing positions p0 ... p1. the runs of a stream are
+// rebuilt only when its cells have been modified in other ways than by placing new tokens, in which case the new cells
+// are appended to the runs (see llama_kv_cache_unified::commit_ubatch()). the row of the mask of a token is then
+// filled run by run: the cells of the other sequences are never visited and a run that is fully visible is a single
+// contiguous store
+class llama_kv_mask_runs {
+public:
+    struct run {
+        uint32_t  i0;
+        uint32_t  i1;
+        llama_pos p0;
+        llama_pos p1;
+    };
+
+    void init(uint32_t n_seq_max, uint32_t n_stream) {
+        seqs.clear();
+        seqs.resize(n_seq_max);
+
+        versions.assign(n_stream, 0);
+        valid.assign(n_stream, false);
+    }
+
+    // the runs of the stream describe the given version of its cells
+    bool is_valid(uint32_t strm, uint64_t version) const {
+        return valid[strm] && versions[strm] == version;
+    }
+
+    void set_valid(uint32_t strm, uint64_t version) {
+        valid[strm]    = true;
+        versions[strm] = version;
+    }
+
+    void invalidate(uint32_t strm) {
+        valid[strm] = false;
+    }
+
+    void clear(llama_seq_id seq_id) {
+        seqs[seq_id].clear();
+    }
+
+    // append the cell idx with position pos to the runs of the sequence
+    void add(llama_seq_id seq_id, uint32_t idx, llama_pos pos) {
+        auto & runs = seqs[seq_id];
+
+        if (!runs.empty() && runs.back().i1 == idx && runs.back().p1 <= pos) {
+            runs.back().i1 = idx + 1;
+            runs.back().p1 = pos;
+            return;
+        }
+
+        runs.push_back({ idx, idx + 1, pos, pos });
+    }
+
+    // remove the cell idx from the front of the runs of the sequence, before it is overwritten
+    // the runs of the first n_fixed cells (the attention sinks of a ring) are never overwritten and are skipped
+    // returns false if the cell is not the first one of the other runs
+    bool pop_front(llama_seq_id seq_id, uint32_t idx, const llama_kv_cells_unified & cells, uint32_t n_fixed = 0) {
+        auto & runs = seqs[seq_id];
+
+        auto it = runs.begin();
+        while (it != runs.end() && it->i0 < n_fixed) {
+            ++it;
+        }
+
+        if (it == runs.end() || it->i0 != idx) {
+            return false;
+        }
+
+        if (++it->i0 == it->i1) {
+            runs.erase(it);
+        } else {
+            it->p0 = cells.pos_get(it->i0);
+        }
+
+        return true;
+    }
+
+    const std::vector<run> & get(llama_seq_id seq_id) const {
+        return seqs[seq_id];
+    }
+
+    // fill the row of the mask of a token of seq_id for the cells [0, n_kv)
+    // the cells of the sequence with positions in [p_min, p_max] are set to 0.0f, or to -|p - p_alibi| with ALiBi,
+    // all the other cells are set to -INFINITY
+    void fill_row(float * row, uint32_t n_kv, llama_seq_id seq_id, llama_pos p_min, llama_pos p_max,
+            bool alibi, llama_pos p_alibi, const llama_kv_cells_unified & cells) const {
+        std::fill(row, row + n_kv, -INFINITY);
+
+        if (p_min > p_max) {
+            return;
+        }
+
+        for (const auto & r : seqs[seq_id]) {
+            if (r.i0 >= n_kv || r.p1 < p_min || r.p0 > p_max) {
+                continue;
+            }
+
+            uint32_t j0 = r.i0;
+            uint32_t j1 = std::min(r.i1, n_kv);
+
+            // the positions in a run are sorted, so the visible cells of a partially visible run are found by bisection
+            if (r.p0 < p_min) {
+                j0 = lower_bound(cells, j0, j1, p_min);
+            }
+
+            if (r.p1 > p_max) {
+                j1 = lower_bound(cells, j0, j1, p_max + 1);
+            }
+
+            if (!alibi) {
+                std::fill(row + j0, row + j1, 0.0f);
+                continue;
+            }
+
+            for (uint32_t j = j0; j < j1; ++j) {
+                row[j] = -std::abs(cells.pos_get(j) - p_alibi);
+            }
+        }
+    }
+
+private:
+    // the runs of each sequence, in the order in which the cells have been added
+    std::vector<std::vector<run>> seqs;
+
+    // the version of the cells of each stream described by the runs
+    std::vector<uint64_t> versions;
+    std::vector<bool>     valid;
+
+    // the first cell in [j0, j1) with position >= p, the positions of the cells in [j0, j1) are sorted
+    static uint32_t lower_bound(const llama_kv_cells_unified & cells, uint32_t j0, uint32_t j1, llama_pos p) {
+        while (j0 < j1) {
+            const uint32_t j = j0 + (j1 - j0)/2;
+
+            if (cells.pos_get(j) < p) {
+                j0 = j + 1;
+            } else {
+                j1 = j;
+            }
+        }
+
+        return j0;
+    }
+};
+
+// call fill(r) for the rows [0, n_rows) of a mask of n_kv cells per row
+// the rows are independent, a large mask is split in contiguous chunks of rows across n_threads threads, the calling
+// thread included. below n_min_parallel cells, starting the threads costs more than the fill and a single thread is used
+template <typename F>
+static void llama_kv_mask_fill_rows(int64_t n_rows, int64_t n_kv, int n_threads, F && fill) {
+    static const int64_t n_min_parallel = 4*1024*1024;
+
+    n_threads = (int) std::max<int64_t>(1, std::min<int64_t>(n_threads, n_rows));
+
+    if (n_threads == 1 || n_rows*n_kv < n_min_parallel) {
+        for (int64_t r = 0; r < n_rows; ++r) {
+            fill(r);
+        }
+        return;
+    }
+
+    const int64_t n_per_thread = (n_rows + n_threads - 1)/n_threads;
+
+    auto fill_chunk = [&](int ith) {
+        const int64_t r0 = ith*n_per_thread;
+        const int64_t r1 = std::min(n_rows, r0 + n_per_thread);
+
+        for (int64_t r = r0; r < r1; ++r) {
+            fill(r);
+        }
+    };
+
+    std::vector<std::thread> workers;
+    workers.reserve(n_threads - 1);
+
+    for (int ith = 1; ith < n_threads; ++ith) {
+        workers.emplace_back(fill_chunk, ith);
+    }
+
+    fill_chunk(0);
+
+    for (auto & w : workers) {
+        w.join();
+    }
+}
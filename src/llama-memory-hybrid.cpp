@@ -11,8 +11,7 @@
 llama_memory_hybrid::llama_memory_hybrid(
     const llama_model & model,
                          /* attn */
-            ggml_type    type_k,
-            ggml_type    type_v,
+ const llama_kv_types &  types,
                  bool    v_trans,
              uint32_t    kv_size,
              uint32_t    n_pad,
@@ -34,8 +33,7 @@ llama_memory_hybrid::llama_memory_hybrid(
         filter_attn == nullptr ?
             [&](int32_t il) { return !hparams.is_recurrent(il); }
             : filter_attn,
-        type_k,
-        type_v,
+        types,
         v_trans,
         offload,
         1,
@@ -43,7 +41,10 @@ llama_memory_hybrid::llama_memory_hybrid(
         n_seq_max,
         n_pad,
         n_swa,
-        swa_type
+        swa_type,
+        0,
+        0,
+        0
     )),
     mem_recr(new llama_memory_recurrent(
         model,
@@ -120,6 +121,10 @@ bool llama_memory_hybrid::get_can_shift() const {
     return mem_attn->get_can_shift();
 }
 
+std::vector<llama_memory_stream_stats> llama_memory_hybrid::get_stream_stats() const {
+    return mem_attn->get_stream_stats();
+}
+
 void llama_memory_hybrid::clear(bool data) {
     mem_attn->clear(data);
     mem_recr->clear(data);
@@ -174,6 +179,16 @@ void llama_memory_hybrid::state_read(llama_io_read_i & io, llama_seq_id seq_id)
     mem_recr->state_read(io, seq_id);
 }
 
+void llama_memory_hybrid::state_write_range(llama_io_write_i & io, llama_seq_id seq_id, llama_pos p0, llama_pos p1) const {
+    mem_attn->state_write_range(io, seq_id, p0, p1);
+    mem_recr->state_write_range(io, seq_id, p0, p1);
+}
+
+void llama_memory_hybrid::state_read_append(llama_io_read_i & io, llama_seq_id seq_id) {
+    mem_attn->state_read_append(io, seq_id);
+    mem_recr->state_read_append(io, seq_id);
+}
+
 llama_kv_cache_unified * llama_memory_hybrid::get_mem_attn() const {
     return mem_attn.get();
 }
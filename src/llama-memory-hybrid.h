@@ -25,8 +25,7 @@ public:
     llama_memory_hybrid(
         const llama_model & model,
                             /* attn */
-                ggml_type    type_k,
-                ggml_type    type_v,
+     const llama_kv_types &  types,
                      bool    v_trans,
                  uint32_t    kv_size,
                  uint32_t    n_pad,
@@ -60,6 +59,8 @@ public:
 
     bool get_can_shift() const override;
 
+    std::vector<llama_memory_stream_stats> get_stream_stats() const override;
+
     void clear(bool data) override;
 
     bool seq_rm  (llama_seq_id seq_id,                              llama_pos p0, llama_pos p1) override;
@@ -76,6 +77,9 @@ public:
     void state_write(llama_io_write_i & io, llama_seq_id seq_id = -1) const override;
     void state_read (llama_io_read_i  & io, llama_seq_id seq_id = -1)       override;
 
+    void state_write_range (llama_io_write_i & io, llama_seq_id seq_id, llama_pos p0, llama_pos p1) const override;
+    void state_read_append(llama_io_read_i  & io, llama_seq_id seq_id)                                   override;
+
     //
     // llama_memory_hybrid specific API
     //
@@ -1,5 +1,36 @@
 #include "llama-memory.h"
 
+static bool llama_kv_type_override_match(const llama_kv_type_override & o, int32_t il, int32_t n_layer) {
+    const int32_t il_first = o.il_first < 0 ? n_layer + o.il_first : o.il_first;
+    const int32_t il_last  = o.il_last  < 0 ? n_layer + o.il_last  : o.il_last;
+
+    return il_first <= il && il <= il_last;
+}
+
+ggml_type llama_kv_types::get_k(int32_t il, int32_t n_layer) const {
+    ggml_type res = type_k;
+
+    for (const auto & o : overrides) {
+        if (o.type_k != GGML_TYPE_COUNT && llama_kv_type_override_match(o, il, n_layer)) {
+            res = o.type_k;
+        }
+    }
+
+    return res;
+}
+
+ggml_type llama_kv_types::get_v(int32_t il, int32_t n_layer) const {
+    ggml_type res = type_v;
+
+    for (const auto & o : overrides) {
+        if (o.type_v != GGML_TYPE_COUNT && llama_kv_type_override_match(o, il, n_layer)) {
+            res = o.type_v;
+        }
+    }
+
+    return res;
+}
+
 llama_memory_status llama_memory_status_combine(llama_memory_status s0, llama_memory_status s1) {
     bool has_update = false;
 
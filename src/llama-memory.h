@@ -3,6 +3,7 @@
 #include "llama.h"
 
 #include <memory>
+#include <vector>
 
 struct llama_ubatch;
 
@@ -11,11 +12,26 @@ class llama_batch_allocr;
 class llama_io_write_i;
 class llama_io_read_i;
 
+// the types of the K and V cache of each layer
+struct llama_kv_types {
+    ggml_type type_k;
+    ggml_type type_v;
+
+    // per-layer types, the last matching entry wins
+    std::vector<llama_kv_type_override> overrides;
+
+    ggml_type get_k(int32_t il, int32_t n_layer) const;
+    ggml_type get_v(int32_t il, int32_t n_layer) const;
+};
+
 struct llama_memory_params {
     // kv cache
     ggml_type type_k;
     ggml_type type_v;
 
+    // per-layer kv cache types
+    std::vector<llama_kv_type_override> type_overrides;
+
     // use full-size SWA cache
     bool swa_full;
 };
@@ -84,6 +100,11 @@ struct llama_memory_i {
     // getters
     virtual bool get_can_shift() const = 0;
 
+    // usage and fragmentation of each stream of KV cells, empty if the memory has no KV cells
+    virtual std::vector<llama_memory_stream_stats> get_stream_stats() const {
+        return {};
+    }
+
     //
     // ops
     //
@@ -106,6 +127,18 @@ struct llama_memory_i {
 
     virtual void state_write(llama_io_write_i & io, llama_seq_id seq_id = -1) const = 0;
     virtual void state_read (llama_io_read_i  & io, llama_seq_id seq_id = -1) = 0;
+
+    // write only the cells of the sequence with positions in [p0, p1)
+    // read such cells and append them to the sequence, replacing the cells at the same or later positions
+    // memory types that cannot be split by position write and read the whole sequence state
+    virtual void state_write_range (llama_io_write_i & io, llama_seq_id seq_id, llama_pos p0, llama_pos p1) const {
+        GGML_UNUSED(p0);
+        GGML_UNUSED(p1);
+        state_write(io, seq_id);
+    }
+    virtual void state_read_append(llama_io_read_i  & io, llama_seq_id seq_id) {
+        state_read(io, seq_id);
+    }
 };
 
 using llama_memory_ptr = std::unique_ptr<llama_memory_i>;
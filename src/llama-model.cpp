@@ -8,6 +8,7 @@
 
 #include "llama-kv-cache-unified.h"
 #include "llama-kv-cache-unified-iswa.h"
+#include "llama-kv-cache-paged.h"
 #include "llama-memory-hybrid.h"
 #include "llama-memory-recurrent.h"
 
@@ -17030,6 +17031,8 @@ llama_memory_i * llama_model::create_memory(const llama_memory_params & params,
         // checks
         default:
             {
+                const llama_kv_types types_kv = { params.type_k, params.type_v, params.type_overrides };
+
                 if (llm_arch_is_recurrent(arch)) {
                     res = new llama_memory_recurrent(
                             *this,
@@ -17044,10 +17047,21 @@ llama_memory_i * llama_model::create_memory(const llama_memory_params & params,
 
                     cparams.n_ctx = GGML_PAD(cparams.n_ctx, padding);
 
+                    if (cparams.n_kv_block > 0) {
+                        LLAMA_LOG_WARN("%s: the paged KV cache does not support hybrid models - allocating the cells individually\n", __func__);
+                    }
+
+                    if (cparams.n_kv_budget > 0) {
+                        LLAMA_LOG_WARN("%s: the KV budget is not supported by hybrid models - ignoring\n", __func__);
+                    }
+
+                    if (cparams.n_kv_sink > 0) {
+                        LLAMA_LOG_WARN("%s: the attention sink ring is not supported by hybrid models - ignoring\n", __func__);
+                    }
+
                     res = new llama_memory_hybrid(
                         /* model             */ *this,
-                        /* attn_type_k       */ params.type_k,
-                        /* attn_type_v       */ params.type_v,
+                        /* attn_types        */ types_kv,
                         /* attn_v_trans      */ !cparams.flash_attn,
                         /* attn_kv_size      */ cparams.n_ctx,
                         /* attn_n_pad        */ padding,
@@ -17081,10 +17095,17 @@ llama_memory_i * llama_model::create_memory(const llama_memory_params & params,
                     if (hparams.swa_type != LLAMA_SWA_TYPE_NONE) {
                         GGML_ASSERT(hparams.is_swa_any());
 
+                        if (cparams.n_kv_block > 0) {
+                            LLAMA_LOG_WARN("%s: the paged KV cache does not support SWA models - allocating the cells individually\n", __func__);
+                        }
+
+                        if (cparams.n_kv_sink > 0) {
+                            LLAMA_LOG_WARN("%s: the attention sink ring is not supported by SWA models - ignoring\n", __func__);
+                        }
+
                         res = new llama_kv_cache_unified_iswa(
                                 *this,
-                                params.type_k,
-                                params.type_v,
+                                types_kv,
                                 !cparams.flash_attn,
                                 cparams.offload_kqv,
                                 params.swa_full,
@@ -17092,15 +17113,38 @@ llama_memory_i * llama_model::create_memory(const llama_memory_params & params,
                                 n_ctx_per_stream,
                                 cparams.n_seq_max,
                                 cparams.n_ubatch,
-                                padding);
+                                padding,
+                                cparams.n_kv_budget,
+                                cparams.n_kv_recent);
+                    } else if (cparams.n_kv_block > 0) {
+                        GGML_ASSERT(!hparams.is_swa_any());
+                        GGML_ASSERT(cparams.kv_unified);
+
+                        if (cparams.n_kv_budget > 0) {
+                            LLAMA_LOG_WARN("%s: the KV budget is not supported by the paged KV cache - ignoring\n", __func__);
+                        }
+
+                        if (cparams.n_kv_sink > 0) {
+                            LLAMA_LOG_WARN("%s: the attention sink ring is not supported by the paged KV cache - ignoring\n", __func__);
+                        }
+
+                        res = new llama_kv_cache_paged(
+                                *this,
+                                nullptr,
+                                types_kv,
+                                !cparams.flash_attn,
+                                cparams.offload_kqv,
+                                n_ctx_per_stream,
+                                cparams.n_seq_max,
+                                padding,
+                                cparams.n_kv_block);
                     } else {
                         GGML_ASSERT(!hparams.is_swa_any());
 
                         res = new llama_kv_cache_unified(
                                 *this,
                                 nullptr,
-                                params.type_k,
-                                params.type_v,
+                                types_kv,
                                 !cparams.flash_attn,
                                 cparams.offload_kqv,
                                 cparams.kv_unified,
@@ -17108,7 +17152,10 @@ llama_memory_i * llama_model::create_memory(const llama_memory_params & params,
                                 cparams.n_seq_max,
                                 padding,
                                 hparams.n_swa,
-                                hparams.swa_type);
+                                hparams.swa_type,
+                                cparams.n_kv_budget,
+                                cparams.n_kv_recent,
+                                cparams.n_kv_sink);
                     }
                 }
             }
@@ -17455,6 +17502,8 @@ ggml_cgraph * llama_model::build_graph(const llm_graph_params & params) const {
     // add on pooling layer
     llm->build_pooling(cls, cls_b, cls_out, cls_out_b);
 
+    llm->res->set_outputs();
+
     return llm->res->get_gf();
 }
 
@@ -17756,6 +17805,10 @@ bool llama_model_is_recurrent(const llama_model * model) {
     return llm_arch_is_recurrent(model->arch);
 }
 
+bool llama_model_is_hybrid(const llama_model * model) {
+    return llm_arch_is_hybrid(model->arch);
+}
+
 const std::vector<std::pair<std::string, ggml_tensor *>> & llama_internal_get_tensor_map(const llama_model * model) {
     return model->tensors_by_name;
 }
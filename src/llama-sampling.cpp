@@ -12,6 +12,7 @@
 #include <cstdlib>
 #include <cstring>
 #include <ctime>
+#include <functional>
 #include <numeric>
 #include <random>
 #include <unordered_map>
@@ -483,10 +484,12 @@ struct llama_sampler * llama_sampler_chain_init(struct llama_sampler_chain_param
     return llama_sampler_init(
         /* .iface = */ &llama_sampler_chain_i,
         /* .ctx   = */ new llama_sampler_chain {
-            /* .params      = */ params,
-            /* .samplers    = */ {},
-            /* .t_sample_us = */ 0,
-            /* .n_sample    = */ 0,
+            /* .params       = */ params,
+            /* .samplers     = */ {},
+            /* .fused_sparse = */ {},
+            /* .fused_sample = */ {},
+            /* .t_sample_us  = */ 0,
+            /* .n_sample     = */ 0,
         }
     );
 }
@@ -1421,6 +1424,10 @@ struct llama_sampler_grammar {
     std::string grammar_root;
 
     struct llama_grammar * grammar;
+
+    // perf
+    int64_t t_sample_us = 0;
+    int32_t n_sample    = 0;
 };
 
 static const char * llama_sampler_grammar_name(const struct llama_sampler * /*smpl*/) {
@@ -1437,7 +1444,11 @@ static void llama_sampler_grammar_accept_impl(struct llama_sampler * smpl, llama
 static void llama_sampler_grammar_apply(struct llama_sampler * smpl, llama_token_data_array * cur_p) {
     auto * ctx = (llama_sampler_grammar *) smpl->ctx;
     if (ctx->grammar) {
+        time_meas tm(ctx->t_sample_us);
+
         llama_grammar_apply_impl(*ctx->grammar, cur_p);
+
+        ctx->n_sample++;
     }
 }
 
@@ -1470,6 +1481,9 @@ static void llama_sampler_grammar_reset(struct llama_sampler * smpl) {
                                                  ctx->grammar->lazy, trigger_patterns_c.data(), trigger_patterns_c.size(),
                                                  ctx->grammar->trigger_tokens.data(), ctx->grammar->trigger_tokens.size());
 
+    // same rules, the masks of the states seen so far remain valid
+    grammar_new->mask_cache = std::move(ctx->grammar->mask_cache);
+
     llama_grammar_free_impl(ctx->grammar);
     ctx->grammar = grammar_new;
 }
@@ -1549,6 +1563,8 @@ static struct llama_sampler * llama_sampler_init_grammar_impl(
             /* .grammar_str  = */ grammar_str,
             /* .grammar_root = */ grammar_root,
             /* .grammar      = */ llama_grammar_init_impl(vocab, grammar_str, grammar_root, lazy, trigger_patterns, num_trigger_patterns, trigger_tokens, num_trigger_tokens),
+            /* .t_sample_us  = */ 0,
+            /* .n_sample     = */ 0,
         };
         if (!ctx->grammar) {
             delete ctx;
@@ -1560,6 +1576,8 @@ static struct llama_sampler * llama_sampler_init_grammar_impl(
             /* .grammar_str  = */ {},
             /* .grammar_root = */ {},
             /* .grammar      = */ nullptr,
+            /* .t_sample_us  = */ 0,
+            /* .n_sample     = */ 0,
         };
     }
 
@@ -2512,6 +2530,359 @@ struct llama_sampler * llama_sampler_init_infill(const struct llama_vocab * voca
     );
 }
 
+// fused chain
+
+// the logits are read in blocks, the blocks without a candidate are skipped after a vectorized count
+static constexpr int64_t LLAMA_FUSED_BLOCK = 64;
+
+// the number of logits sampled to estimate the thresholds of the candidates
+static constexpr int64_t LLAMA_FUSED_SAMPLES = 2048;
+
+// append the candidates with a logit >= t to data, in the order of the ids
+// within a block, each candidate is written and kept only if its logit is above the threshold, without branches
+static size_t llama_fused_collect_ge(const float * x, int64_t n, float t, llama_token_data * data) {
+    size_t res = 0;
+
+    for (int64_t i0 = 0; i0 < n; i0 += LLAMA_FUSED_BLOCK) {
+        const int64_t i1 = std::min(n, i0 + LLAMA_FUSED_BLOCK);
+
+        int32_t n_ge = 0;
+        for (int64_t i = i0; i < i1; ++i) {
+            n_ge += x[i] >= t;
+        }
+
+        if (n_ge == 0) {
+            continue;
+        }
+
+        // res <= i, so the writes remain in data[0, n)
+        for (int64_t i = i0; i < i1; ++i) {
+            data[res] = { (llama_token) i, x[i], 0.0f };
+            res += x[i] >= t;
+        }
+    }
+
+    return res;
+}
+
+// remove the candidates with the sorted ids in skip from the candidates sorted by id
+static size_t llama_fused_remove_ids(llama_token_data * data, size_t n, const std::vector<llama_token_data> & skip) {
+    if (skip.empty()) {
+        return n;
+    }
+
+    size_t res = 0;
+    size_t is  = 0;
+
+    for (size_t i = 0; i < n; ++i) {
+        while (is < skip.size() && skip[is].id < data[i].id) {
+            is++;
+        }
+
+        if (is < skip.size() && skip[is].id == data[i].id) {
+            continue;
+        }
+
+        data[res++] = data[i];
+    }
+
+    return res;
+}
+
+// the logits at a regular stride, excluding the sorted ids in skip
+static void llama_fused_sample(const float * x, int64_t n, const std::vector<llama_token_data> & skip, std::vector<float> & sample) {
+    const int64_t n_sample = std::min(n, LLAMA_FUSED_SAMPLES);
+
+    sample.clear();
+
+    for (int64_t k = 0; k < n_sample; ++k) {
+        const llama_token id = k*n/n_sample;
+
+        const bool in_skip = std::binary_search(skip.begin(), skip.end(), llama_token_data { id, 0.0f, 0.0f }, [](const llama_token_data & a, const llama_token_data & b) {
+            return a.id < b.id;
+        });
+
+        if (!in_skip && !std::isnan(x[id])) {
+            sample.push_back(x[id]);
+        }
+    }
+}
+
+// a threshold with about n_top of the n logits above it, lowered by a factor 4 with each attempt
+// -INFINITY when the sample is too small for the estimate
+static float llama_fused_threshold(std::vector<float> & sample, int64_t n, int64_t n_top, int attempt) {
+    const int64_t rank = (2*n_top*(int64_t) sample.size()/n + 2) << 2*attempt;
+
+    if (rank >= (int64_t) sample.size()) {
+        return -INFINITY;
+    }
+
+    std::nth_element(sample.begin(), sample.begin() + rank, sample.end(), std::greater<float>());
+
+    return sample[rank];
+}
+
+enum llama_sampler_fuse_type {
+    LLAMA_SAMPLER_FUSE_NONE,   // the chain cannot be fused at this sampler
+    LLAMA_SAMPLER_FUSE_NOOP,   // the sampler does nothing with its parameters
+    LLAMA_SAMPLER_FUSE_SPARSE, // the sampler changes the logits of a few candidates
+    LLAMA_SAMPLER_FUSE_CUT,    // the sampler keeps few candidates, selected with passes over the logits
+};
+
+static llama_sampler_fuse_type llama_sampler_fuse_type_get(const struct llama_sampler * smpl) {
+    if (smpl->iface == &llama_sampler_logit_bias_i) {
+        const auto * ctx = (const llama_sampler_logit_bias *) smpl->ctx;
+        return ctx->logit_bias.empty() ? LLAMA_SAMPLER_FUSE_NOOP : LLAMA_SAMPLER_FUSE_SPARSE;
+    }
+
+    if (smpl->iface == &llama_sampler_penalties_i) {
+        const auto * ctx = (const llama_sampler_penalties *) smpl->ctx;
+        if ((ctx->penalty_last_n == 0) ||
+            (ctx->penalty_repeat == 1.0f && ctx->penalty_freq == 0.0f && ctx->penalty_present == 0.0f)) {
+            return LLAMA_SAMPLER_FUSE_NOOP;
+        }
+        return LLAMA_SAMPLER_FUSE_SPARSE;
+    }
+
+    if (smpl->iface == &llama_sampler_top_k_i) {
+        return ((const llama_sampler_top_k *) smpl->ctx)->k <= 0 ? LLAMA_SAMPLER_FUSE_NOOP : LLAMA_SAMPLER_FUSE_CUT;
+    }
+
+    if (smpl->iface == &llama_sampler_min_p_i) {
+        return ((const llama_sampler_min_p *) smpl->ctx)->p <= 0.0f ? LLAMA_SAMPLER_FUSE_NOOP : LLAMA_SAMPLER_FUSE_CUT;
+    }
+
+    if (smpl->iface == &llama_sampler_top_p_i) {
+        return ((const llama_sampler_top_p *) smpl->ctx)->p >= 1.0f ? LLAMA_SAMPLER_FUSE_NOOP : LLAMA_SAMPLER_FUSE_NONE;
+    }
+
+    if (smpl->iface == &llama_sampler_typical_i) {
+        return ((const llama_sampler_typical *) smpl->ctx)->p >= 1.0f ? LLAMA_SAMPLER_FUSE_NOOP : LLAMA_SAMPLER_FUSE_NONE;
+    }
+
+    if (smpl->iface == &llama_sampler_top_n_sigma_i) {
+        return ((const llama_sampler_top_n_sigma *) smpl->ctx)->n <= 0.0f ? LLAMA_SAMPLER_FUSE_NOOP : LLAMA_SAMPLER_FUSE_NONE;
+    }
+
+    if (smpl->iface == &llama_sampler_xtc_i) {
+        const auto * ctx = (const llama_sampler_xtc *) smpl->ctx;
+        return ctx->probability <= 0.0f || ctx->threshold > 0.5f ? LLAMA_SAMPLER_FUSE_NOOP : LLAMA_SAMPLER_FUSE_NONE;
+    }
+
+    if (smpl->iface == &llama_sampler_dry_i) {
+        const auto * ctx = (const llama_sampler_dry *) smpl->ctx;
+        return ctx->dry_multiplier == 0.0f || ctx->dry_base < 1.0f || ctx->dry_penalty_last_n == 0 ? LLAMA_SAMPLER_FUSE_NOOP : LLAMA_SAMPLER_FUSE_NONE;
+    }
+
+    // a division by 1 does not change the logits
+    if (smpl->iface == &llama_sampler_temp_i) {
+        return ((const llama_sampler_temp *) smpl->ctx)->temp == 1.0f ? LLAMA_SAMPLER_FUSE_NOOP : LLAMA_SAMPLER_FUSE_NONE;
+    }
+
+    if (smpl->iface == &llama_sampler_temp_ext_i) {
+        const auto * ctx = (const llama_sampler_temp_ext *) smpl->ctx;
+        return ctx->temp == 1.0f && ctx->delta <= 0.0f ? LLAMA_SAMPLER_FUSE_NOOP : LLAMA_SAMPLER_FUSE_NONE;
+    }
+
+    return LLAMA_SAMPLER_FUSE_NONE;
+}
+
+// the index of the sampler that cuts the candidates of a fused chain, -1 if the chain cannot be fused
+static int32_t llama_sampler_chain_fused_cut(const llama_sampler_chain * chain) {
+    for (size_t i = 0; i < chain->samplers.size(); ++i) {
+        switch (llama_sampler_fuse_type_get(chain->samplers[i])) {
+            case LLAMA_SAMPLER_FUSE_NOOP:
+            case LLAMA_SAMPLER_FUSE_SPARSE:
+                break;
+            case LLAMA_SAMPLER_FUSE_CUT:
+                return i;
+            case LLAMA_SAMPLER_FUSE_NONE:
+                return -1;
+        }
+    }
+
+    return -1;
+}
+
+bool llama_sampler_chain_can_apply_logits(const struct llama_sampler * chain) {
+    if (chain->iface != &llama_sampler_chain_i) {
+        return false;
+    }
+
+    return llama_sampler_chain_fused_cut((const llama_sampler_chain *) chain->ctx) >= 0;
+}
+
+bool llama_sampler_chain_apply_logits(struct llama_sampler * smpl, const float * logits, llama_token_data_array * cur_p) {
+    if (smpl->iface != &llama_sampler_chain_i) {
+        return false;
+    }
+
+    auto * chain = (llama_sampler_chain *) smpl->ctx;
+
+    const int32_t i_cut = llama_sampler_chain_fused_cut(chain);
+    if (i_cut < 0) {
+        return false;
+    }
+
+    time_meas tm(chain->t_sample_us, chain->params.no_perf);
+
+    const int64_t n_vocab = cur_p->size;
+
+    // the candidates changed by the samplers before the cut, sorted by id
+    auto & sparse = chain->fused_sparse;
+    sparse.clear();
+
+    for (int32_t i = 0; i < i_cut; ++i) {
+        const auto * s = chain->samplers[i];
+
+        if (llama_sampler_fuse_type_get(s) != LLAMA_SAMPLER_FUSE_SPARSE) {
+            continue;
+        }
+
+        if (s->iface == &llama_sampler_logit_bias_i) {
+            for (const auto & lb : ((const llama_sampler_logit_bias *) s->ctx)->logit_bias) {
+                if (lb.token >= 0 && lb.token < n_vocab) {
+                    sparse.push_back({ lb.token, logits[lb.token], 0.0f });
+                }
+            }
+        } else {
+            for (const auto & tc : ((const llama_sampler_penalties *) s->ctx)->token_count) {
+                if (tc.first >= 0 && tc.first < n_vocab) {
+                    sparse.push_back({ tc.first, logits[tc.first], 0.0f });
+                }
+            }
+        }
+    }
+
+    std::sort(sparse.begin(), sparse.end(), [](const llama_token_data & a, const llama_token_data & b) {
+        return a.id < b.id;
+    });
+    sparse.erase(std::unique(sparse.begin(), sparse.end(), [](const llama_token_data & a, const llama_token_data & b) {
+        return a.id == b.id;
+    }), sparse.end());
+
+    // apply the samplers before the cut to these candidates, in the order of the chain
+    for (int32_t i = 0; i < i_cut; ++i) {
+        auto * s = chain->samplers[i];
+
+        if (llama_sampler_fuse_type_get(s) != LLAMA_SAMPLER_FUSE_SPARSE) {
+            continue;
+        }
+
+        if (s->iface == &llama_sampler_logit_bias_i) {
+            // same as llama_sampler_logit_bias_apply() on the full vocabulary, where each bias is added in turn
+            for (const auto & lb : ((const llama_sampler_logit_bias *) s->ctx)->logit_bias) {
+                auto it = std::lower_bound(sparse.begin(), sparse.end(), lb.token, [](const llama_token_data & a, llama_token id) {
+                    return a.id < id;
+                });
+                if (it != sparse.end() && it->id == lb.token) {
+                    it->logit += lb.bias;
+                }
+            }
+        } else {
+            llama_token_data_array sparse_p = { sparse.data(), sparse.size(), -1, false };
+            llama_sampler_apply(s, &sparse_p);
+        }
+    }
+
+    auto & sample = chain->fused_sample;
+
+    llama_fused_sample(logits, n_vocab, sparse, sample);
+
+    auto * data = cur_p->data;
+
+    const auto * cut = chain->samplers[i_cut];
+
+    if (cut->iface == &llama_sampler_top_k_i) {
+        const int64_t k = std::min<int64_t>(((const llama_sampler_top_k *) cut->ctx)->k, n_vocab);
+
+        // with at least k candidates not in the sparse set above the threshold, the top k of the changed logits are either
+        // above the threshold or in the sparse set
+        size_t n = 0;
+
+        for (int attempt = 0; ; ++attempt) {
+            const float t = llama_fused_threshold(sample, n_vocab, k, attempt);
+
+            n = llama_fused_collect_ge(logits, n_vocab, t, data);
+            n = llama_fused_remove_ids(data, n, sparse);
+
+            if ((int64_t) n >= k || t == -INFINITY) {
+                break;
+            }
+        }
+
+        std::copy(sparse.begin(), sparse.end(), data + n);
+        n += sparse.size();
+
+        GGML_ASSERT((int64_t) n >= k);
+
+        std::partial_sort(data, data + k, data + n, [](const llama_token_data & a, const llama_token_data & b) {
+            return a.logit > b.logit;
+        });
+
+        cur_p->size   = k;
+        cur_p->sorted = true;
+    } else {
+        // same as the unsorted path of llama_sampler_min_p_apply()
+        const auto * ctx = (const llama_sampler_min_p *) cut->ctx;
+
+        // the sampled logits are not in the sparse set, so the max of the candidates not in this set is above the threshold
+        // and it is found with the few logits above it. the logits are collected again only if the threshold of min-p is
+        // lower than this threshold
+        const float t = llama_fused_threshold(sample, n_vocab, 1, 0);
+
+        size_t n = llama_fused_collect_ge(logits, n_vocab, t, data);
+        n = llama_fused_remove_ids(data, n, sparse);
+
+        float max_logit = -FLT_MAX;
+        for (size_t i = 0; i < n; ++i) {
+            max_logit = std::max(max_logit, data[i].logit);
+        }
+        for (const auto & td : sparse) {
+            max_logit = std::max(max_logit, td.logit);
+        }
+
+        const float min_logit = max_logit + logf(ctx->p);
+
+        if (min_logit < t) {
+            n = llama_fused_collect_ge(logits, n_vocab, min_logit, data);
+            n = llama_fused_remove_ids(data, n, sparse);
+        }
+
+        n = std::remove_if(data, data + n, [&](const llama_token_data & td) {
+            return !(td.logit >= min_logit);
+        }) - data;
+
+        // merge the sparse candidates above the threshold, keeping the order of the ids
+        const size_t n0 = n;
+        for (const auto & td : sparse) {
+            if (td.logit >= min_logit) {
+                data[n++] = td;
+            }
+        }
+
+        std::inplace_merge(data, data + n0, data + n, [](const llama_token_data & a, const llama_token_data & b) {
+            return a.id < b.id;
+        });
+
+        // the sorted path would be used instead
+        if (n == 0 || n < ctx->min_keep) {
+            return false;
+        }
+
+        cur_p->size   = n;
+        cur_p->sorted = false;
+    }
+
+    cur_p->selected = -1;
+
+    for (size_t i = i_cut + 1; i < chain->samplers.size(); ++i) {
+        llama_sampler_apply(chain->samplers[i], cur_p);
+    }
+
+    return true;
+}
+
 // utils
 
 uint32_t llama_sampler_get_seed(const struct llama_sampler * smpl) {
@@ -2545,6 +2916,19 @@ uint32_t llama_sampler_get_seed(const struct llama_sampler * smpl) {
 struct llama_perf_sampler_data llama_perf_sampler(const struct llama_sampler * chain) {
     struct llama_perf_sampler_data data = {};
 
+    if (chain != nullptr && chain->iface == &llama_sampler_grammar_i) {
+        const auto * ctx = (const struct llama_sampler_grammar *) chain->ctx;
+
+        data.t_sample_ms = 1e-3 * ctx->t_sample_us;
+        data.n_sample    = ctx->n_sample;
+
+        if (ctx->grammar && ctx->grammar->mask_cache) {
+            data.n_mask_hit = ctx->grammar->mask_cache->n_hit;
+        }
+
+        return data;
+    }
+
     if (chain == nullptr || chain->iface != &llama_sampler_chain_i) {
         GGML_ABORT("%s: invalid sampler passed - requires a sampler created with llama_sampler_chain_init()\n", __func__);
     }
@@ -2560,11 +2944,29 @@ struct llama_perf_sampler_data llama_perf_sampler(const struct llama_sampler * c
 void llama_perf_sampler_print(const struct llama_sampler * chain) {
     const auto data = llama_perf_sampler(chain);
 
+    if (chain->iface == &llama_sampler_grammar_i) {
+        LLAMA_LOG_INFO("%s:     grammar time = %10.2f ms / %5d runs   (%8.2f ms per run, %5d mask cache hits = %5.1f%%)\n",
+                __func__, data.t_sample_ms, data.n_sample, data.t_sample_ms / data.n_sample,
+                data.n_mask_hit, 100.0 * data.n_mask_hit / std::max(1, data.n_sample));
+        return;
+    }
+
     LLAMA_LOG_INFO("%s:    sampling time = %10.2f ms / %5d runs   (%8.2f ms per token, %8.2f tokens per second)\n",
             __func__, data.t_sample_ms, data.n_sample, data.t_sample_ms / data.n_sample, 1e3 / data.t_sample_ms * data.n_sample);
 }
 
 void llama_perf_sampler_reset(struct llama_sampler * chain) {
+    if (chain != nullptr && chain->iface == &llama_sampler_grammar_i) {
+        auto * ctx = (struct llama_sampler_grammar *) chain->ctx;
+
+        ctx->t_sample_us = ctx->n_sample = 0;
+
+        if (ctx->grammar && ctx->grammar->mask_cache) {
+            ctx->grammar->mask_cache->n_hit = ctx->grammar->mask_cache->n_miss = 0;
+        }
+        return;
+    }
+
     if (chain == nullptr || chain->iface != &llama_sampler_chain_i) {
         GGML_ABORT("%s: invalid sampler passed - requires a sampler created with llama_sampler_chain_init()\n", __func__);
     }
@@ -16,6 +16,10 @@ struct llama_sampler_chain {
 
     std::vector<struct llama_sampler *> samplers;
 
+    // the candidates changed by the samplers before the cut of a fused chain (see llama_sampler_chain_apply_logits)
+    std::vector<llama_token_data> fused_sparse;
+    std::vector<float>            fused_sample;
+
     // timing
 
     mutable int64_t t_sample_us;
@@ -0,0 +1,235 @@
+#pragma once
+
+#include "llama.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <vector>
+
+// a sparse set of sequence ids
+//
+// the KV cells and the batch tokens almost always belong to a single sequence (a few more for a shared prompt), so the
+// smallest id is stored inline and the other ids, if any, in a sorted array allocated on demand. the cost of the
+// operations is proportional to the number of ids in the set instead of to LLAMA_MAX_SEQ, as with a bitset
+class llama_seq_set {
+public:
+    llama_seq_set() = default;
+
+    llama_seq_set(const llama_seq_set & other) : s0(other.s0) {
+        if (other.ext) {
+            ext = std::make_unique<std::vector<llama_seq_id>>(*other.ext);
+        }
+    }
+
+    llama_seq_set(llama_seq_set && other) noexcept = default;
+
+    llama_seq_set & operator=(const llama_seq_set & other) {
+        if (this != &other) {
+            s0 = other.s0;
+            ext = other.ext ? std::make_unique<std::vector<llama_seq_id>>(*other.ext) : nullptr;
+        }
+        return *this;
+    }
+
+    llama_seq_set & operator=(llama_seq_set && other) noexcept = default;
+
+    bool test(llama_seq_id seq_id) const {
+        assert(seq_id >= 0);
+
+        if (seq_id == s0) {
+            return true;
+        }
+
+        if (seq_id < s0 || !ext) {
+            return false;
+        }
+
+        return std::binary_search(ext->begin(), ext->end(), seq_id);
+    }
+
+    void set(llama_seq_id seq_id) {
+        assert(seq_id >= 0);
+
+        if (s0 < 0) {
+            s0 = seq_id;
+            return;
+        }
+
+        if (seq_id == s0) {
+            return;
+        }
+
+        if (!ext) {
+            ext = std::make_unique<std::vector<llama_seq_id>>();
+        }
+
+        if (seq_id < s0) {
+            ext->insert(ext->begin(), s0);
+            s0 = seq_id;
+            return;
+        }
+
+        // the ids are usually added in increasing order
+        if (ext->empty() || ext->back() < seq_id) {
+            ext->push_back(seq_id);
+            return;
+        }
+
+        auto it = std::lower_bound(ext->begin(), ext->end(), seq_id);
+        if (*it != seq_id) {
+            ext->insert(it, seq_id);
+        }
+    }
+
+    void reset(llama_seq_id seq_id) {
+        assert(seq_id >= 0);
+
+        if (seq_id == s0) {
+            if (ext) {
+                s0 = ext->front();
+                ext->erase(ext->begin());
+                if (ext->empty()) {
+                    ext.reset();
+                }
+            } else {
+                s0 = -1;
+            }
+            return;
+        }
+
+        if (!ext) {
+            return;
+        }
+
+        auto it = std::lower_bound(ext->begin(), ext->end(), seq_id);
+        if (it != ext->end() && *it == seq_id) {
+            ext->erase(it);
+            if (ext->empty()) {
+                ext.reset();
+            }
+        }
+    }
+
+    void reset() {
+        s0 = -1;
+        ext.reset();
+    }
+
+    bool none() const {
+        return s0 < 0;
+    }
+
+    bool any() const {
+        return s0 >= 0;
+    }
+
+    int count() const {
+        return s0 < 0 ? 0 : 1 + (ext ? (int) ext->size() : 0);
+    }
+
+    // the smallest sequence id in the set, -1 if empty
+    llama_seq_id first() const {
+        return s0;
+    }
+
+    // call f(seq_id) for each id in the set, in increasing order
+    template <typename F>
+    void for_each(F && f) const {
+        if (s0 < 0) {
+            return;
+        }
+
+        f(s0);
+
+        if (ext) {
+            for (const llama_seq_id seq_id : *ext) {
+                f(seq_id);
+            }
+        }
+    }
+
+    bool intersects(const llama_seq_set & other) const {
+        if (none() || other.none()) {
+            return false;
+        }
+
+        // fast path for single-owner sets
+        if (!ext) {
+            return other.test(s0);
+        }
+
+        if (!other.ext) {
+            return test(other.s0);
+        }
+
+        bool res = false;
+        for_each([&](llama_seq_id seq_id) {
+            res = res || other.test(seq_id);
+        });
+
+        return res;
+    }
+
+    bool is_subset_of(const llama_seq_set & other) const {
+        bool res = true;
+        for_each([&](llama_seq_id seq_id) {
+            res = res && other.test(seq_id);
+        });
+
+        return res;
+    }
+
+    llama_seq_set & operator&=(const llama_seq_set & other) {
+        std::vector<llama_seq_id> ids;
+        for_each([&](llama_seq_id seq_id) {
+            if (other.test(seq_id)) {
+                ids.push_back(seq_id);
+            }
+        });
+
+        reset();
+        for (const llama_seq_id seq_id : ids) {
+            set(seq_id);
+        }
+
+        return *this;
+    }
+
+    bool operator==(const llama_seq_set & other) const {
+        if (s0 != other.s0) {
+            return false;
+        }
+
+        if (!ext || !other.ext) {
+            return !ext && !other.ext;
+        }
+
+        return *ext == *other.ext;
+    }
+
+    bool operator!=(const llama_seq_set & other) const {
+        return !(*this == other);
+    }
+
+    struct hash {
+        size_t operator()(const llama_seq_set & s) const {
+            size_t res = std::hash<llama_seq_id>{}(s.s0);
+            if (s.ext) {
+                for (const llama_seq_id seq_id : *s.ext) {
+                    res ^= std::hash<llama_seq_id>{}(seq_id) + 0x9e3779b9 + (res << 6) + (res >> 2);
+                }
+            }
+            return res;
+        }
+    };
+
+private:
+    // the smallest id in the set, -1 if the set is empty
+    llama_seq_id s0 = -1;
+
+    // the other ids in increasing order, allocated only for sets with more than one id
+    std::unique_ptr<std::vector<llama_seq_id>> ext;
+};
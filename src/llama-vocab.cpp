@@ -2,6 +2,7 @@
 
 #include "ggml.h"
 #include "gguf.h"
+#include "llama-grammar.h"
 #include "llama-impl.h"
 #include "llama-model-loader.h"
 
@@ -17,6 +18,7 @@
 #include <forward_list>
 #include <limits>
 #include <map>
+#include <mutex>
 #include <queue>
 #include <set>
 #include <unordered_map>
@@ -1568,6 +1570,9 @@ struct llama_vocab::impl {
 
     std::vector<llama_token> cache_special_tokens;
     std::vector<std::string> cache_token_to_piece; // llama_token_to_piece(special = true);
+
+    mutable std::once_flag                        grammar_tokens_once;
+    mutable std::unique_ptr<llama_grammar_tokens> grammar_tokens;
     struct pair_hash {
         size_t operator()(const std::pair<std::string, std::string> & p) const {
             return std::hash<std::string>{}(p.first) ^  //create some hash for pair
@@ -3465,6 +3470,13 @@ const std::string & llama_vocab::token_to_piece(llama_token token) const {
     return pimpl->token_to_piece(token);
 }
 
+const llama_grammar_tokens & llama_vocab::get_grammar_tokens() const {
+    std::call_once(pimpl->grammar_tokens_once, [this]() {
+        pimpl->grammar_tokens = llama_grammar_tokens_init(*this);
+    });
+    return *pimpl->grammar_tokens;
+}
+
 int32_t llama_vocab::token_to_piece(llama_token token, char * buf, int32_t length, int32_t lstrip, bool special) const {
     return pimpl->token_to_piece(token, buf, length, lstrip, special);
 }
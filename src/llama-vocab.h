@@ -6,6 +6,8 @@
 #include <vector>
 #include <memory>
 
+struct llama_grammar_tokens;
+
 // pre-tokenization types
 enum llama_vocab_pre_type {
     LLAMA_VOCAB_PRE_TYPE_DEFAULT        = 0,
@@ -155,6 +157,9 @@ struct llama_vocab {
     // use cached data
     const std::string & token_to_piece(llama_token token) const;
 
+    // decoded code points and prefix trie of the tokens, built on first use
+    const llama_grammar_tokens & get_grammar_tokens() const;
+
     int32_t detokenize(
             const llama_token * tokens,
                       int32_t   n_tokens,
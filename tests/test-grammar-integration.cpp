@@ -10,7 +10,13 @@
 #include <nlohmann/json.hpp>
 
 #include <cassert>
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <sstream>
 #include <string>
+#include <unordered_set>
 #include <vector>
 
 using json = nlohmann::ordered_json;
@@ -1295,7 +1301,237 @@ static void test_json_schema() {
     );
 }
 
-int main() {
+// the stacks are nodes of a graph-structured stack: equal stacks are the same node, and a clone has its
+// own nodes and matches the same strings
+static void test_stack_sharing() {
+    fprintf(stderr, "⚫ Testing stack sharing\n");
+
+    auto * grammar = build_grammar(R"""(
+        root ::= item (ws "," ws item)*
+        item ::= ws "[" ws (item (ws "," ws item)*)? ws "]" ws | ws [a-z]+ ws
+        ws   ::= (" " | "\n" | "  ")*)""");
+    assert(grammar != nullptr);
+
+    // every stack seen so far, by its elements
+    std::map<std::vector<const llama_grammar_element *>, const llama_grammar_stack_node *> nodes;
+
+    for (const auto & cpt : unicode_cpts_from_utf8("[ [a , b ] , [ [ c ], ")) {
+        llama_grammar_accept(grammar, cpt);
+
+        const auto & stacks = llama_grammar_get_stacks(grammar);
+        assert(!stacks.empty());
+
+        std::unordered_set<const llama_grammar_stack_node *> tops;
+        for (const auto & stack : stacks) {
+            assert(tops.insert(stack.top).second);
+
+            for (auto sub = stack; !sub.empty(); sub = sub.pop()) {
+                std::vector<const llama_grammar_element *> elements;
+                for (size_t i = 0; i < sub.size(); ++i) {
+                    elements.push_back(sub[i]);
+                }
+                assert(nodes.emplace(elements, sub.top).first->second == sub.top);
+            }
+        }
+    }
+
+    auto * clone = llama_grammar_clone_impl(*grammar);
+
+    const auto & stacks = llama_grammar_get_stacks(grammar);
+    const auto & stacks_clone = llama_grammar_get_stacks(clone);
+    assert(stacks.size() == stacks_clone.size());
+    for (size_t i = 0; i < stacks.size(); ++i) {
+        assert(stacks[i].size() == stacks_clone[i].size());
+        assert(stacks[i].top != stacks_clone[i].top);
+    }
+
+    llama_grammar_free_impl(grammar);
+
+    assert(match_string("d ,e ] ,[ [ [ x ] ] ] ] , [ f , g ]", clone));
+    llama_grammar_free_impl(clone);
+
+    fprintf(stdout, "  ✅︎\n");
+}
+
+// the nodes of the stacks that are not reachable anymore are dropped between two pieces once the pool is over its
+// threshold, the grammar keeps matching the same strings
+static void test_stack_gc() {
+    fprintf(stderr, "⚫ Testing stack gc\n");
+
+    const std::string grammar_str = R"""(
+        root ::= item (ws "," ws item)*
+        item ::= ws "[" ws (item (ws "," ws item)*)? ws "]" ws | ws [a-z]+ ws
+        ws   ::= (" " | "\n" | "  ")*)""";
+
+    auto * grammar = build_grammar(grammar_str);
+    auto * ref     = build_grammar(grammar_str);
+    assert(grammar != nullptr && ref != nullptr);
+
+    // rule and offset of an element, the same for both grammars
+    const auto element_id = [](const llama_grammar & g, const llama_grammar_element * pos) {
+        for (size_t ir = 0; ir < g.rules.size(); ++ir) {
+            if (pos >= g.rules[ir].data() && pos < g.rules[ir].data() + g.rules[ir].size()) {
+                return std::make_pair(ir, (size_t) (pos - g.rules[ir].data()));
+            }
+        }
+        return std::make_pair(g.rules.size(), (size_t) 0);
+    };
+
+    auto & pool = *grammar->stack_pool;
+    pool.n_gc_min = 32;
+    pool.n_gc     = 32;
+
+    // nested lists of varying depth, so that new stacks keep being reached
+    std::vector<std::string> pieces;
+    for (int i = 0; i < 64; ++i) {
+        const int depth = 1 + (i*7) % 9;
+        pieces.push_back(i == 0 ? "" : " , ");
+        pieces.push_back(std::string(depth, '['));
+        pieces.push_back(std::string(1, 'a' + i % 26));
+        pieces.push_back(std::string(depth, ']'));
+    }
+
+    size_t n_gc = 0;
+    size_t n_nodes_max = 0;
+    for (const auto & piece : pieces) {
+        const size_t n_nodes = pool.nodes.size();
+
+        llama_grammar_accept_str(*grammar, piece);
+        llama_grammar_accept_str(*ref,     piece);
+
+        n_gc += pool.nodes.size() < n_nodes;
+        n_nodes_max = std::max(n_nodes_max, pool.nodes.size());
+
+        assert(pool.nodes.size() <= pool.n_gc);
+
+        // same stacks as without gc
+        const auto & stacks     = llama_grammar_get_stacks(grammar);
+        const auto & stacks_ref = llama_grammar_get_stacks(ref);
+        assert(stacks.size() == stacks_ref.size());
+        for (size_t i = 0; i < stacks.size(); ++i) {
+            assert(stacks[i].size() == stacks_ref[i].size());
+            for (size_t j = 0; j < stacks[i].size(); ++j) {
+                assert(element_id(*grammar, stacks[i][j]) == element_id(*ref, stacks_ref[i][j]));
+            }
+        }
+    }
+
+    assert(n_gc > 0);
+    assert(n_nodes_max < ref->stack_pool->nodes.size());
+
+    const auto & stacks = llama_grammar_get_stacks(grammar);
+    assert(std::any_of(stacks.begin(), stacks.end(), [](const llama_grammar_stack & stack) { return stack.empty(); }));
+
+    llama_grammar_free_impl(grammar);
+    llama_grammar_free_impl(ref);
+
+    fprintf(stdout, "  ✅︎\n");
+}
+
+static void bench_accept(const std::string & name, const std::string & grammar_str, const std::string & input, int n_iter) {
+    auto * grammar = build_grammar(grammar_str);
+    if (grammar == nullptr) {
+        fprintf(stderr, "%s: failed to build grammar\n", name.c_str());
+        return;
+    }
+
+    const auto cpts = unicode_cpts_from_utf8(input);
+
+    const llama_grammar_stacks stacks_org = llama_grammar_get_stacks(grammar); // copy
+    llama_grammar_stacks & stacks_cur = llama_grammar_get_stacks(grammar);
+
+    size_t n_stacks = 0;
+    size_t n_stacks_max = 0;
+
+    const auto t_start = std::chrono::steady_clock::now();
+    for (int iter = 0; iter < n_iter; ++iter) {
+        stacks_cur = stacks_org;
+        for (const auto & cpt : cpts) {
+            llama_grammar_accept(grammar, cpt);
+            assert(!stacks_cur.empty());
+            if (iter == 0) {
+                n_stacks    += stacks_cur.size();
+                n_stacks_max = std::max(n_stacks_max, stacks_cur.size());
+            }
+        }
+    }
+    const auto t_end = std::chrono::steady_clock::now();
+
+    const double t_us = std::chrono::duration<double, std::micro>(t_end - t_start).count();
+
+    printf("%-20s: %5zu chars, %8.3f us/char, %6.1f stacks avg, %4zu max\n", name.c_str(), cpts.size(),
+            t_us/n_iter/cpts.size(), (double) n_stacks/cpts.size(), n_stacks_max);
+
+    llama_grammar_free_impl(grammar);
+}
+
+// the cost of accepting a char with the grammars in grammars/ and with large generated schemas
+static void test_perf(const std::string & grammars_dir) {
+    const auto read_file = [&](const std::string & name) {
+        std::ifstream file(grammars_dir + "/" + name);
+        std::stringstream ss;
+        ss << file.rdbuf();
+        return ss.str();
+    };
+
+    std::string doc = R"""({"items": [)""";
+    for (int i = 0; i < 30; i++) {
+        doc += (i ? ", " : "") + std::string(R"""({"id": )""") + std::to_string(i) + R"""(, "name": "item )""" + std::to_string(i) +
+            R"""(", "tags": ["a", "b"], "price": 12.5, "ok": true})""";
+    }
+    doc += "]}";
+
+    bench_accept("json.gbnf",       read_file("json.gbnf"),       doc, 20);
+    bench_accept("json_arr.gbnf",   read_file("json_arr.gbnf"),   "[\n" + doc + ",\n" + doc + "]", 10);
+    bench_accept("arithmetic.gbnf", read_file("arithmetic.gbnf"), "(1+2)*3-4/(5+6*7)-(8*(9+10))/11+12-13*14\n", 200);
+    bench_accept("list.gbnf",       read_file("list.gbnf"),       "- item one\n- item two with more words\n- item three\n", 200);
+    bench_accept("chess.gbnf",      read_file("chess.gbnf"),      "1. e4 e5\n2. Nf3 Nc6\n3. Bb5 a6\n4. Ba4 Nf6\n5. O-O Be7\n", 200);
+    bench_accept("c.gbnf",          read_file("c.gbnf"),          "int main(int a){int x = a+b*3;while(x<10){x = x+1;}return x;}", 200);
+
+    // an object with many optional properties
+    {
+        json props = json::object();
+        std::string input = "{";
+        for (int i = 0; i < 40; i++) {
+            props["field_" + std::to_string(i)] = i % 2 ? json{{"type", "string"}} : json{{"type", "integer"}};
+            if (i % 3 == 0) {
+                input += (input.size() > 1 ? ", " : "") + std::string("\"field_") + std::to_string(i) + "\": " + (i % 2 ? "\"v\"" : "7");
+            }
+        }
+        input += "}";
+        bench_accept("schema-40-optional", json_schema_to_grammar({{"type", "object"}, {"properties", props}}), input, 50);
+    }
+
+    // a union of tool calls
+    {
+        json tools = json::array();
+        for (int t = 0; t < 16; t++) {
+            json args = json::object();
+            for (int i = 0; i < 6; i++) {
+                args["arg_" + std::to_string(i)] = i % 2 ? json{{"type", "string"}} : json{{"type", "integer"}};
+            }
+            tools.push_back({
+                {"type", "object"},
+                {"properties", {{"name", {{"const", "tool_" + std::to_string(t)}}}, {"arguments", {{"type", "object"}, {"properties", args}}}}},
+                {"required", json::array({"name", "arguments"})},
+            });
+        }
+        std::string input = "[";
+        for (int k = 0; k < 4; k++) {
+            input += (k ? ", " : "") + std::string(R"""({"name": "tool_)""") + std::to_string(k*5) + R"""(", "arguments": {"arg_0": 1, "arg_1": "x", "arg_4": 3}})""";
+        }
+        input += "]";
+        bench_accept("schema-16-tools", json_schema_to_grammar({{"type", "array"}, {"items", {{"anyOf", tools}}}}), input, 50);
+    }
+}
+
+int main(int argc, char ** argv) {
+    // test-grammar-integration perf [grammars dir]: only the benchmarks
+    if (argc > 1 && strcmp(argv[1], "perf") == 0) {
+        test_perf(argc > 2 ? argv[2] : "grammars");
+        return 0;
+    }
+
     fprintf(stdout, "Running grammar integration tests...\n");
     test_simple_grammar();
     test_complex_grammar();
@@ -1305,6 +1541,8 @@ int main() {
     test_failure_missing_reference();
     test_failure_left_recursion();
     test_json_schema();
+    test_stack_sharing();
+    test_stack_gc();
     fprintf(stdout, "All tests passed.\n");
     return 0;
 }
@@ -0,0 +1,158 @@
+#ifdef NDEBUG
+#    undef NDEBUG
+#endif
+
+// checks that the grammar sampler masks the same tokens when applied to the whole vocab at once
+// (walking the token trie), when applied to small slices of it (matching each candidate) and when
+// the mask of the grammar state is taken from the cache
+
+#include "llama.h"
+#include "common.h"
+
+#include <cassert>
+#include <cmath>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+static const llama_vocab * vocab;
+
+static std::vector<bool> apply(llama_sampler * smpl, size_t n_slice) {
+    const int n_vocab = llama_vocab_n_tokens(vocab);
+
+    std::vector<llama_token_data> cur;
+    cur.reserve(n_vocab);
+    for (llama_token id = 0; id < n_vocab; id++) {
+        cur.push_back({ id, 0.0f, 0.0f });
+    }
+
+    for (size_t i0 = 0; i0 < cur.size(); i0 += n_slice) {
+        llama_token_data_array cur_p = { cur.data() + i0, std::min(n_slice, cur.size() - i0), -1, false };
+        llama_sampler_apply(smpl, &cur_p);
+    }
+
+    std::vector<bool> allowed(n_vocab);
+    for (llama_token id = 0; id < n_vocab; id++) {
+        allowed[id] = std::isfinite(cur[id].logit);
+    }
+    return allowed;
+}
+
+static void test(const std::string & desc, const std::string & grammar_str, const std::string & input) {
+    fprintf(stderr, "%s: %s\n", __func__, desc.c_str());
+
+    llama_sampler * smpl = llama_sampler_init_grammar(vocab, grammar_str.c_str(), "root");
+    assert(smpl != nullptr);
+
+    const size_t n_vocab = llama_vocab_n_tokens(vocab);
+    const size_t n_slice = n_vocab/16;
+
+    // follow the input with the longest allowed token, which picks byte tokens for the chars missing
+    // from the vocab and leaves the grammar in the middle of a UTF-8 sequence
+    size_t pos = 0;
+
+    for (int i = 0; ; i++) {
+        // a clone starts with an empty mask cache
+        llama_sampler * fresh = llama_sampler_clone(smpl);
+        const auto sliced = apply(fresh, n_slice);
+        const auto all    = apply(fresh, n_vocab);
+        const auto cached = apply(fresh, n_slice);
+        llama_sampler_free(fresh);
+
+        // may be a hit on the state of an earlier step
+        const auto reused = apply(smpl, n_vocab);
+
+        llama_token best     = LLAMA_TOKEN_NULL;
+        size_t      best_len = 0;
+
+        size_t n_allowed = 0;
+        for (size_t id = 0; id < n_vocab; id++) {
+            if (all[id] != sliced[id] || all[id] != cached[id] || all[id] != reused[id]) {
+                fprintf(stderr, "  mismatch after %d tokens: token %zu '%s' is %s with the whole vocab\n",
+                        i, id, common_token_to_piece(vocab, id).c_str(), all[id] ? "allowed" : "rejected");
+                assert(false);
+            }
+            if (!all[id]) {
+                continue;
+            }
+            n_allowed++;
+
+            const std::string piece = common_token_to_piece(vocab, id);
+            if (piece.size() > best_len && input.compare(pos, piece.size(), piece) == 0) {
+                best     = id;
+                best_len = piece.size();
+            }
+        }
+        assert(n_allowed > 0);
+
+        if (pos == input.size()) {
+            break;
+        }
+        assert(best != LLAMA_TOKEN_NULL);
+
+        llama_sampler_accept(smpl, best);
+        pos += best_len;
+    }
+
+    const auto perf = llama_perf_sampler(smpl);
+    fprintf(stderr, "  %d applies, %d mask cache hits\n", perf.n_sample, perf.n_mask_hit);
+
+    // the final state is cached
+    apply(smpl, n_vocab);
+    assert(llama_perf_sampler(smpl).n_mask_hit == perf.n_mask_hit + 1);
+
+    llama_sampler_free(smpl);
+}
+
+int main(int argc, const char ** argv) {
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s <vocab-file>\n", argv[0]);
+        return 1;
+    }
+
+    const char * vocab_file = argv[1];
+
+    fprintf(stderr, "reading vocab from: '%s'\n", vocab_file);
+
+    llama_backend_init();
+
+    auto mparams = llama_model_default_params();
+    mparams.vocab_only = true;
+
+    llama_model * model = llama_model_load_from_file(vocab_file, mparams);
+    if (model == NULL) {
+        fprintf(stderr, "%s: error: failed to load vocab '%s'\n", __func__, vocab_file);
+        return 1;
+    }
+
+    vocab = llama_model_get_vocab(model);
+
+    test("literal", R"""(root ::= "hello" (" world")*)""", "hello world world");
+
+    test("char classes", R"""(root ::= [a-z]+ (" " [0-9]+)? [.!?])""", "abc 123!");
+
+    test("non-ascii", R"""(
+        root ::= word (" " word)*
+        word ::= [a-zA-ZÀ-ɏ]+ | [一-鿿]+ | [€✓]
+    )""", "héllo 你好世界 € ✓ déjà");
+
+    test("negated class", R"""(root ::= "\"" [^"\\\x7F\x00-\x1F]* "\"")""", "\"naïve café — ok\"");
+
+    test("any char", R"""(root ::= "<" .* ">")""", "<anything ▲ goes>");
+
+    test("json", R"""(
+        root   ::= object
+        value  ::= object | array | string | number | ("true" | "false" | "null") ws
+        object ::= "{" ws ( string ":" ws value ("," ws string ":" ws value)* )? "}" ws
+        array  ::= "[" ws ( value ("," ws value)* )? "]" ws
+        string ::= "\"" ( [^"\\\x7F\x00-\x1F] | "\\" (["\\bfnrt] | "u" [0-9a-fA-F]{4}) )* "\"" ws
+        number ::= ("-"? ([0-9] | [1-9] [0-9]{0,15})) ("." [0-9]+)? ([eE] [-+]? [0-9] [1-9]{0,15})? ws
+        ws     ::= | " " | "\n" [ \t]{0,20}
+    )""", R"""({"name": "Zoë", "tags": ["a", "ü", "日本"], "n": -1.5e3, "ok": true})""");
+
+    llama_model_free(model);
+    llama_backend_free();
+
+    fprintf(stderr, "All tests passed.\n");
+    return 0;
+}
@@ -0,0 +1,117 @@
+// checks the KV budget (n_kv_budget): a batch that does not fit in the cache must fail without evicting any cell, and a
+// batch that fits evicts only the cells over the budget, never the last n_kv_recent positions
+//
+// usage: LLAMA_SET_ROWS=1 test-kv-budget <model>
+
+#ifdef NDEBUG
+#undef NDEBUG
+#endif
+
+#include "llama.h"
+#include "get-model.h"
+
+#include <cassert>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <vector>
+
+static const int n_ctx    = 64;
+static const int n_budget = 32;
+static const int n_recent = 8;
+static const int n_prompt = 30;
+
+// decode n tokens of the sequence at the positions [p0, p0 + n)
+static int decode(llama_context * ctx, llama_batch & batch, const std::vector<llama_token> & tokens, llama_seq_id seq_id, llama_pos p0, int n) {
+    batch.n_tokens = 0;
+    for (int i = 0; i < n; ++i) {
+        batch.token   [batch.n_tokens]    = tokens[(p0 + i) % tokens.size()];
+        batch.pos     [batch.n_tokens]    = p0 + i;
+        batch.n_seq_id[batch.n_tokens]    = 1;
+        batch.seq_id  [batch.n_tokens][0] = seq_id;
+        batch.logits  [batch.n_tokens]    = i == n - 1;
+        batch.n_tokens++;
+    }
+
+    return llama_decode(ctx, batch);
+}
+
+static uint64_t n_evicted(llama_context * ctx) {
+    llama_memory_stream_stats stats;
+    assert(llama_memory_get_stream_stats(llama_get_memory(ctx), &stats, 1) == 1);
+
+    return stats.n_evicted;
+}
+
+int main(int argc, char ** argv) {
+    auto * model_path = get_model_or_exit(argc, argv);
+
+    llama_backend_init();
+
+    llama_model * model = llama_model_load_from_file(model_path, llama_model_default_params());
+    if (model == nullptr) {
+        fprintf(stderr, "%s: failed to load the model '%s'\n", __func__, model_path);
+        return 1;
+    }
+
+    auto cparams = llama_context_default_params();
+
+    cparams.n_ctx       = n_ctx;
+    cparams.n_batch     = n_ctx;
+    cparams.n_ubatch    = n_ctx;
+    cparams.n_seq_max   = 2;
+    cparams.kv_unified  = true;
+    cparams.flash_attn  = false;
+    cparams.n_kv_budget = n_budget;
+    cparams.n_kv_recent = n_recent;
+
+    llama_context * ctx = llama_init_from_model(model, cparams);
+    assert(ctx != nullptr);
+    assert(llama_n_ctx(ctx) == n_ctx);
+
+    const int n_vocab = llama_vocab_n_tokens(llama_model_get_vocab(model));
+
+    std::mt19937 rng(42);
+    std::vector<llama_token> tokens(n_ctx);
+    for (auto & t : tokens) {
+        t = rng() % n_vocab;
+    }
+
+    llama_batch batch = llama_batch_init(n_ctx, 0, 1);
+
+    llama_memory_t mem = llama_get_memory(ctx);
+
+    // both sequences within the budget, 60 of the 64 cells are used
+    assert(decode(ctx, batch, tokens, 0, 0, n_prompt) == 0);
+    assert(decode(ctx, batch, tokens, 1, 0, n_prompt) == 0);
+    assert(n_evicted(ctx) == 0);
+
+    // 16 more tokens of sequence 0 would be over the budget, but they do not fit in the 4 free cells: the batch fails
+    // and the cache is left untouched
+    assert(decode(ctx, batch, tokens, 0, n_prompt, 16) == 1);
+    assert(n_evicted(ctx) == 0);
+    for (llama_seq_id s = 0; s < 2; ++s) {
+        assert(llama_memory_seq_pos_min(mem, s) == 0);
+        assert(llama_memory_seq_pos_max(mem, s) == n_prompt - 1);
+    }
+
+    // 4 more tokens fit, 2 cells of sequence 0 are evicted to stay within the budget
+    assert(decode(ctx, batch, tokens, 0, n_prompt, 4) == 0);
+    assert(n_evicted(ctx) == 2);
+    assert(llama_memory_seq_pos_max(mem, 0) == n_prompt + 3);
+    assert(llama_memory_seq_pos_min(mem, 1) == 0 && llama_memory_seq_pos_max(mem, 1) == n_prompt - 1);
+
+    // the free cells are reused, the recent positions are kept
+    assert(decode(ctx, batch, tokens, 0, n_prompt + 4, 2) == 0);
+    assert(n_evicted(ctx) == 4);
+    assert(llama_memory_seq_pos_max(mem, 0) == n_prompt + 5);
+
+    llama_batch_free(batch);
+    llama_free(ctx);
+    llama_model_free(model);
+
+    llama_backend_free();
+
+    fprintf(stderr, "All tests passed.\n");
+    return 0;
+}
@@ -0,0 +1,1109 @@
+// tests for the sequence sets, the KV cell metadata, the block tables of the paged KV cache and the runs of cells of the
+// KQ mask and the index of the empty cells, with benchmarks of many short concurrent sequences, of forking sequences
+// that share a long prefix, of building the KQ mask for increasing numbers of KV cells and of finding the free cells of
+// a large cache
+//
+// usage: test-kv-cells [n_seq] [n_tokens_per_seq] [n_prefix]
+
+#ifdef NDEBUG
+#undef NDEBUG
+#endif
+
+#include "llama.h"
+#include "ggml.h"
+
+#include "../src/llama-batch.h"
+#include "../src/llama-kv-blocks.h"
+#include "../src/llama-kv-cells.h"
+#include "../src/llama-kv-mask.h"
+#include "../src/llama-seq-set.h"
+#include "../src/llama-vocab.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cstdio>
+#include <cmath>
+#include <cstdlib>
+#include <limits>
+#include <random>
+#include <vector>
+
+static void test_seq_set() {
+    llama_seq_set a;
+
+    assert(a.none());
+    assert(a.count() == 0);
+    assert(a.first() == -1);
+
+    a.set(7);
+    assert(a.any() && a.count() == 1 && a.first() == 7);
+    assert(a.test(7) && !a.test(3) && !a.test(9));
+
+    // out of order insertion keeps the ids sorted
+    a.set(3);
+    a.set(LLAMA_MAX_SEQ - 1);
+    a.set(5);
+    a.set(5);
+    assert(a.count() == 4 && a.first() == 3);
+
+    std::vector<llama_seq_id> ids;
+    a.for_each([&](llama_seq_id s) { ids.push_back(s); });
+    assert((ids == std::vector<llama_seq_id>{ 3, 5, 7, LLAMA_MAX_SEQ - 1 }));
+
+    llama_seq_set b = a;
+    assert(a == b);
+    assert(llama_seq_set::hash{}(a) == llama_seq_set::hash{}(b));
+
+    b.reset(3);
+    assert(a != b && b.first() == 5 && b.count() == 3);
+    assert(b.is_subset_of(a) && !a.is_subset_of(b));
+
+    llama_seq_set c;
+    c.set(3);
+    assert(a.intersects(c) && c.intersects(a) && !b.intersects(c));
+
+    a &= b;
+    assert(a == b);
+
+    b.reset(5);
+    b.reset(LLAMA_MAX_SEQ - 1);
+    b.reset(100); // not in the set
+    assert(b.count() == 1 && b.first() == 7);
+
+    b.reset(7);
+    assert(b.none());
+    assert(b == llama_seq_set());
+}
+
+static void test_cells(int n_seq) {
+    llama_kv_cells_unified cells;
+
+    const uint32_t n_cells = 2*n_seq + 4;
+
+    cells.resize(n_cells);
+
+    // a 4 token prefix shared by all the sequences, followed by 2 tokens per sequence
+    for (uint32_t i = 0; i < 4; ++i) {
+        cells.pos_set(i, i);
+        for (int s = 0; s < n_seq; ++s) {
+            cells.seq_add(i, s);
+        }
+    }
+
+    for (int s = 0; s < n_seq; ++s) {
+        for (int j = 0; j < 2; ++j) {
+            const uint32_t i = 4 + 2*s + j;
+
+            cells.pos_set(i, 4 + j);
+            cells.seq_add(i, s);
+        }
+    }
+
+    assert(cells.get_used() == n_cells);
+    assert(cells.seq_count(0) == n_seq);
+
+    for (int s = 0; s < n_seq; ++s) {
+        assert(cells.seq_pos_min(s) == 0);
+        assert(cells.seq_pos_max(s) == 5);
+        assert(cells.seq_get(4 + 2*s) == s);
+    }
+
+    // unknown sequences are empty
+    assert(cells.seq_pos_min(n_seq) == -1);
+    assert(cells.seq_pos_max(LLAMA_MAX_SEQ - 1) == -1);
+
+    // removing the last sequence from the prefix keeps the other owners
+    const llama_seq_id s_last = n_seq - 1;
+    for (uint32_t i = 0; i < 4; ++i) {
+        assert(!cells.seq_rm(i, s_last));
+    }
+    assert(cells.seq_pos_min(s_last) == 4);
+    assert(cells.seq_count(0) == n_seq - 1);
+    assert(cells.seq_n_cells(s_last) == 2 && cells.seq_n_cells(0) == 6);
+
+    // keeping only sequence 0 frees the cells of the other sequences
+    for (uint32_t i = 0; i < n_cells; ++i) {
+        cells.seq_keep(i, 0);
+    }
+    assert(cells.get_used() == 6);
+    assert(cells.seq_pos_max(0) == 5);
+    assert(cells.seq_pos_min(1) == -1);
+
+    // moving a cell keeps its sequences and its score, a new cell has no score
+    cells.score_add(4, 0.5f);
+    cells.score_add(4, 1.0f);
+    cells.mv(4, 10);
+    assert(cells.is_empty(4) && cells.seq_has(10, 0) && cells.pos_get(10) == 4 && cells.score_get(10) == 1.5f);
+
+    cells.pos_set(4, 6);
+    assert(cells.score_get(4) == 0.0f);
+    cells.rm(4);
+
+    cells.reset();
+    assert(cells.get_used() == 0);
+    assert(cells.seq_pos_min(0) == -1);
+}
+
+static void test_batch(int n_seq) {
+    llama_vocab vocab;
+
+    llama_batch_allocr balloc(1);
+
+    // one token for each sequence, as during the generation with many parallel sequences
+    llama_batch batch = llama_batch_init(n_seq, 1, 1);
+    for (int s = 0; s < n_seq; ++s) {
+        batch.embd[s]      = 0.0f;
+        batch.pos[s]       = 0;
+        batch.n_seq_id[s]  = 1;
+        batch.seq_id[s][0] = s;
+        batch.logits[s]    = true;
+    }
+    batch.n_tokens = n_seq;
+
+    assert(balloc.init(batch, vocab, nullptr, 1, n_seq, false));
+
+    const llama_ubatch ubatch = balloc.split_equal(n_seq, false);
+    assert(ubatch.n_tokens     == (uint32_t) n_seq);
+    assert(ubatch.n_seqs_unq   == (uint32_t) n_seq);
+    assert(ubatch.n_seq_tokens == 1);
+
+    for (int s = 0; s < n_seq; ++s) {
+        assert(ubatch.seq_idx[s] == s);
+    }
+
+    assert(balloc.split_equal(n_seq, false).n_tokens == 0);
+
+    llama_batch_free(batch);
+}
+
+// place n tokens with consecutive positions starting at p0, all seen by the sequences seq_ids
+static std::vector<uint32_t> place(llama_kv_blocks & blocks, std::vector<llama_seq_id> seq_ids, llama_pos p0, uint32_t n) {
+    std::vector<llama_pos>      pos(n);
+    std::vector<int32_t>        n_seq_id(n, seq_ids.size());
+    std::vector<llama_seq_id *> seq_id(n, seq_ids.data());
+
+    for (uint32_t i = 0; i < n; ++i) {
+        pos[i] = p0 + i;
+    }
+
+    llama_ubatch ubatch = {};
+
+    ubatch.n_tokens = n;
+    ubatch.pos      = pos.data();
+    ubatch.n_seq_id = n_seq_id.data();
+    ubatch.seq_id   = seq_id.data();
+
+    std::vector<uint32_t> idxs;
+    if (!blocks.find(ubatch, idxs)) {
+        return {};
+    }
+
+    blocks.apply(idxs, ubatch);
+
+    return idxs;
+}
+
+static std::vector<llama_pos> seq_positions(const llama_kv_blocks & blocks, const llama_kv_cells_unified & cells, llama_seq_id seq_id) {
+    std::vector<llama_pos> res;
+    blocks.seq_for_each_cell(seq_id, [&](uint32_t idx) {
+        res.push_back(cells.pos_get(idx));
+    });
+
+    return res;
+}
+
+static std::vector<llama_pos> range(llama_pos p0, llama_pos p1) {
+    std::vector<llama_pos> res;
+    for (llama_pos p = p0; p < p1; ++p) {
+        res.push_back(p);
+    }
+
+    return res;
+}
+
+static void test_blocks() {
+    const llama_pos p_max = std::numeric_limits<llama_pos>::max();
+
+    llama_kv_cells_unified cells;
+    cells.resize(128);
+
+    llama_kv_blocks blocks;
+    blocks.init(&cells, 8);
+
+    assert(blocks.get_n_blocks() == 16);
+
+    // a 10 token prompt fills the first block and starts the second one
+    auto idxs = place(blocks, { 0 }, 0, 10);
+    assert((idxs == std::vector<uint32_t>{ 0, 1, 2, 3, 4, 5, 6, 7, 8, 9 }));
+    assert(blocks.get_n_used() == 2 && blocks.get_fill(1) == 2);
+    assert(blocks.seq_pos_min(0) == 0 && blocks.seq_pos_max(0) == 9);
+
+    // forking shares the blocks and reserves a block per shared block and per fork for the copy-on-write
+    assert(blocks.seq_cp(0, 1, -1, p_max));
+    assert(blocks.seq_cp(0, 2, -1, p_max));
+    assert(blocks.get_n_used() == 2 && blocks.get_refs(0) == 3 && blocks.get_refs(1) == 3);
+    assert(blocks.get_n_reserved() == 4);
+    assert(seq_positions(blocks, cells, 2) == range(0, 10));
+
+    // the shared partial block is sealed, each sequence continues in its own block
+    for (llama_seq_id s = 0; s < 3; ++s) {
+        idxs = place(blocks, { s }, 10, 1);
+        assert(idxs.size() == 1 && idxs[0] == (uint32_t) (2 + s)*8);
+    }
+    assert(blocks.get_n_used() == 5 && blocks.get_fill(1) == 2);
+
+    // a token seen by all the sequences of a block is appended to it
+    idxs = place(blocks, { 1 }, 11, 2);
+    assert((idxs == std::vector<uint32_t>{ 25, 26 }));
+    assert(seq_positions(blocks, cells, 1) == range(0, 13));
+    assert(blocks.seq_pos_max(1) == 12 && blocks.seq_pos_max(2) == 10);
+
+    // removing the tail of a sequence frees its private block and makes the cells reusable
+    blocks.seq_rm(2, 10, p_max);
+    assert(blocks.get_refs(4) == 0 && blocks.get_n_used() == 4);
+    assert(cells.is_empty(32));
+    assert(seq_positions(blocks, cells, 2) == range(0, 10));
+
+    // removing a part of a shared block keeps the other sequences
+    blocks.seq_rm(1, 5, 7);
+    assert(seq_positions(blocks, cells, 0) == range(0, 11));
+    auto exp = range(0, 5);
+    for (llama_pos p = 7; p < 13; ++p) {
+        exp.push_back(p);
+    }
+    assert(seq_positions(blocks, cells, 1) == exp);
+    assert(blocks.get_refs(0) == 4); // seq 1 sees two runs of block 0
+
+    // shifting a shared block copies the cells of the block seen by the sequence to a reserved block
+    const auto used = blocks.get_n_used();
+    assert(blocks.seq_add(2, 4, 10, 100));
+    assert(blocks.get_n_used() == used + 2 && blocks.get_copies().size() == 2);
+    assert(blocks.get_copies()[0].src == 0 && blocks.get_copies()[0].n == 8);
+    assert(blocks.get_copies()[1].src == 8 && blocks.get_copies()[1].n == 2);
+    assert(blocks.get_n_reserved() == 2);
+    assert(seq_positions(blocks, cells, 0) == range(0, 11));
+
+    exp = range(0, 4);
+    for (llama_pos p = 104; p < 110; ++p) {
+        exp.push_back(p);
+    }
+    assert(seq_positions(blocks, cells, 2) == exp);
+    assert(blocks.seq_pos_max(2) == 109);
+
+    // the data of the copied cells is read from the source until the copy is done
+    const uint32_t dst = blocks.get_copies()[0].dst;
+    assert(blocks.data_src(dst + 5) == 5 && blocks.data_src(5) == 5);
+
+    const uint32_t refs_src = blocks.get_refs(0);
+    blocks.copies_done();
+    assert(blocks.get_copies().empty() && blocks.get_refs(0) == refs_src - 1);
+    assert(blocks.data_src(dst + 5) == dst + 5);
+
+    // a failed placement is rolled back
+    auto state = blocks.save({ 0 });
+    idxs = place(blocks, { 0 }, 11, 5);
+    assert(!idxs.empty() && blocks.seq_pos_max(0) == 15);
+    blocks.restore(std::move(state), idxs);
+    assert(blocks.seq_pos_max(0) == 10 && blocks.get_n_used() == used + 2);
+    for (const auto idx : idxs) {
+        assert(idx < 16 || cells.is_empty(idx));
+    }
+
+    // not enough free blocks besides the reserved ones
+    assert(blocks.get_n_used() == 6 && blocks.get_n_reserved() == 2);
+    assert(place(blocks, { 3 }, 0, 72).empty());
+    assert(place(blocks, { 3 }, 0, 64).size() == 64);
+    blocks.seq_rm(3, -1, p_max);
+
+    // keeping a single sequence frees the blocks of the others
+    blocks.seq_keep(0);
+    assert(blocks.get_n_used() == 3);
+    assert(blocks.get_table(1).empty() && blocks.get_table(2).empty());
+    assert(seq_positions(blocks, cells, 0) == range(0, 11));
+    assert(cells.get_used() == 11);
+
+    blocks.seq_rm(-1, -1, p_max);
+    assert(blocks.get_n_used() == 0 && cells.get_used() == 0);
+
+    // the new tokens are not placed in the blocks reserved for the copy-on-write of a fork
+    place(blocks, { 0 }, 0, 48);
+    assert(blocks.seq_cp(0, 1, -1, p_max));
+    assert(blocks.get_n_used() == 6 && blocks.get_n_reserved() == 6);
+    assert(place(blocks, { 2 }, 0, 40).empty());
+
+    // shifting the head of a sequence past its tail leaves the table out of position order
+    assert(blocks.seq_add(1, 0, 8, 100));
+    assert(blocks.get_n_used() == 7 && blocks.get_n_reserved() == 5);
+    assert(blocks.seq_pos_min(1) == 8 && blocks.seq_pos_max(1) == 107);
+    assert(blocks.seq_pos_min(0) == 0 && blocks.seq_pos_max(0) == 47);
+
+    blocks.copies_done();
+    blocks.seq_rm(-1, -1, p_max);
+    assert(blocks.get_n_used() == 0 && cells.get_used() == 0 && blocks.get_n_reserved() == 0);
+
+    // a fork that cannot reserve its blocks copies its cells when they fit in fewer blocks
+    place(blocks, { 0 }, 0, 48);
+    for (llama_pos p = 0; p < 48; p += 8) {
+        blocks.seq_rm(0, p + 1, p + 8);
+    }
+    assert(blocks.get_n_used() == 6 && cells.get_used() == 6);
+    assert(blocks.seq_cp(0, 1, -1, p_max));
+    assert(blocks.seq_cp(0, 2, -1, p_max));
+    assert(blocks.get_n_used() == 7 && blocks.get_n_reserved() == 6 && blocks.get_copies().size() == 6);
+    assert(seq_positions(blocks, cells, 2) == seq_positions(blocks, cells, 0));
+    blocks.copies_done();
+
+    // the tokens placed for both sequences go to a new block that they share without a reservation
+    assert(place(blocks, { 0, 1 }, 48, 8).size() == 8);
+    assert(blocks.get_n_used() == 8 && blocks.get_n_reserved() == 6);
+
+    // when neither fits, the fork is refused
+    assert(place(blocks, { 4 }, 0, 16).size() == 16);
+    assert(blocks.get_n_free() == blocks.get_n_reserved());
+    {
+        const uint32_t refs_0 = blocks.get_refs(0);
+        assert(!blocks.seq_cp(0, 3, -1, p_max));
+        assert(blocks.get_table(3).empty() && blocks.get_refs(0) == refs_0);
+    }
+
+    // a shift of shared cells without a free block for their copy leaves the sequence unchanged, instead of updating
+    // the cells that the other sequences see too
+    {
+        const auto pos_0 = seq_positions(blocks, cells, 0);
+        assert(pos_0 == seq_positions(blocks, cells, 1) && pos_0.size() == 14);
+
+        assert(!blocks.seq_add(1, 48, 56, 1));
+        assert(!blocks.seq_add(1, 0, p_max, -4));
+        assert(!blocks.seq_div(1, 0, p_max, 2));
+        assert(seq_positions(blocks, cells, 0) == pos_0);
+        assert(seq_positions(blocks, cells, 1) == pos_0);
+
+        // the reserved blocks are still taken by a shift that does not need others
+        assert(blocks.seq_add(1, 0, 48, 1));
+        assert(blocks.get_n_free() == 0);
+        assert(seq_positions(blocks, cells, 0) == pos_0);
+        assert(seq_positions(blocks, cells, 1)[1] == 9);
+
+        assert(!blocks.seq_add(0, 48, 56, 1));
+        assert(seq_positions(blocks, cells, 0) == pos_0);
+    }
+
+    // the positions of the cells that no other sequence sees are still updated in place
+    assert(blocks.seq_add(4, 0, 16, 1));
+    assert(blocks.seq_pos_min(4) == 1 && blocks.seq_pos_max(4) == 16);
+
+    blocks.copies_done();
+    blocks.seq_rm(-1, -1, p_max);
+    assert(blocks.get_n_used() == 0 && cells.get_used() == 0);
+}
+
+// fill a cache with n_seq sequences of n_tokens tokens after a prefix of n_prefix tokens shared by all the sequences,
+// then build the per-token cell lists like the KQ mask does and remove the sequences one by one
+static void bench(int n_seq, int n_tokens, int n_prefix) {
+    const uint32_t n_cells = n_prefix + n_seq*n_tokens;
+
+    llama_kv_cells_unified cells;
+    cells.resize(n_cells);
+
+    const int64_t t0 = ggml_time_us();
+
+    for (int i = 0; i < n_prefix; ++i) {
+        cells.pos_set(i, i);
+        for (int s = 0; s < n_seq; ++s) {
+            cells.seq_add(i, s);
+        }
+    }
+
+    // the sequences are generated concurrently, so their tokens are interleaved in the cache
+    for (int j = 0; j < n_tokens; ++j) {
+        for (int s = 0; s < n_seq; ++s) {
+            const uint32_t i = n_prefix + j*n_seq + s;
+
+            cells.pos_set(i, n_prefix + j);
+            cells.seq_add(i, s);
+        }
+    }
+
+    const int64_t t1 = ggml_time_us();
+
+    std::vector<std::vector<uint32_t>> seq_cells(n_seq);
+    for (uint32_t i = 0; i < n_cells; ++i) {
+        cells.seq_for_each(i, [&](llama_seq_id s) {
+            seq_cells[s].push_back(i);
+        });
+    }
+
+    size_t n_visible = 0;
+    for (int s = 0; s < n_seq; ++s) {
+        for (const uint32_t i : seq_cells[s]) {
+            n_visible += cells.pos_get(i) <= cells.seq_pos_max(s);
+        }
+    }
+
+    const int64_t t2 = ggml_time_us();
+
+    for (int s = 0; s < n_seq; ++s) {
+        for (const uint32_t i : seq_cells[s]) {
+            cells.seq_rm(i, s);
+        }
+    }
+
+    const int64_t t3 = ggml_time_us();
+
+    assert(n_visible == (size_t) n_seq*(n_prefix + n_tokens));
+    assert(cells.get_used() == 0);
+
+    printf("%s: n_seq = %d, n_tokens = %d, n_prefix = %d, n_cells = %u\n", __func__, n_seq, n_tokens, n_prefix, n_cells);
+    printf("%s:   fill:   %8.3f ms\n", __func__, (t1 - t0)/1000.0);
+    printf("%s:   gather: %8.3f ms\n", __func__, (t2 - t1)/1000.0);
+    printf("%s:   remove: %8.3f ms\n", __func__, (t3 - t2)/1000.0);
+}
+
+// the row of the KQ mask of a token, computed cell by cell
+static void kq_mask_row_ref(float * row, uint32_t n_kv, llama_seq_id seq_id, llama_pos p_min, llama_pos p_max,
+        bool alibi, llama_pos p1, const llama_kv_cells_unified & cells) {
+    for (uint32_t j = 0; j < n_kv; ++j) {
+        row[j] = -INFINITY;
+
+        if (cells.is_empty(j) || !cells.seq_has(j, seq_id)) {
+            continue;
+        }
+
+        const llama_pos p0 = cells.pos_get(j);
+        if (p0 < p_min || p0 > p_max) {
+            continue;
+        }
+
+        row[j] = alibi ? -std::abs(p0 - p1) : 0.0f;
+    }
+}
+
+static void test_kq_mask_runs() {
+    const uint32_t n_cells = 512;
+    const int      n_seq   = 4;
+
+    std::mt19937 rng(42);
+
+    llama_kv_cells_unified cells;
+    cells.resize(n_cells);
+
+    // interleaved sequences with a shared prefix, holes and a few cells with out of order positions
+    std::vector<llama_pos> pos_next(n_seq, 16);
+    for (uint32_t i = 0; i < 16; ++i) {
+        cells.pos_set(i, i);
+        for (int s = 0; s < n_seq; ++s) {
+            cells.seq_add(i, s);
+        }
+    }
+
+    for (uint32_t i = 16; i < n_cells; ++i) {
+        if (rng() % 8 == 0) {
+            continue;
+        }
+
+        const int s = rng() % n_seq;
+
+        llama_pos p = pos_next[s]++;
+        if (rng() % 32 == 0) {
+            p = rng() % p;
+        }
+
+        cells.pos_set(i, p);
+        cells.seq_add(i, s);
+    }
+
+    llama_kv_mask_runs runs;
+    runs.init(n_seq, 1);
+
+    for (uint32_t i = 0; i < n_cells; ++i) {
+        if (!cells.is_empty(i)) {
+            cells.seq_for_each(i, [&](llama_seq_id s) {
+                runs.add(s, i, cells.pos_get(i));
+            });
+        }
+    }
+
+    // the positions of each run are sorted and the runs cover each cell of the sequence once
+    for (int s = 0; s < n_seq; ++s) {
+        uint32_t n = 0;
+        for (const auto & r : runs.get(s)) {
+            for (uint32_t j = r.i0; j < r.i1; ++j) {
+                assert(cells.seq_has(j, s));
+                assert(j == r.i0 || cells.pos_get(j) >= cells.pos_get(j - 1));
+            }
+            assert(cells.pos_get(r.i0) == r.p0 && cells.pos_get(r.i1 - 1) == r.p1);
+            n += r.i1 - r.i0;
+        }
+
+        uint32_t n_ref = 0;
+        for (uint32_t i = 0; i < n_cells; ++i) {
+            n_ref += cells.seq_has(i, s);
+        }
+        assert(n == n_ref);
+    }
+
+    std::vector<float> row(n_cells);
+    std::vector<float> ref(n_cells);
+
+    for (int k = 0; k < 1000; ++k) {
+        const llama_seq_id seq_id = rng() % n_seq;
+        const uint32_t     n_kv   = rng() % (n_cells + 1);
+        const bool         alibi  = rng() % 4 == 0;
+        const llama_pos    p1     = rng() % (pos_next[seq_id] + 1);
+        const llama_pos    p_min  = rng() % 2 ? 0 : std::max(0, p1 - (llama_pos) (rng() % 64));
+        const llama_pos    p_max  = rng() % 2 ? p1 : std::numeric_limits<llama_pos>::max();
+
+        runs.fill_row    (row.data(), n_kv, seq_id, p_min, p_max, alibi, p1, cells);
+        kq_mask_row_ref  (ref.data(), n_kv, seq_id, p_min, p_max, alibi, p1, cells);
+
+        for (uint32_t j = 0; j < n_kv; ++j) {
+            assert(row[j] == ref[j]);
+        }
+    }
+
+    // the version of the cells changes with the cells
+    const uint64_t version = cells.get_version();
+    runs.set_valid(0, version);
+    assert(runs.is_valid(0, version));
+
+    cells.pos_add(20, 1);
+    assert(!runs.is_valid(0, cells.get_version()));
+}
+
+// a single sequence placed in a ring of cells, the token at position p in the cell p % n_cells: the overwritten cells
+// are removed from the front of the runs, which must remain equivalent to the cells
+static void test_kq_mask_runs_ring() {
+    const uint32_t  n_cells = 64;
+    const llama_pos n_swa   = 40;
+
+    std::mt19937 rng(42);
+
+    llama_kv_cells_unified cells;
+    cells.resize(n_cells);
+
+    llama_kv_mask_runs runs;
+    runs.init(1, 1);
+
+    std::vector<float> row(n_cells);
+    std::vector<float> ref(n_cells);
+
+    llama_pos p = 0;
+    while (p < 1000) {
+        const uint32_t n_tokens = 1 + rng() % (n_cells - n_swa);
+
+        for (uint32_t i = 0; i < n_tokens; ++i) {
+            const uint32_t idx = (p + i) % n_cells;
+
+            if (!cells.is_empty(idx)) {
+                // the oldest cell of the sequence, out of the window of the tokens of the ubatch
+                assert(cells.pos_get(idx) == cells.seq_pos_min(0));
+                assert(p - cells.pos_get(idx) >= n_swa);
+
+                const bool ok = runs.pop_front(0, idx, cells);
+                assert(ok);
+
+                cells.rm(idx);
+            }
+        }
+
+        for (uint32_t i = 0; i < n_tokens; ++i) {
+            const uint32_t idx = (p + i) % n_cells;
+
+            cells.pos_set(idx, p + i);
+            cells.seq_add(idx, 0);
+
+            runs.add(0, idx, p + i);
+        }
+
+        // a ring is covered by at most 2 runs: the older cells up to the end, then the newer ones from the start
+        assert(runs.get(0).size() <= 2);
+
+        uint32_t n = 0;
+        for (const auto & r : runs.get(0)) {
+            assert(cells.pos_get(r.i0) == r.p0 && cells.pos_get(r.i1 - 1) == r.p1);
+            n += r.i1 - r.i0;
+        }
+        assert(n == cells.get_used());
+
+        for (uint32_t i = 0; i < n_tokens; ++i) {
+            const llama_pos p1 = p + i;
+
+            runs.fill_row  (row.data(), n_cells, 0, std::max(0, p1 - n_swa + 1), p1, false, p1, cells);
+            kq_mask_row_ref(ref.data(), n_cells, 0, std::max(0, p1 - n_swa + 1), p1, false, p1, cells);
+
+            for (uint32_t j = 0; j < n_cells; ++j) {
+                assert(row[j] == ref[j]);
+            }
+        }
+
+        p += n_tokens;
+    }
+
+    // a cell that is not at the front of the runs cannot be removed
+    const uint32_t idx = (p - 1) % n_cells;
+    assert(!runs.pop_front(0, idx, cells));
+}
+
+// a single sequence with n_sink attention sinks in the first cells and its other positions in a ring of the remaining
+// cells: the overwritten cells are removed from the front of the runs after the one of the sinks. the runs are rebuilt
+// from the sinks and the oldest cell of the ring when the window run is merged with the sink run
+static void test_kq_mask_runs_sink() {
+    const uint32_t  n_cells = 64;
+    const uint32_t  n_sink  = 4;
+    const uint32_t  n_ring  = n_cells - n_sink;
+
+    std::mt19937 rng(42);
+
+    llama_kv_cells_unified cells;
+    cells.resize(n_cells);
+
+    llama_kv_mask_runs runs;
+    runs.init(1, 1);
+
+    std::vector<float> row(n_cells);
+    std::vector<float> ref(n_cells);
+
+    auto ring_idx = [&](llama_pos p) {
+        return p < (llama_pos) n_sink ? (uint32_t) p : n_sink + (p - n_sink) % n_ring;
+    };
+
+    int n_rebuild = 0;
+
+    llama_pos p = 0;
+    while (p < 1000) {
+        const uint32_t n_tokens = 1 + rng() % 8;
+
+        for (uint32_t i = 0; i < n_tokens; ++i) {
+            const uint32_t idx = ring_idx(p + i);
+
+            if (cells.is_empty(idx)) {
+                continue;
+            }
+
+            // the oldest cell of the window, the sinks are never overwritten
+            assert(idx >= n_sink);
+            assert(cells.pos_get(idx) + (llama_pos) n_ring == p + (llama_pos) i);
+
+            if (!runs.pop_front(0, idx, cells, n_sink)) {
+                cells.rm(idx);
+
+                // rebuilt as in llama_kv_cache_unified::build_kq_mask_runs()
+                runs.clear(0);
+                for (uint32_t k = 0; k < n_cells; ++k) {
+                    const uint32_t j = k < n_sink ? k : n_sink + (idx - n_sink + k - n_sink) % n_ring;
+                    if (!cells.is_empty(j)) {
+                        runs.add(0, j, cells.pos_get(j));
+                    }
+                }
+
+                n_rebuild++;
+                continue;
+            }
+
+            cells.rm(idx);
+        }
+
+        for (uint32_t i = 0; i < n_tokens; ++i) {
+            const uint32_t idx = ring_idx(p + i);
+
+            cells.pos_set(idx, p + i);
+            cells.seq_add(idx, 0);
+
+            runs.add(0, idx, p + i);
+        }
+
+        // the sinks, the older cells of the window up to the end and the newer ones after the sinks
+        assert(runs.get(0).size() <= 3);
+
+        uint32_t n = 0;
+        for (const auto & r : runs.get(0)) {
+            assert(cells.pos_get(r.i0) == r.p0 && cells.pos_get(r.i1 - 1) == r.p1);
+            n += r.i1 - r.i0;
+        }
+        assert(n == cells.get_used());
+
+        for (uint32_t i = 0; i < n_tokens; ++i) {
+            const llama_pos p1 = p + i;
+
+            runs.fill_row  (row.data(), n_cells, 0, 0, p1, false, p1, cells);
+            kq_mask_row_ref(ref.data(), n_cells, 0, 0, p1, false, p1, cells);
+
+            for (uint32_t j = 0; j < n_cells; ++j) {
+                assert(row[j] == ref[j]);
+            }
+        }
+
+        p += n_tokens;
+    }
+
+    // at most one rebuild each time the ring wraps around to the cell after the sinks
+    assert(n_rebuild > 0 && n_rebuild <= (int) ((p - n_sink)/n_ring));
+}
+
+// time to build the causal KQ mask of a ubatch of n_ubatch tokens of a single sequence with n_kv cells in the cache,
+// cell by cell (as done before the runs) and from the runs of cells
+static void bench_kq_mask(uint32_t n_ubatch) {
+    const int n_threads = 4;
+
+    printf("%s: n_ubatch = %u\n", __func__, n_ubatch);
+
+    for (uint32_t n_kv = 4096; n_kv <= 128*1024; n_kv *= 2) {
+        llama_kv_cells_unified cells;
+        cells.resize(n_kv);
+
+        for (uint32_t i = 0; i < n_kv; ++i) {
+            cells.pos_set(i, i);
+            cells.seq_add(i, 0);
+        }
+
+        llama_kv_mask_runs runs;
+        runs.init(1, 1);
+
+        std::vector<float> mask((size_t) n_kv*n_ubatch);
+
+        const int64_t t0 = ggml_time_us();
+
+        for (uint32_t i = 0; i < n_ubatch; ++i) {
+            const llama_pos p1 = n_kv - n_ubatch + i;
+            kq_mask_row_ref(mask.data() + (size_t) i*n_kv, n_kv, 0, 0, p1, false, p1, cells);
+        }
+
+        const int64_t t1 = ggml_time_us();
+
+        for (uint32_t i = 0; i < n_kv; ++i) {
+            runs.add(0, i, i);
+        }
+
+        const int64_t t2 = ggml_time_us();
+
+        for (uint32_t i = 0; i < n_ubatch; ++i) {
+            const llama_pos p1 = n_kv - n_ubatch + i;
+            runs.fill_row(mask.data() + (size_t) i*n_kv, n_kv, 0, 0, p1, false, p1, cells);
+        }
+
+        const int64_t t3 = ggml_time_us();
+
+        assert(runs.get(0).size() == 1);
+        assert(mask.back() == 0.0f && (n_ubatch == 1 || mask[n_kv - 1] == -INFINITY));
+
+        const std::vector<float> mask_ref = mask;
+        std::fill(mask.begin(), mask.end(), 1.0f);
+
+        const int64_t t4 = ggml_time_us();
+
+        llama_kv_mask_fill_rows(n_ubatch, n_kv, n_threads, [&](int64_t i) {
+            const llama_pos p1 = n_kv - n_ubatch + i;
+            runs.fill_row(mask.data() + (size_t) i*n_kv, n_kv, 0, 0, p1, false, p1, cells);
+        });
+
+        const int64_t t5 = ggml_time_us();
+
+        assert(mask == mask_ref);
+
+        printf("%s:   n_kv = %6u: cells: %8.3f ms, runs: %8.3f ms (build: %8.3f ms), runs with %d threads: %8.3f ms\n",
+                __func__, n_kv, (t1 - t0)/1000.0, (t3 - t2)/1000.0, (t2 - t1)/1000.0, n_threads, (t5 - t4)/1000.0);
+    }
+}
+
+// fork n_seq sequences from a prompt of n_prefix tokens and generate n_tokens tokens for each of them, with and without
+// block tables. without the block tables, forking a sequence adds the new sequence to each cell of the prompt
+// the cache also has room for the blocks reserved by the forks for the copy-on-write of the prompt
+static void bench_fork(int n_seq, int n_tokens, int n_prefix, uint32_t block_size) {
+    const llama_pos p_max = std::numeric_limits<llama_pos>::max();
+
+    const uint32_t n_blocks_prefix = (n_prefix + block_size - 1)/block_size;
+
+    const uint32_t n_blocks = n_seq*n_blocks_prefix + n_seq*((n_tokens + block_size - 1)/block_size + 1);
+
+    llama_kv_cells_unified cells;
+    cells.resize(n_blocks*block_size);
+
+    // per-cell sequence sets
+    {
+        const int64_t t0 = ggml_time_us();
+
+        for (int i = 0; i < n_prefix; ++i) {
+            cells.pos_set(i, i);
+            cells.seq_add(i, 0);
+        }
+
+        for (int s = 1; s < n_seq; ++s) {
+            for (int i = 0; i < n_prefix; ++i) {
+                cells.seq_add(i, s);
+            }
+        }
+
+        const int64_t t1 = ggml_time_us();
+
+        for (int s = 0; s < n_seq; ++s) {
+            for (int i = 0; i < n_prefix; ++i) {
+                cells.seq_rm(i, s);
+            }
+        }
+
+        const int64_t t2 = ggml_time_us();
+
+        assert(cells.get_used() == 0);
+
+        printf("%s: n_seq = %d, n_tokens = %d, n_prefix = %d\n", __func__, n_seq, n_tokens, n_prefix);
+        printf("%s:   cells:  fork: %8.3f ms, free: %8.3f ms\n", __func__, (t1 - t0)/1000.0, (t2 - t1)/1000.0);
+    }
+
+    llama_kv_blocks blocks;
+    blocks.init(&cells, block_size);
+
+    const int64_t t0 = ggml_time_us();
+
+    place(blocks, { 0 }, 0, n_prefix);
+
+    for (int s = 1; s < n_seq; ++s) {
+        const bool ok = blocks.seq_cp(0, s, -1, p_max);
+        assert(ok);
+    }
+
+    const int64_t t1 = ggml_time_us();
+
+    for (int j = 0; j < n_tokens; ++j) {
+        for (int s = 0; s < n_seq; ++s) {
+            const auto idxs = place(blocks, { s }, n_prefix + j, 1);
+            assert(idxs.size() == 1);
+        }
+    }
+
+    const int64_t t2 = ggml_time_us();
+
+    // the prefix is stored once
+    assert(cells.get_used() == (uint32_t) (n_prefix + n_seq*n_tokens));
+
+    const uint32_t n_used = blocks.get_n_used();
+
+    for (int s = 0; s < n_seq; ++s) {
+        blocks.seq_rm(s, -1, p_max);
+    }
+
+    const int64_t t3 = ggml_time_us();
+
+    assert(blocks.get_n_used() == 0 && cells.get_used() == 0);
+
+    printf("%s:   blocks: fork: %8.3f ms, free: %8.3f ms, decode: %8.3f ms, block_size = %u, blocks used = %u / %u\n",
+            __func__, (t1 - t0)/1000.0, (t3 - t2)/1000.0, (t2 - t1)/1000.0, block_size, n_used, n_blocks);
+}
+
+// random changes of the cells, the index of the empty and the used cells must match a scan of the cells
+static void test_free_index() {
+    std::mt19937 rng(42);
+
+    for (uint32_t n_cells : { 1u, 63u, 64u, 65u, 4096u, 4097u, 300000u }) {
+        llama_kv_cells_unified cells;
+        cells.resize(n_cells);
+
+        assert(cells.find_empty(0) == 0 && cells.find_used(0) == n_cells);
+        assert(cells.find_empty_run(0, n_cells) == 0 && cells.find_empty_run(1, n_cells) == n_cells);
+
+        const int n_ops = std::min<int>(4*n_cells, 20000);
+
+        for (int k = 0; k < n_ops; ++k) {
+            // runs of changes, to make both long empty and long used ranges
+            const uint32_t i0 = rng() % n_cells;
+            const uint32_t n  = std::min<uint32_t>(1 + rng() % 200, n_cells - i0);
+            const bool     add = rng() % 2;
+
+            for (uint32_t i = i0; i < i0 + n; ++i) {
+                if (add && cells.is_empty(i)) {
+                    cells.pos_set(i, i);
+                    cells.seq_add(i, 0);
+                } else if (!add && !cells.is_empty(i)) {
+                    cells.rm(i);
+                }
+            }
+
+            // check the queries from a few random cells
+            for (int q = 0; q < 4; ++q) {
+                const uint32_t i = q == 0 ? 0 : rng() % n_cells;
+                const uint32_t r = 1 + rng() % 64;
+
+                uint32_t e = i;
+                while (e < n_cells && !cells.is_empty(e)) {
+                    e++;
+                }
+
+                uint32_t u = i;
+                while (u < n_cells && cells.is_empty(u)) {
+                    u++;
+                }
+
+                uint32_t run = n_cells;
+                for (uint32_t j = i, n_run = 0; j < n_cells; ++j) {
+                    n_run = cells.is_empty(j) ? n_run + 1 : 0;
+                    if (n_run == r) {
+                        run = j + 1 - r;
+                        break;
+                    }
+                }
+
+                assert(cells.find_empty(i) == e);
+                assert(cells.find_used(i)  == u);
+                assert(cells.find_empty_run(i, r) == run);
+            }
+
+            uint32_t n_used = 0;
+            uint32_t u_min  = n_cells;
+            uint32_t u_max  = 0;
+            if (k % 64 == 0 || n_cells <= 4096) {
+                for (uint32_t i = 0; i < n_cells; ++i) {
+                    if (!cells.is_empty(i)) {
+                        n_used++;
+                        u_min = std::min(u_min, i);
+                        u_max = i + 1;
+                    }
+                }
+
+                assert(cells.get_used() == n_used);
+                assert(cells.used_min() == (n_used ? u_min : 0));
+                assert(cells.used_max_p1() == u_max);
+            }
+        }
+
+        cells.reset();
+        assert(cells.get_used() == 0 && cells.find_empty_run(0, n_cells) == 0);
+    }
+}
+
+// many small decodes of interleaved sequences in a cache of n_cells cells, with the free cells found by scanning the cells
+// one by one and with the index of the empty cells. a random sequence is freed when the cache is full, so the free
+// cells are scattered over the whole cache
+static void bench_find_slot(uint32_t n_cells, uint32_t n_tokens, bool cont) {
+    printf("%s: n_cells = %u, n_tokens = %u, cont = %d\n", __func__, n_cells, n_tokens, cont);
+
+    // fill the cache about twice
+    const int n_seq    = 64;
+    const int n_decode = 2*n_cells/n_tokens;
+
+    for (int mode = 0; mode < 2; ++mode) {
+        llama_kv_cells_unified cells;
+        cells.resize(n_cells);
+
+        std::mt19937 rng(42);
+
+        std::vector<llama_pos> seq_pos(n_seq, 0);
+        std::vector<uint32_t> idxs;
+
+        uint32_t head  = 0;
+        uint64_t n_chk = 0;
+        uint64_t n_rm  = 0;
+
+        int64_t t_search = 0;
+
+        const int64_t t0 = ggml_time_us();
+
+        for (int k = 0; k < n_decode; ++k) {
+            const llama_seq_id seq_id = rng() % n_seq;
+
+            while (true) {
+                idxs.clear();
+
+                const int64_t t_start = ggml_time_us();
+
+                if (mode == 0) {
+                    // the linear search of llama_kv_cache_unified::find_slot()
+                    uint32_t n_tested = 0;
+                    while (idxs.size() < n_tokens && n_tested < n_cells) {
+                        const uint32_t i = (head + n_tested) % n_cells;
+
+                        if (cont && !idxs.empty() && (i == 0 || !cells.is_empty(i))) {
+                            idxs.clear();
+                        }
+
+                        if (cells.is_empty(i)) {
+                            idxs.push_back(i);
+                        }
+
+                        n_tested++;
+                    }
+                    if (idxs.size() < n_tokens) {
+                        idxs.clear();
+                    }
+                } else if (cont) {
+                    uint32_t i = cells.find_empty_run(head, n_tokens);
+                    if (i == n_cells) {
+                        i = cells.find_empty_run(0, n_tokens);
+                    }
+                    for (uint32_t j = 0; i < n_cells && j < n_tokens; ++j) {
+                        idxs.push_back(i + j);
+                    }
+                } else if (n_cells - cells.get_used() >= n_tokens) {
+                    uint32_t i = head;
+                    while (idxs.size() < n_tokens) {
+                        i = cells.find_empty(i);
+                        if (i == n_cells) {
+                            i = cells.find_empty(0);
+                        }
+                        idxs.push_back(i++);
+                    }
+                }
+
+                t_search += ggml_time_us() - t_start;
+
+                if (!idxs.empty()) {
+                    break;
+                }
+
+                // free the cells of a random sequence
+                const llama_seq_id seq_rm = rng() % n_seq;
+                for (uint32_t i = cells.find_used(0); i < n_cells; i = cells.find_used(i + 1)) {
+                    if (cells.seq_has(i, seq_rm)) {
+                        cells.rm(i);
+                    }
+                }
+                seq_pos[seq_rm] = 0;
+                n_rm++;
+            }
+
+            for (uint32_t i : idxs) {
+                cells.pos_set(i, seq_pos[seq_id]++);
+                cells.seq_add(i, seq_id);
+                n_chk += i;
+            }
+
+            head = idxs.back() + 1 == n_cells ? 0 : idxs.back() + 1;
+        }
+
+        const int64_t t1 = ggml_time_us();
+
+        printf("%s:   %-6s: %8.3f ms, search: %8.3f ms, %6.3f us/decode (used = %u, freed = %llu, chk = %llu)\n",
+                __func__, mode == 0 ? "scan" : "index", (t1 - t0)/1000.0, t_search/1000.0, (double) t_search/n_decode,
+                cells.get_used(), (unsigned long long) n_rm, (unsigned long long) n_chk);
+    }
+}
+
+int main(int argc, char ** argv) {
+    const int n_seq    = argc > 1 ? atoi(argv[1]) : 1024;
+    const int n_tokens = argc > 2 ? atoi(argv[2]) : 32;
+    const int n_prefix = argc > 3 ? atoi(argv[3]) : 64;
+
+    if (n_seq < 2 || n_seq > LLAMA_MAX_SEQ || n_tokens < 1 || n_prefix < 0) {
+        fprintf(stderr, "usage: %s [n_seq (2 - %d)] [n_tokens_per_seq] [n_prefix]\n", argv[0], LLAMA_MAX_SEQ);
+        return 1;
+    }
+
+    ggml_time_init();
+
+    test_seq_set();
+    test_cells(n_seq);
+    test_batch(n_seq);
+    test_blocks();
+    test_kq_mask_runs();
+    test_kq_mask_runs_ring();
+    test_kq_mask_runs_sink();
+    test_free_index();
+
+    bench(n_seq, n_tokens, n_prefix);
+    bench_fork(n_seq, n_tokens, n_prefix, 16);
+    bench_kq_mask(1);
+    bench_kq_mask(512);
+    bench_find_slot(128*1024, 1, false);
+    bench_find_slot(128*1024, 4, false);
+    bench_find_slot(128*1024, 4, true);
+
+    return 0;
+}
@@ -0,0 +1,165 @@
+// checks that the defragmentation of the streams of a non-unified KV cache does not change the outputs: two sequences,
+// each in its own stream, are fragmented by removing a large range of their cells, then the same tokens are decoded
+// with and without defragmentation and the logits are compared
+//
+// usage: LLAMA_SET_ROWS=1 test-kv-defrag <model>
+
+#ifdef NDEBUG
+#undef NDEBUG
+#endif
+
+#include "llama.h"
+#include "get-model.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <vector>
+
+static const int n_seq    = 2;
+static const int n_prompt = 3072; // the streams are defragmented only from 2048 cells
+static const int n_gen    = 8;
+
+// decode the prompts, remove a range of cells of each sequence and move the following ones back, then decode n_gen
+// tokens for all the sequences and return their logits
+static std::vector<float> run(llama_model * model, const std::vector<std::vector<llama_token>> & tokens, bool defrag) {
+    auto cparams = llama_context_default_params();
+
+    cparams.n_ctx        = n_seq*4096;
+    cparams.n_batch      = 512;
+    cparams.n_ubatch     = 512;
+    cparams.n_seq_max    = n_seq;
+    cparams.kv_unified   = false;
+    cparams.defrag_thold = defrag ? 0.1f : -1.0f;
+
+    llama_context * ctx = llama_init_from_model(model, cparams);
+    assert(ctx != nullptr);
+
+    auto * mem = llama_get_memory(ctx);
+
+    if (llama_memory_get_stream_stats(mem, nullptr, 0) != n_seq) {
+        fprintf(stderr, "%s: the KV cache is unified, the non-unified cache requires LLAMA_SET_ROWS=1\n", __func__);
+        exit(1);
+    }
+
+    const int n_vocab = llama_vocab_n_tokens(llama_model_get_vocab(model));
+
+    llama_batch batch = llama_batch_init(512, 0, 1);
+
+    for (int s = 0; s < n_seq; ++s) {
+        for (int i = 0; i < n_prompt; i += 512) {
+            batch.n_tokens = 0;
+            for (int j = i; j < i + 512; ++j) {
+                batch.token   [batch.n_tokens]    = tokens[s][j];
+                batch.pos     [batch.n_tokens]    = j;
+                batch.n_seq_id[batch.n_tokens]    = 1;
+                batch.seq_id  [batch.n_tokens][0] = s;
+                batch.logits  [batch.n_tokens]    = false;
+                batch.n_tokens++;
+            }
+            assert(llama_decode(ctx, batch) == 0);
+        }
+    }
+
+    // a different range for each sequence, so that the streams do not have the same layout
+    std::vector<llama_pos> n_past(n_seq);
+    for (int s = 0; s < n_seq; ++s) {
+        const llama_pos p0 = 256 + 64*s;
+        const llama_pos p1 = 2048 + 128*s;
+
+        assert(llama_memory_seq_rm(mem, s, p0, p1));
+        llama_memory_seq_add(mem, s, p1, -1, -(p1 - p0));
+
+        n_past[s] = n_prompt - (p1 - p0);
+    }
+
+    std::vector<float> res;
+
+    for (int i = 0; i < n_gen; ++i) {
+        batch.n_tokens = 0;
+        for (int s = 0; s < n_seq; ++s) {
+            batch.token   [batch.n_tokens]    = tokens[s][n_prompt + i];
+            batch.pos     [batch.n_tokens]    = n_past[s]++;
+            batch.n_seq_id[batch.n_tokens]    = 1;
+            batch.seq_id  [batch.n_tokens][0] = s;
+            batch.logits  [batch.n_tokens]    = true;
+            batch.n_tokens++;
+        }
+        assert(llama_decode(ctx, batch) == 0);
+
+        for (int s = 0; s < n_seq; ++s) {
+            const float * logits = llama_get_logits_ith(ctx, s);
+            res.insert(res.end(), logits, logits + n_vocab);
+        }
+    }
+
+    llama_memory_stream_stats stats[n_seq];
+    assert(llama_memory_get_stream_stats(mem, stats, n_seq) == n_seq);
+
+    for (int s = 0; s < n_seq; ++s) {
+        fprintf(stderr, "%s: defrag = %d, stream %d: n_used = %u, n_kv = %u, n_holes = %u, n_defrag = %u, n_moved = %llu\n",
+                __func__, defrag, s, stats[s].n_used, stats[s].n_kv, stats[s].n_holes, stats[s].n_defrag, (unsigned long long) stats[s].n_moved);
+
+        assert(stats[s].n_used == (uint32_t) n_past[s]);
+
+        if (defrag) {
+            // every stream is defragmented, one per update
+            assert(stats[s].n_defrag > 0);
+            assert(stats[s].n_holes == 0);
+        } else {
+            assert(stats[s].n_defrag == 0);
+            assert(stats[s].n_holes > 0);
+        }
+    }
+
+    llama_batch_free(batch);
+    llama_free(ctx);
+
+    return res;
+}
+
+int main(int argc, char ** argv) {
+    auto * model_path = get_model_or_exit(argc, argv);
+
+    llama_backend_init();
+
+    llama_model * model = llama_model_load_from_file(model_path, llama_model_default_params());
+    if (model == nullptr) {
+        fprintf(stderr, "%s: failed to load the model '%s'\n", __func__, model_path);
+        return 1;
+    }
+
+    const int n_vocab = llama_vocab_n_tokens(llama_model_get_vocab(model));
+
+    std::mt19937 rng(42);
+
+    std::vector<std::vector<llama_token>> tokens(n_seq, std::vector<llama_token>(n_prompt + n_gen));
+    for (auto & seq : tokens) {
+        for (auto & t : seq) {
+            t = rng() % n_vocab;
+        }
+    }
+
+    const auto ref = run(model, tokens, false);
+    const auto res = run(model, tokens, true);
+
+    assert(ref.size() == res.size());
+
+    // the cells are visited in a different order, the sums of the attention may differ in the last bits
+    float diff_max = 0.0f;
+    for (size_t i = 0; i < ref.size(); ++i) {
+        diff_max = std::max(diff_max, std::fabs(ref[i] - res[i]));
+    }
+
+    fprintf(stderr, "%s: max difference of the logits = %g\n", __func__, diff_max);
+    assert(diff_max < 1e-3f);
+
+    llama_model_free(model);
+    llama_backend_free();
+
+    fprintf(stderr, "All tests passed.\n");
+    return 0;
+}
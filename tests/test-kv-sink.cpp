@@ -0,0 +1,186 @@
+// checks the attention sink ring of the KV cache (n_kv_sink): a streaming session goes well past the size of the cache,
+// the oldest tokens of the window being either removed as done by the server on context shift or overwritten by the
+// ring. when the positions reach n_pos_max, the window is moved back right after the sinks with llama_memory_seq_add(),
+// which rotates the ring with a single K-shift. the logits must be the same as with a large cache where the same tokens
+// are removed and moved, and the ring must keep the memory bounded
+//
+// usage: LLAMA_SET_ROWS=1 test-kv-sink <model>
+
+#ifdef NDEBUG
+#undef NDEBUG
+#endif
+
+#include "llama.h"
+#include "get-model.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <vector>
+
+static const int n_ctx     = 256;
+static const int n_sink    = 4;
+static const int n_prompt  = 128;
+static const int n_rolling = 700;  // from this position, the oldest token of the window is overwritten by the ring
+static const int n_total   = 1200;
+static const int n_pos_max = 384;  // the positions are kept below n_pos_max
+
+static llama_context * init_ctx(llama_model * model, uint32_t n_ctx_kv, uint32_t n_kv_sink) {
+    auto cparams = llama_context_default_params();
+
+    cparams.n_ctx      = n_ctx_kv;
+    cparams.n_batch    = n_prompt;
+    cparams.n_ubatch   = n_prompt;
+    cparams.n_seq_max  = 1;
+    cparams.n_kv_sink  = n_kv_sink;
+    cparams.kv_unified = false;
+
+    llama_context * ctx = llama_init_from_model(model, cparams);
+    assert(ctx != nullptr);
+
+    return ctx;
+}
+
+// decode the tokens [i0, i0 + n) at the positions [p0, p0 + n)
+static void decode(llama_context * ctx, llama_batch & batch, const std::vector<llama_token> & tokens, int i0, llama_pos p0, int n, bool logits) {
+    batch.n_tokens = 0;
+    for (int i = 0; i < n; ++i) {
+        batch.token   [batch.n_tokens]    = tokens[i0 + i];
+        batch.pos     [batch.n_tokens]    = p0 + i;
+        batch.n_seq_id[batch.n_tokens]    = 1;
+        batch.seq_id  [batch.n_tokens][0] = 0;
+        batch.logits  [batch.n_tokens]    = logits;
+        batch.n_tokens++;
+    }
+
+    const int ret = llama_decode(ctx, batch);
+    if (ret != 0) {
+        fprintf(stderr, "%s: failed to decode the position %d, ret = %d\n", __func__, p0, ret);
+        exit(1);
+    }
+}
+
+static llama_memory_stream_stats get_stats(llama_context * ctx) {
+    llama_memory_stream_stats stats;
+    assert(llama_memory_get_stream_stats(llama_get_memory(ctx), &stats, 1) == 1);
+
+    return stats;
+}
+
+int main(int argc, char ** argv) {
+    auto * model_path = get_model_or_exit(argc, argv);
+
+    llama_backend_init();
+
+    llama_model * model = llama_model_load_from_file(model_path, llama_model_default_params());
+    if (model == nullptr) {
+        fprintf(stderr, "%s: failed to load the model '%s'\n", __func__, model_path);
+        return 1;
+    }
+
+    const int n_vocab = llama_vocab_n_tokens(llama_model_get_vocab(model));
+
+    std::mt19937 rng(42);
+
+    std::vector<llama_token> tokens(n_total);
+    for (auto & t : tokens) {
+        t = rng() % n_vocab;
+    }
+
+    llama_context * ctx = init_ctx(model, n_ctx,   n_sink);
+    llama_context * ref = init_ctx(model, 2*n_ctx, 0);
+
+    auto * mem     = llama_get_memory(ctx);
+    auto * mem_ref = llama_get_memory(ref);
+
+    const int n_cells = get_stats(ctx).n_cells;
+
+    llama_batch batch = llama_batch_init(n_prompt, 0, 1);
+
+    decode(ctx, batch, tokens, 0, 0, n_prompt, false);
+    decode(ref, batch, tokens, 0, 0, n_prompt, false);
+
+    // the oldest token of the window, and the offset of the positions: the token i of the window is at i - off
+    int w0  = n_sink;
+    int off = 0;
+
+    int n_shift  = 0;
+    int n_rebase = 0;
+
+    float diff_max = 0.0f;
+
+    for (int i = n_prompt; i < n_total; ++i) {
+        if (i - w0 + n_sink == n_cells) {
+            if (i < n_rolling) {
+                // context shift of the server: the oldest half of the window is discarded
+                const int n_discard = (i - w0)/2;
+
+                assert(llama_memory_seq_rm(mem,     0, w0 - off, w0 - off + n_discard));
+                assert(llama_memory_seq_rm(mem_ref, 0, w0 - off, w0 - off + n_discard));
+
+                w0 += n_discard;
+                n_shift++;
+            } else {
+                // the ring overwrites the cell of the oldest token, it is removed by hand from the reference
+                assert(llama_memory_seq_rm(mem_ref, 0, w0 - off, w0 - off + 1));
+
+                w0 += 1;
+            }
+        }
+
+        if (i - off == n_pos_max) {
+            // the window is moved back right after the sinks. in the ring, the cell of the oldest token has not been
+            // overwritten yet, it is removed first as the server does on context shift
+            const int delta = w0 - off - n_sink;
+
+            assert(llama_memory_seq_rm(mem, 0, n_sink, w0 - off));
+
+            llama_memory_seq_add(mem,     0, w0 - off, -1, -delta);
+            llama_memory_seq_add(mem_ref, 0, w0 - off, -1, -delta);
+
+            off += delta;
+            n_rebase++;
+        }
+
+        const llama_pos p = i - off;
+
+        decode(ctx, batch, tokens, i, p, 1, true);
+        decode(ref, batch, tokens, i, p, 1, true);
+
+        assert(llama_memory_seq_pos_min(mem, 0) == 0);
+        assert(llama_memory_seq_pos_max(mem, 0) == p);
+
+        const float * logits     = llama_get_logits_ith(ctx, 0);
+        const float * logits_ref = llama_get_logits_ith(ref, 0);
+
+        for (int k = 0; k < n_vocab; ++k) {
+            diff_max = std::max(diff_max, std::fabs(logits[k] - logits_ref[k]));
+        }
+
+        const auto stats = get_stats(ctx);
+
+        // the memory is bounded and the keys are only re-rotated when the window is moved back
+        assert(stats.n_used  == (uint32_t) (i + 1 - w0 + n_sink));
+        assert(stats.n_shift == (uint64_t) n_rebase);
+    }
+
+    fprintf(stderr, "%s: %d tokens, %d context shifts, %d re-basings, max difference of the logits = %g\n", __func__, n_total, n_shift, n_rebase, diff_max);
+
+    assert(n_rebase > 1);
+
+    // the cells are visited in a different order, the sums of the attention may differ in the last bits
+    assert(diff_max < 1e-3f);
+
+    llama_batch_free(batch);
+    llama_free(ref);
+    llama_free(ctx);
+
+    llama_model_free(model);
+    llama_backend_free();
+
+    fprintf(stderr, "All tests passed.\n");
+    return 0;
+}
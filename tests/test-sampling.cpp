@@ -7,6 +7,9 @@
 
 #include <algorithm>
 #include <cmath>
+#include <cstring>
+#include <functional>
+#include <random>
 #include <string>
 #include <vector>
 
@@ -267,6 +270,121 @@ static void test_sampler_queue(const size_t n_vocab, const std::string & sampler
            samplers_sequence.c_str(), n_vocab, top_k, top_p, min_p);
 }
 
+// the fused chain must select the same candidates and sample the same tokens as the chain applied to all the candidates
+static void test_fused(int n_vocab, const char * desc, bool fusable, const std::function<void(llama_sampler *)> & add) {
+    llama_sampler * chain0 = llama_sampler_chain_init(llama_sampler_chain_default_params());
+    llama_sampler * chain1 = llama_sampler_chain_init(llama_sampler_chain_default_params());
+
+    add(chain0);
+    add(chain1);
+
+    GGML_ASSERT(llama_sampler_chain_can_apply_logits(chain1) == fusable);
+
+    std::mt19937 rng(42);
+    std::normal_distribution<float> dist_logit(0.0f, 3.0f);
+
+    std::vector<float> logits(n_vocab);
+    std::vector<llama_token_data> cur0(n_vocab);
+    std::vector<llama_token_data> cur1(n_vocab);
+
+    for (int it = 0; it < 32; ++it) {
+        for (auto & l : logits) {
+            l = dist_logit(rng);
+        }
+
+        for (llama_token id = 0; id < n_vocab; ++id) {
+            cur0[id] = llama_token_data{id, logits[id], 0.0f};
+        }
+
+        llama_token_data_array cur_p0 = { cur0.data(), cur0.size(), -1, false };
+        llama_token_data_array cur_p1 = { cur1.data(), cur1.size(), -1, false };
+
+        llama_sampler_apply(chain0, &cur_p0);
+
+        // a fusable chain can still fall back, e.g. when min-p keeps less than min_keep candidates
+        if (!llama_sampler_chain_apply_logits(chain1, logits.data(), &cur_p1)) {
+            for (llama_token id = 0; id < n_vocab; ++id) {
+                cur1[id] = llama_token_data{id, logits[id], 0.0f};
+            }
+
+            cur_p1 = { cur1.data(), cur1.size(), -1, false };
+
+            llama_sampler_apply(chain1, &cur_p1);
+        }
+
+        GGML_ASSERT(cur_p0.size == cur_p1.size);
+        GGML_ASSERT(cur_p0.selected == cur_p1.selected);
+
+        for (size_t i = 0; i < cur_p0.size; ++i) {
+            GGML_ASSERT(cur_p0.data[i].id    == cur_p1.data[i].id);
+            GGML_ASSERT(cur_p0.data[i].logit == cur_p1.data[i].logit);
+            GGML_ASSERT(cur_p0.data[i].p     == cur_p1.data[i].p);
+        }
+
+        const llama_token token = cur_p0.data[cur_p0.selected].id;
+
+        llama_sampler_accept(chain0, token);
+        llama_sampler_accept(chain1, token);
+    }
+
+    llama_sampler_free(chain0);
+    llama_sampler_free(chain1);
+
+    printf("Fused chain %-40s OK with n_vocab=%d\n", desc, n_vocab);
+}
+
+static void test_fused_all() {
+    const std::vector<llama_logit_bias> biases = {
+        { 3, 5.0f }, { 7, -INFINITY }, { 3, 2.5f }, { 11, 20.0f },
+    };
+
+    for (int n_vocab : { 10, 1000, 32000 }) {
+        test_fused(n_vocab, "top-k", true, [&](llama_sampler * chain) {
+            llama_sampler_chain_add(chain, llama_sampler_init_top_k(40));
+            llama_sampler_chain_add(chain, llama_sampler_init_dist (1234));
+        });
+
+        test_fused(n_vocab, "bias-pen-top-k-top-p-min-p-temp", true, [&](llama_sampler * chain) {
+            llama_sampler_chain_add(chain, llama_sampler_init_logit_bias(n_vocab, biases.size(), biases.data()));
+            llama_sampler_chain_add(chain, llama_sampler_init_penalties (64, 1.1f, 0.5f, 0.5f));
+            llama_sampler_chain_add(chain, llama_sampler_init_dry_testing(1024, 0.0f, 1.75f, 2, 64, {}));
+            llama_sampler_chain_add(chain, llama_sampler_init_top_k     (40));
+            llama_sampler_chain_add(chain, llama_sampler_init_top_p     (0.9f, 1));
+            llama_sampler_chain_add(chain, llama_sampler_init_min_p     (0.05f, 1));
+            llama_sampler_chain_add(chain, llama_sampler_init_temp_ext  (0.8f, 0.0f, 1.0f));
+            llama_sampler_chain_add(chain, llama_sampler_init_dist      (1234));
+        });
+
+        test_fused(n_vocab, "pen-bias-top-k(200)-greedy", true, [&](llama_sampler * chain) {
+            llama_sampler_chain_add(chain, llama_sampler_init_penalties (8, 1.0f, 2.0f, 0.0f));
+            llama_sampler_chain_add(chain, llama_sampler_init_logit_bias(n_vocab, biases.size(), biases.data()));
+            llama_sampler_chain_add(chain, llama_sampler_init_top_k     (200));
+            llama_sampler_chain_add(chain, llama_sampler_init_temp      (0.0f));
+            llama_sampler_chain_add(chain, llama_sampler_init_dist      (1234));
+        });
+
+        test_fused(n_vocab, "bias-min-p-top-p-temp", true, [&](llama_sampler * chain) {
+            llama_sampler_chain_add(chain, llama_sampler_init_logit_bias(n_vocab, biases.size(), biases.data()));
+            llama_sampler_chain_add(chain, llama_sampler_init_top_k     (0));
+            llama_sampler_chain_add(chain, llama_sampler_init_min_p     (0.1f, 1));
+            llama_sampler_chain_add(chain, llama_sampler_init_top_p     (0.8f, 1));
+            llama_sampler_chain_add(chain, llama_sampler_init_temp      (1.2f));
+            llama_sampler_chain_add(chain, llama_sampler_init_dist      (1234));
+        });
+
+        test_fused(n_vocab, "min-p(min_keep)", true, [&](llama_sampler * chain) {
+            llama_sampler_chain_add(chain, llama_sampler_init_min_p(0.5f, 8));
+            llama_sampler_chain_add(chain, llama_sampler_init_dist (1234));
+        });
+
+        test_fused(n_vocab, "top-p-top-k", false, [&](llama_sampler * chain) {
+            llama_sampler_chain_add(chain, llama_sampler_init_top_p(0.9f, 1));
+            llama_sampler_chain_add(chain, llama_sampler_init_top_k(40));
+            llama_sampler_chain_add(chain, llama_sampler_init_dist (1234));
+        });
+    }
+}
+
 static void bench(llama_sampler * cnstr, const char * cnstr_name, const std::vector<llama_token_data> & data, int n_iter) {
     std::vector<llama_token_data> cur(data.size());
     std::copy(data.begin(), data.end(), cur.begin());
@@ -305,9 +423,69 @@ static void test_perf() {
     BENCH(llama_sampler_init_xtc    (1.0f, 0.1f, 1, 1),       data, 32);
 }
 
-int main(void) {
+// the cost per token of the common chain, applied to all the candidates and fused
+static void test_perf_fused() {
+    for (int n_vocab : { 32000, 151936, 262144 }) {
+        std::mt19937 rng(42);
+        std::normal_distribution<float> dist_logit(0.0f, 3.0f);
+
+        std::vector<float> logits(n_vocab);
+        for (auto & l : logits) {
+            l = dist_logit(rng);
+        }
+
+        llama_sampler * chain = llama_sampler_chain_init(llama_sampler_chain_default_params());
+
+        llama_sampler_chain_add(chain, llama_sampler_init_logit_bias(n_vocab, 0, nullptr));
+        llama_sampler_chain_add(chain, llama_sampler_init_penalties (64, 1.1f, 0.0f, 0.0f));
+        llama_sampler_chain_add(chain, llama_sampler_init_top_k     (40));
+        llama_sampler_chain_add(chain, llama_sampler_init_top_p     (0.95f, 1));
+        llama_sampler_chain_add(chain, llama_sampler_init_min_p     (0.05f, 1));
+        llama_sampler_chain_add(chain, llama_sampler_init_temp_ext  (0.8f, 0.0f, 1.0f));
+        llama_sampler_chain_add(chain, llama_sampler_init_dist      (1234));
+
+        for (int i = 0; i < 64; ++i) {
+            llama_sampler_accept(chain, rng() % n_vocab);
+        }
+
+        std::vector<llama_token_data> cur(n_vocab);
+
+        const int n_iter = 256;
+
+        int64_t t_start = ggml_time_us();
+        for (int i = 0; i < n_iter; i++) {
+            for (llama_token id = 0; id < n_vocab; ++id) {
+                cur[id] = llama_token_data{id, logits[id], 0.0f};
+            }
+
+            llama_token_data_array cur_p = { cur.data(), cur.size(), -1, false };
+            llama_sampler_apply(chain, &cur_p);
+        }
+        const int64_t t_chain = ggml_time_us() - t_start;
+
+        t_start = ggml_time_us();
+        for (int i = 0; i < n_iter; i++) {
+            llama_token_data_array cur_p = { cur.data(), cur.size(), -1, false };
+            GGML_ASSERT(llama_sampler_chain_apply_logits(chain, logits.data(), &cur_p));
+        }
+        const int64_t t_fused = ggml_time_us() - t_start;
+
+        llama_sampler_free(chain);
+
+        printf("n_vocab = %6d: chain %8.3f us/token, fused %8.3f us/token, %5.1fx\n", n_vocab,
+                (double) t_chain/n_iter, (double) t_fused/n_iter, (double) t_chain/std::max<int64_t>(1, t_fused));
+    }
+}
+
+int main(int argc, char ** argv) {
     ggml_time_init();
 
+    // test-sampling perf: only the benchmarks of the fused chain
+    if (argc > 1 && strcmp(argv[1], "perf") == 0) {
+        test_perf_fused();
+        return 0;
+    }
+
     test_temp({0.1f, 0.2f, 0.3f, 0.4f}, {0.4f, 0.3f, 0.2f, 0.1f}, 1.0f);
     test_temp({0.1f, 0.2f, 0.3f, 0.4f}, {1.0f, 0.0f, 0.0f, 0.0f}, 0.0f);
 
@@ -392,6 +570,8 @@ int main(void) {
     test_sampler_queue(10000, "mkp", 100, 0.8f, 0.1f);
     test_sampler_queue(10000, "mpk", 100, 0.8f, 0.1f);
 
+    test_fused_all();
+
     printf("OK\n");
 
     test_perf();
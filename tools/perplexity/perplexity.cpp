@@ -1685,25 +1685,26 @@ static void multiple_choice_score(llama_context * ctx, const common_params & par
     LOG_INF("\n");
 }
 
-static void kl_divergence(llama_context * ctx, const common_params & params) {
+// returns the mean KL-divergence, negative on error
+static double kl_divergence(llama_context * ctx, const common_params & params) {
     const llama_model * model = llama_get_model(ctx);
     const llama_vocab * vocab = llama_model_get_vocab(model);
 
     if (params.logits_file.empty()) {
         LOG_ERR("%s: you must provide a name of a file containing the log probabilities of the base model\n", __func__);
-        return;
+        return -1.0;
     }
     std::ifstream in(params.logits_file.c_str(), std::ios::binary);
     if (!in) {
         LOG_ERR("%s: failed to open %s\n", __func__, params.logits_file.c_str());
-        return;
+        return -1.0;
     }
     {
         char check[9]; check[8] = 0;
         in.read(check, 8);
         if (in.fail() || strncmp("_logits_", check, 8) != 0) {
             LOG_ERR("%s: %s does not look like a file containing log-probabilities\n", __func__, params.logits_file.c_str());
-            return;
+            return -1.0;
         }
     }
 
@@ -1720,7 +1721,7 @@ static void kl_divergence(llama_context * ctx, const common_params & params) {
     in.read((char *)&n_chunk, sizeof(n_chunk));
     if (in.fail()) {
         LOG_ERR("%s: failed reading n_vocab, n_chunk from %s\n", __func__, params.logits_file.c_str());
-        return;
+        return -1.0;
     }
     if (n_vocab != llama_vocab_n_tokens(vocab)) {
         LOG_ERR("%s: inconsistent vocabulary (%d vs %d)\n", __func__, n_vocab, llama_vocab_n_tokens(vocab));
@@ -1729,7 +1730,7 @@ static void kl_divergence(llama_context * ctx, const common_params & params) {
     std::vector<llama_token> tokens(size_t(n_ctx) * n_chunk);
     if (in.read((char *)tokens.data(), tokens.size()*sizeof(tokens[0])).fail()) {
         LOG_ERR("%s: failed reading evaluation tokens from %s\n", __func__, params.logits_file.c_str());
-        return;
+        return -1.0;
     }
 
     const int n_batch = params.n_batch;
@@ -1778,7 +1779,7 @@ static void kl_divergence(llama_context * ctx, const common_params & params) {
 
         if (in.read((char *)log_probs_uint16.data(), log_probs_uint16.size()*sizeof(uint16_t)).fail()) {
             LOG_ERR("%s: failed reading log-probs for chunk %d\n", __func__, i);
-            return;
+            return -1.0;
         }
 
         // clear the KV cache
@@ -1806,7 +1807,7 @@ static void kl_divergence(llama_context * ctx, const common_params & params) {
             if (llama_decode(ctx, batch)) {
                 LOG_ERR("%s : failed to eval\n", __func__);
                 llama_batch_free(batch);
-                return;
+                return -1.0;
             }
 
             // restore the original token in case it was set to BOS
@@ -1873,7 +1874,9 @@ static void kl_divergence(llama_context * ctx, const common_params & params) {
     }
     LOG("\n");
 
-    if (kld.count < 100) return; // we do not wish to do statistics on so few values
+    const double kld_mean = kld.count > 0 ? kld.sum_kld/kld.count : 0.0;
+
+    if (kld.count < 100) return kld_mean; // we do not wish to do statistics on so few values
 
     std::sort(kld_values.begin(), kld_values.end());
     std::sort(p_diff_values.begin(), p_diff_values.end());
@@ -1967,6 +1970,89 @@ static void kl_divergence(llama_context * ctx, const common_params & params) {
 
     const double same_top_p = 1.0*kld.n_same_top/kld.count;
     LOG("Same top p: %6.3lf ± %5.3lf %%\n", 100.0*same_top_p, 100.0*sqrt(same_top_p*(1.0 - same_top_p)/(kld.count - 1)));
+
+    return kld_mean;
+}
+
+// quantize the KV cache of one layer at a time to the types of -ctk and -ctv, with the other layers in F16, and measure the
+// KL-divergence to the base logits. the layers with the largest KL-divergence are kept in F16 in the suggested types
+static void kv_calibrate(llama_model * model, const common_params & params) {
+    const int32_t n_layer = llama_model_n_layer(model);
+
+    const std::string name_k = ggml_type_name(params.cache_type_k);
+    const std::string name_v = ggml_type_name(params.cache_type_v);
+
+    llama_context_params cparams = common_context_params_to_llama(params);
+
+    // the KL-divergence and the types of the layers
+    auto eval = [&](const std::vector<llama_kv_type_override> & overrides) {
+        cparams.kv_type_overrides = overrides.data();
+
+        llama_context * ctx = llama_init_from_model(model, cparams);
+        if (ctx == NULL) {
+            LOG_ERR("%s: failed to create the context\n", __func__);
+            return -1.0;
+        }
+
+        const double res = kl_divergence(ctx, params);
+
+        llama_free(ctx);
+
+        return res;
+    };
+
+    std::vector<std::pair<double, int32_t>> kld_layers;
+
+    for (int32_t il = 0; il < n_layer; ++il) {
+        LOG_INF("%s: layer %d/%d: K (%s), V (%s), the other layers in F16\n", __func__, il, n_layer, name_k.c_str(), name_v.c_str());
+
+        const double kld = eval({
+            {  0, -1, GGML_TYPE_F16,       GGML_TYPE_F16       },
+            { il, il, params.cache_type_k, params.cache_type_v },
+            {  0,  0, GGML_TYPE_COUNT,     GGML_TYPE_COUNT     },
+        });
+
+        if (kld < 0) {
+            return;
+        }
+
+        kld_layers.emplace_back(kld, il);
+    }
+
+    // the most sensitive layers first
+    std::vector<std::pair<double, int32_t>> kld_sorted = kld_layers;
+    std::sort(kld_sorted.begin(), kld_sorted.end(), [](const auto & a, const auto & b) { return a.first > b.first; });
+
+    const int32_t n_keep = std::min(params.kv_calibrate, n_layer);
+
+    std::vector<int32_t> il_keep;
+    for (int32_t i = 0; i < n_keep; ++i) {
+        il_keep.push_back(kld_sorted[i].second);
+    }
+    std::sort(il_keep.begin(), il_keep.end());
+
+    std::vector<llama_kv_type_override> overrides;
+    std::string ctl;
+    for (const int32_t il : il_keep) {
+        overrides.push_back({ il, il, GGML_TYPE_F16, GGML_TYPE_F16 });
+        ctl += (ctl.empty() ? "" : ",") + std::to_string(il) + "=f16";
+    }
+    overrides.push_back({ 0, 0, GGML_TYPE_COUNT, GGML_TYPE_COUNT });
+
+    LOG_INF("%s: suggested types, K (%s), V (%s), %d layers in F16\n", __func__, name_k.c_str(), name_v.c_str(), n_keep);
+
+    const double kld = eval(overrides);
+
+    LOG("\n");
+    LOG("====== KV cache calibration ======\n");
+    LOG("layer    Mean KLD (K %s, V %s)\n", name_k.c_str(), name_v.c_str());
+    for (const auto & [kld_layer, il] : kld_layers) {
+        const bool keep = std::find(il_keep.begin(), il_keep.end(), il) != il_keep.end();
+        LOG("%5d    %10.6lf%s\n", il, kld_layer, keep ? "    (F16)" : "");
+    }
+    LOG("\n");
+    LOG("Mean KLD with the suggested types: %10.6lf\n", kld);
+    LOG("Suggested types: -ctk %s -ctv %s%s%s\n", name_k.c_str(), name_v.c_str(), ctl.empty() ? "" : " -ctl ", ctl.c_str());
 }
 
 int main(int argc, char ** argv) {
@@ -2048,6 +2134,12 @@ int main(int argc, char ** argv) {
         winogrande_score(ctx, params);
     } else if (params.multiple_choice) {
         multiple_choice_score(ctx, params);
+    } else if (params.kl_divergence && params.kv_calibrate > 0) {
+        // the calibration creates a context for each layer, free the default one first
+        llama_init.context.reset();
+        ctx = nullptr;
+
+        kv_calibrate(model, params);
     } else if (params.kl_divergence) {
         kl_divergence(ctx, params);
     } else {
@@ -2055,7 +2147,9 @@ int main(int argc, char ** argv) {
     }
 
     LOG("\n");
-    llama_perf_context_print(ctx);
+    if (ctx) {
+        llama_perf_context_print(ctx);
+    }
 
     llama_backend_free();
 
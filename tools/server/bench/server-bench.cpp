@@ -0,0 +1,807 @@
+// llama-server-bench: native load generator for llama-server
+//
+// closed loop: N users sending requests back to back
+// open loop:   Poisson arrivals at a fixed rate, the latencies are measured from the scheduled arrival time
+//
+// the responses are streamed (SSE) to measure the time to first token and the inter-token latencies
+// the report is printed as JSON, see README.md
+
+#include <cpp-httplib/httplib.h>
+#include <nlohmann/json.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+using json = nlohmann::ordered_json;
+
+static double get_time_s() {
+    using clock = std::chrono::steady_clock;
+    static const auto t0 = clock::now();
+    return std::chrono::duration<double>(clock::now() - t0).count();
+}
+
+// distribution of the prompt / generation lengths
+// fixed:N, uniform:MIN:MAX, normal:MEAN:STDDEV, exp:MEAN
+struct length_dist {
+    enum dist_type {
+        DIST_FIXED,
+        DIST_UNIFORM,
+        DIST_NORMAL,
+        DIST_EXP,
+    };
+
+    dist_type type = DIST_FIXED;
+    double a = 128;
+    double b = 0;
+
+    static bool parse(const std::string & str, length_dist & out) {
+        std::vector<std::string> parts;
+        std::stringstream ss(str);
+        for (std::string part; std::getline(ss, part, ':');) {
+            parts.push_back(part);
+        }
+        try {
+            if (parts.size() == 1) {
+                out = { DIST_FIXED, std::stod(parts[0]), 0 };
+            } else if (parts.size() == 2 && parts[0] == "fixed") {
+                out = { DIST_FIXED, std::stod(parts[1]), 0 };
+            } else if (parts.size() == 2 && parts[0] == "exp") {
+                out = { DIST_EXP, std::stod(parts[1]), 0 };
+            } else if (parts.size() == 3 && parts[0] == "uniform") {
+                out = { DIST_UNIFORM, std::stod(parts[1]), std::stod(parts[2]) };
+            } else if (parts.size() == 3 && parts[0] == "normal") {
+                out = { DIST_NORMAL, std::stod(parts[1]), std::stod(parts[2]) };
+            } else {
+                return false;
+            }
+        } catch (const std::exception &) {
+            return false;
+        }
+        return out.a >= 1 && out.b >= 0 && (out.type != DIST_UNIFORM || out.b >= out.a);
+    }
+
+    int sample(std::mt19937 & rng) const {
+        double v = a;
+        switch (type) {
+            case DIST_FIXED:   v = a;                                                   break;
+            case DIST_UNIFORM: v = std::uniform_int_distribution<int>((int) a, (int) b)(rng); break;
+            case DIST_NORMAL:  v = std::normal_distribution<double>(a, b)(rng);         break;
+            case DIST_EXP:     v = std::exponential_distribution<double>(1.0 / a)(rng); break;
+        }
+        return std::max(1, (int) std::lround(v));
+    }
+
+    std::string str() const {
+        char buf[128];
+        switch (type) {
+            case DIST_FIXED:   snprintf(buf, sizeof(buf), "fixed:%g", a);          break;
+            case DIST_UNIFORM: snprintf(buf, sizeof(buf), "uniform:%g:%g", a, b);  break;
+            case DIST_NORMAL:  snprintf(buf, sizeof(buf), "normal:%g:%g", a, b);   break;
+            case DIST_EXP:     snprintf(buf, sizeof(buf), "exp:%g", a);            break;
+        }
+        return buf;
+    }
+};
+
+struct bench_params {
+    std::string host     = "127.0.0.1";
+    int         port     = 8080;
+    std::string endpoint = "/completion";
+    std::string api_key;
+    std::string model;
+
+    int    n_requests   = 64;
+    double duration     = 0.0;  // seconds, 0 = no limit
+    int    concurrency  = 4;    // closed loop: number of users
+    double rate         = 0.0;  // open loop: requests per second, 0 = closed loop
+    int    max_inflight = 256;  // open loop: max number of requests in flight
+    double timeout      = 600.0;
+
+    length_dist prompt_len = { length_dist::DIST_FIXED, 128, 0 };
+    length_dist gen_len    = { length_dist::DIST_FIXED, 128, 0 };
+
+    std::string dataset;
+    int  n_dataset_max_prompt = 0; // skip the dataset entries with a longer prompt (in words), 0 = no limit
+    bool ignore_eos = true;
+    bool cache_prompt = true;
+
+    uint32_t seed = 42;
+
+    // SLO of the goodput, in milliseconds, 0 = not checked
+    double slo_ttft = 0.0;
+    double slo_tpot = 0.0;
+    double slo_e2e  = 0.0;
+
+    std::string output;
+    bool progress = false;
+};
+
+static void print_usage(int /* argc */, char ** argv) {
+    const bench_params def;
+    printf("usage: %s [options]\n", argv[0]);
+    printf("\n");
+    printf("server:\n");
+    printf("  --host <host>                 server host (default: %s)\n", def.host.c_str());
+    printf("  --port <port>                 server port (default: %d)\n", def.port);
+    printf("  --endpoint <path>             /completion, /v1/completions or /v1/chat/completions (default: %s)\n", def.endpoint.c_str());
+    printf("  --api-key <key>               API key sent as a bearer token\n");
+    printf("  --model <name>                value of the \"model\" field of the requests\n");
+    printf("  --timeout <s>                 timeout of a request in seconds (default: %g)\n", def.timeout);
+    printf("\n");
+    printf("load:\n");
+    printf("  -n, --n-requests <n>          total number of requests (default: %d)\n", def.n_requests);
+    printf("  -d, --duration <s>            stop sending requests after this many seconds, 0 = no limit (default: %g)\n", def.duration);
+    printf("  -c, --concurrency <n>         closed loop: number of concurrent users (default: %d)\n", def.concurrency);
+    printf("  -r, --rate <r>                open loop: Poisson arrival rate in requests/s, overrides --concurrency (default: disabled)\n");
+    printf("  --max-inflight <n>            open loop: max number of requests in flight (default: %d)\n", def.max_inflight);
+    printf("  -s, --seed <n>                random seed (default: %u)\n", def.seed);
+    printf("\n");
+    printf("requests:\n");
+    printf("  -p, --prompt-len <dist>       prompt length in words (default: %s)\n", def.prompt_len.str().c_str());
+    printf("  -g, --gen-len <dist>          number of tokens to generate (default: %s)\n", def.gen_len.str().c_str());
+    printf("                                <dist> = N, fixed:N, uniform:MIN:MAX, normal:MEAN:STDDEV or exp:MEAN\n");
+    printf("  --dataset <file>              replay the prompts of a dataset: a ShareGPT JSON file or a JSONL file of\n");
+    printf("                                {\"prompt\": ..., \"n_predict\": ...} objects (n_predict is optional)\n");
+    printf("  --dataset-max-prompt <n>      skip the dataset prompts longer than this many words (default: no limit)\n");
+    printf("  --no-ignore-eos               stop the generation at EOS instead of generating exactly --gen-len tokens\n");
+    printf("  --no-cache-prompt             disable the server prompt cache for the requests\n");
+    printf("\n");
+    printf("report:\n");
+    printf("  --slo-ttft <ms>               goodput SLO: max time to first token (default: not checked)\n");
+    printf("  --slo-tpot <ms>               goodput SLO: max average time per output token after the first one (default: not checked)\n");
+    printf("  --slo-e2e <ms>                goodput SLO: max end-to-end latency (default: not checked)\n");
+    printf("  -o, --output <file>           write the JSON report to a file instead of stdout\n");
+    printf("  --progress                    print the progress to stderr\n");
+    printf("\n");
+}
+
+static bool parse_params(int argc, char ** argv, bench_params & params) {
+    auto next = [&](int & i) -> const char * {
+        if (++i >= argc) {
+            throw std::invalid_argument(std::string("missing value for ") + argv[i - 1]);
+        }
+        return argv[i];
+    };
+
+    try {
+        for (int i = 1; i < argc; i++) {
+            std::string arg = argv[i];
+            if (arg.compare(0, 2, "--") == 0) {
+                std::replace(arg.begin(), arg.end(), '_', '-');
+            }
+
+            if (arg == "-h" || arg == "--help") {
+                print_usage(argc, argv);
+                exit(0);
+            } else if (arg == "--host") {
+                params.host = next(i);
+            } else if (arg == "--port") {
+                params.port = std::stoi(next(i));
+            } else if (arg == "--endpoint") {
+                params.endpoint = next(i);
+            } else if (arg == "--api-key") {
+                params.api_key = next(i);
+            } else if (arg == "--model") {
+                params.model = next(i);
+            } else if (arg == "--timeout") {
+                params.timeout = std::stod(next(i));
+            } else if (arg == "-n" || arg == "--n-requests") {
+                params.n_requests = std::stoi(next(i));
+            } else if (arg == "-d" || arg == "--duration") {
+                params.duration = std::stod(next(i));
+            } else if (arg == "-c" || arg == "--concurrency") {
+                params.concurrency = std::stoi(next(i));
+            } else if (arg == "-r" || arg == "--rate") {
+                params.rate = std::stod(next(i));
+            } else if (arg == "--max-inflight") {
+                params.max_inflight = std::stoi(next(i));
+            } else if (arg == "-s" || arg == "--seed") {
+                params.seed = (uint32_t) std::stoul(next(i));
+            } else if (arg == "-p" || arg == "--prompt-len") {
+                if (!length_dist::parse(next(i), params.prompt_len)) {
+                    throw std::invalid_argument("invalid prompt length distribution: " + std::string(argv[i]));
+                }
+            } else if (arg == "-g" || arg == "--gen-len") {
+                if (!length_dist::parse(next(i), params.gen_len)) {
+                    throw std::invalid_argument("invalid generation length distribution: " + std::string(argv[i]));
+                }
+            } else if (arg == "--dataset") {
+                params.dataset = next(i);
+            } else if (arg == "--dataset-max-prompt") {
+                params.n_dataset_max_prompt = std::stoi(next(i));
+            } else if (arg == "--no-ignore-eos") {
+                params.ignore_eos = false;
+            } else if (arg == "--no-cache-prompt") {
+                params.cache_prompt = false;
+            } else if (arg == "--slo-ttft") {
+                params.slo_ttft = std::stod(next(i));
+            } else if (arg == "--slo-tpot") {
+                params.slo_tpot = std::stod(next(i));
+            } else if (arg == "--slo-e2e") {
+                params.slo_e2e = std::stod(next(i));
+            } else if (arg == "-o" || arg == "--output") {
+                params.output = next(i);
+            } else if (arg == "--progress") {
+                params.progress = true;
+            } else {
+                throw std::invalid_argument("unknown argument: " + arg);
+            }
+        }
+    } catch (const std::exception & e) {
+        fprintf(stderr, "error: %s\n", e.what());
+        print_usage(argc, argv);
+        return false;
+    }
+
+    if (params.n_requests <= 0 && params.duration <= 0) {
+        fprintf(stderr, "error: --n-requests or --duration must be set\n");
+        return false;
+    }
+    if (params.concurrency <= 0 || params.max_inflight <= 0 || params.rate < 0) {
+        fprintf(stderr, "error: invalid load parameters\n");
+        return false;
+    }
+    if (params.endpoint != "/completion" && params.endpoint != "/v1/completions" && params.endpoint != "/v1/chat/completions") {
+        fprintf(stderr, "error: unsupported endpoint: %s\n", params.endpoint.c_str());
+        return false;
+    }
+
+    return true;
+}
+
+//
+// dataset
+//
+
+struct bench_prompt {
+    std::string prompt;
+    int n_predict = 0; // 0 = sampled from --gen-len
+};
+
+static int count_words(const std::string & str) {
+    int  n    = 0;
+    bool word = false;
+    for (char c : str) {
+        const bool space = std::isspace((unsigned char) c);
+        n   += !space && !word;
+        word = !space;
+    }
+    return n;
+}
+
+static std::vector<bench_prompt> load_dataset(const bench_params & params) {
+    std::ifstream file(params.dataset);
+    if (!file) {
+        throw std::runtime_error("failed to open dataset: " + params.dataset);
+    }
+
+    std::vector<bench_prompt> prompts;
+
+    auto add = [&](const std::string & prompt, int n_predict) {
+        if (prompt.empty()) {
+            return;
+        }
+        if (params.n_dataset_max_prompt > 0 && count_words(prompt) > params.n_dataset_max_prompt) {
+            return;
+        }
+        prompts.push_back({ prompt, n_predict });
+    };
+
+    // ShareGPT: a JSON array of {"conversations": [{"from": "human", "value": ...}, {"from": "gpt", "value": ...}, ...]}
+    // the first human turn is the prompt and the length of the answer (in words) is the number of tokens to generate
+    const int c = (file >> std::ws).peek();
+    if (c == '[') {
+        const json data = json::parse(file);
+        for (const auto & item : data) {
+            const auto & conv = item.value("conversations", json::array());
+            if (conv.size() < 2 || conv[0].value("from", "") != "human") {
+                continue;
+            }
+            add(conv[0].value("value", ""), count_words(conv[1].value("value", "")));
+        }
+    } else {
+        std::string line;
+        while (std::getline(file, line)) {
+            if (line.find_first_not_of(" \t\r") == std::string::npos) {
+                continue;
+            }
+            const json item = json::parse(line);
+            add(item.value("prompt", ""), item.value("n_predict", item.value("max_tokens", 0)));
+        }
+    }
+
+    if (prompts.empty()) {
+        throw std::runtime_error("no prompt found in dataset: " + params.dataset);
+    }
+
+    return prompts;
+}
+
+// synthetic prompt of n_words random common words, most of them are single tokens with the usual vocabularies
+static std::string make_prompt(int n_words, std::mt19937 & rng) {
+    static const char * words[] = {
+        "the", "of", "and", "to", "in", "is", "you", "that", "it", "he", "was", "for", "on", "are", "as", "with",
+        "his", "they", "at", "be", "this", "have", "from", "or", "one", "had", "by", "word", "but", "not", "what", "all",
+        "were", "we", "when", "your", "can", "said", "there", "use", "an", "each", "which", "she", "do", "how", "their", "if",
+        "will", "up", "other", "about", "out", "many", "then", "them", "these", "so", "some", "her", "would", "make", "like", "time",
+    };
+    std::uniform_int_distribution<int> dist(0, (int) (sizeof(words)/sizeof(words[0])) - 1);
+
+    std::string res;
+    res.reserve(n_words * 6);
+    for (int i = 0; i < n_words; i++) {
+        if (i > 0) {
+            res += ' ';
+        }
+        res += words[dist(rng)];
+    }
+    return res;
+}
+
+//
+// requests
+//
+
+struct bench_request {
+    int         id;
+    double      t_sched; // scheduled start time, seconds since the start of the benchmark
+    std::string prompt;
+    int         n_predict;
+};
+
+struct bench_result {
+    int         id      = -1;
+    int         status  = 0;
+    std::string error;
+
+    double t_sched = 0.0;
+    double t_start = 0.0;
+    double t_first = -1.0; // time of the first token
+    double t_end   = 0.0;
+
+    std::vector<double> itl; // inter-token latencies (s), one per streamed chunk after the first one
+
+    int n_prompt = 0;
+    int n_gen    = 0;
+
+    bool ok() const {
+        return status == 200 && error.empty() && t_first >= 0.0;
+    }
+
+    double ttft() const { return t_first - t_sched; }
+    double e2e()  const { return t_end   - t_sched; }
+
+    // average time per output token after the first one
+    double tpot() const {
+        return n_gen > 1 ? (t_end - t_first) / (n_gen - 1) : 0.0;
+    }
+};
+
+static json make_request_body(const bench_params & params, const bench_request & req) {
+    json body = {
+        { "stream",       true },
+        { "ignore_eos",   params.ignore_eos },
+        { "cache_prompt", params.cache_prompt },
+    };
+    if (!params.model.empty()) {
+        body["model"] = params.model;
+    }
+    if (params.endpoint == "/completion") {
+        body["prompt"]    = req.prompt;
+        body["n_predict"] = req.n_predict;
+    } else if (params.endpoint == "/v1/completions") {
+        body["prompt"]     = req.prompt;
+        body["max_tokens"] = req.n_predict;
+    } else {
+        body["messages"]   = json::array({ { { "role", "user" }, { "content", req.prompt } } });
+        body["max_tokens"] = req.n_predict;
+        body["stream_options"] = { { "include_usage", true } };
+    }
+    return body;
+}
+
+// handle one SSE event, returns false to stop the stream
+static bool handle_event(const bench_params & params, const std::string & data, bench_result & res, double & t_last) {
+    if (data == "[DONE]") {
+        return false;
+    }
+
+    json event;
+    try {
+        event = json::parse(data);
+    } catch (const std::exception & e) {
+        res.error = std::string("invalid event: ") + e.what();
+        return false;
+    }
+
+    if (event.contains("error")) {
+        res.error = event.at("error").is_object() ? event.at("error").value("message", "error") : event.at("error").dump();
+        return false;
+    }
+
+    std::string piece;
+    if (params.endpoint == "/completion") {
+        piece = event.value("content", "");
+    } else if (event.contains("choices") && !event.at("choices").empty()) {
+        const auto & choice = event.at("choices").at(0);
+        if (params.endpoint == "/v1/completions") {
+            piece = choice.value("text", "");
+        } else if (choice.contains("delta") && choice.at("delta").is_object()) {
+            const auto & content = choice.at("delta").value("content", json());
+            piece = content.is_string() ? content.get<std::string>() : "";
+        }
+    }
+
+    if (!piece.empty()) {
+        const double t_now = get_time_s();
+        if (res.t_first < 0.0) {
+            res.t_first = t_now;
+        } else {
+            res.itl.push_back(t_now - t_last);
+        }
+        t_last = t_now;
+        res.n_gen++;
+    }
+
+    // the exact token counts, if reported: the timings of llama-server or the OAI usage
+    if (event.contains("timings") && event.at("timings").is_object()) {
+        const auto & timings = event.at("timings");
+        res.n_prompt = timings.value("prompt_n", res.n_prompt);
+        res.n_gen    = std::max(res.n_gen, timings.value("predicted_n", 0));
+    } else if (event.contains("usage") && event.at("usage").is_object()) {
+        const auto & usage = event.at("usage");
+        res.n_prompt = usage.value("prompt_tokens", res.n_prompt);
+        res.n_gen    = std::max(res.n_gen, usage.value("completion_tokens", 0));
+    }
+
+    return true;
+}
+
+static bench_result run_request(const bench_params & params, httplib::Client & cli, const bench_request & req) {
+    bench_result res;
+    res.id      = req.id;
+    res.t_sched = req.t_sched;
+    res.t_start = get_time_s();
+
+    httplib::Request hreq;
+    hreq.method = "POST";
+    hreq.path   = params.endpoint;
+    hreq.body   = make_request_body(params, req).dump();
+    hreq.set_header("Content-Type", "application/json");
+    hreq.set_header("Accept", "text/event-stream");
+    if (!params.api_key.empty()) {
+        hreq.set_header("Authorization", "Bearer " + params.api_key);
+    }
+
+    std::string buf;
+    std::string body_err; // body of a non-200 response
+    double t_last = 0.0;
+    bool stop = false;
+
+    hreq.response_handler = [&](const httplib::Response & response) {
+        res.status = response.status;
+        return true;
+    };
+    hreq.content_receiver = [&](const char * data, size_t len, uint64_t, uint64_t) {
+        if (res.status != 200) {
+            body_err.append(data, len);
+            return true;
+        }
+        buf.append(data, len);
+        size_t pos;
+        while (!stop && (pos = buf.find('\n')) != std::string::npos) {
+            std::string line = buf.substr(0, pos);
+            buf.erase(0, pos + 1);
+            if (!line.empty() && line.back() == '\r') {
+                line.pop_back();
+            }
+            if (line.rfind("data:", 0) != 0) {
+                continue;
+            }
+            size_t off = 5;
+            while (off < line.size() && line[off] == ' ') {
+                off++;
+            }
+            stop = !handle_event(params, line.substr(off), res, t_last);
+        }
+        // note: the events after the end of the stream are ignored
+        return true;
+    };
+
+    auto result = cli.send(hreq);
+
+    res.t_end = get_time_s();
+
+    if (!result) {
+        res.error = "HTTP error: " + httplib::to_string(result.error());
+    } else if (res.status != 200 && res.error.empty()) {
+        res.error = "HTTP " + std::to_string(res.status);
+        try {
+            const json err = json::parse(body_err);
+            res.error += ": " + err.at("error").value("message", "");
+        } catch (const std::exception &) {
+            // not a JSON error
+        }
+    } else if (res.error.empty() && res.t_first < 0.0) {
+        res.error = "no token received";
+    }
+
+    return res;
+}
+
+//
+// report
+//
+
+static json make_stats(std::vector<double> values, double scale) {
+    if (values.empty()) {
+        return json::object();
+    }
+    std::sort(values.begin(), values.end());
+
+    // linear interpolation between the closest ranks
+    auto percentile = [&](double p) {
+        const double pos = p/100.0 * (values.size() - 1);
+        const size_t lo  = (size_t) pos;
+        const size_t hi  = std::min(lo + 1, values.size() - 1);
+        return scale * (values[lo] + (pos - lo) * (values[hi] - values[lo]));
+    };
+
+    double sum = 0.0;
+    for (double v : values) {
+        sum += v;
+    }
+
+    return json {
+        { "mean", scale * sum / values.size() },
+        { "p50",  percentile(50) },
+        { "p90",  percentile(90) },
+        { "p95",  percentile(95) },
+        { "p99",  percentile(99) },
+        { "max",  scale * values.back() },
+    };
+}
+
+static json make_report(const bench_params & params, const std::vector<bench_result> & results, double t_total) {
+    std::vector<double> ttft, tpot, itl, e2e, queue;
+    std::map<std::string, int> errors;
+
+    int64_t n_prompt_total = 0;
+    int64_t n_gen_total    = 0;
+    int     n_ok           = 0;
+    int     n_good         = 0;
+    int64_t n_gen_good     = 0;
+
+    for (const auto & res : results) {
+        if (!res.ok()) {
+            errors[res.error]++;
+            continue;
+        }
+        n_ok++;
+        n_prompt_total += res.n_prompt;
+        n_gen_total    += res.n_gen;
+
+        ttft.push_back(res.ttft());
+        e2e.push_back(res.e2e());
+        queue.push_back(res.t_start - res.t_sched);
+        if (res.n_gen > 1) {
+            tpot.push_back(res.tpot());
+        }
+        itl.insert(itl.end(), res.itl.begin(), res.itl.end());
+
+        const bool good =
+            (params.slo_ttft <= 0.0 || 1e3*res.ttft() <= params.slo_ttft) &&
+            (params.slo_tpot <= 0.0 || 1e3*res.tpot() <= params.slo_tpot) &&
+            (params.slo_e2e  <= 0.0 || 1e3*res.e2e()  <= params.slo_e2e);
+        if (good) {
+            n_good++;
+            n_gen_good += res.n_gen;
+        }
+    }
+
+    json j_errors = json::object();
+    for (const auto & [err, n] : errors) {
+        j_errors[err] = n;
+    }
+
+    const double t = std::max(t_total, 1e-9);
+
+    return json {
+        { "config", {
+            { "endpoint",     params.endpoint },
+            { "mode",         params.rate > 0.0 ? "open" : "closed" },
+            { "rate",         params.rate },
+            { "concurrency",  params.rate > 0.0 ? params.max_inflight : params.concurrency },
+            { "n_requests",   params.n_requests },
+            { "duration",     params.duration },
+            { "prompt_len",   params.dataset.empty() ? params.prompt_len.str() : "dataset" },
+            { "gen_len",      params.gen_len.str() },
+            { "dataset",      params.dataset },
+            { "ignore_eos",   params.ignore_eos },
+            { "cache_prompt", params.cache_prompt },
+            { "seed",         params.seed },
+        }},
+        { "duration_s",          t_total },
+        { "n_requests",          results.size() },
+        { "n_ok",                n_ok },
+        { "n_failed",            results.size() - n_ok },
+        { "errors",              j_errors },
+        { "n_prompt_tokens",     n_prompt_total },
+        { "n_gen_tokens",        n_gen_total },
+        { "request_throughput",  n_ok / t },
+        { "output_throughput",   n_gen_total / t },
+        { "ttft_ms",             make_stats(ttft,  1e3) },
+        { "tpot_ms",             make_stats(tpot,  1e3) },
+        { "itl_ms",              make_stats(itl,   1e3) },
+        { "e2e_ms",              make_stats(e2e,   1e3) },
+        { "queue_ms",            make_stats(queue, 1e3) },
+        { "goodput", {
+            { "slo_ttft_ms",        params.slo_ttft },
+            { "slo_tpot_ms",        params.slo_tpot },
+            { "slo_e2e_ms",         params.slo_e2e },
+            { "n_requests",         n_good },
+            { "ratio",              results.empty() ? 0.0 : (double) n_good / results.size() },
+            { "request_throughput", n_good / t },
+            { "output_throughput",  n_gen_good / t },
+        }},
+    };
+}
+
+int main(int argc, char ** argv) {
+    bench_params params;
+    if (!parse_params(argc, argv, params)) {
+        return 1;
+    }
+
+    std::vector<bench_prompt> dataset;
+    if (!params.dataset.empty()) {
+        try {
+            dataset = load_dataset(params);
+        } catch (const std::exception & e) {
+            fprintf(stderr, "error: %s\n", e.what());
+            return 1;
+        }
+        fprintf(stderr, "loaded %zu prompts from %s\n", dataset.size(), params.dataset.c_str());
+    }
+
+    // wait for the server to be ready
+    {
+        httplib::Client cli(params.host, params.port);
+        cli.set_connection_timeout(1, 0);
+        bool ready = false;
+        for (int i = 0; i < 600 && !ready; i++) {
+            auto res = cli.Get("/health");
+            ready = res && res->status == 200;
+            if (!ready) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(100));
+            }
+        }
+        if (!ready) {
+            fprintf(stderr, "error: server %s:%d is not ready\n", params.host.c_str(), params.port);
+            return 1;
+        }
+    }
+
+    // the requests are generated on the fly, in order, so that the sequence only depends on the seed
+    std::mt19937 rng(params.seed);
+    std::mutex   mutex;
+    int          n_sent = 0;
+    double       t_next = 0.0; // open loop: next arrival time
+
+    const double t_begin = get_time_s();
+
+    auto next_request = [&](bench_request & req) -> bool {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (params.n_requests > 0 && n_sent >= params.n_requests) {
+            return false;
+        }
+        const double t_now = get_time_s();
+        if (params.rate > 0.0) {
+            if (n_sent > 0) {
+                t_next += std::exponential_distribution<double>(params.rate)(rng);
+            } else {
+                t_next = t_now;
+            }
+            req.t_sched = t_next;
+        } else {
+            req.t_sched = t_now;
+        }
+        if (params.duration > 0.0 && req.t_sched - t_begin >= params.duration) {
+            return false;
+        }
+        req.id = n_sent++;
+        if (dataset.empty()) {
+            req.prompt    = make_prompt(params.prompt_len.sample(rng), rng);
+            req.n_predict = params.gen_len.sample(rng);
+        } else {
+            const auto & p = dataset[req.id % dataset.size()];
+            req.prompt    = p.prompt;
+            req.n_predict = p.n_predict > 0 ? p.n_predict : params.gen_len.sample(rng);
+        }
+        return true;
+    };
+
+    std::vector<bench_result> results;
+    std::atomic<int> n_done = 0;
+
+    auto worker = [&]() {
+        httplib::Client cli(params.host, params.port);
+        // note: no keep-alive, the server may close the connection at the end of a stream
+        cli.set_keep_alive(false);
+        cli.set_read_timeout((time_t) params.timeout, 0);
+        cli.set_write_timeout((time_t) params.timeout, 0);
+
+        bench_request req;
+        while (next_request(req)) {
+            const double t_wait = req.t_sched - get_time_s();
+            if (t_wait > 0.0) {
+                std::this_thread::sleep_for(std::chrono::duration<double>(t_wait));
+            }
+
+            bench_result res = run_request(params, cli, req);
+
+            const int n = ++n_done;
+            if (params.progress) {
+                fprintf(stderr, "request %4d: %s, ttft = %8.2f ms, e2e = %8.2f ms, n_gen = %d (%d done)\n",
+                        res.id, res.ok() ? "ok" : res.error.c_str(), 1e3*res.ttft(), 1e3*res.e2e(), res.n_gen, n);
+            }
+
+            std::lock_guard<std::mutex> lock(mutex);
+            results.push_back(std::move(res));
+        }
+    };
+
+    const int n_workers = params.rate > 0.0 ? params.max_inflight : params.concurrency;
+
+    if (params.rate > 0.0) {
+        fprintf(stderr, "benchmarking %s:%d%s, open loop, %g requests/s, max %d in flight\n",
+                params.host.c_str(), params.port, params.endpoint.c_str(), params.rate, n_workers);
+    } else {
+        fprintf(stderr, "benchmarking %s:%d%s, closed loop, %d users\n",
+                params.host.c_str(), params.port, params.endpoint.c_str(), n_workers);
+    }
+
+    std::vector<std::thread> workers;
+    for (int i = 0; i < n_workers; i++) {
+        workers.emplace_back(worker);
+    }
+    for (auto & t : workers) {
+        t.join();
+    }
+
+    const double t_total = get_time_s() - t_begin;
+
+    std::sort(results.begin(), results.end(), [](const bench_result & a, const bench_result & b) { return a.id < b.id; });
+
+    const json report = make_report(params, results, t_total);
+
+    if (params.output.empty()) {
+        printf("%s\n", report.dump(4).c_str());
+    } else {
+        std::ofstream out(params.output);
+        if (!out) {
+            fprintf(stderr, "error: failed to open %s\n", params.output.c_str());
+            return 1;
+        }
+        out << report.dump(4) << std::endl;
+    }
+
+    fprintf(stderr, "%d/%zu requests ok in %.2f s, %.2f requests/s, %.2f tokens/s\n",
+            report.at("n_ok").get<int>(), results.size(), t_total,
+            report.at("request_throughput").get<double>(), report.at("output_throughput").get<double>());
+
+    return 0;
+}
@@ -8,6 +8,7 @@
 #include "log.h"
 #include "sampling.h"
 #include "speculative.h"
+#include "ngram-cache.h"
 #include "mtmd.h"
 #include "mtmd-helper.h"
 
@@ -24,6 +25,12 @@
 #include <cstddef>
 #include <cinttypes>
 #include <deque>
+#include <filesystem>
+#include <functional>
+#include <future>
+#include <limits>
+#include <list>
+#include <map>
 #include <memory>
 #include <mutex>
 #include <signal.h>
@@ -31,6 +38,16 @@
 #include <unordered_map>
 #include <unordered_set>
 
+#if defined (__unix__) || (defined (__APPLE__) && defined (__MACH__))
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#ifdef LLAMA_SERVER_ZLIB
+#include <zlib.h>
+#endif
+
 using json = nlohmann::ordered_json;
 
 constexpr int HTTP_POLLING_SECONDS = 1;
@@ -86,6 +103,7 @@ enum error_type {
     ERROR_TYPE_PERMISSION,
     ERROR_TYPE_UNAVAILABLE, // custom error
     ERROR_TYPE_NOT_SUPPORTED, // custom error
+    ERROR_TYPE_OVERLOADED, // custom error
 };
 
 static bool server_task_type_need_embd(server_task_type task_type) {
@@ -228,15 +246,25 @@ struct server_task {
         int slot_id;
         std::string filename;
         std::string filepath;
+
+        bool incremental = true;  // save: only append the tokens added since the last save to the same file
+        bool compress    = false; // save: compress the KV payload
     };
     slot_action slot_action;
 
+    // used by the admission control: estimated number of KV cells the task will occupy
+    int32_t n_kv_need = 0;
+
     // used by SERVER_TASK_TYPE_METRICS
     bool metrics_reset_bucket = false;
 
     // used by SERVER_TASK_TYPE_SET_LORA
     std::vector<common_adapter_lora_info> set_lora;
 
+    // used for the latency metrics
+    int64_t t_arrival = -1; // time when the HTTP request was received
+    int64_t t_queued  = -1; // time when the task was first posted to the queue
+
     server_task(server_task_type type) : type(type) {}
 
     static slot_params params_from_json_cmpl(
@@ -1126,6 +1154,10 @@ static json format_error_response(const std::string & message, const enum error_
             type_str = "unavailable_error";
             code = 503;
             break;
+        case ERROR_TYPE_OVERLOADED:
+            type_str = "overloaded_error";
+            code = 429;
+            break;
     }
     return json {
         {"code", code},
@@ -1169,6 +1201,25 @@ struct server_task_result_metrics : server_task_result {
     uint64_t n_decode_total     = 0;
     uint64_t n_busy_slots_total = 0;
 
+    uint64_t n_resp_cache_hits    = 0;
+    uint64_t n_resp_cache_misses  = 0;
+    uint64_t n_resp_cache_entries = 0;
+    uint64_t n_resp_cache_bytes   = 0;
+
+    uint64_t n_mtmd_cache_hits    = 0;
+    uint64_t n_mtmd_cache_misses  = 0;
+    uint64_t n_mtmd_cache_entries = 0;
+    uint64_t n_mtmd_cache_bytes   = 0;
+
+    int64_t  n_kv_capacity      = 0;
+    int64_t  n_kv_reserved      = 0;
+    int64_t  n_kv_queued        = 0;
+    double   kv_tokens_per_s    = 0.0;
+    uint64_t n_rejected_total   = 0;
+
+    // usage and fragmentation of each stream of KV cells
+    std::vector<llama_memory_stream_stats> kv_streams;
+
     // while we can also use std::vector<server_slot> this requires copying the slot object which can be quite messy
     // therefore, we use json to temporarily store the slot.to_json() result
     json slots_data = json::array();
@@ -1193,9 +1244,85 @@ struct server_task_result_metrics : server_task_result {
             { "n_decode_total",                  n_decode_total },
             { "n_busy_slots_total",              n_busy_slots_total },
 
+            { "n_resp_cache_hits",               n_resp_cache_hits },
+            { "n_resp_cache_misses",             n_resp_cache_misses },
+            { "n_resp_cache_entries",            n_resp_cache_entries },
+            { "n_resp_cache_bytes",              n_resp_cache_bytes },
+
+            { "n_mtmd_cache_hits",               n_mtmd_cache_hits },
+            { "n_mtmd_cache_misses",             n_mtmd_cache_misses },
+            { "n_mtmd_cache_entries",            n_mtmd_cache_entries },
+            { "n_mtmd_cache_bytes",              n_mtmd_cache_bytes },
+
+            { "n_kv_capacity",                   n_kv_capacity },
+            { "n_kv_reserved",                   n_kv_reserved },
+            { "n_kv_queued",                     n_kv_queued },
+            { "kv_tokens_per_s",                 kv_tokens_per_s },
+            { "n_rejected_total",                n_rejected_total },
+
+            { "kv_streams",                      kv_streams_to_json() },
+
             { "slots",                           slots_data },
         };
     }
+
+    json kv_streams_to_json() const {
+        json res = json::array();
+
+        for (const auto & st : kv_streams) {
+            res.push_back({
+                { "n_cells",  st.n_cells },
+                { "n_used",   st.n_used },
+                { "n_kv",     st.n_kv },
+                { "n_holes",  st.n_holes },
+                { "frag",     st.frag },
+                { "n_defrag",  st.n_defrag },
+                { "n_moved",   st.n_moved },
+                { "n_evicted", st.n_evicted },
+                { "n_shift",   st.n_shift },
+            });
+        }
+
+        return res;
+    }
+
+    // the statistics of each stream, using the Prometheus text exposition format
+    std::string kv_streams_to_prometheus() const {
+        std::stringstream ss;
+
+        const struct {
+            const char * name;
+            const char * type;
+            const char * help;
+            std::function<double(const llama_memory_stream_stats &)> get;
+        } defs[] = {
+            { "kv_stream_used_cells",          "gauge",   "Number of KV cells in use, per stream.",
+                [](const llama_memory_stream_stats & st) { return (double) st.n_used; } },
+            { "kv_stream_holes",               "gauge",   "Number of runs of free KV cells below the last cell in use, per stream.",
+                [](const llama_memory_stream_stats & st) { return (double) st.n_holes; } },
+            { "kv_stream_fragmentation",       "gauge",   "Fraction of free KV cells below the last cell in use, per stream.",
+                [](const llama_memory_stream_stats & st) { return (double) st.frag; } },
+            { "kv_stream_defrag_total",        "counter", "Number of KV cache defragmentations, per stream.",
+                [](const llama_memory_stream_stats & st) { return (double) st.n_defrag; } },
+            { "kv_stream_defrag_moved_total",  "counter", "Number of KV cells moved by the defragmentations, per stream.",
+                [](const llama_memory_stream_stats & st) { return (double) st.n_moved; } },
+            { "kv_stream_evicted_total",       "counter", "Number of KV cells evicted to keep the sequences within --kv-budget, per stream.",
+                [](const llama_memory_stream_stats & st) { return (double) st.n_evicted; } },
+            { "kv_stream_shift_total",         "counter", "Number of K-shifts (re-rotations of the keys) of the KV cells, per stream.",
+                [](const llama_memory_stream_stats & st) { return (double) st.n_shift; } },
+        };
+
+        for (const auto & def : defs) {
+            ss << "# HELP llamacpp:" << def.name << " " << def.help << "\n"
+               << "# TYPE llamacpp:" << def.name << " " << def.type << "\n";
+
+            for (size_t s = 0; s < kv_streams.size(); ++s) {
+                ss << "llamacpp:" << def.name << "{stream=\"" << s << "\"} " << def.get(kv_streams[s]) << "\n";
+            }
+        }
+
+        return ss.str();
+    }
 };
 
 struct server_task_result_slot_save_load : server_task_result {
@@ -1265,6 +1392,14 @@ struct server_slot {
 
     common_speculative * spec = nullptr;
 
+    // n-gram drafting (prompt lookup), used instead of a draft model
+    bool spec_ngram = false;
+
+    common_ngram_cache ngram_cache; // n-grams of cache_tokens
+    size_t n_ngram_cached = 0;      // number of leading cache_tokens added to ngram_cache
+
+    int32_t n_kv_need = 0; // KV cells reserved by the admission control for the current task
+
     std::vector<common_adapter_lora_info> lora;
 
     // the index relative to completion multi-task request
@@ -1277,10 +1412,34 @@ struct server_slot {
     // used to determine the slot that has been used the longest
     int64_t t_last_used = -1;
 
+    // number of restores of the slot pending on the I/O thread, the slot cannot be used until they are applied
+    int32_t n_io_pending = 0;
+
+    // state of the last save of the slot, used for the incremental saves
+    struct {
+        std::string  filepath;     // empty = the next save rewrites the file
+        llama_tokens tokens;       // tokens in the file
+        llama_pos    n_pos_offset = 0;
+    } save_state;
+
     // generation props
     int32_t n_ctx       = 0;  // context size per slot
     int32_t n_past      = 0;
     int32_t n_decoded   = 0;
+
+    // after an attention sink context shift, the first n_pos_fixed tokens of cache_tokens (the sinks) keep the
+    // positions [0, n_pos_fixed) and the token i of the rolling window is at the position i + n_pos_offset
+    int32_t   n_pos_fixed  = 0;
+    llama_pos n_pos_offset = 0;
+
+    // the KV data is not a plain evaluation of cache_tokens from position 0 (chunks moved by --cache-reuse, context
+    // shifts, a restored state), so it cannot be saved to the KV store under the hashes of the token prefixes
+    bool kv_shifted = false;
+
+    // some cells of the slot have been evicted by --kv-budget, so the KV data no longer matches cache_tokens and no
+    // prefix of them can be reused by the next prompt
+    bool kv_evicted = false;
+
     int32_t n_remaining = -1;
     int32_t i_batch     = -1;
     int32_t n_predict   = -1; // TODO: disambiguate from params.n_predict
@@ -1322,8 +1481,11 @@ struct server_slot {
     // stats
     size_t n_sent_text        = 0; // number of sent text character
 
+    int64_t t_arrival = -1;
+    int64_t t_queued  = -1;
     int64_t t_start_process_prompt;
     int64_t t_start_generation;
+    int64_t t_last_token;
 
     double t_prompt_processing; // ms
     double t_token_generation;  // ms
@@ -1334,6 +1496,10 @@ struct server_slot {
     int32_t n_draft_total = 0;      // Total draft tokens generated
     int32_t n_draft_accepted = 0;   // Draft tokens actually accepted
 
+    // response cache key of the current task, empty if the results are not cached
+    std::string resp_cache_key;
+    std::vector<server_task_result_cmpl_partial> resp_cache_partials;
+
     void reset() {
         SLT_DBG(*this, "%s", "\n");
 
@@ -1358,6 +1524,9 @@ struct server_slot {
         // clear speculative decoding stats
         n_draft_total = 0;
         n_draft_accepted = 0;
+
+        resp_cache_key.clear();
+        resp_cache_partials.clear();
     }
 
     bool need_embd() const {
@@ -1400,8 +1569,12 @@ struct server_slot {
         return state != SLOT_STATE_IDLE;
     }
 
+    bool is_available() const {
+        return !is_processing() && n_io_pending == 0;
+    }
+
     bool can_speculate() const {
-        return ctx_dft && params.speculative.n_max > 0 && params.cache_prompt;
+        return (ctx_dft || spec_ngram) && params.speculative.n_max > 0 && params.cache_prompt;
     }
 
     void add_token(const completion_token_output & token) {
@@ -1536,6 +1709,123 @@ struct server_slot {
     }
 };
 
+enum server_histogram_type {
+    SERVER_HISTOGRAM_QUEUE_WAIT,      // task queued -> slot assigned
+    SERVER_HISTOGRAM_TOKENIZE,        // request parsing + tokenization on the HTTP thread
+    SERVER_HISTOGRAM_PREFILL,         // prompt processing
+    SERVER_HISTOGRAM_TTFT,            // request received -> first generated token
+    SERVER_HISTOGRAM_ITL,             // time between two consecutive generated tokens
+    SERVER_HISTOGRAM_SAMPLING,        // time spent in the sampler per sampled token
+    SERVER_HISTOGRAM_BATCH_OCCUPANCY, // n_tokens / n_batch for each llama_decode() call
+    SERVER_HISTOGRAM_COUNT,
+};
+
+// lock-free histogram with log-linear (HDR-style) buckets
+// record() only does relaxed atomic increments, so it can be called from the hot path and from any thread
+struct server_histogram {
+    const std::vector<double> * bounds = nullptr; // upper bounds of the buckets, shared by all histograms of a family
+
+    std::unique_ptr<std::atomic<uint64_t>[]> buckets; // bounds->size() + 1 entries, the last one is +Inf
+
+    std::atomic<uint64_t> count  {0};
+    std::atomic<uint64_t> sum_us {0}; // sum of the recorded values, in millionths
+
+    void init(const std::vector<double> * b) {
+        bounds  = b;
+        buckets = std::make_unique<std::atomic<uint64_t>[]>(b->size() + 1);
+        for (size_t i = 0; i <= b->size(); i++) {
+            buckets[i].store(0, std::memory_order_relaxed);
+        }
+    }
+
+    void record(double value) {
+        const size_t i = std::lower_bound(bounds->begin(), bounds->end(), value) - bounds->begin();
+
+        buckets[i].fetch_add(1, std::memory_order_relaxed);
+        count     .fetch_add(1, std::memory_order_relaxed);
+        sum_us    .fetch_add((uint64_t) std::max(0.0, value*1e6 + 0.5), std::memory_order_relaxed);
+    }
+};
+
+// one histogram per (task type, endpoint) combination
+struct server_histogram_family {
+    static constexpr int N_TASK_TYPES    = SERVER_TASK_TYPE_INFILL + 2; // only the inference task types are tracked
+    static constexpr int N_ENDPOINTS     = OAICOMPAT_TYPE_EMBEDDING + 1;
+    static constexpr int TASK_TYPE_MIXED = N_TASK_TYPES - 1;            // values that come from several task types
+
+    const char * name;
+    const char * help;
+
+    bool per_endpoint = true; // if false, only the task type label is exported
+
+    std::vector<double> bounds;
+
+    server_histogram hist[N_TASK_TYPES][N_ENDPOINTS];
+
+    void init(const char * name, const char * help, std::vector<double> && bounds, bool per_endpoint) {
+        this->name         = name;
+        this->help         = help;
+        this->bounds       = std::move(bounds);
+        this->per_endpoint = per_endpoint;
+
+        for (auto & row : hist) {
+            for (auto & h : row) {
+                h.init(&this->bounds);
+            }
+        }
+    }
+
+    void record(server_task_type task_type, oaicompat_type endpoint, double value) {
+        if (task_type > SERVER_TASK_TYPE_INFILL) {
+            return;
+        }
+        hist[task_type][per_endpoint ? endpoint : OAICOMPAT_TYPE_NONE].record(value);
+    }
+
+    void record_mixed(double value) {
+        hist[TASK_TYPE_MIXED][OAICOMPAT_TYPE_NONE].record(value);
+    }
+
+    // log-linear buckets: n_sub buckets per power of two in [v_min, v_max]
+    static std::vector<double> buckets_log2(double v_min, double v_max, int n_sub) {
+        std::vector<double> res;
+        for (double v = v_min; v <= v_max; v *= 2.0) {
+            for (int i = 0; i < n_sub; i++) {
+                res.push_back(v * (1.0 + (double) i / n_sub));
+            }
+        }
+        return res;
+    }
+
+    static std::vector<double> buckets_linear(double v_min, double v_max, double step) {
+        std::vector<double> res;
+        for (double v = v_min; v <= v_max + 1e-9; v += step) {
+            res.push_back(v);
+        }
+        return res;
+    }
+};
+
+static const char * server_task_type_label(server_task_type task_type) {
+    switch (task_type) {
+        case SERVER_TASK_TYPE_COMPLETION: return "completion";
+        case SERVER_TASK_TYPE_EMBEDDING:  return "embedding";
+        case SERVER_TASK_TYPE_RERANK:     return "rerank";
+        case SERVER_TASK_TYPE_INFILL:     return "infill";
+        default:                          return "other";
+    }
+}
+
+static const char * oaicompat_type_label(oaicompat_type type) {
+    switch (type) {
+        case OAICOMPAT_TYPE_NONE:       return "native";
+        case OAICOMPAT_TYPE_CHAT:       return "chat";
+        case OAICOMPAT_TYPE_COMPLETION: return "completion";
+        case OAICOMPAT_TYPE_EMBEDDING:  return "embedding";
+        default:                        return "other";
+    }
+}
+
 struct server_metrics {
     int64_t t_start = 0;
 
@@ -1553,8 +1843,71 @@ struct server_metrics {
     uint64_t n_decode_total     = 0;
     uint64_t n_busy_slots_total = 0;
 
+    // latency distributions, these are never reset
+    server_histogram_family histograms[SERVER_HISTOGRAM_COUNT];
+
     void init() {
         t_start = ggml_time_us();
+
+        // 100us .. ~200s, 4 sub-buckets per power of two
+        const auto buckets_latency = server_histogram_family::buckets_log2(1e-4, 128.0, 4);
+
+        histograms[SERVER_HISTOGRAM_QUEUE_WAIT]     .init("queue_wait_seconds",         "Time spent by a task in the queue before being assigned to a slot.", std::vector<double>(buckets_latency), true);
+        histograms[SERVER_HISTOGRAM_TOKENIZE]       .init("tokenization_seconds",       "Time spent parsing and tokenizing a request.",                        std::vector<double>(buckets_latency), true);
+        histograms[SERVER_HISTOGRAM_PREFILL]        .init("prefill_seconds",            "Prompt processing time.",                                             std::vector<double>(buckets_latency), true);
+        histograms[SERVER_HISTOGRAM_TTFT]           .init("time_to_first_token_seconds","Time from receiving the request to the first generated token.",      std::vector<double>(buckets_latency), true);
+        histograms[SERVER_HISTOGRAM_ITL]            .init("inter_token_latency_seconds","Time between two consecutive generated tokens.",                      std::vector<double>(buckets_latency), true);
+        histograms[SERVER_HISTOGRAM_SAMPLING]       .init("sampling_seconds",           "Time spent in the sampler per sampling call.",                        std::vector<double>(buckets_latency), true);
+        histograms[SERVER_HISTOGRAM_BATCH_OCCUPANCY].init("batch_occupancy_ratio",      "Number of tokens per llama_decode() call relative to n_batch.",       server_histogram_family::buckets_linear(0.05, 1.0, 0.05), false);
+    }
+
+    // thread-safe, can be called from the HTTP threads
+    void record(server_histogram_type type, server_task_type task_type, oaicompat_type endpoint, double value) {
+        histograms[type].record(task_type, endpoint, value);
+    }
+
+    void record_mixed(server_histogram_type type, double value) {
+        histograms[type].record_mixed(value);
+    }
+
+    // format the histograms using the Prometheus text exposition format
+    std::string histograms_to_prometheus() const {
+        std::stringstream ss;
+
+        for (const auto & fam : histograms) {
+            ss << "# HELP llamacpp:" << fam.name << " " << fam.help << "\n"
+               << "# TYPE llamacpp:" << fam.name << " histogram\n";
+
+            for (int it = 0; it < server_histogram_family::N_TASK_TYPES; it++) {
+                for (int ie = 0; ie < server_histogram_family::N_ENDPOINTS; ie++) {
+                    const auto & h = fam.hist[it][ie];
+
+                    if (h.count.load(std::memory_order_relaxed) == 0) {
+                        continue;
+                    }
+
+                    std::string labels = string_format("task_type=\"%s\"",
+                            it == server_histogram_family::TASK_TYPE_MIXED ? "mixed" : server_task_type_label((server_task_type) it));
+                    if (fam.per_endpoint) {
+                        labels += string_format(",endpoint=\"%s\"", oaicompat_type_label((oaicompat_type) ie));
+                    }
+
+                    uint64_t cumulative = 0;
+                    for (size_t ib = 0; ib < fam.bounds.size(); ib++) {
+                        cumulative += h.buckets[ib].load(std::memory_order_relaxed);
+                        ss << "llamacpp:" << fam.name << "_bucket{" << labels << ",le=\"" << fam.bounds[ib] << "\"} " << cumulative << "\n";
+                    }
+                    cumulative += h.buckets[fam.bounds.size()].load(std::memory_order_relaxed);
+
+                    // note: derive the count from the buckets so that the series stays consistent with concurrent record() calls
+                    ss << "llamacpp:" << fam.name << "_bucket{" << labels << ",le=\"+Inf\"} " << cumulative << "\n";
+                    ss << "llamacpp:" << fam.name << "_sum{"    << labels << "} " << h.sum_us.load(std::memory_order_relaxed) / 1e6 << "\n";
+                    ss << "llamacpp:" << fam.name << "_count{"  << labels << "} " << cumulative << "\n";
+                }
+            }
+        }
+
+        return ss.str();
     }
 
     void on_prompt_eval(const server_slot & slot) {
@@ -1588,158 +1941,963 @@ struct server_metrics {
     }
 };
 
-struct server_queue {
-    int id = 0;
-    bool running;
+// LRU cache of the results of deterministic completion requests (greedy sampling or fixed seed)
+// the entries are keyed by the full request state (see server_context::response_cache_key())
+// note: only accessed from the main loop, so no locking is needed
+struct server_response_cache {
+    struct entry {
+        std::string key;
+        int64_t     t_insert = 0; // us
+        size_t      n_bytes  = 0; // approximate memory usage
+
+        // in stream mode, the partial results are replayed before the final one
+        std::vector<server_task_result_cmpl_partial> partials;
+        server_task_result_cmpl_final                final;
+    };
 
-    // queues
-    std::deque<server_task> queue_tasks;
-    std::deque<server_task> queue_tasks_deferred;
+    size_t  n_bytes_max = 0; // 0 = disabled
+    int64_t t_ttl_us    = 0; // 0 = entries never expire
 
-    std::mutex mutex_tasks;
-    std::condition_variable condition_tasks;
+    // most recently used entries first
+    std::list<entry> entries;
+    std::unordered_map<std::string, std::list<entry>::iterator> map;
 
-    // callback functions
-    std::function<void(server_task &&)> callback_new_task;
-    std::function<void(void)>           callback_update_slots;
+    size_t n_bytes = 0;
 
-    // Add a new task to the end of the queue
-    int post(server_task && task, bool front = false) {
-        std::unique_lock<std::mutex> lock(mutex_tasks);
-        GGML_ASSERT(task.id != -1);
-        // if this is cancel task make sure to clean up pending tasks
-        if (task.type == SERVER_TASK_TYPE_CANCEL) {
-            cleanup_pending_task(task.id_target);
+    uint64_t n_hits      = 0;
+    uint64_t n_misses    = 0;
+    uint64_t n_evictions = 0;
+
+    void init(size_t size_mib, int ttl_s) {
+        n_bytes_max = size_mib*1024*1024;
+        t_ttl_us    = (int64_t) std::max(ttl_s, 0)*1000000;
+    }
+
+    bool enabled() const {
+        return n_bytes_max > 0;
+    }
+
+    // returns nullptr on miss, the pointer is valid until the next call to put()
+    const entry * get(const std::string & key) {
+        auto it = map.find(key);
+        if (it == map.end()) {
+            n_misses++;
+            return nullptr;
         }
-        const int task_id = task.id;
-        QUE_DBG("new task, id = %d, front = %d\n", task_id, front);
-        if (front) {
-            queue_tasks.push_front(std::move(task));
-        } else {
-            queue_tasks.push_back(std::move(task));
+
+        if (t_ttl_us > 0 && ggml_time_us() - it->second->t_insert > t_ttl_us) {
+            erase(it->second);
+            n_misses++;
+            return nullptr;
         }
-        condition_tasks.notify_one();
-        return task_id;
+
+        entries.splice(entries.begin(), entries, it->second);
+        n_hits++;
+
+        return &entries.front();
     }
 
-    // multi-task version of post()
-    int post(std::vector<server_task> && tasks, bool front = false) {
-        std::unique_lock<std::mutex> lock(mutex_tasks);
-        for (auto & task : tasks) {
-            if (task.id == -1) {
-                task.id = id++;
-            }
-            // if this is cancel task make sure to clean up pending tasks
-            if (task.type == SERVER_TASK_TYPE_CANCEL) {
-                cleanup_pending_task(task.id_target);
-            }
-            QUE_DBG("new task, id = %d/%d, front = %d\n", task.id, (int) tasks.size(), front);
-            if (front) {
-                queue_tasks.push_front(std::move(task));
-            } else {
-                queue_tasks.push_back(std::move(task));
-            }
+    void put(entry && e) {
+        e.t_insert = ggml_time_us();
+        e.n_bytes  = entry_size(e);
+
+        if (e.n_bytes > n_bytes_max) {
+            return;
         }
-        condition_tasks.notify_one();
-        return 0;
-    }
 
-    // Add a new task, but defer until one slot is available
-    void defer(server_task && task) {
-        std::unique_lock<std::mutex> lock(mutex_tasks);
-        QUE_DBG("defer task, id = %d\n", task.id);
-        queue_tasks_deferred.push_back(std::move(task));
-        condition_tasks.notify_one();
-    }
+        auto it = map.find(e.key);
+        if (it != map.end()) {
+            erase(it->second);
+        }
 
-    // Get the next id for creating a new task
-    int get_new_id() {
-        std::unique_lock<std::mutex> lock(mutex_tasks);
-        int new_id = id++;
-        return new_id;
-    }
+        while (!entries.empty() && n_bytes + e.n_bytes > n_bytes_max) {
+            erase(std::prev(entries.end()));
+            n_evictions++;
+        }
 
-    // Register function to process a new task
-    void on_new_task(std::function<void(server_task &&)> callback) {
-        callback_new_task = std::move(callback);
+        n_bytes += e.n_bytes;
+        entries.push_front(std::move(e));
+        map[entries.front().key] = entries.begin();
     }
 
-    // Register the function to be called when all slots data is ready to be processed
-    void on_update_slots(std::function<void(void)> callback) {
-        callback_update_slots = std::move(callback);
+    void erase(std::list<entry>::iterator it) {
+        n_bytes -= it->n_bytes;
+        map.erase(it->key);
+        entries.erase(it);
     }
 
-    // Call when the state of one slot is changed, it will move one task from deferred to main queue
-    void pop_deferred_task() {
-        std::unique_lock<std::mutex> lock(mutex_tasks);
-        if (!queue_tasks_deferred.empty()) {
-            queue_tasks.emplace_back(std::move(queue_tasks_deferred.front()));
-            queue_tasks_deferred.pop_front();
+    static size_t entry_size(const entry & e) {
+        size_t res = sizeof(entry) + 2*e.key.size();
+
+        res += e.final.content.size() + e.final.prompt.size() + e.final.tokens.size()*sizeof(llama_token);
+        res += e.final.probs_output.size()*sizeof(completion_token_output);
+        for (const auto & p : e.partials) {
+            res += sizeof(p) + p.content.size() + p.tokens.size()*sizeof(llama_token);
         }
-        condition_tasks.notify_one();
-    }
 
-    // end the start_loop routine
-    void terminate() {
-        std::unique_lock<std::mutex> lock(mutex_tasks);
-        running = false;
-        condition_tasks.notify_all();
+        return res;
     }
+};
 
-    /**
-     * Main loop consists of these steps:
-     * - Wait until a new task arrives
-     * - Process the task (i.e. maybe copy data into slot)
-     * - Check if multitask is finished
-     * - Update all slots
-     */
-    void start_loop() {
-        running = true;
+// background file I/O of the slot save/restore actions
+// the KV data is copied to/from staging buffers on the main loop (see process_single_task() and process_slot_io()),
+// the file access happens on a dedicated thread, so that a large save does not stall the other slots
+//
+// file format: header (magic, version) followed by one or more segments, each one holding the tokens and the KV cells
+// added since the previous segment - the first segment is restored with llama_state_seq_set_data(), the following
+// ones are appended with llama_state_seq_append_data()
+// the KV data of a segment can be compressed with zlib (deflate at its fastest level), a flag of the segment tells
+// which ones are, so each save can choose independently - the server must be built with LLAMA_SERVER_ZLIB to write
+// or read them
+// the lengths of a segment are checked against the size of the file before its data is read
+// the files written by llama_state_seq_save_file() are also accepted on restore
+#define SLOT_SAVE_MAGIC   0x67677373u // 'ggss'
+#define SLOT_SAVE_VERSION 2
+
+enum slot_save_flags : uint32_t {
+    SLOT_SAVE_FLAG_ZLIB = 1 << 0,
+};
 
-        while (true) {
-            QUE_DBG("%s", "processing new tasks\n");
+struct server_slot_io {
+    struct job {
+        int id_task = -1;
+        int id_slot = -1;
 
-            while (true) {
-                std::unique_lock<std::mutex> lock(mutex_tasks);
-                if (!running) {
-                    QUE_DBG("%s", "terminate\n");
-                    return;
-                }
-                if (queue_tasks.empty()) {
-                    lock.unlock();
-                    break;
-                }
-                server_task task = std::move(queue_tasks.front());
-                queue_tasks.pop_front();
-                lock.unlock();
+        std::string filename;
+        std::string filepath;
 
-                QUE_DBG("processing task, id = %d\n", task.id);
-                callback_new_task(std::move(task));
-            }
+        bool is_save  = true;
+        bool append   = false; // save: append a segment to an existing file
+        bool compress = false; // save: compress the KV payload
 
-            // all tasks in the current loop is processed, slots data is now ready
-            QUE_DBG("%s", "update slots\n");
+        size_t n_ctx = 0; // restore: max number of tokens
 
-            callback_update_slots();
+        // save: tokens added since the previous save and their KV data
+        // restore: all restored tokens and the KV data of each segment
+        llama_tokens                      tokens;
+        std::vector<std::vector<uint8_t>> segments;
 
-            QUE_DBG("%s", "waiting for new tasks\n");
-            {
-                std::unique_lock<std::mutex> lock(mutex_tasks);
-                if (!running) {
-                    QUE_DBG("%s", "terminate\n");
-                    return;
-                }
-                if (queue_tasks.empty()) {
-                    condition_tasks.wait(lock, [&]{
-                        return (!queue_tasks.empty() || !running);
-                    });
-                }
-            }
-        }
-    }
+        size_t  n_tokens_total = 0;
+        int64_t t_start_us     = 0;
 
-private:
-    void cleanup_pending_task(int id_target) {
+        // result
+        bool        ok      = false;
+        std::string err;
+        size_t      n_bytes = 0; // bytes written (save) or read (restore)
+    };
+
+    std::thread             thread;
+    std::mutex              mutex;
+    std::condition_variable cv;
+
+    std::deque<job> jobs;
+    std::deque<job> done;
+
+    bool running = false;
+
+    // size of the files written by this worker, used to validate the incremental saves
+    std::unordered_map<std::string, size_t> file_size;
+
+    // called from the I/O thread when a job is done
+    std::function<void()> on_done;
+
+    ~server_slot_io() {
+        stop();
+    }
+
+    void start(std::function<void()> && callback) {
+        on_done = std::move(callback);
+        running = true;
+        thread  = std::thread([this]() { loop(); });
+    }
+
+    void stop() {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            running = false;
+        }
+        cv.notify_all();
+        if (thread.joinable()) {
+            thread.join();
+        }
+    }
+
+    void post(job && j) {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            jobs.push_back(std::move(j));
+        }
+        cv.notify_one();
+    }
+
+    bool pop_done(job & j) {
+        std::unique_lock<std::mutex> lock(mutex);
+        if (done.empty()) {
+            return false;
+        }
+        j = std::move(done.front());
+        done.pop_front();
+        return true;
+    }
+
+    void loop() {
+        while (true) {
+            job j;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                cv.wait(lock, [&]{ return !jobs.empty() || !running; });
+                if (jobs.empty()) {
+                    return; // pending jobs are completed before exiting
+                }
+                j = std::move(jobs.front());
+                jobs.pop_front();
+            }
+
+            if (j.is_save) {
+                j.ok = save(j);
+            } else {
+                j.ok = restore(j);
+            }
+
+            // the staging buffers are not needed anymore for the saves
+            if (j.is_save) {
+                j.segments.clear();
+            }
+
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                done.push_back(std::move(j));
+            }
+            on_done();
+        }
+    }
+
+    bool save(job & j) {
+        GGML_ASSERT(j.segments.size() == 1);
+
+        const std::vector<uint8_t> & raw = j.segments[0];
+
+        if (j.append) {
+            auto it = file_size.find(j.filepath);
+            std::error_code ec;
+            const auto size = std::filesystem::file_size(j.filepath, ec);
+            if (it == file_size.end() || ec || size != it->second) {
+                file_size.erase(j.filepath);
+                j.err = "slot save file was modified, the next save will rewrite it";
+                return false;
+            }
+            if (j.tokens.empty()) {
+                return true; // nothing new since the last save
+            }
+        }
+
+        // the compressed data is kept only if it is smaller
+        std::vector<uint8_t> compressed;
+        uint32_t flags = 0;
+#ifdef LLAMA_SERVER_ZLIB
+        if (j.compress && raw.size() <= std::numeric_limits<uLong>::max()) {
+            uLongf n_compressed = compressBound(raw.size());
+            compressed.resize(n_compressed);
+            if (compress2(compressed.data(), &n_compressed, raw.data(), raw.size(), Z_BEST_SPEED) == Z_OK && n_compressed < raw.size()) {
+                compressed.resize(n_compressed);
+                flags |= SLOT_SAVE_FLAG_ZLIB;
+            }
+        }
+#endif
+        const std::vector<uint8_t> & data = flags & SLOT_SAVE_FLAG_ZLIB ? compressed : raw;
+
+        std::FILE * fp = std::fopen(j.filepath.c_str(), j.append ? "ab" : "wb");
+        if (!fp) {
+            file_size.erase(j.filepath);
+            j.err = string_format("failed to open '%s' for writing", j.filename.c_str());
+            return false;
+        }
+
+        bool ok = true;
+        const auto write = [&](const void * src, size_t size) {
+            ok = ok && (size == 0 || std::fwrite(src, size, 1, fp) == 1);
+            j.n_bytes += size;
+        };
+        const auto write_u32 = [&](uint32_t v) { write(&v, sizeof(v)); };
+        const auto write_u64 = [&](uint64_t v) { write(&v, sizeof(v)); };
+
+        if (!j.append) {
+            write_u32(SLOT_SAVE_MAGIC);
+            write_u32(SLOT_SAVE_VERSION);
+        }
+
+        write_u32(flags);
+        write_u32(j.tokens.size());
+        write(j.tokens.data(), j.tokens.size()*sizeof(llama_token));
+        write_u64(raw.size());
+        write_u64(data.size());
+        write(data.data(), data.size());
+
+        ok = std::fclose(fp) == 0 && ok;
+
+        if (!ok) {
+            file_size.erase(j.filepath);
+            j.err = string_format("failed to write '%s'", j.filename.c_str());
+            return false;
+        }
+
+        file_size[j.filepath] = (j.append ? file_size[j.filepath] : 0) + j.n_bytes;
+
+        return true;
+    }
+
+    bool restore(job & j) {
+        std::FILE * fp = std::fopen(j.filepath.c_str(), "rb");
+        if (!fp) {
+            j.err = "failed to open slot save file";
+            return false;
+        }
+
+        bool ok = true;
+        const auto read = [&](void * dst, size_t size) {
+            ok = ok && (size == 0 || std::fread(dst, size, 1, fp) == 1);
+            j.n_bytes += ok ? size : 0;
+            return ok;
+        };
+        uint32_t u32 = 0;
+        const auto read_tokens = [&](uint32_t n) {
+            if (j.tokens.size() + n > j.n_ctx) {
+                j.err = string_format("token count in slot save file exceeded capacity! %zu > %zu", j.tokens.size() + n, j.n_ctx);
+                return false;
+            }
+            const size_t n_cur = j.tokens.size();
+            j.tokens.resize(n_cur + n);
+            return read(j.tokens.data() + n_cur, n*sizeof(llama_token));
+        };
+
+        uint32_t magic   = 0;
+        uint32_t version = 0;
+        read(&magic,   sizeof(magic));
+        read(&version, sizeof(version));
+
+        if (ok && magic == LLAMA_STATE_SEQ_MAGIC && version == LLAMA_STATE_SEQ_VERSION) {
+            // single segment written by llama_state_seq_save_file()
+            if (read(&u32, sizeof(u32)) && read_tokens(u32)) {
+                std::error_code ec;
+                const auto size = std::filesystem::file_size(j.filepath, ec);
+                if (ec || size < j.n_bytes) {
+                    ok = false;
+                } else {
+                    std::vector<uint8_t> data(size - j.n_bytes);
+                    if (read(data.data(), data.size())) {
+                        j.segments.push_back(std::move(data));
+                    }
+                }
+            }
+        } else if (ok && magic == SLOT_SAVE_MAGIC && version == SLOT_SAVE_VERSION) {
+            std::error_code ec;
+            const auto size = std::filesystem::file_size(j.filepath, ec);
+            ok = !ec;
+
+            while (ok && j.err.empty()) {
+                uint32_t flags = 0;
+                if (std::fread(&flags, sizeof(flags), 1, fp) != 1) {
+                    break; // end of file
+                }
+                j.n_bytes += sizeof(flags);
+
+                uint64_t n_raw  = 0;
+                uint64_t n_data = 0;
+                if (!read(&u32, sizeof(u32)) || !read_tokens(u32) || !read(&n_raw, sizeof(n_raw)) || !read(&n_data, sizeof(n_data))) {
+                    break;
+                }
+
+                // a corrupted length must not allocate more than the file holds, deflate expands at most 1032:1
+                if (size < j.n_bytes || n_data > size - j.n_bytes || (flags & ~SLOT_SAVE_FLAG_ZLIB) != 0 ||
+                    (flags & SLOT_SAVE_FLAG_ZLIB ? n_raw / 1032 > n_data : n_raw != n_data)) {
+                    ok = false;
+                    break;
+                }
+
+                std::vector<uint8_t> data(n_data);
+                if (!read(data.data(), data.size())) {
+                    break;
+                }
+
+                if (flags & SLOT_SAVE_FLAG_ZLIB) {
+#ifdef LLAMA_SERVER_ZLIB
+                    std::vector<uint8_t> raw(n_raw);
+                    uLongf n_dst = raw.size();
+                    if (n_raw > std::numeric_limits<uLong>::max() || n_data > std::numeric_limits<uLong>::max() ||
+                        uncompress(raw.data(), &n_dst, data.data(), data.size()) != Z_OK || n_dst != raw.size()) {
+                        j.err = "failed to decompress slot save file";
+                        break;
+                    }
+                    data = std::move(raw);
+#else
+                    j.err = "slot save file is compressed, the server was built without zlib (LLAMA_SERVER_ZLIB)";
+                    break;
+#endif
+                }
+
+                j.segments.push_back(std::move(data));
+            }
+        } else {
+            j.err = string_format("unknown (magic, version) for slot save file: %08x, %08x", magic, version);
+        }
+        std::fclose(fp);
+
+        if (j.err.empty() && (!ok || j.segments.empty())) {
+            j.err = "invalid slot save file";
+        }
+
+        if (!j.err.empty()) {
+            j.segments.clear();
+            return false;
+        }
+
+        j.n_tokens_total = j.tokens.size();
+
+        // the file can be extended by the incremental saves of the slot it is restored to
+        file_size[j.filepath] = j.n_bytes;
+
+        return true;
+    }
+};
+
+// persistent store of the KV data of the prompt prefixes, shared by the slots and kept across server restarts
+// the prompts are split in blocks of n_block tokens, a block is keyed by a hash of all the tokens from the start of the
+// prompt up to its end, so the blocks of a prompt are found one after the other until the first miss
+// the hash only locates the record: a record also holds the id of the record of the previous block of its prompt, so a
+// block is used only if its own tokens match and its parent is the record that was matched for the previous block. by
+// induction the whole prefix is compared token by token, a hash collision is a miss
+//
+// file format: header (magic, version, n_block, model id) followed by the records of the blocks, each one holding the
+// hash, the ids of the record and of its parent (0 for the first block of a prompt), the tokens and the KV data of the
+// block (llama_state_seq_get_data_range() of its positions)
+// the file is append-only: at startup the index is rebuilt by reading only the record headers and the KV data is read
+// through a memory map, so the blocks are loaded from disk on first use. the records are written by a dedicated thread,
+// the KV data is copied to a staging buffer on the main loop (see server_context::kv_store_save())
+#define KV_STORE_MAGIC     0x67676b76u // 'ggkv'
+#define KV_STORE_REC_MAGIC 0x67676b62u // 'ggkb'
+#define KV_STORE_VERSION   2
+
+struct server_kv_store {
+    struct entry {
+        size_t   offs   = 0; // offset of the tokens of the block, followed by the KV data
+        uint64_t size   = 0; // size of the KV data
+        uint64_t id     = 0;
+        uint64_t parent = 0;
+    };
+
+    struct job {
+        uint64_t hash   = 0;
+        uint64_t id     = 0; // set by post()
+        uint64_t parent = 0;
+
+        llama_tokens         tokens;
+        std::vector<uint8_t> data;
+    };
+
+    std::string path;
+
+    uint32_t n_block  = 0;
+    uint64_t model_id = 0;
+    size_t   size_max = 0;
+
+    std::FILE * fp = nullptr; // only used by the writer thread after init()
+
+    std::thread             thread;
+    std::mutex              mutex;
+    std::condition_variable cv;
+
+    // protected by the mutex
+    std::deque<job>                        jobs;    // the front job stays in the queue while it is written
+    std::unordered_map<uint64_t, entry>    index;
+    size_t                                 file_size = 0;
+    uint64_t                               id_next   = 1;
+    bool                                   running   = false;
+
+    // memory map of the file, remapped when a block is past its end (main loop only)
+    uint8_t *            map_addr = nullptr;
+    size_t               map_size = 0;
+    std::vector<uint8_t> buf; // fallback without mmap
+
+    // max number of queued blocks, the saves are skipped while the writer is behind
+    static constexpr size_t n_jobs_max = 8;
+
+    ~server_kv_store() {
+        stop();
+        unmap();
+        if (fp) {
+            std::fclose(fp);
+        }
+    }
+
+    bool enabled() const {
+        return fp != nullptr;
+    }
+
+    bool init(const std::string & path, uint32_t n_block, uint64_t model_id, size_t size_max) {
+        this->path     = path;
+        this->n_block  = n_block;
+        this->model_id = model_id;
+        this->size_max = size_max;
+
+        // rebuild the index, a file written for another model or configuration is discarded
+        size_t n_valid = 0;
+        if (std::FILE * f = std::fopen(path.c_str(), "rb")) {
+            uint32_t hdr[4] = {};
+            uint64_t id     = 0;
+            if (std::fread(hdr, sizeof(hdr), 1, f) == 1 && std::fread(&id, sizeof(id), 1, f) == 1 &&
+                hdr[0] == KV_STORE_MAGIC && hdr[1] == KV_STORE_VERSION && hdr[2] == n_block && id == model_id) {
+                n_valid = sizeof(hdr) + sizeof(id);
+
+                std::error_code ec;
+                const size_t size = std::filesystem::file_size(path, ec);
+
+                while (!ec) {
+                    uint32_t rec[2] = {};
+                    uint64_t val[4] = {}; // hash, id, parent, n_data
+                    if (std::fread(rec, sizeof(rec), 1, f) != 1 || std::fread(val, sizeof(val), 1, f) != 1) {
+                        break;
+                    }
+
+                    const size_t offs = n_valid + sizeof(rec) + sizeof(val);
+                    const size_t end  = offs + (size_t) n_block*sizeof(llama_token) + val[3];
+                    if (rec[0] != KV_STORE_REC_MAGIC || rec[1] != n_block || end > size || std::fseek(f, (long) (end - offs), SEEK_CUR) != 0) {
+                        break; // a record that was not fully written
+                    }
+
+                    index[val[0]] = { offs, val[3], val[1], val[2] };
+                    id_next = std::max(id_next, val[1] + 1);
+                    n_valid = end;
+                }
+            }
+            std::fclose(f);
+        }
+
+        if (n_valid == 0) {
+            fp = std::fopen(path.c_str(), "wb");
+            if (fp) {
+                const uint32_t hdr[4] = { KV_STORE_MAGIC, KV_STORE_VERSION, n_block, 0 };
+                const bool ok = std::fwrite(hdr, sizeof(hdr), 1, fp) == 1 && std::fwrite(&model_id, sizeof(model_id), 1, fp) == 1 && std::fflush(fp) == 0;
+                n_valid = sizeof(hdr) + sizeof(model_id);
+                if (!ok) {
+                    std::fclose(fp);
+                    fp = nullptr;
+                }
+            }
+        } else {
+            // drop the partial record at the end of the file, if any
+            std::error_code ec;
+            std::filesystem::resize_file(path, n_valid, ec);
+            fp = ec ? nullptr : std::fopen(path.c_str(), "ab");
+        }
+
+        if (!fp) {
+            index.clear();
+            id_next = 1;
+            return false;
+        }
+
+        file_size = n_valid;
+
+        running = true;
+        thread  = std::thread([this]() { loop(); });
+
+        return true;
+    }
+
+    void stop() {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            running = false;
+        }
+        cv.notify_all();
+        if (thread.joinable()) {
+            thread.join();
+        }
+    }
+
+    // hashes of the full blocks of tokens, each one depends on all the previous tokens
+    std::vector<uint64_t> hashes(const llama_tokens & tokens) const {
+        std::vector<uint64_t> res;
+
+        uint64_t h = model_id;
+        for (size_t i = 0; i + n_block <= tokens.size(); i += n_block) {
+            for (size_t j = i; j < i + n_block; ++j) {
+                h = (h ^ (uint32_t) tokens[j]) * 0x100000001b3ULL; // FNV-1a
+            }
+            res.push_back(h);
+        }
+
+        return res;
+    }
+
+    // id of the stored or queued block with the given hash, tokens and parent
+    // returns 0 if there is no such block, -1 if another block has the same hash
+    int64_t find(uint64_t hash, const llama_token * tokens, uint64_t parent) {
+        const size_t n_tokens = (size_t) n_block*sizeof(llama_token);
+
+        entry e;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            for (const auto & j : jobs) {
+                if (j.hash == hash) {
+                    return j.parent == parent && std::memcmp(j.tokens.data(), tokens, n_tokens) == 0 ? (int64_t) j.id : -1;
+                }
+            }
+            auto it = index.find(hash);
+            if (it == index.end()) {
+                return 0;
+            }
+            e = it->second;
+        }
+
+        const uint8_t * src = read(e);
+        if (src == nullptr) {
+            return -1;
+        }
+
+        return e.parent == parent && std::memcmp(src, tokens, n_tokens) == 0 ? (int64_t) e.id : -1;
+    }
+
+    // KV data of the block with the given hash, nullptr if it is not in the store or if its tokens or its parent do not
+    // match, in which case the block belongs to another prompt
+    const uint8_t * get(uint64_t hash, const llama_token * tokens, uint64_t parent, size_t & size, uint64_t & id) {
+        entry e;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            auto it = index.find(hash);
+            if (it == index.end()) {
+                return nullptr;
+            }
+            e = it->second;
+        }
+
+        if (e.parent != parent) {
+            return nullptr;
+        }
+
+        const size_t n_tokens = (size_t) n_block*sizeof(llama_token);
+
+        const uint8_t * src = read(e);
+        if (src == nullptr || std::memcmp(src, tokens, n_tokens) != 0) {
+            return nullptr;
+        }
+
+        size = e.size;
+        id   = e.id;
+
+        return src + n_tokens;
+    }
+
+    // queue the block for writing, returns the id of its record or 0 if the store is full or the writer is behind
+    uint64_t post(job && j) {
+        uint64_t id = 0;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+
+            size_t size_queued = 0;
+            for (const auto & q : jobs) {
+                size_queued += q.data.size();
+            }
+
+            if (!running || jobs.size() >= n_jobs_max || file_size + size_queued + j.data.size() > size_max) {
+                return 0;
+            }
+
+            id = id_next++;
+
+            j.id = id;
+            jobs.push_back(std::move(j));
+        }
+        cv.notify_one();
+
+        return id;
+    }
+
+    size_t n_blocks() {
+        std::unique_lock<std::mutex> lock(mutex);
+        return index.size();
+    }
+
+private:
+    void unmap() {
+#if defined (__unix__) || (defined (__APPLE__) && defined (__MACH__))
+        if (map_addr) {
+            munmap(map_addr, map_size);
+        }
+#endif
+        map_addr = nullptr;
+        map_size = 0;
+    }
+
+    // tokens of the stored block, followed by its KV data (main loop only)
+    const uint8_t * read(const entry & e) {
+        const size_t n_tokens = (size_t) n_block*sizeof(llama_token);
+        const size_t end      = e.offs + n_tokens + e.size;
+
+#if defined (__unix__) || (defined (__APPLE__) && defined (__MACH__))
+        if (end > map_size) {
+            unmap();
+            const int fd = open(path.c_str(), O_RDONLY);
+            if (fd < 0) {
+                return nullptr;
+            }
+            std::error_code ec;
+            const size_t size_cur = std::filesystem::file_size(path, ec);
+            if (!ec && size_cur >= end) {
+                void * addr = mmap(nullptr, size_cur, PROT_READ, MAP_SHARED, fd, 0);
+                if (addr != MAP_FAILED) {
+                    map_addr = (uint8_t *) addr;
+                    map_size = size_cur;
+                }
+            }
+            close(fd);
+            if (end > map_size) {
+                return nullptr;
+            }
+        }
+        return map_addr + e.offs;
+#else
+        std::FILE * f = std::fopen(path.c_str(), "rb");
+        if (!f) {
+            return nullptr;
+        }
+        buf.resize(n_tokens + e.size);
+#if defined (_WIN32)
+        const bool ok = _fseeki64(f, (__int64) e.offs, SEEK_SET) == 0 && std::fread(buf.data(), buf.size(), 1, f) == 1;
+#else
+        const bool ok = std::fseek(f, (long) e.offs, SEEK_SET) == 0 && std::fread(buf.data(), buf.size(), 1, f) == 1;
+#endif
+        std::fclose(f);
+        return ok ? buf.data() : nullptr;
+#endif
+    }
+
+    void loop() {
+        while (true) {
+            const job * j = nullptr;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                cv.wait(lock, [&]{ return !jobs.empty() || !running; });
+                if (jobs.empty()) {
+                    return; // pending jobs are completed before exiting
+                }
+                j = &jobs.front(); // the references to the elements of a deque stay valid on push_back()
+            }
+
+            const uint32_t rec[2] = { KV_STORE_REC_MAGIC, n_block };
+            const uint64_t val[4] = { j->hash, j->id, j->parent, j->data.size() };
+
+            bool ok = true;
+            ok = ok && std::fwrite(rec,              sizeof(rec), 1, fp) == 1;
+            ok = ok && std::fwrite(val,              sizeof(val), 1, fp) == 1;
+            ok = ok && std::fwrite(j->tokens.data(), j->tokens.size()*sizeof(llama_token), 1, fp) == 1;
+            ok = ok && std::fwrite(j->data.data(),   j->data.size(),  1, fp) == 1;
+            ok = ok && std::fflush(fp) == 0;
+
+            std::unique_lock<std::mutex> lock(mutex);
+
+            if (!ok) {
+                // the partial record is dropped when the index is rebuilt, the following ones would not be reachable
+                SRV_WRN("failed to write to the KV store '%s', disabling the saves\n", path.c_str());
+                running = false;
+                jobs.clear();
+                return;
+            }
+
+            const size_t offs = file_size + sizeof(rec) + sizeof(val);
+
+            index[j->hash] = { offs, val[3], j->id, j->parent };
+            file_size = offs + j->tokens.size()*sizeof(llama_token) + val[3];
+
+            jobs.pop_front();
+        }
+    }
+};
+
+struct server_queue {
+    int id = 0;
+    bool running = true; // note: a terminate() before start_loop() makes it return immediately
+
+    // queues
+    std::deque<server_task> queue_tasks;
+    std::deque<server_task> queue_tasks_deferred;
+
+    std::mutex mutex_tasks;
+    std::condition_variable condition_tasks;
+
+    // callback functions
+    std::function<void(server_task &&)> callback_new_task;
+    std::function<void(void)>           callback_update_slots;
+
+    // Add a new task to the end of the queue
+    int post(server_task && task, bool front = false) {
+        std::unique_lock<std::mutex> lock(mutex_tasks);
+        GGML_ASSERT(task.id != -1);
+        // if this is cancel task make sure to clean up pending tasks
+        if (task.type == SERVER_TASK_TYPE_CANCEL) {
+            cleanup_pending_task(task.id_target);
+        }
+        const int task_id = task.id;
+        if (task.t_queued < 0) {
+            task.t_queued = ggml_time_us();
+        }
+        QUE_DBG("new task, id = %d, front = %d\n", task_id, front);
+        if (front) {
+            queue_tasks.push_front(std::move(task));
+        } else {
+            queue_tasks.push_back(std::move(task));
+        }
+        condition_tasks.notify_one();
+        return task_id;
+    }
+
+    // multi-task version of post()
+    int post(std::vector<server_task> && tasks, bool front = false) {
+        std::unique_lock<std::mutex> lock(mutex_tasks);
+        for (auto & task : tasks) {
+            if (task.id == -1) {
+                task.id = id++;
+            }
+            if (task.t_queued < 0) {
+                task.t_queued = ggml_time_us();
+            }
+            // if this is cancel task make sure to clean up pending tasks
+            if (task.type == SERVER_TASK_TYPE_CANCEL) {
+                cleanup_pending_task(task.id_target);
+            }
+            QUE_DBG("new task, id = %d/%d, front = %d\n", task.id, (int) tasks.size(), front);
+            if (front) {
+                queue_tasks.push_front(std::move(task));
+            } else {
+                queue_tasks.push_back(std::move(task));
+            }
+        }
+        condition_tasks.notify_one();
+        return 0;
+    }
+
+    // post the tasks only if the KV demand of all waiting tasks (including the new ones) stays within n_kv_max
+    // returns 0 if the tasks were posted, otherwise the number of missing KV cells
+    int64_t post_admit(std::vector<server_task> & tasks, int64_t n_kv_max) {
+        int64_t n_kv_need = 0;
+        for (const auto & task : tasks) {
+            n_kv_need += task.n_kv_need;
+        }
+        {
+            std::unique_lock<std::mutex> lock(mutex_tasks);
+            const int64_t n_kv_queued = n_kv_waiting_impl();
+            const int64_t n_kv_excess = n_kv_queued + n_kv_need - n_kv_max;
+            // a request that does not fit on its own is admitted when nothing is waiting, so that it cannot starve
+            if (n_kv_excess > 0 && (n_kv_queued > 0 || n_kv_need <= n_kv_max)) {
+                QUE_DBG("reject %d tasks, n_kv_need = %lld, n_kv_excess = %lld\n", (int) tasks.size(), (long long) n_kv_need, (long long) n_kv_excess);
+                return n_kv_excess;
+            }
+        }
+        // note: another thread can post in between, the limit is a soft one
+        post(std::move(tasks));
+        return 0;
+    }
+
+    // total KV demand of the tasks that are waiting in the queues
+    int64_t n_kv_waiting() {
+        std::unique_lock<std::mutex> lock(mutex_tasks);
+        return n_kv_waiting_impl();
+    }
+
+    // Add a new task, but defer until one slot is available
+    void defer(server_task && task) {
+        std::unique_lock<std::mutex> lock(mutex_tasks);
+        QUE_DBG("defer task, id = %d\n", task.id);
+        queue_tasks_deferred.push_back(std::move(task));
+        condition_tasks.notify_one();
+    }
+
+    // Get the next id for creating a new task
+    int get_new_id() {
+        std::unique_lock<std::mutex> lock(mutex_tasks);
+        int new_id = id++;
+        return new_id;
+    }
+
+    // Register function to process a new task
+    void on_new_task(std::function<void(server_task &&)> callback) {
+        callback_new_task = std::move(callback);
+    }
+
+    // Register the function to be called when all slots data is ready to be processed
+    void on_update_slots(std::function<void(void)> callback) {
+        callback_update_slots = std::move(callback);
+    }
+
+    // Call when the state of one slot is changed, it will move one task from deferred to main queue
+    void pop_deferred_task() {
+        std::unique_lock<std::mutex> lock(mutex_tasks);
+        if (!queue_tasks_deferred.empty()) {
+            queue_tasks.emplace_back(std::move(queue_tasks_deferred.front()));
+            queue_tasks_deferred.pop_front();
+        }
+        condition_tasks.notify_one();
+    }
+
+    // end the start_loop routine
+    void terminate() {
+        std::unique_lock<std::mutex> lock(mutex_tasks);
+        running = false;
+        condition_tasks.notify_all();
+    }
+
+    /**
+     * Main loop consists of these steps:
+     * - Wait until a new task arrives
+     * - Process the task (i.e. maybe copy data into slot)
+     * - Check if multitask is finished
+     * - Update all slots
+     */
+    void start_loop() {
+        while (true) {
+            QUE_DBG("%s", "processing new tasks\n");
+
+            while (true) {
+                std::unique_lock<std::mutex> lock(mutex_tasks);
+                if (!running) {
+                    QUE_DBG("%s", "terminate\n");
+                    return;
+                }
+                if (queue_tasks.empty()) {
+                    lock.unlock();
+                    break;
+                }
+                server_task task = std::move(queue_tasks.front());
+                queue_tasks.pop_front();
+                lock.unlock();
+
+                QUE_DBG("processing task, id = %d\n", task.id);
+                callback_new_task(std::move(task));
+            }
+
+            // all tasks in the current loop is processed, slots data is now ready
+            QUE_DBG("%s", "update slots\n");
+
+            callback_update_slots();
+
+            QUE_DBG("%s", "waiting for new tasks\n");
+            {
+                std::unique_lock<std::mutex> lock(mutex_tasks);
+                if (!running) {
+                    QUE_DBG("%s", "terminate\n");
+                    return;
+                }
+                if (queue_tasks.empty()) {
+                    condition_tasks.wait(lock, [&]{
+                        return (!queue_tasks.empty() || !running);
+                    });
+                }
+            }
+        }
+    }
+
+private:
+    void cleanup_pending_task(int id_target) {
         // no need lock because this is called exclusively by post()
         auto rm_func = [id_target](const server_task & task) {
             return task.id_target == id_target;
@@ -1751,6 +2909,18 @@ private:
             std::remove_if(queue_tasks_deferred.begin(), queue_tasks_deferred.end(), rm_func),
             queue_tasks_deferred.end());
     }
+
+    int64_t n_kv_waiting_impl() const {
+        // no need lock because the callers hold mutex_tasks
+        int64_t n_kv = 0;
+        for (const auto & task : queue_tasks) {
+            n_kv += task.n_kv_need;
+        }
+        for (const auto & task : queue_tasks_deferred) {
+            n_kv += task.n_kv_need;
+        }
+        return n_kv;
+    }
 };
 
 struct server_response {
@@ -1904,6 +3074,10 @@ struct server_context {
 
     llama_context_params cparams_dft;
 
+    // n-gram caches used for n-gram drafting, together with the per-slot context caches
+    common_ngram_cache ngram_cache_static;  // loaded from --lookup-cache-static, read-only
+    common_ngram_cache ngram_cache_dynamic; // not used, kept empty
+
     llama_batch batch {};
 
     bool clean_kv_cache = true;
@@ -1920,6 +3094,32 @@ struct server_context {
 
     server_metrics metrics;
 
+    server_response_cache response_cache;
+
+    // image / audio embeddings computed by the multimodal projector, shared by all the slots
+    mtmd_embd_cache mtmd_cache;
+
+    // KV-capacity aware admission control, see post_admit()
+    // note: the atomics are written by the main loop and read by the HTTP threads
+    std::atomic<int64_t>  n_kv_reserved    {0};   // KV cells reserved by the processing slots
+    std::atomic<double>   kv_tokens_per_s  {0.0}; // decode throughput, used to estimate the Retry-After delay
+    std::atomic<uint64_t> n_rejected_total {0};
+
+    int64_t t_kv_window = 0; // start of the current throughput window
+    int64_t n_kv_window = 0; // number of tokens decoded in the current throughput window
+
+    // file I/O of the slot save/restore actions, see process_slot_io()
+    // note: declared after the queues, so it is stopped before they are destroyed
+    server_slot_io slot_io;
+
+    // persistent store of the KV data of the prompt prefixes, see kv_store_load() and kv_store_save()
+    server_kv_store kv_store;
+
+    // embedding tasks that are packed together into a single ubatch, bypassing the slots
+    // only used with memory-less models (e.g. BERT) with pooling, see init()
+    std::deque<server_task> queue_embd_packed;
+    int32_t n_seq_embd_packed = 0; // max number of sequences per packed batch, 0 = disabled
+
     // Necessary similarity of prompt for slot selection
     float slot_prompt_similarity = 0.0f;
 
@@ -2055,11 +3255,43 @@ struct server_context {
             }
         }
 
+        if (params_base.n_sink > 0 && llama_model_rope_type(model) == LLAMA_ROPE_TYPE_NONE) {
+            params_base.n_sink = 0;
+            SRV_WRN("%s\n", "attention sinks require a model with relative positions (RoPE), they will be disabled");
+        }
+
+        if (params_base.speculative.ngram) {
+            if (model_dft) {
+                params_base.speculative.ngram = false;
+                SRV_WRN("%s\n", "a draft model is loaded, n-gram drafting will be disabled");
+            } else if (mctx) {
+                params_base.speculative.ngram = false;
+                SRV_WRN("%s\n", "n-gram drafting is not supported by multimodal, it will be disabled");
+            } else if (!params_base.lookup_cache_static.empty()) {
+                try {
+                    ngram_cache_static = common_ngram_cache_load(params_base.lookup_cache_static);
+                } catch (const std::exception & e) {
+                    SRV_ERR("failed to load static lookup cache: %s\n", e.what());
+                    return false;
+                }
+
+                SRV_INF("loaded static lookup cache '%s', n_ngrams = %zu\n", params_base.lookup_cache_static.c_str(), ngram_cache_static.size());
+            }
+        }
+
         return true;
     }
 
     void init() {
-        const int32_t n_ctx_slot = n_ctx / params_base.n_parallel;
+        int32_t n_ctx_slot = n_ctx / params_base.n_parallel;
+
+        // with a KV budget, the cells of a slot are bounded by the budget instead of its share of the context
+        // the positions keep growing, so the slot context is the training context of the model
+        if (params_base.kv_budget > 0) {
+            n_ctx_slot = std::max(n_ctx_slot, llama_model_n_ctx_train(model));
+
+            SRV_INF("KV budget = %d cells per slot, n_ctx_slot = %d\n", params_base.kv_budget, n_ctx_slot);
+        }
 
         SRV_INF("initializing slots, n_slots = %d\n", params_base.n_parallel);
 
@@ -2087,6 +3319,9 @@ struct server_context {
                     SRV_ERR("%s", "failed to create speculator\n");
                     return;
                 }
+            } else if (params_base.speculative.ngram) {
+                slot.batch_spec = llama_batch_init(params_base.speculative.n_max + 1, 0, 1);
+                slot.spec_ngram = true;
             }
 
             SLT_INF(slot, "new slot n_ctx_slot = %d\n", slot.n_ctx);
@@ -2114,6 +3349,39 @@ struct server_context {
 
         metrics.init();
 
+        if (!params_base.slot_save_path.empty()) {
+            // wake up the main loop when a save/restore job is done
+            slot_io.start([this]() {
+                server_task task(SERVER_TASK_TYPE_NEXT_RESPONSE);
+                task.id = queue_tasks.get_new_id();
+                queue_tasks.post(std::move(task));
+            });
+        }
+
+        if (!params_base.kv_store_path.empty()) {
+            kv_store_init();
+        }
+
+        if (params_base.response_cache_size > 0) {
+            response_cache.init(params_base.response_cache_size, params_base.response_cache_ttl);
+
+            SRV_INF("response cache enabled, size = %d MiB, ttl = %d s\n", params_base.response_cache_size, params_base.response_cache_ttl);
+        }
+
+        if (mctx && params_base.mmproj_cache_size > 0) {
+            mtmd_cache.init(params_base.mmproj_cache_size);
+
+            SRV_INF("multimodal embedding cache enabled, size = %d MiB\n", params_base.mmproj_cache_size);
+        }
+
+        // without a memory module, the sequences do not occupy any state outside of the ubatch, so the inputs of
+        // many embedding tasks can be packed into a single ubatch, as long as each one gets its own sequence
+        if (params_base.embedding && !mctx && !llama_get_memory(ctx) && llama_pooling_type(ctx) != LLAMA_POOLING_TYPE_NONE) {
+            n_seq_embd_packed = llama_n_seq_max(ctx);
+
+            SRV_INF("packing of embedding inputs enabled, n_seq_max = %d, n_ubatch = %d\n", n_seq_embd_packed, llama_n_ubatch(ctx));
+        }
+
         oai_parser_opt = {
             /* use_jinja             */ params_base.use_jinja,
             /* prefill_assistant     */ params_base.prefill_assistant,
@@ -2146,12 +3414,12 @@ struct server_context {
 
             for (server_slot & slot : slots) {
                 // skip the slot if it is not available
-                if (slot.is_processing()) {
+                if (!slot.is_available()) {
                     continue;
                 }
 
                 // skip the slot if it does not contains cached tokens
-                if (slot.cache_tokens.empty()) {
+                if (slot.cache_tokens.empty() || slot.kv_evicted) {
                     continue;
                 }
 
@@ -2180,7 +3448,7 @@ struct server_context {
 
             for (server_slot & slot : slots) {
                 // skip the slot if it is not available
-                if (slot.is_processing()) {
+                if (!slot.is_available()) {
                     continue;
                 }
 
@@ -2199,6 +3467,77 @@ struct server_context {
         return ret;
     }
 
+    // estimate of the number of KV cells used by a task: the prompt and the tokens to generate, capped to the slot context
+    int32_t kv_need(const server_task & task) const {
+        const int32_t n_ctx_slot = slots.front().n_ctx;
+
+        int32_t n_predict = n_ctx_slot;
+        if (task.type == SERVER_TASK_TYPE_EMBEDDING || task.type == SERVER_TASK_TYPE_RERANK) {
+            n_predict = 0;
+        } else if (task.params.n_predict >= 0) {
+            n_predict = task.params.n_predict;
+        } else if (params_base.n_predict >= 0) {
+            n_predict = params_base.n_predict;
+        }
+
+        return (int32_t) std::min<int64_t>(n_ctx_slot, (int64_t) task.prompt_tokens.size() + n_predict);
+    }
+
+    // post the tasks if there is enough KV capacity for them, taking into account the reservations of the
+    // processing slots and the demand of the queued tasks
+    // returns 0 if the tasks were posted, otherwise the suggested number of seconds to wait before retrying
+    int post_admit(std::vector<server_task> & tasks) {
+        for (auto & task : tasks) {
+            task.n_kv_need = kv_need(task);
+        }
+
+        if (params_base.kv_queue_max < 0) {
+            queue_tasks.post(std::move(tasks));
+            return 0;
+        }
+
+        const int64_t n_kv_max = (int64_t) n_ctx - n_kv_reserved.load() + params_base.kv_queue_max;
+
+        const int64_t n_kv_excess = queue_tasks.post_admit(tasks, n_kv_max);
+        if (n_kv_excess == 0) {
+            return 0;
+        }
+
+        n_rejected_total++;
+
+        // time needed to drain the excess at the current decode throughput
+        const double rate = std::max(1.0, kv_tokens_per_s.load());
+
+        const int retry_after = std::clamp((int) std::ceil(n_kv_excess / rate), 1, 60);
+
+        SRV_WRN("rejecting %d tasks, not enough KV capacity: excess = %" PRId64 ", retry after %d s\n", (int) tasks.size(), n_kv_excess, retry_after);
+
+        return retry_after;
+    }
+
+    void update_kv_throughput(int32_t n_tokens) {
+        const int64_t t_now = ggml_time_us();
+
+        if (t_kv_window == 0) {
+            t_kv_window = t_now;
+        }
+
+        n_kv_window += n_tokens;
+
+        const int64_t t_elapsed = t_now - t_kv_window;
+        if (t_elapsed < 1000000) {
+            return;
+        }
+
+        const double rate = 1e6*n_kv_window/t_elapsed;
+        const double prev = kv_tokens_per_s.load();
+
+        kv_tokens_per_s = prev > 0.0 ? 0.7*prev + 0.3*rate : rate;
+
+        t_kv_window = t_now;
+        n_kv_window = 0;
+    }
+
     bool launch_slot_with_task(server_slot & slot, server_task && task) {
         slot.reset();
         slot.id_task       = task.id;
@@ -2206,6 +3545,11 @@ struct server_context {
         slot.task_type     = task.type;
         slot.params        = std::move(task.params);
         slot.prompt_tokens = std::move(task.prompt_tokens);
+        slot.t_queued      = task.t_queued;
+        slot.t_arrival     = task.t_arrival >= 0 ? task.t_arrival : task.t_queued;
+        slot.n_kv_need     = task.n_kv_need;
+
+        metrics.record(SERVER_HISTOGRAM_QUEUE_WAIT, slot.task_type, slot.params.oaicompat, (ggml_time_us() - slot.t_queued) / 1e6);
 
         if (!are_lora_equal(slot.params.lora, slot.lora)) {
             // if lora is changed, we cannot reuse cached tokens
@@ -2238,12 +3582,18 @@ struct server_context {
             }
         }
 
-        if (slot.ctx_dft) {
+        if (slot.ctx_dft || slot.spec_ngram) {
             llama_batch_free(slot.batch_spec);
 
             slot.batch_spec = llama_batch_init(slot.params.speculative.n_max + 1, 0, 1);
         }
 
+        if (slot.spec_ngram) {
+            // the n-grams are rebuilt from the new context on the first draft
+            slot.ngram_cache.clear();
+            slot.n_ngram_cached = 0;
+        }
+
         slot.state = SLOT_STATE_STARTED;
 
         SLT_INF(slot, "%s", "processing task\n");
@@ -2476,16 +3826,76 @@ struct server_context {
         res->err_type = type;
         res->err_msg  = error;
 
-        queue_results.send(std::move(res));
+        queue_results.send(std::move(res));
+    }
+
+    // if multimodal is enabled, send an error and return false
+    bool ensure_no_mtmd(const int id_task) {
+        if (mctx) {
+            send_error(id_task, "This feature is not supported by multimodal", ERROR_TYPE_NOT_SUPPORTED);
+            return false;
+        }
+        return true;
+    }
+
+    // returns an empty string if the results of the task cannot be cached
+    std::string response_cache_key(const server_task & task) const {
+        if (!response_cache.enabled()) {
+            return "";
+        }
+
+        if (task.type != SERVER_TASK_TYPE_COMPLETION && task.type != SERVER_TASK_TYPE_INFILL) {
+            return "";
+        }
+
+        const auto & params = task.params;
+
+        // the output must be a function of the request only
+        if (params.sampling.temp > 0.0f && params.sampling.seed == LLAMA_DEFAULT_SEED) {
+            return "";
+        }
+        if (params.t_max_predict_ms > 0 || task.prompt_tokens.has_mtmd) {
+            return "";
+        }
+
+        // note: to_json() includes the sampling params, the grammar and the LoRA scales
+        json key = params.to_json();
+
+        key["model"]            = params_base.model.path;
+        key["type"]             = task.type;
+        key["oaicompat"]        = params.oaicompat;
+        key["verbose"]          = params.verbose;
+        key["return_tokens"]    = params.return_tokens;
+        key["n_indent"]         = params.n_indent;
+        key["response_fields"]  = params.response_fields;
+        key["parse_tool_calls"] = params.oaicompat_chat_syntax.parse_tool_calls;
+        key["prompt"]           = task.prompt_tokens.get_text_tokens();
+
+        return key.dump();
     }
 
-    // if multimodal is enabled, send an error and return false
-    bool ensure_no_mtmd(const int id_task) {
-        if (mctx) {
-            send_error(id_task, "This feature is not supported by multimodal", ERROR_TYPE_NOT_SUPPORTED);
-            return false;
+    // send the cached results of a previous identical request, without using a slot
+    void send_cached_response(const server_task & task, const server_response_cache::entry & entry) {
+        for (const auto & partial : entry.partials) {
+            auto res = std::make_unique<server_task_result_cmpl_partial>(partial);
+            res->id                = task.id;
+            res->id_slot           = -1;
+            res->index             = task.index;
+            res->oaicompat_model   = task.params.oaicompat_model;
+            res->oaicompat_cmpl_id = task.params.oaicompat_cmpl_id;
+
+            queue_results.send(std::move(res));
         }
-        return true;
+
+        auto res = std::make_unique<server_task_result_cmpl_final>(entry.final);
+        res->id                = task.id;
+        res->id_slot           = -1;
+        res->index             = task.index;
+        res->oaicompat_model   = task.params.oaicompat_model;
+        res->oaicompat_cmpl_id = task.params.oaicompat_cmpl_id;
+        res->generation_params = task.params;
+
+        queue_results.send(std::move(res));
     }
 
     void send_partial_response(server_slot & slot, const completion_token_output & tkn) {
@@ -2517,6 +3927,10 @@ struct server_context {
             res->timings = slot.get_timings();
         }
 
+        if (!slot.resp_cache_key.empty() && slot.params.stream) {
+            slot.resp_cache_partials.push_back(*res);
+        }
+
         queue_results.send(std::move(res));
     }
 
@@ -2566,6 +3980,18 @@ struct server_context {
 
         res->generation_params = slot.params; // copy the parameters
 
+        if (!slot.resp_cache_key.empty()) {
+            server_response_cache::entry entry;
+            entry.key      = std::move(slot.resp_cache_key);
+            entry.partials = std::move(slot.resp_cache_partials);
+            entry.final    = *res;
+
+            response_cache.put(std::move(entry));
+
+            slot.resp_cache_key.clear();
+            slot.resp_cache_partials.clear();
+        }
+
         queue_results.send(std::move(res));
     }
 
@@ -2748,6 +4174,175 @@ struct server_context {
     // Functions to process the task
     //
 
+    // check if the task can be processed by process_embd_packed() instead of a slot
+    bool can_pack_embd(const server_task & task) const {
+        return n_seq_embd_packed > 0
+            && task.type == SERVER_TASK_TYPE_EMBEDDING
+            && task.id_selected_slot == -1
+            && !task.prompt_tokens.empty()
+            && task.prompt_tokens.size() <= llama_n_ubatch(ctx)
+            && (int32_t) task.prompt_tokens.size() <= slots[0].n_ctx;
+    }
+
+    // decode the pending packed embedding tasks, one sequence per task
+    // only the tasks with the same LoRA adapters as the oldest one are packed, the others wait for a later batch
+    // returns true if at least one batch was processed
+    bool process_embd_packed() {
+        if (queue_embd_packed.empty()) {
+            return false;
+        }
+
+        const int32_t n_ubatch = llama_n_ubatch(ctx);
+
+        std::vector<common_adapter_lora_info> lora = queue_embd_packed.front().params.lora; // copy
+
+        std::vector<server_task> tasks;
+
+        common_batch_clear(batch);
+
+        for (auto it = queue_embd_packed.begin(); it != queue_embd_packed.end() && (int32_t) tasks.size() < n_seq_embd_packed; ) {
+            if (!are_lora_equal(it->params.lora, lora)) {
+                ++it;
+                continue;
+            }
+
+            if (batch.n_tokens + (int32_t) it->prompt_tokens.size() > n_ubatch) {
+                break;
+            }
+
+            const llama_seq_id seq_id = tasks.size();
+            for (size_t i = 0; i < it->prompt_tokens.size(); ++i) {
+                common_batch_add(batch, it->prompt_tokens[i], i, { seq_id }, true);
+            }
+
+            tasks.push_back(std::move(*it));
+            it = queue_embd_packed.erase(it);
+        }
+
+        GGML_ASSERT(!tasks.empty());
+
+        const int64_t t_start = ggml_time_us();
+
+        for (const auto & task : tasks) {
+            metrics.record(SERVER_HISTOGRAM_QUEUE_WAIT, task.type, task.params.oaicompat, (t_start - task.t_queued) / 1e6);
+        }
+
+        SRV_DBG("decoding packed embedding batch, n_seqs = %d, n_tokens = %d\n", (int) tasks.size(), batch.n_tokens);
+
+        common_set_adapter_lora(ctx, lora);
+        llama_set_embeddings(ctx, true);
+
+        const int ret = llama_decode(ctx, batch);
+
+        metrics.on_decoded(slots);
+        metrics.record(SERVER_HISTOGRAM_BATCH_OCCUPANCY, SERVER_TASK_TYPE_EMBEDDING, OAICOMPAT_TYPE_NONE, (double) batch.n_tokens / llama_n_batch(ctx));
+
+        if (ret != 0) {
+            SRV_ERR("failed to decode packed embedding batch, n_seqs = %d, n_tokens = %d, ret = %d\n", (int) tasks.size(), batch.n_tokens, ret);
+            for (const auto & task : tasks) {
+                send_error(task, "Compute error.");
+            }
+            return true;
+        }
+
+        const int64_t t_end = ggml_time_us();
+
+        const int n_embd = llama_model_n_embd(model);
+
+        for (size_t i = 0; i < tasks.size(); ++i) {
+            const auto & task = tasks[i];
+
+            auto res = std::make_unique<server_task_result_embd>();
+            res->id        = task.id;
+            res->index     = task.index;
+            res->n_tokens  = task.prompt_tokens.size();
+            res->oaicompat = task.params.oaicompat;
+
+            const float * embd = llama_get_embeddings_seq(ctx, i);
+            if (embd == nullptr) {
+                SRV_ERR("failed to get embeddings, task id = %d, seq_id = %d\n", task.id, (int) i);
+
+                res->embedding.push_back(std::vector<float>(n_embd, 0.0f));
+            } else {
+                std::vector<float> embd_res(n_embd, 0.0f);
+                common_embd_normalize(embd, embd_res.data(), n_embd, 2);
+                res->embedding.push_back(std::move(embd_res));
+            }
+
+            metrics.record(SERVER_HISTOGRAM_PREFILL, task.type, task.params.oaicompat, (t_end - t_start) / 1e6);
+
+            metrics.n_prompt_tokens_processed_total += task.prompt_tokens.size();
+            metrics.n_prompt_tokens_processed       += task.prompt_tokens.size();
+
+            queue_results.send(std::move(res));
+        }
+
+        metrics.t_prompt_processing       += (t_end - t_start) / 1e3;
+        metrics.t_prompt_processing_total += (t_end - t_start) / 1e3;
+
+        return true;
+    }
+
+    // StreamingLLM-style context shift: the first n_keep tokens are the attention sinks and the discarded tokens are the
+    // oldest ones of the rolling window. the cells of the window form a ring in the KV cache (n_kv_sink), the next tokens
+    // are placed in the freed cells. the window keeps its positions, which grow by n_discard on each shift, as long as
+    // they stay within the training context of the model. past it, the window is re-based right after the sink cells
+    // with a single K-shift, which rotates the ring without moving its cells
+    void ctx_shift_sink(server_slot & slot, int n_keep, int n_discard) {
+        auto * mem = llama_get_memory(ctx);
+
+        const llama_pos p0 = slot.n_pos_offset + n_keep;
+
+        llama_memory_seq_rm(mem, slot.id, p0, p0 + n_discard);
+
+        slot.n_pos_fixed   = n_keep;
+        slot.n_pos_offset += n_discard;
+
+        // the window starts at the position n_sink, after the sink cells, even when the request keeps fewer sinks
+        const llama_pos n_pos_base = params_base.n_sink - n_keep;
+        const llama_pos n_pos_max  = std::max(llama_model_n_ctx_train(model), n_pos_base + slot.n_ctx);
+
+        // the positions reached before the next shift
+        if (slot.n_pos_offset + slot.n_ctx > n_pos_max) {
+            SLT_INF(slot, "the positions would exceed the training context of the model (%d), re-basing the window\n", n_pos_max);
+
+            llama_memory_seq_add(mem, slot.id, p0 + n_discard, -1, n_pos_base - slot.n_pos_offset);
+
+            slot.n_pos_offset = n_pos_base;
+        }
+
+        if (slot.n_pos_offset == 0) {
+            slot.n_pos_fixed = 0;
+        }
+    }
+
+    // draft tokens by looking up the last n-grams of the slot context (prompt + generated text)
+    // the drafts are validated with the static n-gram cache, if one is loaded
+    llama_tokens gen_draft_ngram(server_slot & slot, llama_token id, int n_draft) {
+        const llama_tokens & tokens = slot.cache_tokens.get_text_tokens();
+
+        // the n-grams look back at most n_look tokens, so only the tail of the context is copied
+        const size_t n_look = std::max(LLAMA_NGRAM_MAX, LLAMA_NGRAM_STATIC);
+
+        // the context cache can only be appended to
+        if (tokens.size() > slot.n_ngram_cached) {
+            llama_tokens inp(tokens.begin() + (slot.n_ngram_cached - std::min(slot.n_ngram_cached, n_look)), tokens.end());
+
+            common_ngram_cache_update(slot.ngram_cache, LLAMA_NGRAM_MIN, LLAMA_NGRAM_MAX, inp, tokens.size() - slot.n_ngram_cached, false);
+            slot.n_ngram_cached = tokens.size();
+        }
+
+        llama_tokens inp(tokens.end() - std::min(tokens.size(), n_look), tokens.end());
+        inp.push_back(id);
+
+        llama_tokens draft = { id };
+        common_ngram_cache_draft(inp, draft, n_draft, LLAMA_NGRAM_MIN, LLAMA_NGRAM_MAX, slot.ngram_cache, ngram_cache_dynamic, ngram_cache_static);
+
+        draft.erase(draft.begin());
+
+        return draft;
+    }
+
     void process_single_task(server_task && task) {
         switch (task.type) {
             case SERVER_TASK_TYPE_COMPLETION:
@@ -2755,6 +4350,25 @@ struct server_context {
             case SERVER_TASK_TYPE_EMBEDDING:
             case SERVER_TASK_TYPE_RERANK:
                 {
+                    if (can_pack_embd(task)) {
+                        if (!task.prompt_tokens.validate(ctx)) {
+                            send_error(task, "Prompt contains invalid tokens", ERROR_TYPE_INVALID_REQUEST);
+                            break;
+                        }
+                        queue_embd_packed.push_back(std::move(task));
+                        break;
+                    }
+
+                    std::string resp_cache_key = response_cache_key(task);
+                    if (!resp_cache_key.empty()) {
+                        const auto * entry = response_cache.get(resp_cache_key);
+                        if (entry != nullptr) {
+                            SRV_DBG("response cache hit, id_task = %d\n", task.id);
+                            send_cached_response(task, *entry);
+                            break;
+                        }
+                    }
+
                     const int id_slot = task.id_selected_slot;
 
                     server_slot * slot = id_slot != -1 ? get_slot_by_id(id_slot) : get_available_slot(task);
@@ -2766,7 +4380,7 @@ struct server_context {
                         break;
                     }
 
-                    if (slot->is_processing()) {
+                    if (!slot->is_available()) {
                         // if requested slot is unavailable, we defer this task for processing later
                         SRV_DBG("requested slot is unavailable, defer task, id_task = %d\n", task.id);
                         queue_tasks.defer(std::move(task));
@@ -2777,6 +4391,8 @@ struct server_context {
                         SRV_ERR("failed to launch slot with task, id_task = %d\n", task.id);
                         break;
                     }
+
+                    slot->resp_cache_key = std::move(resp_cache_key);
                 } break;
             case SERVER_TASK_TYPE_CANCEL:
                 {
@@ -2787,6 +4403,13 @@ struct server_context {
                             break;
                         }
                     }
+
+                    // drop any pending packed embedding task
+                    queue_embd_packed.erase(
+                        std::remove_if(queue_embd_packed.begin(), queue_embd_packed.end(), [&](const server_task & t) {
+                            return t.id == task.id_target;
+                        }),
+                        queue_embd_packed.end());
                 } break;
             case SERVER_TASK_TYPE_NEXT_RESPONSE:
                 {
@@ -2817,7 +4440,7 @@ struct server_context {
                     res->slots_data          = std::move(slots_data);
                     res->n_idle_slots        = n_idle_slots;
                     res->n_processing_slots  = n_processing_slots;
-                    res->n_tasks_deferred    = queue_tasks.queue_tasks_deferred.size();
+                    res->n_tasks_deferred    = queue_tasks.queue_tasks_deferred.size() + queue_embd_packed.size();
                     res->t_start             = metrics.t_start;
 
                     res->n_prompt_tokens_processed_total = metrics.n_prompt_tokens_processed_total;
@@ -2833,6 +4456,29 @@ struct server_context {
                     res->n_decode_total          = metrics.n_decode_total;
                     res->n_busy_slots_total      = metrics.n_busy_slots_total;
 
+                    res->n_resp_cache_hits    = response_cache.n_hits;
+                    res->n_resp_cache_misses  = response_cache.n_misses;
+                    res->n_resp_cache_entries = response_cache.entries.size();
+                    res->n_resp_cache_bytes   = response_cache.n_bytes;
+
+                    res->n_mtmd_cache_hits    = mtmd_cache.n_hits;
+                    res->n_mtmd_cache_misses  = mtmd_cache.n_misses;
+                    res->n_mtmd_cache_entries = mtmd_cache.entries.size();
+                    res->n_mtmd_cache_bytes   = mtmd_cache.n_bytes;
+
+                    res->n_kv_capacity    = n_ctx;
+                    res->n_kv_reserved    = n_kv_reserved;
+                    res->n_kv_queued      = queue_tasks.n_kv_waiting();
+                    res->kv_tokens_per_s  = kv_tokens_per_s;
+                    res->n_rejected_total = n_rejected_total;
+
+                    {
+                        llama_memory_t mem = llama_get_memory(ctx);
+
+                        res->kv_streams.resize(std::max(0, llama_memory_get_stream_stats(mem, nullptr, 0)));
+                        llama_memory_get_stream_stats(mem, res->kv_streams.data(), res->kv_streams.size());
+                    }
+
                     if (task.metrics_reset_bucket) {
                         metrics.reset_bucket();
                     }
@@ -2850,34 +4496,70 @@ struct server_context {
                         send_error(task, "Invalid slot ID", ERROR_TYPE_INVALID_REQUEST);
                         break;
                     }
-                    if (slot->is_processing()) {
+                    if (!slot->is_available()) {
                         // if requested slot is unavailable, we defer this task for processing later
                         SRV_DBG("requested slot is unavailable, defer task, id_task = %d\n", task.id);
                         queue_tasks.defer(std::move(task));
                         break;
                     }
 
-                    const size_t token_count = slot->cache_tokens.size();
                     const int64_t t_start = ggml_time_us();
 
                     std::string filename = task.slot_action.filename;
                     std::string filepath = task.slot_action.filepath;
 
                     const llama_tokens & tokens = slot->cache_tokens.get_text_tokens();
-                    const size_t nwrite = llama_state_seq_save_file(ctx, filepath.c_str(), slot->id, tokens.data(), token_count);
 
-                    const int64_t t_end = ggml_time_us();
-                    const double t_save_ms = (t_end - t_start) / 1000.0;
+                    // append only the new tokens if the file still holds the state of the previous save of the slot
+                    auto & st = slot->save_state;
+                    const bool append = task.slot_action.incremental &&
+                        st.filepath == filepath &&
+                        st.n_pos_offset == slot->n_pos_offset &&
+                        st.tokens.size() <= tokens.size() &&
+                        std::equal(st.tokens.begin(), st.tokens.end(), tokens.begin());
+
+                    const size_t    n_keep = append ? st.tokens.size() : 0;
+                    const llama_pos p0     = append ? (llama_pos) n_keep + slot->n_pos_offset : -1;
+
+                    // snapshot the KV cells to the staging buffer, the file is written by the I/O thread
+                    std::vector<uint8_t> data;
+                    if (!append || n_keep < tokens.size()) {
+                        data.resize(llama_state_seq_get_size_range(ctx, slot->id, p0, -1));
+                        const size_t n_copy = llama_state_seq_get_data_range(ctx, data.data(), data.size(), slot->id, p0, -1);
+                        if (n_copy == 0) {
+                            st = {};
+                            send_error(task, "Unable to copy the slot state", ERROR_TYPE_SERVER);
+                            break;
+                        }
+                        data.resize(n_copy);
+                    }
 
-                    auto res = std::make_unique<server_task_result_slot_save_load>();
-                    res->id       = task.id;
-                    res->id_slot  = id_slot;
-                    res->filename = filename;
-                    res->is_save  = true;
-                    res->n_tokens = token_count;
-                    res->n_bytes  = nwrite;
-                    res->t_ms     = t_save_ms;
-                    queue_results.send(std::move(res));
+                    server_slot_io::job job;
+                    job.id_task        = task.id;
+                    job.id_slot        = id_slot;
+                    job.filename       = filename;
+                    job.filepath       = filepath;
+                    job.is_save        = true;
+                    job.append         = append;
+                    job.compress       = task.slot_action.compress;
+                    job.tokens         = llama_tokens(tokens.begin() + n_keep, tokens.end());
+                    job.n_tokens_total = tokens.size();
+                    job.t_start_us     = t_start;
+                    job.segments.push_back(std::move(data));
+
+                    SLT_INF(*slot, "saving %zu tokens to '%s' (%s, %zu new)\n", tokens.size(), filename.c_str(), append ? "append" : "rewrite", job.tokens.size());
+
+                    // the other slots that saved to the same file cannot append to it anymore
+                    for (auto & other : slots) {
+                        if (other.save_state.filepath == filepath) {
+                            other.save_state = {};
+                        }
+                    }
+                    st.filepath     = filepath;
+                    st.tokens       = tokens;
+                    st.n_pos_offset = slot->n_pos_offset;
+
+                    slot_io.post(std::move(job));
                 } break;
             case SERVER_TASK_TYPE_SLOT_RESTORE:
                 {
@@ -2888,43 +4570,25 @@ struct server_context {
                         send_error(task, "Invalid slot ID", ERROR_TYPE_INVALID_REQUEST);
                         break;
                     }
-                    if (slot->is_processing()) {
+                    if (!slot->is_available()) {
                         // if requested slot is unavailable, we defer this task for processing later
                         SRV_DBG("requested slot is unavailable, defer task, id_task = %d\n", task.id);
                         queue_tasks.defer(std::move(task));
                         break;
                     }
 
-                    const int64_t t_start = ggml_time_us();
-
-                    std::string filename = task.slot_action.filename;
-                    std::string filepath = task.slot_action.filepath;
-
-                    llama_tokens tokens;
-                    tokens.resize(slot->n_ctx);
-                    size_t token_count = 0;
-                    size_t nread = llama_state_seq_load_file(ctx, filepath.c_str(), slot->id, tokens.data(), tokens.size(), &token_count);
-                    if (nread == 0) {
-                        slot->cache_tokens.clear(); // KV may already been invalidated?
-                        send_error(task, "Unable to restore slot, no available space in KV cache or invalid slot save file", ERROR_TYPE_INVALID_REQUEST);
-                        break;
-                    }
-                    tokens.resize(token_count);
-                    slot->cache_tokens.clear();
-                    slot->cache_tokens.insert(tokens);
-
-                    const int64_t t_end = ggml_time_us();
-                    const double t_restore_ms = (t_end - t_start) / 1000.0;
-
-                    auto res = std::make_unique<server_task_result_slot_save_load>();
-                    res->id       = task.id;
-                    res->id_slot  = id_slot;
-                    res->filename = filename;
-                    res->is_save  = false;
-                    res->n_tokens = token_count;
-                    res->n_bytes  = nread;
-                    res->t_ms     = t_restore_ms;
-                    queue_results.send(std::move(res));
+                    // the file is read on the I/O thread, the state is applied by process_slot_io()
+                    server_slot_io::job job;
+                    job.id_task    = task.id;
+                    job.id_slot    = id_slot;
+                    job.filename   = task.slot_action.filename;
+                    job.filepath   = task.slot_action.filepath;
+                    job.is_save    = false;
+                    job.n_ctx      = slot->n_ctx;
+                    job.t_start_us = ggml_time_us();
+
+                    slot->n_io_pending++;
+                    slot_io.post(std::move(job));
                 } break;
             case SERVER_TASK_TYPE_SLOT_ERASE:
                 {
@@ -2935,7 +4599,7 @@ struct server_context {
                         send_error(task, "Invalid slot ID", ERROR_TYPE_INVALID_REQUEST);
                         break;
                     }
-                    if (slot->is_processing()) {
+                    if (!slot->is_available()) {
                         // if requested slot is unavailable, we defer this task for processing later
                         SRV_DBG("requested slot is unavailable, defer task, id_task = %d\n", task.id);
                         queue_tasks.defer(std::move(task));
@@ -2946,6 +4610,7 @@ struct server_context {
                     const size_t n_erased = slot->cache_tokens.size();
                     llama_memory_seq_rm(llama_get_memory(ctx), slot->id, -1, -1);
                     slot->cache_tokens.clear();
+                    slot->save_state = {};
 
                     auto res = std::make_unique<server_task_result_slot_erase>();
                     res->id       = task.id;
@@ -2964,19 +4629,296 @@ struct server_context {
         }
     }
 
+    // open the KV store of the model, if the context can load KV blocks at arbitrary positions of a sequence
+    void kv_store_init() {
+        // the blocks are appended at arbitrary positions of the sequences, so the memory must be split by position
+        if (mctx || llama_model_n_swa(model) > 0 || llama_model_is_recurrent(model) || llama_model_is_hybrid(model) ||
+            !params_base.lora_adapters.empty() || !params_base.control_vectors.empty() || params_base.kv_budget > 0) {
+            SRV_WRN("%s", "the KV store is not supported with multimodal, SWA, recurrent or hybrid models, LoRA adapters, control vectors or a KV budget, disabling it\n");
+            return;
+        }
+
+        // everything that changes the layout or the values of the KV data
+        char desc[128];
+        llama_model_desc(model, desc, sizeof(desc));
+
+        const std::string id = string_format("%s|%" PRIu64 "|%" PRIu64 "|%s|%s|%d|%d|%d|%g|%g|%g|%g|%g|%g|%d",
+                desc, llama_model_n_params(model), llama_model_size(model),
+                ggml_type_name(params_base.cache_type_k), ggml_type_name(params_base.cache_type_v),
+                params_base.flash_attn, params_base.kv_unified ? 1 : params_base.n_parallel, (int) params_base.rope_scaling_type,
+                params_base.rope_freq_base, params_base.rope_freq_scale,
+                params_base.yarn_ext_factor, params_base.yarn_attn_factor, params_base.yarn_beta_fast, params_base.yarn_beta_slow,
+                params_base.yarn_orig_ctx);
+
+        uint64_t model_id = 0xcbf29ce484222325ULL; // FNV-1a
+        for (const char c : id) {
+            model_id = (model_id ^ (uint8_t) c) * 0x100000001b3ULL;
+        }
+
+        // the metadata does not tell apart two fine-tunes of the same base model, so the weights are hashed too
+        // (all the files of a split model)
+        std::vector<std::string> files = { params_base.model.path };
+        {
+            int split_no = 0;
+            int n_split  = 0;
+            const std::string & path = params_base.model.path;
+            if (path.size() > 20 && std::sscanf(path.c_str() + path.size() - 20, "-%5d-of-%5d.gguf", &split_no, &n_split) == 2 && split_no == 1) {
+                std::vector<char> prefix(path.size() + 1);
+                if (llama_split_prefix(prefix.data(), prefix.size(), path.c_str(), split_no - 1, n_split) > 0) {
+                    files.clear();
+                    for (int i = 0; i < n_split; ++i) {
+                        std::vector<char> split_path(path.size() + 1); // all the splits have a name of the same length
+                        llama_split_path(split_path.data(), split_path.size(), prefix.data(), i, n_split);
+                        files.push_back(split_path.data());
+                    }
+                }
+            }
+        }
+
+        const int64_t t_start = ggml_time_us();
+        for (const auto & file : files) {
+            if (!fs_file_digest(file, model_id)) {
+                SRV_WRN("failed to read the model file '%s', disabling the KV store\n", file.c_str());
+                return;
+            }
+        }
+        SRV_INF("KV store: hashed the weights in %.2f s\n", (ggml_time_us() - t_start) / 1e6);
+
+        std::error_code ec;
+        std::filesystem::create_directories(params_base.kv_store_path, ec);
+
+        const std::string path = (std::filesystem::path(params_base.kv_store_path) / string_format("%s.%s-%s.kvstore",
+                std::filesystem::path(params_base.model.path).stem().string().c_str(),
+                ggml_type_name(params_base.cache_type_k), ggml_type_name(params_base.cache_type_v))).string();
+
+        if (!kv_store.init(path, params_base.kv_store_block, model_id, (size_t) params_base.kv_store_size*1024*1024)) {
+            SRV_ERR("failed to open the KV store '%s', disabling it\n", path.c_str());
+            return;
+        }
+
+        SRV_INF("KV store '%s': %zu blocks of %d tokens, %.2f MiB\n", path.c_str(), kv_store.n_blocks(), params_base.kv_store_block, kv_store.file_size/1024.0/1024.0);
+    }
+
+    // extend the cached part of the prompt with the following blocks found in the KV store
+    void kv_store_load(server_slot & slot, const server_tokens & prompt_tokens) {
+        const llama_tokens & tokens = prompt_tokens.get_text_tokens();
+
+        const int n_block = kv_store.n_block;
+
+        const auto hashes = kv_store.hashes(tokens);
+
+        const int k0 = slot.n_past / n_block;
+
+        // the blocks already in the cache of the slot are matched again, to get the id of the parent of the first block
+        uint64_t parent = 0;
+        for (int k = 0; k < k0; ++k) {
+            const int64_t id = kv_store.find(hashes[k], tokens.data() + k*n_block, parent);
+            if (id <= 0) {
+                return;
+            }
+            parent = id;
+        }
+
+        int k = k0;
+        for (; k < (int) hashes.size(); ++k) {
+            size_t size = 0;
+            const uint8_t * data = kv_store.get(hashes[k], tokens.data() + k*n_block, parent, size, parent);
+            if (data == nullptr) {
+                break;
+            }
+
+            if (llama_state_seq_append_data(ctx, data, size, slot.id) == 0) {
+                SLT_WRN(slot, "failed to load block %d from the KV store\n", k);
+
+                llama_memory_seq_rm(llama_get_memory(ctx), slot.id, -1, -1);
+                slot.cache_tokens.clear();
+                slot.n_past       = 0;
+                slot.n_pos_fixed  = 0;
+                slot.n_pos_offset = 0;
+                slot.kv_shifted   = false;
+
+                return;
+            }
+        }
+
+        if (k == k0) {
+            return;
+        }
+
+        SLT_INF(slot, "loaded %d tokens from the KV store, n_past = %d -> %d\n", (k - k0)*n_block, slot.n_past, k*n_block);
+
+        slot.cache_tokens.keep_first(k0*n_block);
+        slot.cache_tokens.insert(llama_tokens(tokens.begin() + k0*n_block, tokens.begin() + k*n_block));
+
+        slot.n_past = k*n_block;
+    }
+
+    // append the full blocks of the evaluated prompt that are not in the KV store yet
+    void kv_store_save(server_slot & slot) {
+        if (slot.kv_shifted) {
+            return;
+        }
+
+        const llama_tokens & tokens = slot.cache_tokens.get_text_tokens();
+
+        const int n_block = kv_store.n_block;
+
+        const auto hashes = kv_store.hashes(tokens);
+
+        int n_saved = 0;
+        uint64_t parent = 0;
+        for (int k = 0; k < (int) hashes.size(); ++k) {
+            const int64_t id = kv_store.find(hashes[k], tokens.data() + k*n_block, parent);
+            if (id < 0) {
+                SLT_DBG(slot, "block %d collides with another block of the KV store, skipping the remaining blocks\n", k);
+                break;
+            }
+            if (id > 0) {
+                parent = id;
+                continue;
+            }
+
+            const llama_pos p0 = k*n_block;
+            const llama_pos p1 = p0 + n_block;
+
+            server_kv_store::job job;
+            job.hash   = hashes[k];
+            job.parent = parent;
+            job.tokens.assign(tokens.begin() + p0, tokens.begin() + p1);
+            job.data.resize(llama_state_seq_get_size_range(ctx, slot.id, p0, p1));
+
+            if (llama_state_seq_get_data_range(ctx, job.data.data(), job.data.size(), slot.id, p0, p1) != job.data.size()) {
+                SLT_WRN(slot, "failed to copy block %d to the KV store\n", k);
+                break;
+            }
+
+            parent = kv_store.post(std::move(job));
+            if (parent == 0) {
+                SLT_DBG(slot, "%s", "the KV store is full or busy, skipping the remaining blocks\n");
+                break;
+            }
+
+            n_saved++;
+        }
+
+        if (n_saved > 0) {
+            SLT_INF(slot, "saving %d blocks of %d tokens to the KV store\n", n_saved, n_block);
+        }
+    }
+
+    // apply the results of the slot save/restore jobs completed by the I/O thread
+    void process_slot_io() {
+        server_slot_io::job job;
+        while (slot_io.pop_done(job)) {
+            server_slot * slot = get_slot_by_id(job.id_slot);
+            GGML_ASSERT(slot != nullptr);
+
+            if (job.is_save) {
+                if (!job.ok) {
+                    if (slot->save_state.filepath == job.filepath) {
+                        slot->save_state = {};
+                    }
+                    send_error(job.id_task, "Unable to save slot: " + job.err, ERROR_TYPE_SERVER);
+                    continue;
+                }
+            } else {
+                slot->n_io_pending--;
+                GGML_ASSERT(slot->n_io_pending >= 0);
+
+                // the slot was reserved while the file was read, the deferred tasks can use it again
+                queue_tasks.pop_deferred_task();
+
+                if (!job.ok) {
+                    send_error(job.id_task, "Unable to restore slot: " + job.err, ERROR_TYPE_INVALID_REQUEST);
+                    continue;
+                }
+
+                // the first segment replaces the state of the sequence, the following ones extend it
+                size_t n_read = 0;
+                for (size_t i = 0; i < job.segments.size(); ++i) {
+                    const auto & data = job.segments[i];
+                    const size_t n = i == 0 ?
+                        llama_state_seq_set_data   (ctx, data.data(), data.size(), slot->id) :
+                        llama_state_seq_append_data(ctx, data.data(), data.size(), slot->id);
+                    if (n == 0) {
+                        n_read = 0;
+                        break;
+                    }
+                    n_read += n;
+                }
+
+                slot->cache_tokens.clear();
+                slot->save_state = {};
+
+                if (n_read == 0) {
+                    llama_memory_seq_rm(llama_get_memory(ctx), slot->id, -1, -1);
+                    send_error(job.id_task, "Unable to restore slot, no available space in KV cache or invalid slot save file", ERROR_TYPE_INVALID_REQUEST);
+                    continue;
+                }
+
+                slot->cache_tokens.insert(job.tokens);
+
+                // the saved state may come from a slot that went through attention sink context shifts, assumed to keep
+                // all the sinks of this server (no n_keep in the request)
+                slot->n_pos_offset = std::max(0, llama_memory_seq_pos_max(llama_get_memory(ctx), slot->id) + 1 - (llama_pos) job.tokens.size());
+                slot->n_pos_fixed  = slot->n_pos_offset > 0 ? std::min(params_base.n_sink, (int32_t) job.tokens.size()) : 0;
+                slot->kv_shifted   = true;
+
+                // the file holds the state of the slot, so the next save to it can be incremental
+                for (auto & other : slots) {
+                    if (other.save_state.filepath == job.filepath) {
+                        other.save_state = {};
+                    }
+                }
+                slot->save_state.filepath     = job.filepath;
+                slot->save_state.tokens       = job.tokens;
+                slot->save_state.n_pos_offset = slot->n_pos_offset;
+            }
+
+            auto res = std::make_unique<server_task_result_slot_save_load>();
+            res->id       = job.id_task;
+            res->id_slot  = job.id_slot;
+            res->filename = job.filename;
+            res->is_save  = job.is_save;
+            res->n_tokens = job.n_tokens_total;
+            res->n_bytes  = job.n_bytes;
+            res->t_ms     = (ggml_time_us() - job.t_start_us) / 1000.0;
+            queue_results.send(std::move(res));
+        }
+    }
+
     void update_slots() {
+        process_slot_io();
+
+        // the packed embeddings are processed independently of the slots, one batch per iteration
+        process_embd_packed();
+
+        if (!queue_embd_packed.empty()) {
+            server_task task(SERVER_TASK_TYPE_NEXT_RESPONSE);
+            task.id = queue_tasks.get_new_id();
+            queue_tasks.post(std::move(task));
+        }
+
         // check if all slots are idle
         {
             bool all_idle = true;
 
+            int64_t n_kv = 0;
+
             for (auto & slot : slots) {
                 if (slot.is_processing()) {
                     all_idle = false;
-                    break;
+                    n_kv += slot.n_kv_need;
                 }
             }
 
+            n_kv_reserved = n_kv;
+
             if (all_idle) {
+                // do not count the idle time in the decode throughput
+                t_kv_window = 0;
+                n_kv_window = 0;
+
                 SRV_INF("%s", "all slots are idle\n");
                 if (clean_kv_cache) {
                     kv_cache_clear();
@@ -3013,14 +4955,31 @@ struct server_context {
                 }
 
                 // Shift context
-                const int n_keep    = slot.params.n_keep + add_bos_token;
+                int n_keep = slot.params.n_keep + add_bos_token;
+                if (params_base.n_sink > 0) {
+                    // the kept tokens are the attention sinks, the first cells of the slot in the KV cache before the ring
+                    // of the window. a request without n_keep keeps all of them, and once the slot has been shifted the
+                    // sinks are fixed
+                    const int n_sink = std::min(params_base.n_sink, slot.n_ctx - 4);
+
+                    if (slot.n_pos_offset > 0) {
+                        n_keep = slot.n_pos_fixed;
+                    } else {
+                        n_keep = slot.params.n_keep > 0 ? std::min(n_keep, n_sink) : n_sink;
+                    }
+                }
+
                 const int n_left    = slot.n_past - n_keep;
                 const int n_discard = slot.params.n_discard ? slot.params.n_discard : (n_left / 2);
 
                 SLT_WRN(slot, "slot context shift, n_keep = %d, n_left = %d, n_discard = %d\n", n_keep, n_left, n_discard);
 
-                llama_memory_seq_rm (llama_get_memory(ctx), slot.id, n_keep            , n_keep + n_discard);
-                llama_memory_seq_add(llama_get_memory(ctx), slot.id, n_keep + n_discard, slot.n_past,        -n_discard);
+                if (params_base.n_sink > 0) {
+                    ctx_shift_sink(slot, n_keep, n_discard);
+                } else {
+                    llama_memory_seq_rm (llama_get_memory(ctx), slot.id, n_keep            , n_keep + n_discard);
+                    llama_memory_seq_add(llama_get_memory(ctx), slot.id, n_keep + n_discard, slot.n_past,        -n_discard);
+                }
 
                 // add generated tokens to cache
                 {
@@ -3034,7 +4993,18 @@ struct server_context {
                     slot.cache_tokens.insert(new_tokens);
                 }
 
-                slot.n_past -= n_discard;
+                slot.n_past -= n_discard;
+
+                // the n-grams of the discarded tokens remain in the cache, only keep track of the position
+                if (slot.n_ngram_cached >= (size_t) (n_keep + n_discard)) {
+                    slot.n_ngram_cached -= n_discard;
+                } else {
+                    slot.n_ngram_cached = std::min(slot.n_ngram_cached, (size_t) n_keep);
+                }
+
+                // the cells of the kept tokens may have moved, the next save rewrites the file
+                slot.save_state = {};
+                slot.kv_shifted = true;
 
                 slot.truncated = true;
             }
@@ -3065,7 +5035,7 @@ struct server_context {
 
             slot.i_batch = batch.n_tokens;
 
-            common_batch_add(batch, slot.sampled, slot.n_past, { slot.id }, true);
+            common_batch_add(batch, slot.sampled, slot.n_pos_offset + slot.n_past, { slot.id }, true);
 
             slot.n_past += 1;
             slot.cache_tokens.push_back(slot.sampled);
@@ -3195,7 +5165,9 @@ struct server_context {
                                 GGML_ASSERT(slot.n_prompt_tokens < slot.n_ctx);
                             }
 
-                            if (slot.params.cache_prompt) {
+                            if (slot.params.cache_prompt && slot.kv_evicted) {
+                                SLT_WRN(slot, "%s", "the KV budget evicted some cells of the cached prompt, forcing full prompt re-processing\n");
+                            } else if (slot.params.cache_prompt) {
                                 // reuse any previously computed tokens that are common with the new prompt
                                 slot.n_past = slot.cache_tokens.get_common_prefix(prompt_tokens);
 
@@ -3230,14 +5202,18 @@ struct server_context {
 
                                             const int64_t kv_shift = (int64_t) head_p - (int64_t) head_c;
 
-                                            llama_memory_seq_rm (llama_get_memory(ctx), slot.id, head_p, head_c);
-                                            llama_memory_seq_add(llama_get_memory(ctx), slot.id, head_c, head_c + n_match, kv_shift);
+                                            const llama_pos p_off = slot.n_pos_offset;
+
+                                            llama_memory_seq_rm (llama_get_memory(ctx), slot.id, p_off + head_p, p_off + head_c);
+                                            llama_memory_seq_add(llama_get_memory(ctx), slot.id, p_off + head_c, p_off + head_c + n_match, kv_shift);
 
                                             for (size_t i = 0; i < n_match; i++) {
                                                 slot.cache_tokens.set_token(head_p + i, slot.cache_tokens[head_c + i]);
                                                 slot.n_past++;
                                             }
 
+                                            slot.kv_shifted = true;
+
                                             head_c += n_match;
                                             head_p += n_match;
                                         } else {
@@ -3260,13 +5236,25 @@ struct server_context {
                                 }
 
                                 const auto n_swa = llama_model_n_swa(model);
-                                if (pos_min > std::max(0, slot.n_past - n_swa)) {
+                                if (pos_min - slot.n_pos_offset > std::max(0, slot.n_past - n_swa)) {
                                     SLT_WRN(slot, "n_past = %d, cache_tokens.size() = %d, seq_id = %d, pos_min = %d, n_swa = %d\n", slot.n_past, (int) slot.cache_tokens.size(), slot.id, pos_min, n_swa);
                                     SLT_WRN(slot, "forcing full prompt re-processing due to lack of cache data (likely due to SWA, see %s)\n",
                                             "https://github.com/ggml-org/llama.cpp/pull/13194#issuecomment-2868343055");
                                     slot.n_past = 0;
                                 }
                             }
+
+                            if (kv_store.enabled() && slot.params.cache_prompt) {
+                                if (slot.n_past == 0) {
+                                    slot.n_pos_fixed  = 0;
+                                    slot.n_pos_offset = 0;
+                                    slot.kv_shifted   = false;
+                                }
+
+                                if (slot.n_pos_offset == 0) {
+                                    kv_store_load(slot, prompt_tokens);
+                                }
+                            }
                         }
 
                         if (slot.n_past == slot.n_prompt_tokens && slot.n_past > 0) {
@@ -3275,6 +5263,14 @@ struct server_context {
                             slot.n_past--;
                         }
 
+                        // the attention sinks are followed by a gap in the positions, the tokens after them cannot be
+                        // evaluated at the position n_pos_offset + n_past
+                        if (slot.n_past < slot.n_pos_fixed) {
+                            SLT_WRN(slot, "the prompt diverges within the attention sinks, n_past = %d, n_sink = %d - forcing full prompt re-processing\n", slot.n_past, slot.n_pos_fixed);
+
+                            slot.n_past = 0;
+                        }
+
                         slot.n_prompt_tokens_processed = 0;
                     }
 
@@ -3285,13 +5281,24 @@ struct server_context {
                         }
                     }
 
+                    if (slot.n_past == 0) {
+                        slot.n_pos_fixed  = 0;
+                        slot.n_pos_offset = 0;
+                        slot.kv_shifted   = false;
+                        slot.kv_evicted   = false;
+                    }
+
                     // keep only the common part
-                    if (!llama_memory_seq_rm(llama_get_memory(ctx), slot.id, slot.n_past, -1)) {
+                    if (!llama_memory_seq_rm(llama_get_memory(ctx), slot.id, slot.n_pos_offset + slot.n_past, -1)) {
                         // could not partially delete (likely using a non-Transformer model)
                         llama_memory_seq_rm(llama_get_memory(ctx), slot.id, -1, -1);
 
                         // there is no common part left
-                        slot.n_past = 0;
+                        slot.n_past       = 0;
+                        slot.n_pos_fixed  = 0;
+                        slot.n_pos_offset = 0;
+                        slot.kv_shifted   = false;
+                        slot.kv_evicted   = false;
                     }
 
                     SLT_INF(slot, "kv cache rm [%d, end)\n", slot.n_past);
@@ -3303,7 +5310,7 @@ struct server_context {
                     if (slot.n_past < slot.n_prompt_tokens && slot.prompt_tokens[slot.n_past] == LLAMA_TOKEN_NULL) {
                         // process the image
                         int32_t new_n_past;
-                        int32_t res = slot.prompt_tokens.process_chunk(ctx, mctx, slot.n_past, slot.id, new_n_past);
+                        int32_t res = slot.prompt_tokens.process_chunk(ctx, mctx, slot.n_past, slot.id, new_n_past, &mtmd_cache);
                         int32_t n_pos = new_n_past - slot.n_past;
 
                         if (res != 0) {
@@ -3334,7 +5341,7 @@ struct server_context {
                         // embedding requires all tokens in the batch to be output
                         const bool need_embd = server_task_type_need_embd(slot.task_type);
 
-                        common_batch_add(batch, cur_tok, slot.n_past, { slot.id }, need_embd);
+                        common_batch_add(batch, cur_tok, slot.n_pos_offset + slot.n_past, { slot.id }, need_embd);
                         slot.cache_tokens.push_back(cur_tok);
 
                         slot.n_prompt_tokens_processed++;
@@ -3385,6 +5392,15 @@ struct server_context {
 
         SRV_DBG("decoding batch, n_tokens = %d\n", batch.n_tokens);
 
+        // a slot evicts some of its cells when its tokens exceed the budget
+        if (params_base.kv_budget > 0) {
+            for (auto & slot : slots) {
+                if (slot.n_past > params_base.kv_budget) {
+                    slot.kv_evicted = true;
+                }
+            }
+        }
+
         if (slot_batched) {
             // apply lora, only need to do it once per batch
             common_set_adapter_lora(ctx, slot_batched->lora);
@@ -3411,6 +5427,22 @@ struct server_context {
             const int ret = llama_decode(ctx, batch_view);
 
             metrics.on_decoded(slots);
+            {
+                // label the call by the task types of its tokens, the sequence of a token is the id of its slot
+                const server_task_type task_type = slots[batch_view.seq_id[0][0]].task_type;
+
+                bool mixed = false;
+                for (int32_t k = 1; k < n_tokens && !mixed; ++k) {
+                    mixed = slots[batch_view.seq_id[k][0]].task_type != task_type;
+                }
+
+                const double occupancy = (double) n_tokens / llama_n_batch(ctx);
+                if (mixed) {
+                    metrics.record_mixed(SERVER_HISTOGRAM_BATCH_OCCUPANCY, occupancy);
+                } else {
+                    metrics.record(SERVER_HISTOGRAM_BATCH_OCCUPANCY, task_type, OAICOMPAT_TYPE_NONE, occupancy);
+                }
+            }
 
             if (ret != 0) {
                 {
@@ -3452,6 +5484,8 @@ struct server_context {
             // move the head of the batch forward with the number of tokens we just processed
             i_next = i + n_tokens;
 
+            update_kv_throughput(n_tokens);
+
             // on successful decode, restore the original batch size
             n_batch = llama_n_batch(ctx);
 
@@ -3461,6 +5495,10 @@ struct server_context {
                 }
 
                 if (slot.state == SLOT_STATE_DONE_PROMPT) {
+                    if (slot.task_type == SERVER_TASK_TYPE_EMBEDDING || slot.task_type == SERVER_TASK_TYPE_RERANK) {
+                        metrics.record(SERVER_HISTOGRAM_PREFILL, slot.task_type, slot.params.oaicompat, (ggml_time_us() - slot.t_start_process_prompt) / 1e6);
+                    }
+
                     if (slot.task_type == SERVER_TASK_TYPE_EMBEDDING) {
                         // prompt evaluated for embedding
                         send_embedding(slot, batch_view);
@@ -3478,12 +5516,18 @@ struct server_context {
 
                     // prompt evaluated for next-token prediction
                     slot.state = SLOT_STATE_GENERATING;
+
+                    if (kv_store.enabled() && slot.params.cache_prompt) {
+                        kv_store_save(slot);
+                    }
                 } else if (slot.state != SLOT_STATE_GENERATING) {
                     continue; // continue loop of slots
                 }
 
                 const int tok_idx = slot.i_batch - i;
 
+                const int64_t t_sample_start = ggml_time_us();
+
                 llama_token id = common_sampler_sample(slot.smpl, ctx, tok_idx);
 
                 slot.i_batch = -1;
@@ -3494,12 +5538,20 @@ struct server_context {
 
                 const int64_t t_current = ggml_time_us();
 
+                metrics.record(SERVER_HISTOGRAM_SAMPLING, slot.task_type, slot.params.oaicompat, (t_current - t_sample_start) / 1e6);
+
                 if (slot.n_decoded == 1) {
                     slot.t_start_generation = t_current;
                     slot.t_prompt_processing = (slot.t_start_generation - slot.t_start_process_prompt) / 1e3;
                     metrics.on_prompt_eval(slot);
+                    metrics.record(SERVER_HISTOGRAM_PREFILL, slot.task_type, slot.params.oaicompat, slot.t_prompt_processing / 1e3);
+                    metrics.record(SERVER_HISTOGRAM_TTFT,    slot.task_type, slot.params.oaicompat, (t_current - slot.t_arrival) / 1e6);
+                } else {
+                    metrics.record(SERVER_HISTOGRAM_ITL,     slot.task_type, slot.params.oaicompat, (t_current - slot.t_last_token) / 1e6);
                 }
 
+                slot.t_last_token = t_current;
+
                 slot.t_token_generation = (t_current - slot.t_start_generation) / 1e3;
 
                 completion_token_output result;
@@ -3521,121 +5573,596 @@ struct server_context {
                 }
             }
 
-            // do speculative decoding
-            for (auto & slot : slots) {
-                if (!slot.is_processing() || !slot.can_speculate()) {
-                    continue;
-                }
+            // do speculative decoding
+            for (auto & slot : slots) {
+                if (!slot.is_processing() || !slot.can_speculate()) {
+                    continue;
+                }
+
+                if (slot.state != SLOT_STATE_GENERATING) {
+                    continue;
+                }
+
+                if (mctx) {
+                    // we should never reach this, as speculative is automatically disabled if mmproj is loaded
+                    GGML_ABORT("not supported by multimodal");
+                }
+
+                // determine the max draft that fits the current slot state
+                int n_draft_max = slot.params.speculative.n_max;
+
+                // note: n_past is not yet increased for the `id` token sampled above
+                //       also, need to leave space for 1 extra token to allow context shifts
+                n_draft_max = std::min(n_draft_max, slot.n_ctx - slot.n_past - 2);
+
+                if (slot.n_remaining > 0) {
+                    n_draft_max = std::min(n_draft_max, slot.n_remaining - 1);
+                }
+
+                SLT_DBG(slot, "max possible draft: %d\n", n_draft_max);
+
+                if (n_draft_max < slot.params.speculative.n_min) {
+                    SLT_DBG(slot, "the max possible draft is too small: %d < %d - skipping speculative decoding\n", n_draft_max, slot.params.speculative.n_min);
+
+                    continue;
+                }
+
+                llama_token id = slot.sampled;
+
+                llama_tokens draft;
+
+                if (slot.spec_ngram) {
+                    draft = gen_draft_ngram(slot, id, n_draft_max);
+                } else {
+                    struct common_speculative_params params_spec;
+                    params_spec.n_draft   = n_draft_max;
+                    params_spec.n_reuse   = llama_n_ctx(slot.ctx_dft) - slot.params.speculative.n_max;
+                    params_spec.p_min     = slot.params.speculative.p_min;
+
+                    const llama_tokens & cached_text_tokens = slot.cache_tokens.get_text_tokens();
+                    draft = common_speculative_gen_draft(slot.spec, params_spec, cached_text_tokens, id);
+                }
+
+                if (draft.empty()) {
+                    continue;
+                }
+
+                // ignore small drafts
+                if (slot.params.speculative.n_min > (int) draft.size()) {
+                    SLT_DBG(slot, "ignoring small draft: %d < %d\n", (int) draft.size(), slot.params.speculative.n_min);
+
+                    continue;
+                }
+
+                // keep track of total number of drafted tokens tested
+                slot.n_draft_total += draft.size();
+
+                // construct the speculation batch
+                common_batch_clear(slot.batch_spec);
+                common_batch_add  (slot.batch_spec, id, slot.n_pos_offset + slot.n_past, { slot.id }, true);
+
+                for (size_t i = 0; i < draft.size(); ++i) {
+                    common_batch_add(slot.batch_spec, draft[i], slot.n_pos_offset + slot.n_past + 1 + i, { slot.id }, true);
+                }
+
+                SLT_DBG(slot, "decoding speculative batch, size = %d\n", slot.batch_spec.n_tokens);
+
+                llama_decode(ctx, slot.batch_spec);
+
+                const int64_t t_sample_start = ggml_time_us();
+
+                // the accepted tokens from the speculation
+                const auto ids = common_sampler_sample_and_accept_n(slot.smpl, ctx, draft);
+
+                {
+                    const int64_t t_current = ggml_time_us();
+
+                    metrics.record(SERVER_HISTOGRAM_SAMPLING, slot.task_type, slot.params.oaicompat, (t_current - t_sample_start) / 1e6);
+
+                    // the accepted tokens arrive together - spread the elapsed time evenly over them
+                    const double t_itl = (t_current - slot.t_last_token) / 1e6 / ids.size();
+                    for (size_t i = 0; i < ids.size(); ++i) {
+                        metrics.record(SERVER_HISTOGRAM_ITL, slot.task_type, slot.params.oaicompat, t_itl);
+                    }
+
+                    slot.t_last_token = t_current;
+                }
+
+                slot.n_past    += ids.size();
+                slot.n_decoded += ids.size();
+
+                // update how many tokens out of those tested were accepted
+                slot.n_draft_accepted += ids.size() - 1;
+
+                slot.cache_tokens.push_back(id);
+                slot.cache_tokens.insert({ids.begin(), ids.end() - 1});
+
+                llama_memory_seq_rm(llama_get_memory(ctx), slot.id, slot.n_pos_offset + slot.n_past, -1);
+
+                for (size_t i = 0; i < ids.size(); ++i) {
+                    completion_token_output result;
+
+                    result.tok          = ids[i];
+                    result.text_to_send = common_token_to_piece(ctx, result.tok, accept_special_token(slot, result.tok));
+                    result.prob         = 1.0f; // set later
+
+                    // TODO: set result.probs
+
+                    if (!process_token(result, slot)) {
+                        // release slot because of stop condition
+                        slot.release();
+                        slot.print_timings();
+                        send_final_response(slot);
+                        metrics.on_prediction(slot);
+                        break;
+                    }
+                }
+
+                SLT_DBG(slot, "accepted %d/%d draft tokens, new n_past = %d\n", (int) ids.size() - 1, (int) draft.size(), slot.n_past);
+            }
+        }
+
+        SRV_DBG("%s", "run slots completed\n");
+    }
+
+    json model_meta() const {
+        return json {
+            {"vocab_type",  llama_vocab_type       (vocab)},
+            {"n_vocab",     llama_vocab_n_tokens   (vocab)},
+            {"n_ctx_train", llama_model_n_ctx_train(model)},
+            {"n_embd",      llama_model_n_embd     (model)},
+            {"n_params",    llama_model_n_params   (model)},
+            {"size",        llama_model_size       (model)},
+        };
+    }
+};
+
+using server_context_ptr = std::shared_ptr<server_context>;
+
+// additional models served by the same process, selected with the "model" field of the requests (--models-dir)
+// each model runs its own server_context and main loop thread, so a request only waits for its own model
+// the models are loaded on first use (mmap-ed, so reloading a recently unloaded model is mostly a page cache hit)
+// and the least recently used idle models are unloaded when the memory budget is exceeded
+struct server_models {
+    enum entry_state {
+        ENTRY_UNLOADED,
+        ENTRY_LOADING,
+        ENTRY_LOADED,
+        ENTRY_FAILED,
+    };
+
+    struct entry {
+        std::string name;
+        std::string path;
+
+        entry_state state = ENTRY_UNLOADED;
+
+        std::unique_ptr<server_context> ctx;
+        std::thread                     thread; // main loop of the model
+
+        int32_t n_users     = 0; // requests using the model, it cannot be unloaded while > 0
+        int64_t t_last_used = 0;
+        size_t  n_bytes     = 0; // estimated memory usage of the model and its context
+    };
+
+    struct unloaded {
+        std::unique_ptr<server_context> ctx;
+        std::thread                     thread;
+    };
+
+    common_params params; // used to load the models, with the model path replaced
+
+    size_t n_bytes_max = 0; // 0 = unlimited
+
+    std::map<std::string, entry> entries;
+
+    std::mutex              mutex;
+    std::condition_variable cv;
+
+    // all the contexts share a single CPU threadpool, so their computations cannot overlap
+    std::mutex mutex_compute;
+
+    ggml_threadpool * threadpool = nullptr;
+    decltype(ggml_threadpool_free) * threadpool_free_fn = nullptr;
+
+    ~server_models() {
+        stop();
+    }
+
+    bool enabled() const {
+        return !entries.empty();
+    }
+
+    void init(const common_params & params_base, server_context & ctx_default) {
+        if (params_base.models_dir.empty()) {
+            return;
+        }
+
+        params = params_base;
+        params.speculative.model = {};
+        params.mmproj            = {};
+        params.lora_adapters.clear();
+        params.model_alias.clear();
+        params.use_mmap = true;
+
+        n_bytes_max = (size_t) std::max(params_base.models_max_mem, 0)*1024*1024;
+
+        std::error_code ec;
+        for (const auto & file : std::filesystem::directory_iterator(params_base.models_dir, ec)) {
+            const auto & path = file.path();
+            if (!file.is_regular_file() || path.extension() != ".gguf" || string_starts_with(path.filename().string(), "mmproj")) {
+                continue;
+            }
+
+            entry e;
+            e.name = path.stem().string();
+            e.path = path.string();
+            entries[e.name] = std::move(e);
+        }
+
+        if (ec) {
+            SRV_ERR("failed to list the models in '%s': %s\n", params_base.models_dir.c_str(), ec.message().c_str());
+        }
+
+        SRV_INF("found %zu models in '%s', memory budget = %d MiB\n", entries.size(), params_base.models_dir.c_str(), params_base.models_max_mem);
+
+        if (!enabled()) {
+            return;
+        }
+
+        auto * cpu_dev = ggml_backend_dev_by_type(GGML_BACKEND_DEVICE_TYPE_CPU);
+        if (cpu_dev) {
+            auto * reg = ggml_backend_dev_backend_reg(cpu_dev);
+            auto * threadpool_new_fn = (decltype(ggml_threadpool_new) *) ggml_backend_reg_get_proc_address(reg, "ggml_threadpool_new");
+            threadpool_free_fn       = (decltype(ggml_threadpool_free) *) ggml_backend_reg_get_proc_address(reg, "ggml_threadpool_free");
+
+            if (threadpool_new_fn && threadpool_free_fn) {
+                ggml_threadpool_params tpp = ggml_threadpool_params_from_cpu_params(params.cpuparams);
+                threadpool = threadpool_new_fn(&tpp);
+            }
+        }
+
+        if (threadpool) {
+            llama_attach_threadpool(ctx_default.ctx, threadpool, nullptr);
+        }
+    }
+
+    void stop() {
+        std::vector<unloaded> res;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            for (auto & it : entries) {
+                if (it.second.state == ENTRY_LOADED) {
+                    res.push_back(take(it.second));
+                }
+            }
+        }
+        destroy(res);
+
+        if (threadpool) {
+            threadpool_free_fn(threadpool);
+            threadpool = nullptr;
+        }
+    }
+
+    // returns the context of the model, loading it if needed, or nullptr if the model failed to load
+    // the model cannot be unloaded until the returned pointer is released
+    // note: blocks until the model is loaded, only the requests for the same model wait for it
+    server_context_ptr acquire(const std::string & name) {
+        std::unique_lock<std::mutex> lock(mutex);
+
+        auto it = entries.find(name);
+        GGML_ASSERT(it != entries.end());
+
+        entry & e = it->second;
+        e.n_users++;
+
+        bool waited = false;
+        while (e.state == ENTRY_LOADING) {
+            cv.wait(lock);
+            waited = true;
+        }
+
+        if (e.state == ENTRY_FAILED && waited) {
+            e.n_users--;
+            return nullptr;
+        }
+
+        std::vector<unloaded> res;
+
+        if (e.state != ENTRY_LOADED) {
+            e.state = ENTRY_LOADING;
+            lock.unlock();
+
+            std::unique_ptr<server_context> ctx = load(e);
+
+            lock.lock();
+            if (!ctx) {
+                e.state = ENTRY_FAILED;
+                e.n_users--;
+                cv.notify_all();
+                return nullptr;
+            }
+
+            e.n_bytes = estimate_size(*ctx);
+            e.ctx     = std::move(ctx);
+            e.thread  = std::thread([c = e.ctx.get()]() { c->queue_tasks.start_loop(); });
+            e.state   = ENTRY_LOADED;
+            cv.notify_all();
+
+            res = evict();
+        }
+
+        e.t_last_used = ggml_time_us();
+
+        server_context_ptr ptr(e.ctx.get(), [this, &e](server_context *) { release(e); });
+
+        lock.unlock();
+        destroy(res);
+
+        return ptr;
+    }
+
+    void release(entry & e) {
+        std::vector<unloaded> res;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            e.n_users--;
+            e.t_last_used = ggml_time_us();
+            res = evict();
+        }
+        destroy(res);
+    }
+
+    std::unique_ptr<server_context> load(const entry & e) {
+        SRV_INF("loading model '%s' from '%s'\n", e.name.c_str(), e.path.c_str());
+
+        common_params params_model = params;
+        params_model.model.path  = e.path;
+        params_model.model_alias = e.name;
+
+        auto ctx = std::make_unique<server_context>();
+        if (!ctx->load_model(params_model)) {
+            SRV_ERR("failed to load model '%s'\n", e.name.c_str());
+            return nullptr;
+        }
+
+        if (threadpool) {
+            llama_attach_threadpool(ctx->ctx, threadpool, nullptr);
+        }
+
+        ctx->init();
+
+        server_context * c = ctx.get();
+        c->queue_tasks.on_new_task([c](server_task && task) {
+            c->process_single_task(std::move(task));
+        });
+        c->queue_tasks.on_update_slots([this, c]() {
+            std::lock_guard<std::mutex> lock(mutex_compute);
+            c->update_slots();
+        });
+
+        return ctx;
+    }
+
+    // least recently used models that are not in use, until the loaded models fit in the memory budget
+    // note: must be called with the mutex locked, the returned models must be destroyed after unlocking it
+    std::vector<unloaded> evict() {
+        std::vector<unloaded> res;
+        if (n_bytes_max == 0) {
+            return res;
+        }
+
+        while (true) {
+            size_t n_bytes = 0;
+            entry * lru = nullptr;
+            for (auto & it : entries) {
+                entry & e = it.second;
+                if (e.state != ENTRY_LOADED) {
+                    continue;
+                }
+                n_bytes += e.n_bytes;
+                if (e.n_users == 0 && (!lru || e.t_last_used < lru->t_last_used)) {
+                    lru = &e;
+                }
+            }
+
+            if (n_bytes <= n_bytes_max || !lru) {
+                break;
+            }
+
+            SRV_INF("unloading model '%s', loaded = %.1f MiB, budget = %.1f MiB\n", lru->name.c_str(), n_bytes/1024.0/1024.0, n_bytes_max/1024.0/1024.0);
+            res.push_back(take(*lru));
+        }
 
-                if (slot.state != SLOT_STATE_GENERATING) {
-                    continue;
-                }
+        return res;
+    }
 
-                if (mctx) {
-                    // we should never reach this, as speculative is automatically disabled if mmproj is loaded
-                    GGML_ABORT("not supported by multimodal");
-                }
+    static unloaded take(entry & e) {
+        e.state = ENTRY_UNLOADED;
+        return { std::move(e.ctx), std::move(e.thread) };
+    }
 
-                // determine the max draft that fits the current slot state
-                int n_draft_max = slot.params.speculative.n_max;
+    static void destroy(std::vector<unloaded> & res) {
+        for (auto & u : res) {
+            u.ctx->queue_tasks.terminate();
+            u.thread.join();
+            u.ctx.reset();
+        }
+        res.clear();
+    }
 
-                // note: n_past is not yet increased for the `id` token sampled above
-                //       also, need to leave space for 1 extra token to allow context shifts
-                n_draft_max = std::min(n_draft_max, slot.n_ctx - slot.n_past - 2);
+    // model weights + KV cache, with the K/V types of each layer (the last matching --cache-type-layers entry wins)
+    static size_t estimate_size(const server_context & ctx) {
+        const llama_model * model = ctx.model;
 
-                if (slot.n_remaining > 0) {
-                    n_draft_max = std::min(n_draft_max, slot.n_remaining - 1);
-                }
+        const int32_t n_layer   = llama_model_n_layer(model);
+        const int64_t n_embd_kv = llama_model_n_embd(model) / llama_model_n_head(model) * llama_model_n_head_kv(model);
+        const int64_t n_elem_kv = n_embd_kv * llama_n_ctx(ctx.ctx);
 
-                SLT_DBG(slot, "max possible draft: %d\n", n_draft_max);
+        const auto type_bytes = [](ggml_type type, int64_t n) {
+            return (double) ggml_type_size(type) * n / ggml_blck_size(type);
+        };
 
-                if (n_draft_max < slot.params.speculative.n_min) {
-                    SLT_DBG(slot, "the max possible draft is too small: %d < %d - skipping speculative decoding\n", n_draft_max, slot.params.speculative.n_min);
+        double res = llama_model_size(model);
+        for (int32_t il = 0; il < n_layer; ++il) {
+            ggml_type type_k = ctx.params_base.cache_type_k;
+            ggml_type type_v = ctx.params_base.cache_type_v;
 
+            for (const auto & o : ctx.params_base.kv_type_overrides) {
+                const int32_t il_first = o.il_first < 0 ? n_layer + o.il_first : o.il_first;
+                const int32_t il_last  = o.il_last  < 0 ? n_layer + o.il_last  : o.il_last;
+                if (il < il_first || il > il_last) {
                     continue;
                 }
+                type_k = o.type_k != GGML_TYPE_COUNT ? o.type_k : type_k;
+                type_v = o.type_v != GGML_TYPE_COUNT ? o.type_v : type_v;
+            }
 
-                llama_token id = slot.sampled;
-
-                struct common_speculative_params params_spec;
-                params_spec.n_draft   = n_draft_max;
-                params_spec.n_reuse   = llama_n_ctx(slot.ctx_dft) - slot.params.speculative.n_max;
-                params_spec.p_min     = slot.params.speculative.p_min;
+            res += type_bytes(type_k, n_elem_kv) + type_bytes(type_v, n_elem_kv);
+        }
 
-                const llama_tokens & cached_text_tokens = slot.cache_tokens.get_text_tokens();
-                llama_tokens draft = common_speculative_gen_draft(slot.spec, params_spec, cached_text_tokens, id);
+        return res;
+    }
 
-                // ignore small drafts
-                if (slot.params.speculative.n_min > (int) draft.size()) {
-                    SLT_DBG(slot, "ignoring small draft: %d < %d\n", (int) draft.size(), slot.params.speculative.n_min);
+    json to_json() {
+        static const char * state_names[] = { "unloaded", "loading", "loaded", "failed" };
+
+        std::unique_lock<std::mutex> lock(mutex);
+
+        json res = json::array();
+        for (const auto & it : entries) {
+            const entry & e = it.second;
+            res.push_back({
+                {"id",       e.name},
+                {"object",   "model"},
+                {"created",  std::time(0)},
+                {"owned_by", "llamacpp"},
+                {"meta",     e.state == ENTRY_LOADED ? e.ctx->model_meta() : json(nullptr)},
+                {"status", {
+                    {"value",   state_names[e.state]},
+                    {"n_users", e.n_users},
+                    {"n_bytes", e.state == ENTRY_LOADED ? e.n_bytes : 0},
+                }},
+            });
+        }
+        return res;
+    }
+};
 
-                    continue;
-                }
+// bounded pool of worker threads for the CPU-heavy request preprocessing (chat template rendering, JSON schema
+// conversion, tokenization), so that bursts of large prompts are processed by a fixed number of threads instead
+// of competing with the HTTP threads that stream the responses
+struct server_preprocess_pool {
+    std::vector<std::thread> workers;
 
-                // keep track of total number of drafted tokens tested
-                slot.n_draft_total += draft.size();
+    std::deque<std::function<void()>> jobs;
 
-                // construct the speculation batch
-                common_batch_clear(slot.batch_spec);
-                common_batch_add  (slot.batch_spec, id, slot.n_past, { slot.id }, true);
+    std::mutex mutex;
+    std::condition_variable cv;
 
-                for (size_t i = 0; i < draft.size(); ++i) {
-                    common_batch_add(slot.batch_spec, draft[i], slot.n_past + 1 + i, { slot.id }, true);
-                }
+    bool   running     = false;
+    size_t n_queue_max = 0;
 
-                SLT_DBG(slot, "decoding speculative batch, size = %d\n", slot.batch_spec.n_tokens);
+    std::atomic<int32_t>  n_busy           {0};
+    std::atomic<uint64_t> n_jobs_total     {0};
+    std::atomic<uint64_t> n_rejected_total {0};
+    std::atomic<uint64_t> t_wait_us_total  {0}; // time spent by the jobs in the queue
+    std::atomic<uint64_t> t_run_us_total   {0}; // time spent running the jobs
 
-                llama_decode(ctx, slot.batch_spec);
+    ~server_preprocess_pool() {
+        stop();
+    }
 
-                // the accepted tokens from the speculation
-                const auto ids = common_sampler_sample_and_accept_n(slot.smpl, ctx, draft);
+    void start(int n_threads, int n_queue) {
+        running     = true;
+        n_queue_max = std::max(n_queue, 1);
+        for (int i = 0; i < n_threads; i++) {
+            workers.emplace_back([this]() {
+                while (true) {
+                    std::function<void()> job;
+                    {
+                        std::unique_lock<std::mutex> lock(mutex);
+                        cv.wait(lock, [this]() { return !jobs.empty() || !running; });
+                        if (jobs.empty()) {
+                            return;
+                        }
+                        job = std::move(jobs.front());
+                        jobs.pop_front();
+                    }
+                    job();
+                }
+            });
+        }
+    }
 
-                slot.n_past    += ids.size();
-                slot.n_decoded += ids.size();
+    void stop() {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            running = false;
+        }
+        cv.notify_all();
+        for (auto & t : workers) {
+            t.join();
+        }
+        workers.clear();
+    }
 
-                // update how many tokens out of those tested were accepted
-                slot.n_draft_accepted += ids.size() - 1;
+    size_t n_queued() {
+        std::unique_lock<std::mutex> lock(mutex);
+        return jobs.size();
+    }
 
-                slot.cache_tokens.push_back(id);
-                slot.cache_tokens.insert({ids.begin(), ids.end() - 1});
+    // run fn on a worker thread and wait for it, the exceptions thrown by fn are rethrown to the caller
+    // returns false without running fn if the queue is full
+    // without workers, fn is run on the calling thread
+    bool run(const std::function<void()> & fn) {
+        if (workers.empty()) {
+            fn();
+            return true;
+        }
 
-                llama_memory_seq_rm(llama_get_memory(ctx), slot.id, slot.n_past, -1);
+        const int64_t t_post = ggml_time_us();
 
-                for (size_t i = 0; i < ids.size(); ++i) {
-                    completion_token_output result;
+        // the job owns the task, the caller only keeps its future
+        auto task = std::make_shared<std::packaged_task<void()>>([this, fn, t_post]() {
+            const int64_t t_start = ggml_time_us();
+            n_busy++;
 
-                    result.tok          = ids[i];
-                    result.text_to_send = common_token_to_piece(ctx, result.tok, accept_special_token(slot, result.tok));
-                    result.prob         = 1.0f; // set later
+            // the stats are updated before the caller is woken up
+            auto on_done = [&]() {
+                n_busy--;
+                t_wait_us_total += t_start - t_post;
+                t_run_us_total  += ggml_time_us() - t_start;
+                n_jobs_total++;
+            };
 
-                    // TODO: set result.probs
+            try {
+                fn();
+            } catch (...) {
+                on_done();
+                throw;
+            }
+            on_done();
+        });
 
-                    if (!process_token(result, slot)) {
-                        // release slot because of stop condition
-                        slot.release();
-                        slot.print_timings();
-                        send_final_response(slot);
-                        metrics.on_prediction(slot);
-                        break;
-                    }
-                }
+        std::future<void> res = task->get_future();
 
-                SLT_DBG(slot, "accepted %d/%d draft tokens, new n_past = %d\n", (int) ids.size() - 1, (int) draft.size(), slot.n_past);
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            if (jobs.size() >= n_queue_max || !running) {
+                n_rejected_total++;
+                return false;
             }
+            jobs.emplace_back([task]() {
+                (*task)();
+            });
         }
+        cv.notify_one();
 
-        SRV_DBG("%s", "run slots completed\n");
-    }
+        res.get();
 
-    json model_meta() const {
-        return json {
-            {"vocab_type",  llama_vocab_type       (vocab)},
-            {"n_vocab",     llama_vocab_n_tokens   (vocab)},
-            {"n_ctx_train", llama_model_n_ctx_train(model)},
-            {"n_embd",      llama_model_n_embd     (model)},
-            {"n_params",    llama_model_n_params   (model)},
-            {"size",        llama_model_size       (model)},
-        };
+        return true;
     }
 };
 
@@ -3680,6 +6207,12 @@ int main(int argc, char ** argv) {
     // struct that contains llama context and inference
     server_context ctx_server;
 
+    // additional models from --models-dir, note: destroyed before ctx_server
+    server_models models;
+
+    // workers of the request preprocessing, shared by all the models
+    server_preprocess_pool preprocess;
+
     llama_backend_init();
     llama_numa_init(params.numa);
 
@@ -3723,6 +6256,26 @@ int main(int argc, char ** argv) {
         res.status = 200;
     };
 
+    // the queue of the preprocessing pool is full
+    auto res_preprocess_busy = [&res_error](httplib::Response & res) {
+        res.set_header("Retry-After", "1");
+        res_error(res, format_error_response("Too many requests are being preprocessed, retry later", ERROR_TYPE_OVERLOADED));
+    };
+
+    // post the tasks through the admission control (see server_context::post_admit())
+    // returns false if they are rejected, the response is then a 429 with the time to wait before retrying
+    auto post_admit = [&res_error](server_context & ctx_server, std::vector<server_task> & tasks, const std::unordered_set<int> & task_ids, httplib::Response & res) {
+        const int retry_after = ctx_server.post_admit(tasks);
+        if (retry_after == 0) {
+            return true;
+        }
+
+        ctx_server.queue_results.remove_waiting_task_ids(task_ids);
+        res.set_header("Retry-After", std::to_string(retry_after));
+        res_error(res, format_error_response("The server does not have enough KV cache capacity for the request, retry later", ERROR_TYPE_OVERLOADED));
+        return false;
+    };
+
     svr->set_exception_handler([&res_error](const httplib::Request &, httplib::Response & res, const std::exception_ptr & ep) {
         std::string message;
         try {
@@ -3925,6 +6478,13 @@ int main(int argc, char ** argv) {
         GGML_ASSERT(res_metrics != nullptr);
 
         // metrics definition: https://prometheus.io/docs/practices/naming/#metric-names
+        const auto grammar_cache = json_schema_to_grammar_get_cache_stats();
+
+        double kv_frag_max = 0.0;
+        for (const auto & st : res_metrics->kv_streams) {
+            kv_frag_max = std::max(kv_frag_max, (double) st.frag);
+        }
+
         json all_metrics_def = json {
             {"counter", {{
                     {"name",  "prompt_tokens_total"},
@@ -3950,6 +6510,50 @@ int main(int argc, char ** argv) {
                     {"name",  "n_busy_slots_per_decode"},
                     {"help",  "Average number of busy slots per llama_decode() call"},
                     {"value",  (float) res_metrics->n_busy_slots_total / std::max((float) res_metrics->n_decode_total, 1.f)}
+            }, {
+                    {"name",  "response_cache_hits_total"},
+                    {"help",  "Number of requests served from the response cache."},
+                    {"value",  res_metrics->n_resp_cache_hits}
+            }, {
+                    {"name",  "response_cache_misses_total"},
+                    {"help",  "Number of cacheable requests not found in the response cache."},
+                    {"value",  res_metrics->n_resp_cache_misses}
+            }, {
+                    {"name",  "mmproj_cache_hits_total"},
+                    {"help",  "Number of image/audio inputs whose embeddings were found in the multimodal embedding cache."},
+                    {"value",  res_metrics->n_mtmd_cache_hits}
+            }, {
+                    {"name",  "mmproj_cache_misses_total"},
+                    {"help",  "Number of image/audio inputs encoded by the multimodal projector."},
+                    {"value",  res_metrics->n_mtmd_cache_misses}
+            }, {
+                    {"name",  "requests_rejected_total"},
+                    {"help",  "Number of requests rejected by the admission control (--kv-queue-max)."},
+                    {"value",  res_metrics->n_rejected_total}
+            }, {
+                    {"name",  "preprocess_requests_total"},
+                    {"help",  "Number of requests parsed and tokenized by the preprocessing threads."},
+                    {"value",  preprocess.n_jobs_total.load()}
+            }, {
+                    {"name",  "preprocess_rejected_total"},
+                    {"help",  "Number of requests rejected because the preprocessing queue was full (--preprocess-queue)."},
+                    {"value",  preprocess.n_rejected_total.load()}
+            }, {
+                    {"name",  "preprocess_wait_seconds_total"},
+                    {"help",  "Total time spent by the requests waiting for a preprocessing thread."},
+                    {"value",  preprocess.t_wait_us_total.load() / 1.e6}
+            }, {
+                    {"name",  "preprocess_seconds_total"},
+                    {"help",  "Total time spent parsing and tokenizing the requests."},
+                    {"value",  preprocess.t_run_us_total.load() / 1.e6}
+            }, {
+                    {"name",  "grammar_cache_hits_total"},
+                    {"help",  "Number of JSON schemas whose grammar was found in the grammar cache."},
+                    {"value",  grammar_cache.n_hits}
+            }, {
+                    {"name",  "grammar_cache_misses_total"},
+                    {"help",  "Number of JSON schemas converted to a grammar."},
+                    {"value",  grammar_cache.n_misses}
             }}},
             {"gauge", {{
                     {"name",  "prompt_tokens_seconds"},
@@ -3967,6 +6571,62 @@ int main(int argc, char ** argv) {
                     {"name",  "requests_deferred"},
                     {"help",  "Number of requests deferred."},
                     {"value",  (uint64_t) res_metrics->n_tasks_deferred}
+            },{
+                    {"name",  "response_cache_hit_ratio"},
+                    {"help",  "Ratio of cacheable requests served from the response cache."},
+                    {"value",  (double) res_metrics->n_resp_cache_hits / std::max((double) (res_metrics->n_resp_cache_hits + res_metrics->n_resp_cache_misses), 1.)}
+            },{
+                    {"name",  "response_cache_entries"},
+                    {"help",  "Number of entries in the response cache."},
+                    {"value",  res_metrics->n_resp_cache_entries}
+            },{
+                    {"name",  "response_cache_bytes"},
+                    {"help",  "Approximate memory used by the response cache."},
+                    {"value",  res_metrics->n_resp_cache_bytes}
+            },{
+                    {"name",  "mmproj_cache_hit_ratio"},
+                    {"help",  "Ratio of image/audio inputs whose embeddings were found in the multimodal embedding cache."},
+                    {"value",  (double) res_metrics->n_mtmd_cache_hits / std::max((double) (res_metrics->n_mtmd_cache_hits + res_metrics->n_mtmd_cache_misses), 1.)}
+            },{
+                    {"name",  "mmproj_cache_entries"},
+                    {"help",  "Number of entries in the multimodal embedding cache."},
+                    {"value",  res_metrics->n_mtmd_cache_entries}
+            },{
+                    {"name",  "mmproj_cache_bytes"},
+                    {"help",  "Approximate memory used by the multimodal embedding cache."},
+                    {"value",  res_metrics->n_mtmd_cache_bytes}
+            },{
+                    {"name",  "kv_capacity_tokens"},
+                    {"help",  "Total number of KV cache cells."},
+                    {"value",  res_metrics->n_kv_capacity}
+            },{
+                    {"name",  "kv_reserved_tokens"},
+                    {"help",  "Estimated KV demand (prompt + n_predict) of the requests processing."},
+                    {"value",  res_metrics->n_kv_reserved}
+            },{
+                    {"name",  "kv_queued_tokens"},
+                    {"help",  "Estimated KV demand (prompt + n_predict) of the queued requests."},
+                    {"value",  res_metrics->n_kv_queued}
+            },{
+                    {"name",  "kv_tokens_seconds"},
+                    {"help",  "Recent llama_decode() throughput in tokens/s, used to compute the Retry-After delay."},
+                    {"value",  res_metrics->kv_tokens_per_s}
+            },{
+                    {"name",  "preprocess_queue_depth"},
+                    {"help",  "Number of requests waiting for a preprocessing thread."},
+                    {"value",  (uint64_t) preprocess.n_queued()}
+            },{
+                    {"name",  "preprocess_busy_threads"},
+                    {"help",  "Number of preprocessing threads busy."},
+                    {"value",  preprocess.n_busy.load()}
+            },{
+                    {"name",  "grammar_cache_entries"},
+                    {"help",  "Number of entries in the grammar cache."},
+                    {"value",  (uint64_t) grammar_cache.n_entries}
+            },{
+                    {"name",  "kv_fragmentation_max"},
+                    {"help",  "Largest fragmentation of the streams of KV cells (see kv_stream_fragmentation)."},
+                    {"value",  kv_frag_max}
             }}}
         };
 
@@ -3987,6 +6647,11 @@ int main(int argc, char ** argv) {
             }
         }
 
+        prometheus << res_metrics->kv_streams_to_prometheus();
+
+        // the histograms are updated with atomics, so they can be read directly from the HTTP thread
+        prometheus << ctx_server.metrics.histograms_to_prometheus();
+
         res.set_header("Process-Start-Time-Unix", std::to_string(res_metrics->t_start));
 
         res.set_content(prometheus.str(), "text/plain; version=0.0.4");
@@ -4002,13 +6667,23 @@ int main(int argc, char ** argv) {
         }
         std::string filepath = params.slot_save_path + filename;
 
+        const bool compress = json_value(request_data, "compress", false);
+#ifndef LLAMA_SERVER_ZLIB
+        if (compress) {
+            res_error(res, format_error_response("This server does not support compression. Build it with LLAMA_SERVER_ZLIB.", ERROR_TYPE_NOT_SUPPORTED));
+            return;
+        }
+#endif
+
         int task_id = ctx_server.queue_tasks.get_new_id();
         {
             server_task task(SERVER_TASK_TYPE_SLOT_SAVE);
             task.id = task_id;
-            task.slot_action.slot_id  = id_slot;
-            task.slot_action.filename = filename;
-            task.slot_action.filepath = filepath;
+            task.slot_action.slot_id     = id_slot;
+            task.slot_action.filename    = filename;
+            task.slot_action.filepath    = filepath;
+            task.slot_action.incremental = json_value(request_data, "incremental", true);
+            task.slot_action.compress    = compress;
 
             ctx_server.queue_results.add_waiting_task_id(task_id);
             ctx_server.queue_tasks.post(std::move(task));
@@ -4177,104 +6852,143 @@ int main(int argc, char ** argv) {
 
     // handle completion-like requests (completion, chat, infill)
     // we can optionally provide a custom format for partial results and final results
-    const auto handle_completions_impl = [&ctx_server, &res_error, &res_ok](
+    // the context of the model selected by the "model" field of the request, see server_models
+    // the default model is used when the field is missing or does not name one of the --models-dir models
+    const auto get_model_ctx = [&ctx_server, &models, &res_error](const json & body, httplib::Response & res) -> server_context_ptr {
+        const std::string name = body.is_object() ? json_value(body, "model", std::string()) : std::string();
+        if (!models.enabled() || models.entries.count(name) == 0) {
+            return server_context_ptr(&ctx_server, [](server_context *) {});
+        }
+
+        server_context_ptr ctx = models.acquire(name);
+        if (!ctx) {
+            res_error(res, format_error_response(string_format("Failed to load model '%s'", name.c_str()), ERROR_TYPE_UNAVAILABLE));
+        }
+        return ctx;
+    };
+
+    // prepare, if set, is run on the preprocessing pool before the tokenization, to fill data and files
+    const auto handle_completions_impl = [&res_error, &res_ok, &res_preprocess_busy, &post_admit, &preprocess](
+            const server_context_ptr & ctx_ptr,
             server_task_type type,
             json & data,
-            const std::vector<raw_buffer> & files,
+            std::vector<raw_buffer> & files,
             const std::function<bool()> & is_connection_closed,
             httplib::Response & res,
-            oaicompat_type oaicompat) -> void {
+            oaicompat_type oaicompat,
+            const std::function<void()> & prepare = nullptr) -> void {
         GGML_ASSERT(type == SERVER_TASK_TYPE_COMPLETION || type == SERVER_TASK_TYPE_INFILL);
 
+        server_context & ctx_server = *ctx_ptr;
+
+        const int64_t t_arrival = ggml_time_us();
+
         auto completion_id = gen_chatcmplid();
         std::unordered_set<int> task_ids;
         try {
             std::vector<server_task> tasks;
 
-            const auto & prompt = data.at("prompt");
-            // TODO: this log can become very long, put it behind a flag or think about a more compact format
-            //SRV_DBG("Prompt: %s\n", prompt.is_string() ? prompt.get<std::string>().c_str() : prompt.dump(2).c_str());
-
-            // process files
-            mtmd::bitmaps bitmaps;
-            const bool has_mtmd = ctx_server.mctx != nullptr;
-            {
-                if (!has_mtmd && !files.empty()) {
-                    throw std::runtime_error("This server does not support multimodal");
+            // the parsing and the tokenization run on the preprocessing pool
+            const bool accepted = preprocess.run([&]() {
+                if (prepare) {
+                    prepare();
                 }
-                for (auto & file : files) {
-                    mtmd::bitmap bmp(mtmd_helper_bitmap_init_from_buf(ctx_server.mctx, file.data(), file.size()));
-                    if (!bmp.ptr) {
-                        throw std::runtime_error("Failed to load image or audio file");
+
+                const auto & prompt = data.at("prompt");
+                // TODO: this log can become very long, put it behind a flag or think about a more compact format
+                //SRV_DBG("Prompt: %s\n", prompt.is_string() ? prompt.get<std::string>().c_str() : prompt.dump(2).c_str());
+
+                // process files
+                mtmd::bitmaps bitmaps;
+                const bool has_mtmd = ctx_server.mctx != nullptr;
+                {
+                    if (!has_mtmd && !files.empty()) {
+                        throw std::runtime_error("This server does not support multimodal");
+                    }
+                    for (auto & file : files) {
+                        mtmd::bitmap bmp(mtmd_helper_bitmap_init_from_buf(ctx_server.mctx, file.data(), file.size()));
+                        if (!bmp.ptr) {
+                            throw std::runtime_error("Failed to load image or audio file");
+                        }
+                        // calculate bitmap hash (for KV and embedding caching), the dimensions are part of the content
+                        std::string hash = content_hash(bmp.data(), bmp.n_bytes(), ((uint64_t) bmp.nx() << 32) | bmp.ny());
+                        bmp.set_id(hash.c_str());
+                        bitmaps.entries.push_back(std::move(bmp));
                     }
-                    // calculate bitmap hash (for KV caching)
-                    std::string hash = fnv_hash(bmp.data(), bmp.n_bytes());
-                    bmp.set_id(hash.c_str());
-                    bitmaps.entries.push_back(std::move(bmp));
                 }
-            }
-
-            // process prompt
-            std::vector<server_tokens> inputs;
-            if (oaicompat && !prompt.is_string()) {
-                throw std::runtime_error("prompt must be a string");
-            }
 
-            if (oaicompat && has_mtmd) {
-                // multimodal
-                std::string prompt_str = prompt.get<std::string>();
-                mtmd_input_text inp_txt = {
-                    prompt_str.c_str(),
-                    /* add_special */   true,
-                    /* parse_special */ true,
-                };
-                mtmd::input_chunks chunks(mtmd_input_chunks_init());
-                auto bitmaps_c_ptr = bitmaps.c_ptr();
-                int32_t tokenized = mtmd_tokenize(ctx_server.mctx,
-                                                    chunks.ptr.get(),
-                                                    &inp_txt,
-                                                    bitmaps_c_ptr.data(),
-                                                    bitmaps_c_ptr.size());
-                if (tokenized != 0) {
-                    throw std::runtime_error("Failed to tokenize prompt");
+                // process prompt
+                std::vector<server_tokens> inputs;
+                if (oaicompat && !prompt.is_string()) {
+                    throw std::runtime_error("prompt must be a string");
                 }
 
-                server_tokens tmp(chunks, true);
-                inputs.push_back(std::move(tmp));
-            } else {
-                // non-multimodal version
-                auto tokenized_prompts = tokenize_input_prompts(ctx_server.vocab, prompt, true, true);
-                for (auto & p : tokenized_prompts) {
-                    auto tmp = server_tokens(p, ctx_server.mctx != nullptr);
+                if (oaicompat && has_mtmd) {
+                    // multimodal
+                    std::string prompt_str = prompt.get<std::string>();
+                    mtmd_input_text inp_txt = {
+                        prompt_str.c_str(),
+                        /* add_special */   true,
+                        /* parse_special */ true,
+                    };
+                    mtmd::input_chunks chunks(mtmd_input_chunks_init());
+                    auto bitmaps_c_ptr = bitmaps.c_ptr();
+                    int32_t tokenized = mtmd_tokenize(ctx_server.mctx,
+                                                        chunks.ptr.get(),
+                                                        &inp_txt,
+                                                        bitmaps_c_ptr.data(),
+                                                        bitmaps_c_ptr.size());
+                    if (tokenized != 0) {
+                        throw std::runtime_error("Failed to tokenize prompt");
+                    }
+
+                    server_tokens tmp(chunks, true);
                     inputs.push_back(std::move(tmp));
+                } else {
+                    // non-multimodal version
+                    auto tokenized_prompts = tokenize_input_prompts(ctx_server.vocab, prompt, true, true);
+                    for (auto & p : tokenized_prompts) {
+                        auto tmp = server_tokens(p, ctx_server.mctx != nullptr);
+                        inputs.push_back(std::move(tmp));
+                    }
                 }
-            }
 
-            tasks.reserve(inputs.size());
-            for (size_t i = 0; i < inputs.size(); i++) {
-                server_task task = server_task(type);
+                tasks.reserve(inputs.size());
+                for (size_t i = 0; i < inputs.size(); i++) {
+                    server_task task = server_task(type);
 
-                task.id    = ctx_server.queue_tasks.get_new_id();
-                task.index = i;
+                    task.id    = ctx_server.queue_tasks.get_new_id();
+                    task.index = i;
 
-                task.prompt_tokens    = std::move(inputs[i]);
-                task.params           = server_task::params_from_json_cmpl(
-                        ctx_server.ctx,
-                        ctx_server.params_base,
-                        data);
-                task.id_selected_slot = json_value(data, "id_slot", -1);
+                    task.prompt_tokens    = std::move(inputs[i]);
+                    task.params           = server_task::params_from_json_cmpl(
+                            ctx_server.ctx,
+                            ctx_server.params_base,
+                            data);
+                    task.id_selected_slot = json_value(data, "id_slot", -1);
+                    task.t_arrival        = t_arrival;
 
-                // OAI-compat
-                task.params.oaicompat                 = oaicompat;
-                task.params.oaicompat_cmpl_id         = completion_id;
-                // oaicompat_model is already populated by params_from_json_cmpl
+                    // OAI-compat
+                    task.params.oaicompat                 = oaicompat;
+                    task.params.oaicompat_cmpl_id         = completion_id;
+                    // oaicompat_model is already populated by params_from_json_cmpl
 
-                tasks.push_back(std::move(task));
+                    tasks.push_back(std::move(task));
+                }
+
+                ctx_server.metrics.record(SERVER_HISTOGRAM_TOKENIZE, type, oaicompat, (ggml_time_us() - t_arrival) / 1e6);
+            });
+            if (!accepted) {
+                res_preprocess_busy(res);
+                return;
             }
 
             task_ids = server_task::get_list_id(tasks);
             ctx_server.queue_results.add_waiting_tasks(tasks);
-            ctx_server.queue_tasks.post(std::move(tasks));
+
+            if (!post_admit(ctx_server, tasks, task_ids, res)) {
+                return;
+            }
         } catch (const std::exception & e) {
             res_error(res, format_error_response(e.what(), ERROR_TYPE_INVALID_REQUEST));
             return;
@@ -4301,8 +7015,9 @@ int main(int argc, char ** argv) {
 
             ctx_server.queue_results.remove_waiting_task_ids(task_ids);
         } else {
-            const auto chunked_content_provider = [task_ids, &ctx_server, oaicompat](size_t, httplib::DataSink & sink) {
-                ctx_server.receive_cmpl_results_stream(task_ids, [&](server_task_result_ptr & result) -> bool {
+            // note: the model cannot be unloaded until the stream is done
+            const auto chunked_content_provider = [task_ids, ctx_ptr, oaicompat](size_t, httplib::DataSink & sink) {
+                ctx_ptr->receive_cmpl_results_stream(task_ids, [&](server_task_result_ptr & result) -> bool {
                     json res_json = result->to_json();
                     if (res_json.is_array()) {
                         for (const auto & res : res_json) {
@@ -4329,18 +7044,23 @@ int main(int argc, char ** argv) {
                 return false;
             };
 
-            auto on_complete = [task_ids, &ctx_server] (bool) {
-                ctx_server.queue_results.remove_waiting_task_ids(task_ids);
+            auto on_complete = [task_ids, ctx_ptr] (bool) {
+                ctx_ptr->queue_results.remove_waiting_task_ids(task_ids);
             };
 
             res.set_chunked_content_provider("text/event-stream", chunked_content_provider, on_complete);
         }
     };
 
-    const auto handle_completions = [&handle_completions_impl](const httplib::Request & req, httplib::Response & res) {
+    const auto handle_completions = [&get_model_ctx, &handle_completions_impl](const httplib::Request & req, httplib::Response & res) {
         json data = json::parse(req.body);
+        server_context_ptr ctx_ptr = get_model_ctx(data, res);
+        if (!ctx_ptr) {
+            return;
+        }
         std::vector<raw_buffer> files; // dummy
         handle_completions_impl(
+            ctx_ptr,
             SERVER_TASK_TYPE_COMPLETION,
             data,
             files,
@@ -4349,10 +7069,15 @@ int main(int argc, char ** argv) {
             OAICOMPAT_TYPE_NONE);
     };
 
-    const auto handle_completions_oai = [&handle_completions_impl](const httplib::Request & req, httplib::Response & res) {
+    const auto handle_completions_oai = [&get_model_ctx, &handle_completions_impl](const httplib::Request & req, httplib::Response & res) {
         json data = oaicompat_completion_params_parse(json::parse(req.body));
+        server_context_ptr ctx_ptr = get_model_ctx(data, res);
+        if (!ctx_ptr) {
+            return;
+        }
         std::vector<raw_buffer> files; // dummy
         handle_completions_impl(
+            ctx_ptr,
             SERVER_TASK_TYPE_COMPLETION,
             data,
             files,
@@ -4361,7 +7086,15 @@ int main(int argc, char ** argv) {
             OAICOMPAT_TYPE_COMPLETION);
     };
 
-    const auto handle_infill = [&ctx_server, &res_error, &handle_completions_impl](const httplib::Request & req, httplib::Response & res) {
+    const auto handle_infill = [&get_model_ctx, &res_error, &handle_completions_impl](const httplib::Request & req, httplib::Response & res) {
+        json data = json::parse(req.body);
+
+        server_context_ptr ctx_ptr = get_model_ctx(data, res);
+        if (!ctx_ptr) {
+            return;
+        }
+        server_context & ctx_server = *ctx_ptr;
+
         // check model compatibility
         std::string err;
         if (llama_vocab_fim_pre(ctx_server.vocab) == LLAMA_TOKEN_NULL) {
@@ -4378,8 +7111,6 @@ int main(int argc, char ** argv) {
             return;
         }
 
-        json data = json::parse(req.body);
-
         // validate input
         if (data.contains("prompt") && !data.at("prompt").is_string()) {
             // prompt is optional
@@ -4415,69 +7146,85 @@ int main(int argc, char ** argv) {
         }
         data["input_extra"] = input_extra; // default to empty array if it's not exist
 
-        std::string prompt = json_value(data, "prompt", std::string());
-        std::vector<llama_tokens> tokenized_prompts = tokenize_input_prompts(ctx_server.vocab, prompt, false, true);
-        SRV_DBG("creating infill tasks, n_prompts = %d\n", (int) tokenized_prompts.size());
-        data["prompt"] = format_infill(
-            ctx_server.vocab,
-            data.at("input_prefix"),
-            data.at("input_suffix"),
-            data.at("input_extra"),
-            ctx_server.params_base.n_batch,
-            ctx_server.params_base.n_predict,
-            ctx_server.slots[0].n_ctx, // TODO: there should be a better way
-            ctx_server.params_base.spm_infill,
-            tokenized_prompts[0]
-        );
-
         std::vector<raw_buffer> files; // dummy
         handle_completions_impl(
+            ctx_ptr,
             SERVER_TASK_TYPE_INFILL,
             data,
             files,
             req.is_connection_closed,
             res,
-            OAICOMPAT_TYPE_NONE); // infill is not OAI compatible
+            OAICOMPAT_TYPE_NONE, // infill is not OAI compatible
+            [&]() {
+                // the prefix, the suffix and the extra context are tokenized on the preprocessing pool too
+                std::string prompt = json_value(data, "prompt", std::string());
+                std::vector<llama_tokens> tokenized_prompts = tokenize_input_prompts(ctx_server.vocab, prompt, false, true);
+                SRV_DBG("creating infill tasks, n_prompts = %d\n", (int) tokenized_prompts.size());
+                data["prompt"] = format_infill(
+                    ctx_server.vocab,
+                    data.at("input_prefix"),
+                    data.at("input_suffix"),
+                    data.at("input_extra"),
+                    ctx_server.params_base.n_batch,
+                    ctx_server.params_base.n_predict,
+                    ctx_server.slots[0].n_ctx, // TODO: there should be a better way
+                    ctx_server.params_base.spm_infill,
+                    tokenized_prompts[0]
+                );
+            });
     };
 
-    const auto handle_chat_completions = [&ctx_server, &handle_completions_impl](const httplib::Request & req, httplib::Response & res) {
+    const auto handle_chat_completions = [&get_model_ctx, &handle_completions_impl](const httplib::Request & req, httplib::Response & res) {
         LOG_DBG("request: %s\n", req.body.c_str());
 
         auto body = json::parse(req.body);
+        server_context_ptr ctx_ptr = get_model_ctx(body, res);
+        if (!ctx_ptr) {
+            return;
+        }
         std::vector<raw_buffer> files;
-        json data = oaicompat_chat_params_parse(
-            body,
-            ctx_server.oai_parser_opt,
-            files);
+        json data;
 
         handle_completions_impl(
+            ctx_ptr,
             SERVER_TASK_TYPE_COMPLETION,
             data,
             files,
             req.is_connection_closed,
             res,
-            OAICOMPAT_TYPE_CHAT);
+            OAICOMPAT_TYPE_CHAT,
+            [&]() {
+                data = oaicompat_chat_params_parse(
+                    body,
+                    ctx_ptr->oai_parser_opt,
+                    files);
+            });
     };
 
     // same with handle_chat_completions, but without inference part
-    const auto handle_apply_template = [&ctx_server, &res_ok](const httplib::Request & req, httplib::Response & res) {
+    const auto handle_apply_template = [&get_model_ctx, &res_ok, &res_preprocess_busy, &preprocess](const httplib::Request & req, httplib::Response & res) {
         auto body = json::parse(req.body);
+        server_context_ptr ctx_ptr = get_model_ctx(body, res);
+        if (!ctx_ptr) {
+            return;
+        }
         std::vector<raw_buffer> files; // dummy, unused
-        json data = oaicompat_chat_params_parse(
-            body,
-            ctx_server.oai_parser_opt,
-            files);
+        json data;
+        if (!preprocess.run([&]() { data = oaicompat_chat_params_parse(body, ctx_ptr->oai_parser_opt, files); })) {
+            res_preprocess_busy(res);
+            return;
+        }
         res_ok(res, {{ "prompt", std::move(data.at("prompt")) }});
     };
 
-    const auto handle_models = [&params, &ctx_server, &state, &res_ok](const httplib::Request &, httplib::Response & res) {
+    const auto handle_models = [&params, &ctx_server, &models, &state, &res_ok](const httplib::Request &, httplib::Response & res) {
         server_state current_state = state.load();
         json model_meta = nullptr;
         if (current_state == SERVER_STATE_READY) {
             model_meta = ctx_server.model_meta();
         }
 
-        json models = {
+        json res_models = {
             {"models", {
                 {
                     {"name", params.model_alias.empty() ? params.model.path : params.model_alias},
@@ -4512,12 +7259,33 @@ int main(int argc, char ** argv) {
             }}
         };
 
-        res_ok(res, models);
+        if (current_state == SERVER_STATE_READY && models.enabled()) {
+            for (auto & model : models.to_json()) {
+                res_models["models"].push_back({
+                    {"name",  model.at("id")},
+                    {"model", model.at("id")},
+                    {"type",  "model"},
+                    {"capabilities", {"completion"}},
+                    {"details", {
+                        {"format", "gguf"},
+                    }},
+                });
+                res_models["data"].push_back(std::move(model));
+            }
+        }
+
+        res_ok(res, res_models);
     };
 
-    const auto handle_tokenize = [&ctx_server, &res_ok](const httplib::Request & req, httplib::Response & res) {
+    const auto handle_tokenize = [&get_model_ctx, &res_ok](const httplib::Request & req, httplib::Response & res) {
         const json body = json::parse(req.body);
 
+        server_context_ptr ctx_ptr = get_model_ctx(body, res);
+        if (!ctx_ptr) {
+            return;
+        }
+        server_context & ctx_server = *ctx_ptr;
+
         json tokens_response = json::array();
         if (body.count("content") != 0) {
             const bool add_special = json_value(body, "add_special", false);
@@ -4556,9 +7324,15 @@ int main(int argc, char ** argv) {
         res_ok(res, data);
     };
 
-    const auto handle_detokenize = [&ctx_server, &res_ok](const httplib::Request & req, httplib::Response & res) {
+    const auto handle_detokenize = [&get_model_ctx, &res_ok](const httplib::Request & req, httplib::Response & res) {
         const json body = json::parse(req.body);
 
+        server_context_ptr ctx_ptr = get_model_ctx(body, res);
+        if (!ctx_ptr) {
+            return;
+        }
+        server_context & ctx_server = *ctx_ptr;
+
         std::string content;
         if (body.count("tokens") != 0) {
             const llama_tokens tokens = body.at("tokens");
@@ -4569,7 +7343,15 @@ int main(int argc, char ** argv) {
         res_ok(res, data);
     };
 
-    const auto handle_embeddings_impl = [&ctx_server, &res_error, &res_ok](const httplib::Request & req, httplib::Response & res, oaicompat_type oaicompat) {
+    const auto handle_embeddings_impl = [&get_model_ctx, &res_error, &res_ok, &res_preprocess_busy, &post_admit, &preprocess](const httplib::Request & req, httplib::Response & res, oaicompat_type oaicompat) {
+        const json body = json::parse(req.body);
+
+        server_context_ptr ctx_ptr = get_model_ctx(body, res);
+        if (!ctx_ptr) {
+            return;
+        }
+        server_context & ctx_server = *ctx_ptr;
+
         if (!ctx_server.params_base.embedding) {
             res_error(res, format_error_response("This server does not support embeddings. Start it with `--embeddings`", ERROR_TYPE_NOT_SUPPORTED));
             return;
@@ -4580,7 +7362,7 @@ int main(int argc, char ** argv) {
             return;
         }
 
-        const json body = json::parse(req.body);
+        const int64_t t_arrival = ggml_time_us();
 
         // for the shape of input/content, see tokenize_input_prompts()
         json prompt;
@@ -4605,7 +7387,11 @@ int main(int argc, char ** argv) {
             }
         }
 
-        auto tokenized_prompts = tokenize_input_prompts(ctx_server.vocab, prompt, true, true);
+        std::vector<llama_tokens> tokenized_prompts;
+        if (!preprocess.run([&]() { tokenized_prompts = tokenize_input_prompts(ctx_server.vocab, prompt, true, true); })) {
+            res_preprocess_busy(res);
+            return;
+        }
         for (const auto & tokens : tokenized_prompts) {
             // this check is necessary for models that do not add BOS token to the input
             if (tokens.empty()) {
@@ -4626,6 +7412,7 @@ int main(int argc, char ** argv) {
                 task.id            = ctx_server.queue_tasks.get_new_id();
                 task.index         = i;
                 task.prompt_tokens = server_tokens(tokenized_prompts[i], ctx_server.mctx != nullptr);
+                task.t_arrival     = t_arrival;
 
                 // OAI-compat
                 task.params.oaicompat = oaicompat;
@@ -4633,9 +7420,14 @@ int main(int argc, char ** argv) {
                 tasks.push_back(std::move(task));
             }
 
+            ctx_server.metrics.record(SERVER_HISTOGRAM_TOKENIZE, SERVER_TASK_TYPE_EMBEDDING, oaicompat, (ggml_time_us() - t_arrival) / 1e6);
+
             task_ids = server_task::get_list_id(tasks);
             ctx_server.queue_results.add_waiting_tasks(tasks);
-            ctx_server.queue_tasks.post(std::move(tasks));
+
+            if (!post_admit(ctx_server, tasks, task_ids, res)) {
+                return;
+            }
         }
 
         // get the result
@@ -4670,13 +7462,21 @@ int main(int argc, char ** argv) {
         handle_embeddings_impl(req, res, OAICOMPAT_TYPE_EMBEDDING);
     };
 
-    const auto handle_rerank = [&ctx_server, &res_error, &res_ok](const httplib::Request & req, httplib::Response & res) {
+    const auto handle_rerank = [&get_model_ctx, &res_error, &res_ok, &res_preprocess_busy, &post_admit, &preprocess](const httplib::Request & req, httplib::Response & res) {
+        const json body = json::parse(req.body);
+
+        server_context_ptr ctx_ptr = get_model_ctx(body, res);
+        if (!ctx_ptr) {
+            return;
+        }
+        server_context & ctx_server = *ctx_ptr;
+
         if (!ctx_server.params_base.embedding || ctx_server.params_base.pooling_type != LLAMA_POOLING_TYPE_RANK) {
             res_error(res, format_error_response("This server does not support reranking. Start it with `--reranking`", ERROR_TYPE_NOT_SUPPORTED));
             return;
         }
 
-        const json body = json::parse(req.body);
+        const int64_t t_arrival = ggml_time_us();
 
         // TODO: implement
         //int top_n = 1;
@@ -4711,7 +7511,15 @@ int main(int argc, char ** argv) {
             return;
         }
 
-        llama_tokens tokenized_query = tokenize_input_prompts(ctx_server.vocab, query, /* add_special */ false, true)[0];
+        llama_tokens tokenized_query;
+        std::vector<llama_tokens> tokenized_docs;
+        if (!preprocess.run([&]() {
+            tokenized_query = tokenize_input_prompts(ctx_server.vocab, query,     /* add_special */ false, true)[0];
+            tokenized_docs  = tokenize_input_prompts(ctx_server.vocab, documents, /* add_special */ false, true);
+        })) {
+            res_preprocess_busy(res);
+            return;
+        }
 
         // create and queue the task
         json responses = json::array();
@@ -4719,7 +7527,6 @@ int main(int argc, char ** argv) {
         std::unordered_set<int> task_ids;
         {
             std::vector<server_task> tasks;
-            auto tokenized_docs = tokenize_input_prompts(ctx_server.vocab, documents, /* add_special */ false, true);
             tasks.reserve(tokenized_docs.size());
             for (size_t i = 0; i < tokenized_docs.size(); i++) {
                 auto tmp = format_rerank(ctx_server.vocab, tokenized_query, tokenized_docs[i]);
@@ -4727,12 +7534,18 @@ int main(int argc, char ** argv) {
                 task.id            = ctx_server.queue_tasks.get_new_id();
                 task.index         = i;
                 task.prompt_tokens = server_tokens(tmp, ctx_server.mctx != nullptr);
+                task.t_arrival     = t_arrival;
                 tasks.push_back(std::move(task));
             }
 
+            ctx_server.metrics.record(SERVER_HISTOGRAM_TOKENIZE, SERVER_TASK_TYPE_RERANK, OAICOMPAT_TYPE_NONE, (ggml_time_us() - t_arrival) / 1e6);
+
             task_ids = server_task::get_list_id(tasks);
             ctx_server.queue_results.add_waiting_tasks(tasks);
-            ctx_server.queue_tasks.post(std::move(tasks));
+
+            if (!post_admit(ctx_server, tasks, task_ids, res)) {
+                return;
+            }
         }
 
         ctx_server.receive_multi_results(task_ids, [&](std::vector<server_task_result_ptr> & results) {
@@ -4878,11 +7691,18 @@ int main(int argc, char ** argv) {
     log_data["n_threads_http"] =  std::to_string(params.n_threads_http);
     svr->new_task_queue = [&params] { return new httplib::ThreadPool(params.n_threads_http); };
 
+    if (params.n_threads_preprocess < 0) {
+        params.n_threads_preprocess = std::clamp((int32_t) std::thread::hardware_concurrency() / 4, 1, 8);
+    }
+    preprocess.start(params.n_threads_preprocess, params.preprocess_queue_max);
+
     // clean up function, to be called before exit
-    auto clean_up = [&svr, &ctx_server]() {
+    auto clean_up = [&svr, &ctx_server, &models, &preprocess]() {
         SRV_INF("%s: cleaning up before exit...\n", __func__);
         svr->stop();
+        preprocess.stop();
         ctx_server.queue_results.terminate();
+        models.stop();
         llama_backend_free();
     };
 
@@ -4931,6 +7751,7 @@ int main(int argc, char ** argv) {
     }
 
     ctx_server.init();
+    models.init(params, ctx_server);
     state.store(SERVER_STATE_READY);
 
     LOG_INF("%s: model loaded\n", __func__);
@@ -4944,7 +7765,12 @@ int main(int argc, char ** argv) {
         ctx_server.process_single_task(std::move(task));
     });
 
-    ctx_server.queue_tasks.on_update_slots([&ctx_server]() {
+    ctx_server.queue_tasks.on_update_slots([&ctx_server, &models]() {
+        // the contexts of the --models-dir models share the CPU threadpool with this one
+        std::unique_lock<std::mutex> lock(models.mutex_compute, std::defer_lock);
+        if (models.enabled()) {
+            lock.lock();
+        }
         ctx_server.update_slots();
     });
 
@@ -40,6 +40,37 @@ def test_server_models():
     assert res.body["data"][0]["id"] == server.model_alias
 
 
+def test_server_models_dir(tmp_path):
+    global server
+    # a file that is not a valid model, it is listed but fails to load
+    (tmp_path / "broken.gguf").write_bytes(b"not a gguf file")
+    server.models_dir = str(tmp_path)
+    server.start()
+
+    res = server.make_request("GET", "/models")
+    assert res.status_code == 200
+    assert len(res.body["data"]) == 2
+    assert res.body["data"][1]["id"] == "broken"
+    assert res.body["data"][1]["status"]["value"] == "unloaded"
+
+    res = server.make_request("POST", "/completion", data={
+        "model": "broken",
+        "prompt": "I believe the meaning of life is",
+        "n_predict": 4,
+    })
+    assert res.status_code == 503 # ERROR_TYPE_UNAVAILABLE
+    res = server.make_request("GET", "/models")
+    assert res.body["data"][1]["status"]["value"] == "failed"
+
+    # other names are served by the default model
+    res = server.make_request("POST", "/completion", data={
+        "model": "unknown",
+        "prompt": "I believe the meaning of life is",
+        "n_predict": 4,
+    })
+    assert res.status_code == 200
+
+
 def test_server_slots():
     global server
 
@@ -94,3 +125,21 @@ def test_no_webui():
     server.start()
     res = requests.get(url)
     assert res.status_code == 404
+
+
+def test_server_metrics_histograms():
+    global server
+    server.server_metrics = True
+    server.start()
+    res = server.make_request("POST", "/completion", data={
+        "n_predict": 8,
+        "prompt": "Hello",
+        "temperature": 0.0,
+    })
+    assert res.status_code == 200
+    res = requests.get(f"http://{server.server_host}:{server.server_port}/metrics")
+    assert res.status_code == 200
+    assert "# TYPE llamacpp:time_to_first_token_seconds histogram" in res.text
+    assert 'llamacpp:time_to_first_token_seconds_count{task_type="completion",endpoint="native"} 1' in res.text
+    assert "llamacpp:inter_token_latency_seconds_count{" in res.text
+    assert 'llamacpp:prefill_seconds_bucket{task_type="completion",endpoint="native",le="+Inf"} 1' in res.text
@@ -180,6 +180,33 @@ def test_different_result_different_seed(n_slots: int):
             assert res.body["content"] != last_res.body["content"]
         last_res = res
 
+@pytest.mark.parametrize("stream", [False, True])
+def test_response_cache(stream: bool):
+    global server
+    server.response_cache_size = 16
+    server.server_metrics = True
+    server.start()
+    contents = []
+    for _ in range(3):
+        res = server.make_stream_request("POST", "/completion", data={
+            "prompt": "I believe the meaning of life is",
+            "n_predict": 16,
+            "temperature": 0.0,
+            "stream": True,
+        }) if stream else [server.make_request("POST", "/completion", data={
+            "prompt": "I believe the meaning of life is",
+            "n_predict": 16,
+            "temperature": 0.0,
+        }).body]
+        contents.append("".join(data["content"] for data in res))
+    assert contents[0] != ""
+    assert contents[1] == contents[0]
+    assert contents[2] == contents[0]
+    metrics = requests.get(f"http://{server.server_host}:{server.server_port}/metrics").text
+    assert "llamacpp:response_cache_hits_total 2" in metrics
+    assert "llamacpp:response_cache_misses_total 1" in metrics
+
+
 # TODO figure why it don't work with temperature = 1
 # @pytest.mark.parametrize("temperature", [0.0, 1.0])
 @pytest.mark.parametrize("n_batch", [16, 32])
@@ -330,6 +357,77 @@ def test_completion_parallel_slots(n_slots: int, n_requests: int):
         # assert match_regex(re_content, res.body["content"])
 
 
+def test_completion_kv_admission_control():
+    global server
+    server.n_ctx = 256
+    server.n_slots = 1
+    server.kv_queue_max = 0
+    server.server_metrics = True
+    server.start()
+
+    # each request reserves the whole slot context, only the first one fits in the free KV cells
+    tasks = []
+    for _ in range(4):
+        tasks.append((server.make_request, ("POST", "/completion", {
+            "prompt": "I believe the meaning of life is",
+            "n_predict": 200,
+            "ignore_eos": True,
+        })))
+    results = parallel_function_calls(tasks)
+
+    n_ok = sum(1 for res in results if res.status_code == 200)
+    rejected = [res for res in results if res.status_code == 429]
+    assert n_ok >= 1
+    assert n_ok + len(rejected) == len(results)
+    assert len(rejected) > 0
+    for res in rejected:
+        assert res.body["error"]["type"] == "overloaded_error"
+        assert 1 <= int(res.headers["Retry-After"]) <= 60
+
+    # once the server is idle, the requests are admitted again
+    res = server.make_request("POST", "/completion", data={
+        "prompt": "I believe the meaning of life is",
+        "n_predict": 8,
+    })
+    assert res.status_code == 200
+
+    metrics = requests.get(f"http://{server.server_host}:{server.server_port}/metrics").text
+    assert f"llamacpp:requests_rejected_total {len(rejected)}" in metrics
+    assert "llamacpp:kv_capacity_tokens 256" in metrics
+
+
+def test_completion_preprocess_pool():
+    global server
+    server.n_slots = 2
+    server.n_threads_preprocess = 2
+    server.server_metrics = True
+    server.start()
+
+    def make_data(i: int):
+        return {
+            "prompt": f"I believe the meaning of life is {i}",
+            "n_predict": 4,
+            "json_schema": {"type": "object", "properties": {"answer": {"type": "string"}}},
+        }
+
+    res = server.make_request("POST", "/completion", data=make_data(0))
+    assert res.status_code == 200
+
+    tasks = []
+    for i in range(1, 8):
+        tasks.append((server.make_request, ("POST", "/completion", make_data(i))))
+    results = parallel_function_calls(tasks)
+    for res in results:
+        assert res.status_code == 200
+
+    # the schema was converted to a grammar by the first request only
+    metrics = requests.get(f"http://{server.server_host}:{server.server_port}/metrics").text
+    assert "llamacpp:preprocess_requests_total 8" in metrics
+    assert "llamacpp:preprocess_rejected_total 0" in metrics
+    assert "llamacpp:grammar_cache_misses_total 1" in metrics
+    assert "llamacpp:grammar_cache_hits_total 7" in metrics
+
+
 @pytest.mark.parametrize(
     "prompt,n_predict,response_fields",
     [
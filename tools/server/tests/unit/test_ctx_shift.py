@@ -1,4 +1,5 @@
 import pytest
+import requests
 from utils import *
 
 server = ServerPreset.tinyllama2()
@@ -11,7 +12,8 @@ Duis aute irure dolor in reprehenderit in voluptate velit esse cillum dolore eu
 Excepteur sint occaecat cupidatat non proident, sunt in culpa qui officia deserunt mollit anim id est laborum.
 """.strip()
 
-@pytest.fixture(scope="module", autouse=True)
+# the tests change the settings of the server, a new one is created for each of them
+@pytest.fixture(autouse=True)
 def create_server():
     global server
     server = ServerPreset.tinyllama2()
@@ -36,6 +38,126 @@ def test_ctx_shift_enabled():
     assert res.body["truncated"] is True
 
 
+def get_kv_shift_total() -> float:
+    res = requests.get(f"http://{server.server_host}:{server.server_port}/metrics")
+    assert res.status_code == 200
+    shifts = [line for line in res.text.split("\n") if line.startswith("llamacpp:kv_stream_shift_total")]
+    assert len(shifts) > 0
+    return sum(float(line.split()[-1]) for line in shifts)
+
+
+@pytest.mark.parametrize("set_rows", [False, True])
+def test_ctx_shift_sink(set_rows: bool, monkeypatch: pytest.MonkeyPatch):
+    # same as above, but the context shifts keep 4 attention sink tokens and only drop the oldest tokens of the window
+    # the generation continues well past the slot context size without re-rotating the KV cache, as the positions stay
+    # within the training context of the model (512)
+    # with ggml_set_rows(), each slot has its own stream and its window is placed in a ring of cells
+    global server
+    if set_rows:
+        monkeypatch.setenv("LLAMA_SET_ROWS", "1")
+    server.n_sink = 4
+    server.n_predict = 256
+    server.server_metrics = True
+    server.start()
+    res = server.make_request("POST", "/completion", data={
+        "n_predict": 256,
+        "prompt": LONG_TEXT,
+    })
+    assert res.status_code == 200
+    assert res.body["timings"]["prompt_n"] == 109
+    assert res.body["timings"]["predicted_n"] == 256
+    assert res.body["truncated"] is True
+    assert get_kv_shift_total() == 0
+
+
+def test_ctx_shift_sink_rebase():
+    # the positions of the window grow by ~61 on each context shift. once they would pass the training context of the
+    # model, the window is moved back right after the sinks with a single K-shift, every 7 context shifts
+    global server
+    server.n_sink = 4
+    server.n_predict = 1024
+    server.server_metrics = True
+    server.start()
+    res = server.make_request("POST", "/completion", data={
+        "n_predict": 1024,
+        "prompt": LONG_TEXT,
+    })
+    assert res.status_code == 200
+    assert res.body["timings"]["predicted_n"] == 1024
+    assert res.body["truncated"] is True
+    assert 0 < get_kv_shift_total() <= 3
+
+
+def test_ctx_shift_rotates():
+    # the regular context shift moves the window back, which re-rotates the keys of the KV cache
+    global server
+    server.server_metrics = True
+    server.start()
+    res = server.make_request("POST", "/completion", data={
+        "n_predict": 64,
+        "prompt": LONG_TEXT,
+    })
+    assert res.status_code == 200
+    assert res.body["truncated"] is True
+    assert get_kv_shift_total() > 0
+
+
+def test_kv_budget():
+    # the KV budget evicts the least attended cells of the slot instead of shifting the context
+    # the generation continues past the slot context size without truncation
+    global server
+    server.kv_budget = 96
+    server.disable_ctx_shift = True
+    server.server_metrics = True
+    server.n_predict = 256
+    server.start()
+    res = server.make_request("POST", "/completion", data={
+        "n_predict": 256,
+        "prompt": "Hi how are you",
+    })
+    assert res.status_code == 200
+    assert res.body["timings"]["predicted_n"] == 256
+    assert res.body["truncated"] is False
+    content = res.body["content"]
+    # the cached prompt lost some of its cells, so none of it is reused by a continuation
+    res = server.make_request("POST", "/completion", data={
+        "n_predict": 4,
+        "prompt": "Hi how are you" + content,
+    })
+    assert res.status_code == 200
+    assert res.body["timings"]["prompt_n"] == res.body["tokens_evaluated"]
+    res = requests.get(f"http://{server.server_host}:{server.server_port}/metrics")
+    assert res.status_code == 200
+    evicted = [line for line in res.text.split("\n") if line.startswith("llamacpp:kv_stream_evicted_total")]
+    assert len(evicted) > 0
+    assert sum(float(line.split()[-1]) for line in evicted) > 0
+
+
+def test_ctx_shift_paged():
+    # with a paged KV cache, the shifts move the cells of the blocks of the slot
+    # the output must be the same as with the contiguous cache
+    global server
+    data = {
+        "n_predict": 64,
+        "prompt": LONG_TEXT,
+        "temperature": 0.0,
+        "top_k": 1,
+    }
+    server.start()
+    res = server.make_request("POST", "/completion", data=data)
+    assert res.status_code == 200
+    content = res.body["content"]
+    server.stop()
+
+    server.kv_block_size = 16
+    server.start()
+    res = server.make_request("POST", "/completion", data=data)
+    assert res.status_code == 200
+    assert res.body["timings"]["predicted_n"] == 64
+    assert res.body["truncated"] is True
+    assert res.body["content"] == content
+
+
 @pytest.mark.parametrize("n_predict,n_token_output,truncated", [
     (64, 64, False),
     (-1, 120, True),
@@ -188,6 +188,38 @@ def test_same_prompt_give_same_result():
             assert abs(x - y) < EPSILON
 
 
+def test_embedding_packed_matches_single():
+    global server
+    server.pooling = 'mean'
+    server.server_metrics = True
+    server.start()
+    inputs = [
+        "I believe the meaning of life is",
+        "This is a test",
+        "Write a joke about AI",
+        "The quick brown fox jumps over the lazy dog",
+        "Hello",
+        "Embeddings for short texts are packed into a single batch",
+    ]
+    res = server.make_request("POST", "/v1/embeddings", data={
+        "input": inputs,
+    })
+    assert res.status_code == 200
+    assert len(res.body['data']) == len(inputs)
+    # all the inputs went into a single llama_decode() call
+    metrics = requests.get(f"http://{server.server_host}:{server.server_port}/metrics").text
+    assert "llamacpp:n_decode_total 1\n" in metrics
+    for i, content in enumerate(inputs):
+        res_single = server.make_request("POST", "/v1/embeddings", data={
+            "input": content,
+        })
+        assert res_single.status_code == 200
+        v0 = res_single.body['data'][0]['embedding']
+        vi = res.body['data'][i]['embedding']
+        for x, y in zip(v0, vi):
+            assert abs(x - y) < EPSILON
+
+
 @pytest.mark.parametrize(
     "content,n_tokens",
     [
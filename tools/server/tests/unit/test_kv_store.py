@@ -0,0 +1,123 @@
+import os
+import shutil
+import time
+import pytest
+from utils import *
+
+server = ServerPreset.tinyllama2()
+
+KV_STORE_PATH = "./tmp/kv_store"
+
+LONG_PROMPT = "Once upon a time, in a small village at the foot of the mountains, there lived an old clockmaker. " * 4
+
+
+@pytest.fixture(scope="module", autouse=True)
+def create_server():
+    global server
+    server = ServerPreset.tinyllama2()
+    server.kv_store = KV_STORE_PATH
+    server.kv_store_block = 32
+    server.temperature = 0.0
+
+
+@pytest.fixture(autouse=True)
+def clear_kv_store():
+    shutil.rmtree(KV_STORE_PATH, ignore_errors=True)
+
+
+def wait_for_kv_store(n_bytes_min: int):
+    for _ in range(50):
+        files = os.listdir(KV_STORE_PATH)
+        if files and os.path.getsize(os.path.join(KV_STORE_PATH, files[0])) >= n_bytes_min:
+            return
+        time.sleep(0.1)
+    raise TimeoutError("the KV store was not written")
+
+
+def test_kv_store_across_restarts():
+    global server
+    server.start()
+
+    res = server.make_request("POST", "/completion", data={
+        "prompt": LONG_PROMPT,
+        "n_predict": 8,
+    })
+    assert res.status_code == 200
+    n_prompt = res.body["timings"]["prompt_n"]
+    content = res.body["content"]
+    assert n_prompt > 64
+
+    # header + at least 2 blocks, the records are written in the background
+    wait_for_kv_store(1024)
+    server.stop()
+
+    server.start()
+
+    # the full blocks are loaded from the store, only the tail of the prompt is processed
+    res = server.make_request("POST", "/completion", data={
+        "prompt": LONG_PROMPT,
+        "n_predict": 8,
+    })
+    assert res.status_code == 200
+    assert res.body["timings"]["prompt_n"] < 32
+    assert res.body["content"] == content
+
+
+def test_kv_store_other_slot():
+    global server
+    server.n_slots = 2
+    server.start()
+
+    res = server.make_request("POST", "/completion", data={
+        "prompt": LONG_PROMPT,
+        "n_predict": 8,
+        "id_slot": 0,
+    })
+    assert res.status_code == 200
+
+    wait_for_kv_store(1024)
+
+    # the prefix blocks stored by slot 0 are loaded into slot 1
+    res = server.make_request("POST", "/completion", data={
+        "prompt": LONG_PROMPT + "The end.",
+        "n_predict": 8,
+        "id_slot": 1,
+    })
+    assert res.status_code == 200
+    assert res.body["timings"]["prompt_n"] < 40
+
+
+def test_kv_store_skips_reused_chunks():
+    global server
+    server.n_slots = 1
+    server.n_cache_reuse = 8
+    server.start()
+
+    res = server.make_request("POST", "/completion", data={
+        "prompt": "Hello. " + LONG_PROMPT,
+        "n_predict": 8,
+    })
+    assert res.status_code == 200
+
+    wait_for_kv_store(1024)
+
+    # the KV data of the prompt is shifted from the previous one by --cache-reuse, so it is not saved to the store
+    res = server.make_request("POST", "/completion", data={
+        "prompt": LONG_PROMPT,
+        "n_predict": 8,
+    })
+    assert res.status_code == 200
+    assert res.body["timings"]["prompt_n"] < 32
+
+    time.sleep(0.5)
+    server.stop()
+
+    server.start()
+
+    # only the blocks of the first prompt are in the store, the whole prompt is processed
+    res = server.make_request("POST", "/completion", data={
+        "prompt": LONG_PROMPT,
+        "n_predict": 8,
+    })
+    assert res.status_code == 200
+    assert res.body["timings"]["prompt_n"] > 64
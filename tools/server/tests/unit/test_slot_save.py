@@ -96,3 +96,166 @@ def test_slot_erase():
     assert res.status_code == 200
     assert match_regex("(Whiskers|Flana)+", res.body["content"])
     assert res.body["timings"]["prompt_n"] == 21  # all tokens are processed
+
+
+def test_slot_save_incremental():
+    global server
+    server.start()
+
+    res = server.make_request("POST", "/completion", data={
+        "prompt": "What is the capital of France?",
+        "id_slot": 1,
+        "cache_prompt": True,
+    })
+    assert res.status_code == 200
+
+    res = server.make_request("POST", "/slots/1?action=save", data={
+        "filename": "slot1_incremental.bin",
+    })
+    assert res.status_code == 200
+    assert res.body["n_saved"] == 84
+    assert res.body["n_written"] > 0
+
+    # nothing changed since the last save, nothing is appended
+    res = server.make_request("POST", "/slots/1?action=save", data={
+        "filename": "slot1_incremental.bin",
+    })
+    assert res.status_code == 200
+    assert res.body["n_saved"] == 84
+    assert res.body["n_written"] == 0
+
+    res = server.make_request("POST", "/slots/0?action=restore", data={
+        "filename": "slot1_incremental.bin",
+    })
+    assert res.status_code == 200
+    assert res.body["n_restored"] == 84
+
+    res = server.make_request("POST", "/completion", data={
+        "prompt": "What is the capital of Germany?",
+        "id_slot": 0,
+        "cache_prompt": True,
+    })
+    assert res.status_code == 200
+    assert match_regex("(Jack|said)+", res.body["content"])
+    assert res.body["timings"]["prompt_n"] == 6  # only different part is processed
+
+
+def test_slot_save_incremental_append():
+    global server
+    server.start()
+
+    prompt = "What is the capital of France?"
+    res = server.make_request("POST", "/completion", data={
+        "prompt": prompt,
+        "id_slot": 1,
+        "cache_prompt": True,
+        "n_predict": 1,
+    })
+    assert res.status_code == 200
+
+    res = server.make_request("POST", "/slots/1?action=save", data={
+        "filename": "slot1_append.bin",
+    })
+    assert res.status_code == 200
+    n_saved = res.body["n_saved"]
+    n_written = res.body["n_written"]
+
+    # the cache of the slot grows from the saved tokens, only the new cells are appended as a new segment
+    prompt += " And what is the capital of Germany?"
+    res = server.make_request("POST", "/completion", data={
+        "prompt": prompt,
+        "id_slot": 1,
+        "cache_prompt": True,
+        "n_predict": 1,
+    })
+    assert res.status_code == 200
+
+    res = server.make_request("POST", "/slots/1?action=save", data={
+        "filename": "slot1_append.bin",
+    })
+    assert res.status_code == 200
+    assert res.body["n_saved"] > n_saved
+    assert 0 < res.body["n_written"] < n_written
+    n_saved = res.body["n_saved"]
+
+    # both segments are restored
+    res = server.make_request("POST", "/slots/0?action=restore", data={
+        "filename": "slot1_append.bin",
+    })
+    assert res.status_code == 200
+    assert res.body["n_restored"] == n_saved
+
+    res = server.make_request("POST", "/completion", data={
+        "prompt": prompt,
+        "id_slot": 0,
+        "cache_prompt": True,
+        "n_predict": 1,
+    })
+    assert res.status_code == 200
+    assert res.body["timings"]["prompt_n"] == 1  # only the last token is re-evaluated
+
+
+def test_slot_save_compressed():
+    global server
+    server.start()
+
+    res = server.make_request("POST", "/completion", data={
+        "prompt": "What is the capital of France?",
+        "id_slot": 1,
+        "cache_prompt": True,
+    })
+    assert res.status_code == 200
+
+    res = server.make_request("POST", "/slots/1?action=save", data={
+        "filename": "slot1_plain.bin",
+    })
+    assert res.status_code == 200
+    n_plain = res.body["n_written"]
+
+    res = server.make_request("POST", "/slots/1?action=save", data={
+        "filename": "slot1_compressed.bin",
+        "compress": True,
+    })
+    if res.status_code == 501:
+        pytest.skip("server built without LLAMA_SERVER_ZLIB")
+    assert res.status_code == 200
+    assert res.body["n_saved"] == 84
+    assert 0 < res.body["n_written"] <= n_plain
+
+    res = server.make_request("POST", "/slots/0?action=restore", data={
+        "filename": "slot1_compressed.bin",
+    })
+    assert res.status_code == 200
+    assert res.body["n_restored"] == 84
+
+    res = server.make_request("POST", "/completion", data={
+        "prompt": "What is the capital of Germany?",
+        "id_slot": 0,
+        "cache_prompt": True,
+    })
+    assert res.status_code == 200
+    assert res.body["timings"]["prompt_n"] == 6  # only different part is processed
+
+
+def test_slot_restore_corrupted_length():
+    global server
+    server.start()
+
+    # a segment that claims more KV data than the file holds is rejected before the data is read
+    import struct
+    os.makedirs(server.slot_save_path, exist_ok=True)
+    with open(os.path.join(server.slot_save_path, "slot_corrupted.bin"), "wb") as f:
+        f.write(struct.pack("<IIIIiQQ", 0x67677373, 2, 0, 1, 1, 1 << 40, 1 << 40))
+
+    res = server.make_request("POST", "/slots/0?action=restore", data={
+        "filename": "slot_corrupted.bin",
+    })
+    assert res.status_code != 200
+
+    # the slot is still usable
+    res = server.make_request("POST", "/completion", data={
+        "prompt": "What is the capital of France?",
+        "id_slot": 0,
+        "n_predict": 1,
+    })
+    assert res.status_code == 200
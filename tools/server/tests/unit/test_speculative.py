@@ -48,6 +48,33 @@ def test_with_and_without_draft():
     assert content_no_draft == content_draft
 
 
+def test_with_and_without_ngram_draft():
+    global server
+    server.model_draft = None  # disable draft model
+    server.start()
+    data = {
+        # a prompt with a repeated span, so that the n-gram drafts have something to match
+        "prompt": "Once upon a time, there was a little girl named Lily. Once upon a time, there was a little",
+        "temperature": 0.0,
+        "top_k": 1,
+        "n_predict": 32,
+    }
+    res = server.make_request("POST", "/completion", data=data)
+    assert res.status_code == 200
+    content_no_draft = res.body["content"]
+    server.stop()
+
+    # create new server with n-gram drafting
+    create_server()
+    server.model_draft = None
+    server.draft_ngram = True
+    server.start()
+    res = server.make_request("POST", "/completion", data=data)
+    assert res.status_code == 200
+    assert res.body["content"] == content_no_draft
+    assert res.body["timings"]["draft_n"] > 0
+
+
 def test_different_draft_min_draft_max():
     global server
     test_values = [
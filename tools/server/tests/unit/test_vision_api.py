@@ -58,3 +58,28 @@ def test_vision_chat_completion(prompt, image_url, success, re_content):
     else:
         assert res.status_code != 200
 
+
+
+def test_vision_embedding_cache():
+    global server
+    server.server_metrics = True
+    server.start(timeout_seconds=60)
+    # the different text before the image prevents the reuse of the slot KV cache, but not of the image embeddings
+    for prompt in ["What is this:\n", "Test test\n"]:
+        res = server.make_request("POST", "/chat/completions", data={
+            "temperature": 0.0,
+            "top_k": 1,
+            "messages": [
+                {"role": "user", "content": [
+                    {"type": "text", "text": prompt},
+                    {"type": "image_url", "image_url": {
+                        "url": IMG_BASE64_0,
+                    }},
+                ]},
+            ],
+        })
+        assert res.status_code == 200
+        assert match_regex("(cat)+", res.body["choices"][0]["message"]["content"])
+    metrics = requests.get(f"http://{server.server_host}:{server.server_port}/metrics").text
+    assert "llamacpp:mmproj_cache_misses_total 1" in metrics
+    assert "llamacpp:mmproj_cache_hits_total 1" in metrics
@@ -64,6 +64,10 @@ class ServerProcess:
     n_predict: int | None = None
     n_prompts: int | None = 0
     slot_save_path: str | None = None
+    response_cache_size: int | None = None
+    kv_store: str | None = None
+    kv_store_block: int | None = None
+    n_cache_reuse: int | None = None
     id_slot: int | None = None
     cache_prompt: bool | None = None
     n_slots: int | None = None
@@ -82,6 +86,15 @@ class ServerProcess:
     disable_ctx_shift: int | None = False
     draft_min: int | None = None
     draft_max: int | None = None
+    draft_ngram: bool | None = None
+    n_sink: int | None = None
+    kv_budget: int | None = None
+    kv_block_size: int | None = None
+    models_dir: str | None = None
+    models_max_mem: int | None = None
+    kv_queue_max: int | None = None
+    n_threads_preprocess: int | None = None
+    preprocess_queue: int | None = None
     no_webui: bool | None = None
     jinja: bool | None = None
     reasoning_format: Literal['deepseek', 'none', 'nothink'] | None = None
@@ -169,6 +182,14 @@ class ServerProcess:
             server_args.extend(["--n-predict", self.n_predict])
         if self.slot_save_path:
             server_args.extend(["--slot-save-path", self.slot_save_path])
+        if self.response_cache_size:
+            server_args.extend(["--response-cache-size", self.response_cache_size])
+        if self.kv_store:
+            server_args.extend(["--kv-store", self.kv_store])
+        if self.kv_store_block:
+            server_args.extend(["--kv-store-block", self.kv_store_block])
+        if self.n_cache_reuse:
+            server_args.extend(["--cache-reuse", self.n_cache_reuse])
         if self.n_ga:
             server_args.extend(["--grp-attn-n", self.n_ga])
         if self.n_ga_w:
@@ -180,12 +201,30 @@ class ServerProcess:
                 server_args.extend(["--lora", lora_file])
         if self.disable_ctx_shift:
             server_args.extend(["--no-context-shift"])
+        if self.n_sink:
+            server_args.extend(["--ctx-sink", self.n_sink])
+        if self.kv_budget:
+            server_args.extend(["--kv-budget", self.kv_budget])
+        if self.kv_block_size:
+            server_args.extend(["--kv-block-size", self.kv_block_size])
+        if self.models_dir:
+            server_args.extend(["--models-dir", self.models_dir])
+        if self.models_max_mem:
+            server_args.extend(["--models-max-mem", self.models_max_mem])
+        if self.kv_queue_max is not None:
+            server_args.extend(["--kv-queue-max", self.kv_queue_max])
+        if self.n_threads_preprocess is not None:
+            server_args.extend(["--threads-preprocess", self.n_threads_preprocess])
+        if self.preprocess_queue is not None:
+            server_args.extend(["--preprocess-queue", self.preprocess_queue])
         if self.api_key:
             server_args.extend(["--api-key", self.api_key])
         if self.draft_max:
             server_args.extend(["--draft-max", self.draft_max])
         if self.draft_min:
             server_args.extend(["--draft-min", self.draft_min])
+        if self.draft_ngram:
+            server_args.append("--draft-ngram")
         if self.no_webui:
             server_args.append("--no-webui")
         if self.jinja: